@@ -4,91 +4,206 @@
 
 #include "def.h"
 
-pthread_mutex_t mutex_for_fs_stat;//mutex used by RSFS_stat()
 
+//create and initialize a file system instance - should be called as the first thing before accessing this file system;
+//return NULL if it fails
+rsfs_t *RSFS_init(){
+    char *debugTitle = "RSFS_init";
+
+    rsfs_t *fs = calloc(1, sizeof(rsfs_t)); //the data blocks are part of the instance
+    if(fs==NULL){
+        printf("[%s] fails to allocate the file system\n", debugTitle);
+        return NULL;
+    }
+
+    if(rsfs_setup(fs) < 0){
+        free(fs);
+        return NULL;
+    }
+
+    return fs;
+}
 
-//initialize file system - should be called as the first thing before accessing this file system 
-int RSFS_init(){
+//initialize the zero-filled instance fs in place (allocated by RSFS_init,
+//or in a shared memory region by RSFS_init_shared); return 0 if succeed
+int rsfs_setup(rsfs_t *fs){
     char *debugTitle = "RSFS_init";
 
-    //initialize data blocks
-    for(int i=0; i<NUM_DBLOCKS; i++){
-      void *block = malloc(BLOCK_SIZE); //a data block is allocated from memory
-      if(block==NULL){
-        printf("[%s] fails to init data_blocks\n", debugTitle);
-        return -1;
-      }
-      data_blocks[i] = block;  
-    } 
+    //start with the initial capacity; both grow on demand
+    fs->num_dblocks = NUM_DBLOCKS;
+    fs->num_inodes = NUM_INODES;
 
     //initialize bitmaps
-    for(int i=0; i<NUM_DBLOCKS; i++) data_bitmap[i]=0;
-    pthread_mutex_init(&data_bitmap_mutex,NULL);
-    for(int i=0; i<NUM_INODES; i++) inode_bitmap[i]=0;
-    pthread_mutex_init(&inode_bitmap_mutex,NULL);    
+    for(int i=0; i<fs->num_dblocks; i++) fs->data_bitmap[i]=0;
+    for(int i=0; i<fs->num_dblocks; i++) fs->data_refcount[i]=0;
+    shm_mutex_init(fs, &fs->data_bitmap_mutex);
+    dedup_init(fs);
+    checksum_init(fs);
+    block_copy_init();
+    trace_init(fs);
+    metrics_init(fs);
+    watch_init(fs);
+    for(int i=0; i<fs->num_inodes; i++) fs->inode_bitmap[i]=0;
+    shm_mutex_init(fs, &fs->inode_bitmap_mutex);
 
     //initialize inodes
-    for(int i=0; i<NUM_INODES; i++){
-        inodes[i].length=0;
+    for(int i=0; i<fs->num_inodes; i++){
+        fs->inodes[i].length=0;
     }
-    pthread_mutex_init(&inodes_mutex,NULL); 
+    shm_mutex_init(fs, &fs->inodes_mutex);
 
     //initialize open file table
     for(int i=0; i<NUM_OPEN_FILE; i++){
-        struct open_file_entry entry=open_file_table[i];
-        entry.used=0; //each entry is not used initially
-        pthread_mutex_init(&entry.entry_mutex,NULL);
-        entry.position=0;
-        entry.access_flag=-1;
-        // entry.ref=0;
-        entry.inode_number=-1;
+        struct open_file_entry *entry=&fs->open_file_table[i];
+        entry->used=0; //each entry is not used initially
+        shm_mutex_init(fs, &entry->entry_mutex);
+        entry->position=0;
+        entry->access_flag=-1;
+        // entry->ref=0;
+        entry->inode_number=-1;
     }
-    pthread_mutex_init(&open_file_table_mutex,NULL); 
+    shm_mutex_init(fs, &fs->open_file_table_mutex);
+
+    //initialize the decompressed-chunk cache
+    compress_init(fs);
 
     //initialize root inode
-    root_inode_number = allocate_inode();
-    if(root_inode_number<0){
+    fs->root_data_block_pinned = -1;
+    fs->root_inode_number = allocate_inode(fs);
+    if(fs->root_inode_number<0){
         printf("[%s] fails to allocate root inode\n", debugTitle);
         return -1;
     }
-    pthread_mutex_init(&root_dir_mutex,NULL); 
+    shm_mutex_init(fs, &fs->root_dir_mutex);
     
     
     //initialize mutex_for_fs_stat
-    pthread_mutex_init(&mutex_for_fs_stat,NULL);
+    shm_mutex_init(fs, &fs->mutex_for_fs_stat);
+
+    //initialize mutator_lock; prefer the checkpoint so that a steady stream
+    //of mutators cannot starve it
+    pthread_rwlockattr_t rwlock_attr;
+    pthread_rwlockattr_init(&rwlock_attr);
+    pthread_rwlockattr_setkind_np(&rwlock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    if(fs->shm.active) pthread_rwlockattr_setpshared(&rwlock_attr, PTHREAD_PROCESS_SHARED);
+    pthread_rwlock_init(&fs->mutator_lock,&rwlock_attr);
+    pthread_rwlockattr_destroy(&rwlock_attr);
+
+    stats_rebuild(fs);
 
-    //return 0 means success
     return 0;
 }
 
 
+//stop the background threads of a file system instance (scrubber, journal
+//committer, read-ahead), write its cached blocks back, and free it
+void RSFS_destroy(rsfs_t *fs){
+    if(fs==NULL) return;
+
+    RSFS_trace_stop(fs);
+    events_free(fs);
+    watches_free(fs);
+
+    //remote: disconnect from the server
+    if(fs->remote.active){
+        remote_disconnect(fs);
+        free(fs);
+        return;
+    }
+
+    RSFS_serve_stop(fs);
+
+    //sharded: destroy every partition
+    if(fs->num_shards){
+        for(int i=0; i<fs->num_shards; i++) RSFS_destroy(fs->shards[i]);
+        free(fs);
+        return;
+    }
+
+    //shared: unmap the region from this process
+    if(fs->shm.active){
+        shm_detach(fs);
+        return;
+    }
+
+    RSFS_scrubber_stop(fs);
+    if(fs->journal.active) RSFS_journal_close(fs);
+    if(fs->block_cache.active) RSFS_cache_close(fs);
+
+    for(int i=0; i<(MAX_DBLOCKS-NUM_DBLOCKS)/DBLOCK_CHUNK; i++) free(fs->block_chunks[i]);
+    free(fs);
+}
+
+
 //create file
 //if file does not exist, create the file and return 0;
 //if file_name already exists, return -1; 
 //otherwise (other errors), return -2.
-int RSFS_create(char file_name){
+int RSFS_create(rsfs_t *fs, char file_name){
+    return RSFS_create_ex(fs, file_name, 0);
+}
+
+
+//create file with flags: RSFS_COMPRESSED stores the file data compressed;
+//return values are the same as RSFS_create()
+int RSFS_create_ex(rsfs_t *fs, char file_name, int flags){
+
+    //observed: time the call (and trace it or record its events while on) once it returns
+    long call_start;
+    if(call_enter(fs, TRACE_CREATE, &call_start)){
+        int ret = RSFS_create_ex(fs, file_name, flags);
+        call_exit(fs, call_start, TRACE_CREATE, -1, file_name, flags, 0, ret);
+        return ret;
+    }
+
+    //sharded: forward to the partition of the file
+    if(fs->num_shards) return RSFS_create_ex(fs->shards[shard_index(fs, file_name)], file_name, flags);
+    //remote: forward to the server
+    if(fs->remote.active) return remote_create(fs, file_name, flags);
+
+    if(flags & ~RSFS_COMPRESSED){
+        printf("[create] invalid flags (%d).\n", flags);
+        return -2;
+    }
+
+    pthread_rwlock_rdlock(&fs->mutator_lock);
 
     //search root_dir for dir_entry matching provided file_name
-    struct dir_entry *dir_entry = search_dir(file_name);
+    struct dir_entry *dir_entry = search_dir(fs, file_name);
 
     if(dir_entry){//already exists
         printf("[create] file (%c) already exists.\n", file_name);
+        pthread_rwlock_unlock(&fs->mutator_lock);
         return -1;
     }else{
 
         if(DEBUG) printf("[create] file (%c) does not exist.\n", file_name);
 
         //get a free inode 
-        char inode_number = allocate_inode();
+        char inode_number = allocate_inode(fs);
         if(inode_number<0){
             printf("[create] fail to allocate an inode.\n");
+            pthread_rwlock_unlock(&fs->mutator_lock);
             return -2;
         } 
         if(DEBUG) printf("[create] allocate inode with number:%d.\n", inode_number);
+        fs->inodes[(int)inode_number].flags = flags;
+        stats_file(fs, inode_number);
 
         //insert (file_name, inode_number) to root directory entry
-        dir_entry = insert_dir(file_name, inode_number);
+        dir_entry = insert_dir(fs, file_name, inode_number);
         if(DEBUG) printf("[create] insert a dir_entry with file_name:%c.\n", dir_entry->name);
+
+        //log the new inode and directory entry
+        struct journal_txn txn;
+        journal_txn_begin(&txn);
+        journal_log_inode(fs, &txn, inode_number);
+        journal_log_dirent(fs, &txn, dir_entry);
+        unsigned int seq = journal_txn_queue(fs, &txn);
+
+        pthread_rwlock_unlock(&fs->mutator_lock);
+
+        if(journal_wait(fs, seq) < 0) return -2;
         
         return 0;
     }
@@ -97,83 +212,142 @@ int RSFS_create(char file_name){
 
 
 //delete file
-int RSFS_delete(char file_name){
+int RSFS_delete(rsfs_t *fs, char file_name){
+
+    //observed: time the call (and trace it or record its events while on) once it returns
+    long call_start;
+    if(call_enter(fs, TRACE_DELETE, &call_start)){
+        int ret = RSFS_delete(fs, file_name);
+        call_exit(fs, call_start, TRACE_DELETE, -1, file_name, 0, 0, ret);
+        return ret;
+    }
+
+    //sharded: forward to the partition of the file
+    if(fs->num_shards) return RSFS_delete(fs->shards[shard_index(fs, file_name)], file_name);
+    //remote: forward to the server
+    if(fs->remote.active) return remote_delete(fs, file_name);
 
     char debug_title[32] = "[RSFS_delete]";
 
+    pthread_rwlock_rdlock(&fs->mutator_lock);
+
     //to do: find the corresponding dir_entry
-    struct dir_entry *dir_entry = search_dir(file_name);
+    struct dir_entry *dir_entry = search_dir(fs, file_name);
     if(dir_entry==NULL){
         printf("%s director entry does not exist for file (%c)\n", 
             debug_title, file_name);
+        pthread_rwlock_unlock(&fs->mutator_lock);
         return -1;
     }
 
     //to do: find the corresponding inode
     int inode_number = dir_entry->inode_number;
-    if(inode_number<0 || inode_number>=NUM_INODES){
+    if(inode_number<0 || inode_number>=fs->num_inodes){
         printf("%s inode number (%d) is invalid.\n", 
             debug_title, inode_number);
+        pthread_rwlock_unlock(&fs->mutator_lock);
         return -2;
     }
-    struct inode *inode = &inodes[inode_number];
+    struct inode *inode = &fs->inodes[inode_number];
+
+    //log the deletion before releasing anything, so that a later reuse of
+    //the inode, blocks, or directory slot is always journaled after it
+    struct journal_txn txn;
+    journal_txn_begin(&txn);
+    journal_log_inode_free(fs, &txn, inode_number);
+    for(int i = 0; i < NUM_POINTERS; i++){
+        if(inode->block[i] >= 0) journal_log_dblock(fs, &txn, inode->block[i], 0);
+    }
+    journal_log_dirent_free(fs, &txn, dir_entry);
+    unsigned int seq = journal_txn_queue(fs, &txn);
 
     //to do: find the data blocks, free them in data-bitmap
-    pthread_mutex_lock(&data_bitmap_mutex);
-    for(int i = 0; i <= inode->length/BLOCK_SIZE; i++){
+    //(a block shared with other files is only freed with its last reference)
+    inode_meta_begin(inode);
+    for(int i = 0; i < NUM_POINTERS; i++){
         int block_number = inode->block[i];
-        if(block_number>=0) data_bitmap[block_number]=0;    
+        if(block_number>=0) free_data_block(fs, block_number);
+        inode->block[i] = -1;
     }
-    pthread_mutex_unlock(&data_bitmap_mutex);
+    inode_meta_end(inode);
 
     //to do: free the inode in inode-bitmap
-    pthread_mutex_lock(&inode_bitmap_mutex);
-    inode_bitmap[inode_number]=0;
-    pthread_mutex_unlock(&inode_bitmap_mutex);
+    free_inode(fs, inode_number);
+    stats_file(fs, inode_number);
 
     //to do: free the dir_entry
-    int ret = delete_dir(file_name);
+    int ret = delete_dir(fs, file_name);
+
+    //the watches of the file let go of it once its name is gone, so that
+    //RSFS_watch cannot attach to the inode after they were dropped
+    watch_notify(fs, inode_number, RSFS_WATCH_DELETE);
+
+    pthread_rwlock_unlock(&fs->mutator_lock);
+
+    if(journal_wait(fs, seq) < 0) return -1;
     
     return 0;
 }
 
 
 //print status of the file system
-void RSFS_stat(){
+void RSFS_stat(rsfs_t *fs){
 
-    pthread_mutex_lock(&mutex_for_fs_stat);
+    //remote: the state lives in the server process
+    if(fs->remote.active){
+        printf("\n[RSFS_stat] the file system is hosted by the server.\n");
+        return;
+    }
 
+    //sharded: print every partition
+    if(fs->num_shards){
+        for(int i=0; i<fs->num_shards; i++){
+            printf("\n[Shard %d]", i);
+            RSFS_stat(fs->shards[i]);
+        }
+        return;
+    }
+
+    //take a snapshot, then print it without holding anything
+    struct rsfs_stats snapshot;
+    struct rsfs_stats *stats = &snapshot;
+    RSFS_stat_snapshot(fs, stats);
 
     printf("\nCurrent status of the file system:\n\n %16s%10s%10s\n", "File Name", "Length", "iNode #");
 
     //list files
-    for(int i=0; i<BLOCK_SIZE/sizeof(struct dir_entry); i++){
-        struct dir_entry *dir_entry = (struct dir_entry *)root_data_block + i;
-        if(dir_entry->name==0) continue;
-        
-        int inode_number = dir_entry->inode_number;
-        struct inode *inode = &inodes[inode_number];
-        
-        printf("%16c%10d%10d\n", dir_entry->name, inode->length, inode_number);
+    for(int i=0; i<stats->num_files; i++){
+        struct rsfs_file_stat *file = &stats->files[i];
+        printf("%16c%10d%10d\n", file->name, file->length, file->inode_number);
     }
     
     
     //data blocks
-    int db_used=0;
-    for(int i=0; i<NUM_DBLOCKS; i++) db_used+=data_bitmap[i];
-    printf("\nTotal Data Blocks: %4d,  Used: %d,  Unused: %d\n", NUM_DBLOCKS, db_used, NUM_DBLOCKS-db_used);
+    printf("\nTotal Data Blocks: %4d,  Used: %d,  Unused: %d\n", stats->total_blocks, stats->used_blocks, stats->total_blocks-stats->used_blocks);
+
+    //shared blocks
+    if(stats->shared_blocks>0){
+        printf("Shared Data Blocks: %3d,  Blocks Saved: %d\n", stats->shared_blocks, stats->saved_blocks);
+    }
 
     //inodes
-    int inodes_used=0;
-    for(int i=0; i<NUM_INODES; i++) inodes_used+=inode_bitmap[i];
-    printf("Total iNode Blocks: %3d,  Used: %d,  Unused: %d\n", NUM_INODES, inodes_used, NUM_INODES-inodes_used);
+    printf("Total iNode Blocks: %3d,  Used: %d,  Unused: %d\n", stats->total_inodes, stats->used_inodes, stats->total_inodes-stats->used_inodes);
+
+    //compressed files
+    int compressed_num=0, logical_bytes=0, stored_bytes=0;
+    for(int i=0; i<stats->num_files; i++){
+        if(!(stats->files[i].flags & RSFS_COMPRESSED)) continue;
+        compressed_num++;
+        logical_bytes+=stats->files[i].length;
+        stored_bytes+=stats->files[i].stored_bytes;
+    }
+    if(compressed_num>0){
+        printf("Compressed Files: %3d,  Bytes: %d,  Stored: %d,  Ratio: %.2f\n", compressed_num,
+            logical_bytes, stored_bytes, stored_bytes ? (double)logical_bytes/stored_bytes : 0);
+    }
 
     //open files
-    int of_num=0;
-    for(int i=0; i<NUM_OPEN_FILE; i++) of_num+=open_file_table[i].used;
-    printf("Total Opened Files: %3d\n\n", of_num);
-
-    pthread_mutex_unlock(&mutex_for_fs_stat);
+    printf("Total Opened Files: %3d\n\n", stats->open_files);
 }
 
 
@@ -188,14 +362,34 @@ void RSFS_stat(){
 // open a file with RSFS_RDONLY or RSFS_RDWR flags
 // return a file descriptor if succeed; 
 // otherwise return a negative integer value
-int RSFS_open(char file_name, int access_flag) {
+int RSFS_open(rsfs_t *fs, char file_name, int access_flag) {
+
+    //observed: time the call (and trace it or record its events while on) once it returns
+    long call_start;
+    if(call_enter(fs, TRACE_OPEN, &call_start)){
+        int ret = RSFS_open(fs, file_name, access_flag);
+        call_exit(fs, call_start, TRACE_OPEN, -1, file_name, access_flag, 0, ret);
+        return ret;
+    }
+    //sharded: forward to the partition of the file; the fd encodes the partition
+    if(fs->num_shards) {
+        int index = shard_index(fs, file_name);
+        return shard_fd(index, RSFS_open(fs->shards[index], file_name, access_flag));
+    }
+    //remote: forward to the server
+    if(fs->remote.active) return remote_open(fs, file_name, access_flag);
+
+    //RSFS_WRBUF (with RSFS_RDWR only) gives the descriptor a write-back buffer
+    int buffered = access_flag == (RSFS_RDWR | RSFS_WRBUF);
+    if(buffered) access_flag = RSFS_RDWR;
+
     //to do: check to make sure access_flag is either RSFS_RDONLY or RSFS_RDWR
     if(access_flag != RSFS_RDONLY && access_flag != RSFS_RDWR) {
         printf("[open] access_flag is invalid.\n");
         return -1;
     }
     //to do: find dir_entry matching file_name
-    struct dir_entry *entry = search_dir(file_name);
+    struct dir_entry *entry = search_dir(fs, file_name);
     if(entry == NULL) {
         printf("[open] file (%c) does not exist.\n", file_name);
         return -2;
@@ -203,28 +397,37 @@ int RSFS_open(char file_name, int access_flag) {
     
     //to do: find the corresponding inode 
     int inode_number = entry->inode_number;
-    struct inode *node = &inodes[inode_number];
+    struct inode *node = &fs->inodes[inode_number];
 
     // 2.3.3 Synchronization, enforce reader-writer concurrency
     pthread_mutex_lock(&node->rw_mutex);
+    long wait_start = 0;
     if(access_flag == RSFS_RDONLY) {
         // Wait while a writer is active
         while(node->writer_active) {
+            if(!wait_start) wait_start = metrics_now();
+            event_record(fs, EVENT_WAIT_BEGIN, 0, inode_number);
             pthread_cond_wait(&node->rw_cond, &node->rw_mutex);
+            event_record(fs, EVENT_WAIT_END, 0, inode_number);
         }
         node->reader_count++;
     }
     else if(access_flag == RSFS_RDWR) {
         // Wait while there are active readers or another writer
         while(node->reader_count > 0 || node->writer_active) {
+            if(!wait_start) wait_start = metrics_now();
+            event_record(fs, EVENT_WAIT_BEGIN, 0, inode_number);
             pthread_cond_wait(&node->rw_cond, &node->rw_mutex);
+            event_record(fs, EVENT_WAIT_END, 0, inode_number);
         }
         node->writer_active = 1;
     }
     pthread_mutex_unlock(&node->rw_mutex);
+    metrics_rw_acquired(fs);
+    if(wait_start) metrics_rw_wait(fs, metrics_now() - wait_start);
     
     //to do: find an unused open-file-entry in open-file-table and fill the fields of the entry properly
-    int fd = allocate_open_file_entry(access_flag, inode_number);
+    int fd = allocate_open_file_entry(fs, access_flag, inode_number);
     if (fd < 0) {
         // Decrement reader/writer count if allocation fails
         pthread_mutex_lock(&node->rw_mutex);
@@ -242,6 +445,9 @@ int RSFS_open(char file_name, int access_flag) {
         printf("[open] fail to allocate an open file entry.\n");
         return -3;        
     }
+
+    //compressed files are rewritten chunk by chunk anyway, so they are not buffered
+    fs->open_file_table[fd].wb_enabled = buffered && !(node->flags & RSFS_COMPRESSED);
     
     //to do: return the index of the open-file-entry in open-file-table as file descriptor
     return fd;
@@ -251,7 +457,23 @@ int RSFS_open(char file_name, int access_flag) {
 // 2.3.4
 // append the content in buf to the end of the file of descriptor fd
 // return the number of bytes actually appended to the file
-int RSFS_append(int fd, void *buf, int size){
+int RSFS_append(rsfs_t *fs, int fd, void *buf, int size){
+
+    //observed: time the call (and trace it or record its events while on) once it returns
+    long call_start;
+    if(call_enter(fs, TRACE_APPEND, &call_start)){
+        int ret = RSFS_append(fs, fd, buf, size);
+        call_exit(fs, call_start, TRACE_APPEND, fd, 0, 0, size, ret);
+        return ret;
+    }
+
+    //sharded: forward to the partition encoded in fd
+    if(fs->num_shards){
+        rsfs_t *shard = shard_of_fd(fs, &fd);
+        return RSFS_append(shard, fd, buf, size);
+    }
+    //remote: forward to the server
+    if(fs->remote.active) return remote_io(fs, IPC_APPEND, fd, buf, size);
 
     //to do: check the sanity of the arguments: 
     // fd should be in [0,NUM_OPEN_FILE] and size>0.
@@ -261,7 +483,7 @@ int RSFS_append(int fd, void *buf, int size){
     }
     
     //to do: get the open file entry corresponding to fd
-    struct open_file_entry *entry = &open_file_table[fd];
+    struct open_file_entry *entry = &fs->open_file_table[fd];
     if(entry->used == 0) {
         printf("[append] file descriptor (%d) is not in use\n", fd);
         return 0; // 0 because no bytes appended
@@ -273,65 +495,36 @@ int RSFS_append(int fd, void *buf, int size){
         printf("[append] file descriptor (%d) is not opened with RSFS_RDWR mode\n", fd);
         return 0; // 0 because no bytes appended
     }
-    
-    //to do: get the inode 
-    struct inode *node = &inodes[entry->inode_number];
-
-    //to do: get the current position (moved this to fix length issue)
-    int current_position = node->length;
-    entry->position = current_position;
-    
-    //to do: append the content in buf to the data blocks of the file 
-    // from the end of the file; allocate new block(s) when needed 
-    // - (refer to lecture L22 on how)
-    int bytes_written = 0;
 
-    while (bytes_written < size) {
-        int byte_offset = current_position + bytes_written;
-        int block_index = byte_offset / BLOCK_SIZE;
-        int offset_in_block = byte_offset % BLOCK_SIZE;
+    //buffered: small appends are collected in the entry and written in bulk
+    if(entry->wb_enabled) return writeback_append(fs, fd, buf, size);
 
-        // Check if we need to allocate a new block
-        if(block_index >= NUM_POINTERS) {
-            // No more space in the inode's pointers
-            printf("[append] file size exceeds maximum limit\n");
-            break;
-        }
+    return file_append(fs, fd, buf, size);
+}
 
-        // Allocate a new data block if needed
-        if(node->block[block_index] == -1) {
-            int new_block = allocate_data_block();
-            if(new_block < 0) {
-                printf("[append] fail to allocate a new data block\n");
-                break;
-            }
-            node->block[block_index] = new_block;
-        }
+//append size bytes of buf to the file of fd (checked by the caller), and
+//return the number of bytes appended
+int file_append(rsfs_t *fs, int fd, void *buf, int size){
+    struct open_file_entry *entry = &fs->open_file_table[fd];
 
-        // Get block's memory
-        char *block = (char *)data_blocks[node->block[block_index]];
-        int space_in_block = BLOCK_SIZE - offset_in_block;
-        int bytes_remaining = size - bytes_written;
-        int chunk;
+    pthread_rwlock_rdlock(&fs->mutator_lock);
 
-        if (bytes_remaining < space_in_block) {
-            chunk = bytes_remaining;
-        } else {
-            chunk = space_in_block;
-        }
+    //to do: get the current position (moved this to fix length issue)
+    int current_position = fs->inodes[entry->inode_number].length;
 
-        // Copy data to the block
-        memcpy(block + offset_in_block, (char *)buf + bytes_written, chunk);
-        bytes_written += chunk;
-    }
+    //to do: append the content in buf to the data blocks of the file 
+    // from the end of the file, journaling the new length and blocks
+    struct journal_txn txn;
+    journal_txn_begin(&txn);
+    int bytes_written = inode_write(fs, entry->inode_number, current_position, buf, size, 0, &txn);
+    unsigned int seq = journal_txn_queue(fs, &txn);
 
     //to do: update the current position in open file entry
-    entry->position += bytes_written;
+    entry->position = current_position + bytes_written;
 
-    // update file length if need be
-    if(entry->position > node->length) {
-        node->length = entry->position;
-    }
+    pthread_rwlock_unlock(&fs->mutator_lock);
+
+    if(journal_wait(fs, seq) < 0) return -1;
 
     //to do: return the number of bytes appended to the file
     return bytes_written;
@@ -341,7 +534,23 @@ int RSFS_append(int fd, void *buf, int size){
 // 2.3.5
 // update current position of the file (which is in the open_file_entry) to offset
 // return -1 if fd is invalid; otherwise return the current position after the update
-int RSFS_fseek(int fd, int offset){
+int RSFS_fseek(rsfs_t *fs, int fd, int offset){
+
+    //observed: time the call (and trace it or record its events while on) once it returns
+    long call_start;
+    if(call_enter(fs, TRACE_FSEEK, &call_start)){
+        int ret = RSFS_fseek(fs, fd, offset);
+        call_exit(fs, call_start, TRACE_FSEEK, fd, 0, 0, offset, ret);
+        return ret;
+    }
+
+    //sharded: forward to the partition encoded in fd
+    if(fs->num_shards){
+        rsfs_t *shard = shard_of_fd(fs, &fd);
+        return RSFS_fseek(shard, fd, offset);
+    }
+    //remote: forward to the server
+    if(fs->remote.active) return remote_fd_call(fs, IPC_FSEEK, fd, offset);
     //to do: sanity test of fd; if fd is not valid, return -1    
     if(fd < 0 || fd >= NUM_OPEN_FILE) {
         printf("[fseek] invalid file descriptor (%d)\n", fd);
@@ -349,19 +558,23 @@ int RSFS_fseek(int fd, int offset){
     }
 
     //to do: get the correspondng open file entry
-    struct open_file_entry *entry = &open_file_table[fd];
+    struct open_file_entry *entry = &fs->open_file_table[fd];
     if(entry->used == 0) {
         printf("[fseek] file descriptor (%d) is not in use\n", fd);
         return -1; 
     }
 
+    //buffered bytes are written out first: they count towards the length
+    if(entry->wb_size) writeback_flush(fs, fd);
+
     //to do: get the current position
     int current_position = entry->position;
 
     //to do: get the inode and file length
     int inode_number = entry->inode_number;
-    struct inode *node = &inodes[inode_number];
-    int file_length = node->length;
+    struct inode_meta meta;
+    inode_meta_read(&fs->inodes[inode_number], &meta); //consistent with a concurrent write, without a lock
+    int file_length = meta.length;
 
     //to do: check if argument offset is not within 0...length, 
     // do not proceed and return current position
@@ -379,7 +592,23 @@ int RSFS_fseek(int fd, int offset){
 // 2.3.6
 // read up to size bytes to buf from file's current position towards the end
 // return -1 if fd is invalid; otherwise return the number of bytes actually read
-int RSFS_read(int fd, void *buf, int size){
+int RSFS_read(rsfs_t *fs, int fd, void *buf, int size){
+
+    //observed: time the call (and trace it or record its events while on) once it returns
+    long call_start;
+    if(call_enter(fs, TRACE_READ, &call_start)){
+        int ret = RSFS_read(fs, fd, buf, size);
+        call_exit(fs, call_start, TRACE_READ, fd, 0, 0, size, ret);
+        return ret;
+    }
+
+    //sharded: forward to the partition encoded in fd
+    if(fs->num_shards){
+        rsfs_t *shard = shard_of_fd(fs, &fd);
+        return RSFS_read(shard, fd, buf, size);
+    }
+    //remote: forward to the server
+    if(fs->remote.active) return remote_io(fs, IPC_READ, fd, buf, size);
 
     //to do: sanity test of fd and size (the size should not be negative)    
     if(fd < 0 || fd >= NUM_OPEN_FILE || size < 0) {
@@ -388,60 +617,67 @@ int RSFS_read(int fd, void *buf, int size){
     }
 
     //to do: get the corresponding open file entry
-    struct open_file_entry *entry = &open_file_table[fd];
+    struct open_file_entry *entry = &fs->open_file_table[fd];
     if(entry->used == 0) {
         printf("[read] file descriptor (%d) is not in use\n", fd);
         return -1; 
     }
 
+    //buffered bytes are written out first, so that they can be read back
+    if(entry->wb_size) writeback_flush(fs, fd);
+
     //to do: get the current position
     int current_position = entry->position;
     
-    //to do: get the corresponding inode 
-    struct inode *node = &inodes[entry->inode_number];
+    //to do: get the corresponding inode, and a consistent copy of its length
+    //and block map (taken without a lock, so reads stay as fast as they were)
+    struct inode *node = &fs->inodes[entry->inode_number];
+    struct inode_meta meta;
+    inode_meta_read(node, &meta);
     
     //to do: read from the file
     int bytes_read = 0;
 
-    while (bytes_read < size) {
-        int byte_offset = current_position + bytes_read;
-        
-        // Stop if we reach the end of the file
-        if (byte_offset >= node->length) {
-            break;
-        }
-
-        int block_index = byte_offset / BLOCK_SIZE;
-        int offset_in_block = byte_offset % BLOCK_SIZE;
-        
-        // Check if we need to read from a new block
-        if (block_index >= NUM_POINTERS || node->block[block_index] == -1) {
-            printf("[read] file size exceeds maximum limit\n");
-            break;
-        }
+    if(node->flags & RSFS_COMPRESSED) {
+        // compressed files are served from the decompressed-chunk cache
+        bytes_read = compressed_read(fs, entry->inode_number, current_position, buf, size);
+    }
+    else {
+        // Stop at the end of the file
+        int bytes_left_in_file = meta.length - current_position;
+        if(bytes_left_in_file < 0) bytes_left_in_file = 0;
+
+        struct block_iter it;
+        block_iter_start(&it, current_position, size < bytes_left_in_file ? size : bytes_left_in_file);
+        for(; it.done < it.size; block_iter_next(&it)) {
+
+            // Check if we need to read from a new block
+            if (it.block_index >= NUM_POINTERS || meta.block[it.block_index] == -1) {
+                printf("[read] file size exceeds maximum limit\n");
+                break;
+            }
 
-        // Get block's memory
-        char *block = (char *)data_blocks[node->block[block_index]];
-        int space_in_block = BLOCK_SIZE - offset_in_block;
-        int bytes_remaining = size - bytes_read;
-        int bytes_left_in_file = node->length - byte_offset;
-        int chunk;
-
-        if(bytes_remaining < space_in_block) {
-            chunk = bytes_remaining;
-        } else {
-            chunk = space_in_block;
-        }
+            // Get block's memory (pinned until the copy is done)
+            int block_number = meta.block[it.block_index];
+            char *block = get_block(fs, block_number);
+            if(block == NULL) break;
+            if(checksum_verify(fs, block_number, block) < 0){
+                put_block(fs, block_number, 0);
+                break;
+            }
 
-        if(chunk > bytes_left_in_file) {
-            chunk = bytes_left_in_file;
+            // Copy data from the block to buf
+            block_copy((char *)buf + it.done, block + it.offset_in_block, it.chunk);
+            put_block(fs, block_number, 0);
         }
+        bytes_read = it.done;
+    }
 
-        // Copy data from the block to buf
-        memcpy((char *)buf + bytes_read, block + offset_in_block, chunk);
-        bytes_read += chunk;
+    //track the access pattern and prefetch ahead of a sequential stream
+    if(!(node->flags & RSFS_COMPRESSED)) {
+        readahead_after_read(fs, entry, &meta, current_position, bytes_read);
     }
-    
+
     //to do: update the current position in open file entry
     entry->position += bytes_read;
     
@@ -451,7 +687,23 @@ int RSFS_read(int fd, void *buf, int size){
 
 // 2.3.8
 // close file: return 0 if succeed; otherwise return -1
-int RSFS_close(int fd){
+int RSFS_close(rsfs_t *fs, int fd){
+
+    //observed: time the call (and trace it or record its events while on) once it returns
+    long call_start;
+    if(call_enter(fs, TRACE_CLOSE, &call_start)){
+        int ret = RSFS_close(fs, fd);
+        call_exit(fs, call_start, TRACE_CLOSE, fd, 0, 0, 0, ret);
+        return ret;
+    }
+
+    //sharded: forward to the partition encoded in fd
+    if(fs->num_shards){
+        rsfs_t *shard = shard_of_fd(fs, &fd);
+        return RSFS_close(shard, fd);
+    }
+    //remote: forward to the server
+    if(fs->remote.active) return remote_fd_call(fs, IPC_CLOSE, fd, 0);
 
     //to do: sanity test of fd    
     if(fd < 0 || fd >= NUM_OPEN_FILE) {
@@ -461,15 +713,18 @@ int RSFS_close(int fd){
     
 
     //to do: get the corresponding open file entry
-    struct open_file_entry *entry = &open_file_table[fd];
+    struct open_file_entry *entry = &fs->open_file_table[fd];
     if(entry->used == 0) {
         printf("[close] file descriptor (%d) is not in use\n", fd);
         return -1;
     }
+
+    //write out the buffered bytes (the file is closed even if they cannot be)
+    int ret = entry->wb_size ? writeback_flush(fs, fd) : 0;
     
     //to do: get the corresponding inode 
     int inode_number = entry->inode_number;
-    struct inode *node = &inodes[inode_number];
+    struct inode *node = &fs->inodes[inode_number];
 
     // 2.3.3 Synchronization, update reader-writer tracking
     pthread_mutex_lock(&node->rw_mutex);
@@ -484,17 +739,34 @@ int RSFS_close(int fd){
         pthread_cond_broadcast(&node->rw_cond); // notify waiting readers/writers
     }
     pthread_mutex_unlock(&node->rw_mutex);
+    if(entry->access_flag == RSFS_RDWR) watch_notify(fs, inode_number, RSFS_WATCH_CLOSE_WRITE);
 
     //to do: release this open file entry in the open file table
-    free_open_file_entry(fd);
+    free_open_file_entry(fs, fd);
 
-    return 0;
+    return ret;
 }
 
 
 // 2.3.7
 // write the content of size (bytes) in buf to the file (of descripter fd) 
-int RSFS_write(int fd, void *buf, int size){
+int RSFS_write(rsfs_t *fs, int fd, void *buf, int size){
+
+    //observed: time the call (and trace it or record its events while on) once it returns
+    long call_start;
+    if(call_enter(fs, TRACE_WRITE, &call_start)){
+        int ret = RSFS_write(fs, fd, buf, size);
+        call_exit(fs, call_start, TRACE_WRITE, fd, 0, 0, size, ret);
+        return ret;
+    }
+
+    //sharded: forward to the partition encoded in fd
+    if(fs->num_shards){
+        rsfs_t *shard = shard_of_fd(fs, &fd);
+        return RSFS_write(shard, fd, buf, size);
+    }
+    //remote: forward to the server
+    if(fs->remote.active) return remote_io(fs, IPC_WRITE, fd, buf, size);
     // Sanity check
     if(fd < 0 || fd >= NUM_OPEN_FILE || size <= 0) {
         printf("[write] invalid file descriptor (%d) or size (%d)\n", fd, size);
@@ -502,7 +774,7 @@ int RSFS_write(int fd, void *buf, int size){
     }
 
     // Get the corresponding open file entry
-    struct open_file_entry *entry = &open_file_table[fd];
+    struct open_file_entry *entry = &fs->open_file_table[fd];
     if(entry->used == 0) {
         printf("[write] file descriptor (%d) is not in use\n", fd);
         return -1; 
@@ -514,72 +786,383 @@ int RSFS_write(int fd, void *buf, int size){
         return -1; 
     }
 
-    // Get the current position
-    int current_position = entry->position;
-    // Get the inode
-    struct inode *node = &inodes[entry->inode_number];
+    // Buffered: small writes are collected in the entry and written in bulk
+    if(entry->wb_enabled) return writeback_write(fs, fd, buf, size);
+
+    return file_write(fs, fd, buf, size);
+}
+
+// Write size bytes of buf at the current position of fd (checked by the
+// caller) and end the file after them; return the number of bytes written
+int file_write(rsfs_t *fs, int fd, void *buf, int size){
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+
+    pthread_rwlock_rdlock(&fs->mutator_lock);
+
+    // Write at the current position, journaling the new length and the
+    // allocated/freed blocks
+    struct journal_txn txn;
+    journal_txn_begin(&txn);
+    int bytes_written = inode_write(fs, entry->inode_number, entry->position, buf, size, 1, &txn);
+    unsigned int seq = journal_txn_queue(fs, &txn);
+
+    // Update the current position in open file entry
+    entry->position += bytes_written;
+
+    pthread_rwlock_unlock(&fs->mutator_lock);
+
+    if(journal_wait(fs, seq) < 0) return -1;
+
+    return bytes_written;
+}
+
+// Write size bytes of buf into the file of inode_number at position: with
+// truncate the file ends after them (RSFS_write), otherwise it only grows
+// (RSFS_append); the changed blocks and inode are logged to txn and the
+// watches are told. The caller holds mutator_lock and the file for writing.
+// Return the number of bytes written
+int inode_write(rsfs_t *fs, int inode_number, int position, void *buf, int size, int truncate, struct journal_txn *txn){
+    char *debug_title = truncate ? "[write]" : "[append]";
+    struct inode *node = &fs->inodes[inode_number];
+
+    // Remember the block map so that block changes can be journaled
+    char old_block[NUM_POINTERS];
+    memcpy(old_block, node->block, NUM_POINTERS);
+    int old_length = node->length;
+
+    // Readers of the length and block map wait until the write (and its
+    // truncation) is published
+    inode_meta_begin(node);
 
     int bytes_written = 0;
 
-    while(bytes_written < size) {
-        int byte_offset = current_position + bytes_written;
-        int block_index = byte_offset / BLOCK_SIZE;
-        int offset_in_block = byte_offset % BLOCK_SIZE;
+    if(node->flags & RSFS_COMPRESSED) {
+        // Compressed files are recompressed (and truncated) chunk by chunk
+        bytes_written = compressed_write(fs, inode_number, position, buf, size, truncate);
+    }
+    else {
+        struct block_iter it;
+        for(block_iter_start(&it, position, size); it.done < it.size; block_iter_next(&it)) {
 
-        if(block_index >= NUM_POINTERS) {
-            // No more space in the inode's pointers
-            printf("[write] file size exceeds maximum limit\n");
-            break;
-        }
+            if(it.block_index >= NUM_POINTERS) {
+                // No more space in the inode's pointers
+                printf("%s file size exceeds maximum limit\n", debug_title);
+                break;
+            }
 
-        // Allocate a new data block if needed
-        if(node->block[block_index] == -1) {
-            int new_block = allocate_data_block();
-            if(new_block < 0) {
-                printf("[write] fail to allocate a new data block\n");
+            // Allocate a new data block if needed
+            if(node->block[it.block_index] == -1) {
+                int new_block = allocate_data_block(fs);
+                if(new_block < 0) {
+                    printf("%s fail to allocate a new data block\n", debug_title);
+                    break;
+                }
+                node->block[it.block_index] = new_block;
+            }
+            // Copy a shared block before modifying it
+            else if(writable_block(fs, node, it.block_index) < 0) {
+                printf("%s fail to copy a shared data block\n", debug_title);
                 break;
             }
-            node->block[block_index] = new_block;
-        }
 
-        // Get block's memory
-        char *block = (char *)data_blocks[node->block[block_index]];
-        int space_in_block = BLOCK_SIZE - offset_in_block;
-        int bytes_remaining = size - bytes_written;
-        int chunk;
+            // Get block's memory (pinned until the copy is done)
+            int block_number = node->block[it.block_index];
+            char *block = get_block(fs, block_number);
+            if(block == NULL) break;
+
+            // Copy data to the block
+            block_copy(block + it.offset_in_block, (char *)buf + it.done, it.chunk);
+            checksum_update(fs, block_number, block);
+            put_block(fs, block_number, 1);
+        }
+        bytes_written = it.done;
+
+        // Truncate the file, wipe remaining blocks
+        int last_used_block = (position + bytes_written + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for(int i = last_used_block; truncate && i < NUM_POINTERS; i++) {
+            if(node->block[i] != -1) {
+                free_data_block(fs, node->block[i]);
+                node->block[i] = -1;
+            }
+        }
 
-        if(bytes_remaining < space_in_block) {
-            chunk = bytes_remaining;
-        } else {
-            chunk = space_in_block;
+        // Update inode length (compressed_write sets it, and leaves it if it fails)
+        if(truncate || position + bytes_written > node->length) {
+            node->length = position + bytes_written;
         }
+    }
+
+    // Share the blocks filled by this write with identical ones
+    dedup_blocks(fs, node, position / BLOCK_SIZE, (position + bytes_written) / BLOCK_SIZE);
+    inode_meta_end(node);
+    stats_file(fs, inode_number);
+    if(truncate) watch_notify(fs, inode_number, RSFS_WATCH_WRITE | (node->length < old_length ? RSFS_WATCH_TRUNCATE : 0));
+    else if(bytes_written > 0) watch_notify(fs, inode_number, RSFS_WATCH_APPEND);
+
+    // Journal the new length and the allocated/freed blocks
+    journal_log_blocks_diff(fs, txn, old_block, node->block);
+    journal_log_inode(fs, txn, inode_number);
+
+    return bytes_written;
+}
+
+
+
+
+
 
-        // Copy data to the block
-        memcpy(block + offset_in_block, (char *)buf + bytes_written, chunk);
-        bytes_written += chunk;
+
+// 2.3.9
+// remove size bytes from the file (of descriptor fd) at its current position;
+// the bytes after them move forward and the current position does not change
+// return -1 if fd is invalid; otherwise return the number of bytes removed
+int RSFS_cut(rsfs_t *fs, int fd, int size){
+
+    //observed: time the call (and trace it or record its events while on) once it returns
+    long call_start;
+    if(call_enter(fs, TRACE_CUT, &call_start)){
+        int ret = RSFS_cut(fs, fd, size);
+        call_exit(fs, call_start, TRACE_CUT, fd, 0, 0, size, ret);
+        return ret;
     }
 
-    // Update the current position in open file entry
-    entry->position += bytes_written;
+    //sharded: forward to the partition encoded in fd
+    if(fs->num_shards){
+        rsfs_t *shard = shard_of_fd(fs, &fd);
+        return RSFS_cut(shard, fd, size);
+    }
+    //remote: forward to the server
+    if(fs->remote.active) return remote_fd_call(fs, IPC_CUT, fd, size);
+    // Sanity check
+    if(fd < 0 || fd >= NUM_OPEN_FILE || size <= 0) {
+        printf("[cut] invalid file descriptor (%d) or size (%d)\n", fd, size);
+        return -1;
+    }
+
+    // Get the corresponding open file entry
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+    if(entry->used == 0) {
+        printf("[cut] file descriptor (%d) is not in use\n", fd);
+        return -1;
+    }
+
+    // Check if the file is opened with RSFS_RDWR mode
+    if(entry->access_flag != RSFS_RDWR) {
+        printf("[cut] file descriptor (%d) is not opened with RSFS_RDWR mode\n", fd);
+        return -1;
+    }
+
+    // Buffered bytes are written out first
+    if(entry->wb_size) writeback_flush(fs, fd);
+
+    pthread_rwlock_rdlock(&fs->mutator_lock);
+
+    int current_position = entry->position;
+    struct inode *node = &fs->inodes[entry->inode_number];
+
+    // Nothing to cut at or past the end of the file
+    if(current_position >= node->length) {
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        return 0;
+    }
+    if(size > node->length - current_position) {
+        size = node->length - current_position;
+    }
 
-    // Truncate the file, wipe remaining blocks
-    int new_length = entry->position;
-    int last_used_block = (new_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    // Remember the block map so that block changes can be journaled
+    char old_block[NUM_POINTERS];
+    memcpy(old_block, node->block, NUM_POINTERS);
 
-    for(int i = last_used_block; i < NUM_POINTERS; i++) {
-        if(node->block[i] != -1) {
-            free_data_block(node->block[i]);
-            node->block[i] = -1;
+    // Save the bytes that follow the cut
+    int new_length = node->length - size;
+    int tail_size = new_length - current_position;
+    char *tail = malloc(tail_size + 1);
+    if(tail == NULL) {
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        return -1;
+    }
+
+    // Read them before the cut starts a change (compressed_read waits for the end of one)
+    struct block_iter it;
+    int tail_read = 0;
+    if(node->flags & RSFS_COMPRESSED) {
+        tail_read = compressed_read(fs, entry->inode_number, current_position + size, tail, tail_size);
+    }
+    else {
+        for(block_iter_start(&it, current_position + size, tail_size); it.done < it.size; block_iter_next(&it)) {
+            int block_number = node->block[it.block_index];
+            char *block = get_block(fs, block_number);
+            if(block == NULL) break;
+            block_copy(tail + it.done, block + it.offset_in_block, it.chunk);
+            put_block(fs, block_number, 0);
         }
+        tail_read = it.done;
+    }
+    // Nothing is changed unless every byte to keep could be read
+    if(tail_read < tail_size) {
+        printf("[cut] fail to read the bytes after the cut\n");
+        free(tail);
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        return -1;
     }
 
-    // Update inode length
-    node->length = new_length;
+    // Readers of the length and block map wait until the cut is published
+    inode_meta_begin(node);
 
-    return bytes_written;
+    if(node->flags & RSFS_COMPRESSED) {
+        // Compressed files: rewrite the chunks from the current position
+        if(compressed_write(fs, entry->inode_number, current_position, tail, tail_size, 1) < tail_size) {
+            size = 0;
+        }
+    }
+    else {
+        // Move them to the current position; shared blocks are copied first
+        for(block_iter_start(&it, current_position, tail_size); it.done < it.size; block_iter_next(&it)) {
+            if(writable_block(fs, node, it.block_index) < 0) {
+                printf("[cut] fail to copy a shared data block\n");
+                break;
+            }
+            int block_number = node->block[it.block_index];
+            char *block = get_block(fs, block_number);
+            if(block == NULL) break;
+            block_copy(block + it.offset_in_block, tail + it.done, it.chunk);
+            checksum_update(fs, block_number, block);
+            put_block(fs, block_number, 1);
+        }
+        int bytes_written = it.done;
+        if(bytes_written < tail_size) {
+            // keep the file consistent: it now ends where the move stopped
+            size = node->length - current_position - bytes_written;
+            new_length = current_position + bytes_written;
+        }
+
+        // Release the blocks past the new end
+        for(int i = (new_length + BLOCK_SIZE - 1) / BLOCK_SIZE; i < NUM_POINTERS; i++) {
+            if(node->block[i] != -1) {
+                free_data_block(fs, node->block[i]);
+                node->block[i] = -1;
+            }
+        }
+        node->length = new_length;
+
+        // Share the blocks rewritten by the cut with identical ones
+        dedup_blocks(fs, node, current_position / BLOCK_SIZE, new_length / BLOCK_SIZE);
+    }
+    inode_meta_end(node);
+    free(tail);
+    stats_file(fs, entry->inode_number);
+    if(size > 0) watch_notify(fs, entry->inode_number, RSFS_WATCH_TRUNCATE);
+
+    // Journal the new length and the freed/copied blocks
+    struct journal_txn txn;
+    journal_txn_begin(&txn);
+    journal_log_blocks_diff(fs, &txn, old_block, node->block);
+    journal_log_inode(fs, &txn, entry->inode_number);
+    unsigned int seq = journal_txn_queue(fs, &txn);
+
+    pthread_rwlock_unlock(&fs->mutator_lock);
+
+    if(journal_wait(fs, seq) < 0) return -1;
+
+    return size;
 }
 
 
+//clone file src_name as a new file dst_name in constant time: the new inode
+//shares every data block of the source (data_refcount is incremented), and
+//RSFS_write/RSFS_append/RSFS_cut copy a shared block before modifying it;
+//return 0 if succeed; -1 if src_name does not exist or dst_name already
+//exists; otherwise (other errors) return -2
+int RSFS_clone(rsfs_t *fs, char src_name, char dst_name){
 
+    //observed: time the call (and trace it or record its events while on) once it returns
+    long call_start;
+    if(call_enter(fs, TRACE_CLONE, &call_start)){
+        int ret = RSFS_clone(fs, src_name, dst_name);
+        call_exit(fs, call_start, TRACE_CLONE, -1, src_name, dst_name, 0, ret);
+        return ret;
+    }
 
+    //sharded: blocks can only be shared within a partition
+    if(fs->num_shards){
+        rsfs_t *src_fs = fs->shards[shard_index(fs, src_name)];
+        rsfs_t *dst_fs = fs->shards[shard_index(fs, dst_name)];
+        if(src_fs == dst_fs) return RSFS_clone(src_fs, src_name, dst_name);
+        return shard_copy_file(src_fs, src_name, dst_fs, dst_name);
+    }
+    //remote: forward to the server
+    if(fs->remote.active) return remote_clone(fs, src_name, dst_name);
 
+    char *debug_title = "[RSFS_clone]";
+
+    struct dir_entry *src_entry = search_dir(fs, src_name);
+    if(src_entry == NULL){
+        printf("%s file (%c) does not exist.\n", debug_title, src_name);
+        return -1;
+    }
+    int src_inode_number = src_entry->inode_number;
+    struct inode *src = &fs->inodes[src_inode_number];
+
+    //hold read access to the source (as RSFS_open does) so that no writer
+    //changes it while its block map is copied
+    pthread_mutex_lock(&src->rw_mutex);
+    while(src->writer_active){
+        event_record(fs, EVENT_WAIT_BEGIN, 0, src_inode_number);
+        pthread_cond_wait(&src->rw_cond, &src->rw_mutex);
+        event_record(fs, EVENT_WAIT_END, 0, src_inode_number);
+    }
+    src->reader_count++;
+    pthread_mutex_unlock(&src->rw_mutex);
+
+    pthread_rwlock_rdlock(&fs->mutator_lock);
+
+    int ret = 0;
+    unsigned int seq = 0;
+
+    if(search_dir(fs, dst_name)){
+        printf("%s file (%c) already exists.\n", debug_title, dst_name);
+        ret = -1;
+    }else{
+        char inode_number = allocate_inode(fs);
+        if(inode_number < 0){
+            printf("%s fail to allocate an inode.\n", debug_title);
+            ret = -2;
+        }else{
+            struct inode *dst = &fs->inodes[(int)inode_number];
+
+            //share the source's blocks
+            metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+            for(int i=0; i<NUM_POINTERS; i++){
+                if(src->block[i] < 0) continue;
+                int refcount = ++fs->data_refcount[(int)src->block[i]];
+                stats_refcount(fs, refcount - 1, refcount);
+            }
+            metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+            memcpy(dst->block, src->block, NUM_POINTERS);
+            memcpy(dst->chunk_len, src->chunk_len, sizeof(dst->chunk_len));
+            dst->length = src->length;
+            dst->flags = src->flags;
+            stats_file(fs, inode_number);
+
+            struct dir_entry *dir_entry = insert_dir(fs, dst_name, inode_number);
+
+            //log the new inode (with its block map) and directory entry
+            struct journal_txn txn;
+            journal_txn_begin(&txn);
+            journal_log_inode(fs, &txn, inode_number);
+            journal_log_dirent(fs, &txn, dir_entry);
+            seq = journal_txn_queue(fs, &txn);
+        }
+    }
+
+    pthread_rwlock_unlock(&fs->mutator_lock);
+
+    pthread_mutex_lock(&src->rw_mutex);
+    src->reader_count--;
+    if(src->reader_count == 0) pthread_cond_broadcast(&src->rw_cond);
+    pthread_mutex_unlock(&src->rw_mutex);
+
+    if(journal_wait(fs, seq) < 0) return -2;
+
+    return ret;
+}
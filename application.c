@@ -6,6 +6,7 @@
 #include <unistd.h>
 
 struct thread_arg{
+    rsfs_t *fs; //file system the thread works on
     int id;
     char filename; 
     int sleep_time; //in second
@@ -15,9 +16,10 @@ struct thread_arg{
 //reader thread
 void *reader_thread(void *ptr){
     struct thread_arg *arg = (struct thread_arg *)ptr;
+    rsfs_t *fs = arg->fs;
 
     //open a file with RSFS_RDONLY
-    int fd = RSFS_open(arg->filename,RSFS_RDONLY);
+    int fd = RSFS_open(fs, arg->filename,RSFS_RDONLY);
     printf("[reader %d] open file %c with READONLY; return fd=%d.\n", 
         arg->id, arg->filename, fd);
     if(fd<0){
@@ -27,14 +29,14 @@ void *reader_thread(void *ptr){
     }    
 
     //print fs status
-    RSFS_stat();
+    RSFS_stat(fs);
 
     //reset the position to the begining
-    RSFS_fseek(fd,0);
+    RSFS_fseek(fs, fd,0);
 
     //read the full content of the file
     char buf[256];
-    int ret = RSFS_read(fd,buf,256);
+    int ret = RSFS_read(fs, fd,buf,256);
     if(ret>0){
         printf("[reader %d] read %d bytes of string: %s\n",
             arg->id, ret, buf);
@@ -49,19 +51,20 @@ void *reader_thread(void *ptr){
 
     //close the file
     printf("[reader %d] close the file.\n", arg->id);
-    ret = RSFS_close(fd);
+    ret = RSFS_close(fs, fd);
     
 
-    RSFS_stat();        
+    RSFS_stat(fs);        
 }
 
 
 //writer thread
 void *writer_thread(void *ptr){
     struct thread_arg *arg = (struct thread_arg *)ptr;
+    rsfs_t *fs = arg->fs;
 
     //open a file with RSFS_RDONLY
-    int fd = RSFS_open(arg->filename,RSFS_RDWR);
+    int fd = RSFS_open(fs, arg->filename,RSFS_RDWR);
     printf("[writer %d] open file %c with RDWR; return fd=%d.\n", 
         arg->id, arg->filename, fd);
     if(fd<0){
@@ -70,10 +73,10 @@ void *writer_thread(void *ptr){
     }    
 
     //print fs status
-    RSFS_stat();
+    RSFS_stat(fs);
 
     //append to the file
-    int ret = RSFS_append(fd,arg->str,strlen(arg->str));
+    int ret = RSFS_append(fs, fd,arg->str,strlen(arg->str));
     if(ret>0){
         printf("[writer %d] append %d bytes of string.\n", arg->id, ret);
     }else{
@@ -82,32 +85,32 @@ void *writer_thread(void *ptr){
 
 
     //read the whole content
-    ret=RSFS_fseek(fd,0);
+    ret=RSFS_fseek(fs, fd,0);
     char buf[256];
-    ret = RSFS_read(fd,buf,256);
+    ret = RSFS_read(fs, fd,buf,256);
     if(ret>0){
         printf("[writer %d] read %d bytes of string: %s\n", arg->id, ret, buf);
     }else{
         printf("[writer %d] fail to read anything.\n", arg->id);
     }
 
-    RSFS_stat();
+    RSFS_stat(fs);
 
     //sleep for sleep_time
     sleep(arg->sleep_time);
 
     //close the file
     printf("[writer %d] close the file.\n", arg->id);
-    ret = RSFS_close(fd);
+    ret = RSFS_close(fs, fd);
     
 }
 
 
-void test_concurrency(){
+void test_concurrency(rsfs_t *fs){
 
     //create a file named "A"
-    int ret = RSFS_create('A');
-    printf("[main] result of RSFS_create('A'): %d\n", ret);
+    int ret = RSFS_create(fs, 'A');
+    printf("[main] result of RSFS_create(fs, 'A'): %d\n", ret);
 
     //write initial content to the file
     char msg_to_write[55] = "hello 1, hello 2, hello 3, hello 4, hello 5, hello 6, ";
@@ -116,6 +119,7 @@ void test_concurrency(){
     //prepare 2 writer threads
     pthread_t writer_threads[2];
     for(int i=0; i<2; i++){
+        writer_arg[i].fs=fs;
         writer_arg[i].id=i;
         writer_arg[i].filename='A';
         writer_arg[i].sleep_time=2;
@@ -126,6 +130,7 @@ void test_concurrency(){
     pthread_t reader_threads[4];
     struct thread_arg reader_arg[4];
     for(int i=0; i<4; i++){
+        reader_arg[i].fs=fs;
         reader_arg[i].id=i;
         reader_arg[i].filename='A';
         reader_arg[i].sleep_time=2;
@@ -150,7 +155,7 @@ void test_concurrency(){
 }
 
 
-void test_isolated(){
+void test_isolated(rsfs_t *fs){
 
     //preparation
     char str[8][16] = {"Alice", "Bob", "Charlie", "David",
@@ -162,7 +167,7 @@ void test_isolated(){
     int num_file_created=0;
     for(int i=0; i<NUM_INODES; i++){
         printf("%d\b",i);
-        int ret = RSFS_create(str[i][0]);
+        int ret = RSFS_create(fs, str[i][0]);
         if(ret!=0){
             printf("[test_basic] fail to create file: %c.\n", str[i][0]);
         }else{
@@ -170,13 +175,13 @@ void test_isolated(){
         }
     }
     printf("[test_basic] have called to create %d files.\n", num_file_created);
-    RSFS_stat();
+    RSFS_stat(fs);
 
     //open each file
     int num_file_open=0;
     int fd[NUM_INODES];
     for(int i=0; i<NUM_INODES; i++){
-        fd[i] = RSFS_open(str[i][0], RSFS_RDWR);
+        fd[i] = RSFS_open(fs, str[i][0], RSFS_RDWR);
         if(fd[i]<0){
             printf("[test_basic] fail to open file: %c\n", str[i][0]);
         }else{
@@ -184,49 +189,49 @@ void test_isolated(){
         }
     }
     printf("[test_basic] have called to open %d files.\n", num_file_open);
-    RSFS_stat();
+    RSFS_stat(fs);
 
     //append to each file
     for(int i=0; i<num_file_open; i++){
         for(int j=0; j<=i; j++){
-            int ret = RSFS_append(fd[i],str[i],strlen(str[i]));
+            int ret = RSFS_append(fs, fd[i],str[i],strlen(str[i]));
         }
     }
     printf("[test_basic] have appended to each of the opened files.\n");
-    RSFS_stat();
+    RSFS_stat(fs);
 
 
     //close the files
     for(int i=0; i<num_file_open; i++){
-        int ret=RSFS_close(fd[i]);
+        int ret=RSFS_close(fs, fd[i]);
         if(ret!=0){
             printf("[test_basic] fail to close file: %s.\n", str[i]);
         }
     }
     printf("[test_basic] have closed each of the opened files.\n");
-    RSFS_stat();
+    RSFS_stat(fs);
 
     //open each file again
     num_file_open = 0;
     for(int i=0; i<NUM_INODES; i++){
-        fd[i] = RSFS_open(str[i][0], RSFS_RDONLY);
+        fd[i] = RSFS_open(fs, str[i][0], RSFS_RDONLY);
         if(fd[i]>=0) num_file_open++;
     }
     printf("[test_basic] have opened %d files again.\n", num_file_open);
-    RSFS_stat();
+    RSFS_stat(fs);
 
 
     //read each file and then close it
     for(int i=0; i<num_file_open; i++){
         char buf[NUM_POINTERS*BLOCK_SIZE];
         memset(buf,0,NUM_POINTERS*BLOCK_SIZE);
-        RSFS_fseek(fd[i],0);
-        RSFS_read(fd[i],buf,NUM_POINTERS*BLOCK_SIZE); //read the whole file
+        RSFS_fseek(fs, fd[i],0);
+        RSFS_read(fs, fd[i],buf,NUM_POINTERS*BLOCK_SIZE); //read the whole file
         printf("File '%c' content: %s\n", str[i][0], buf);
-        RSFS_close(fd[i]);
+        RSFS_close(fs, fd[i]);
     }
     printf("\n[test_basic] have read and then closed each file.\n");
-    RSFS_stat();
+    RSFS_stat(fs);
 
 
     //write to each file from position 3
@@ -235,16 +240,16 @@ void test_isolated(){
     for(int i=0; i<num_file_open; i++){
         char buf[NUM_POINTERS*BLOCK_SIZE];
         memset(buf,0,NUM_POINTERS*BLOCK_SIZE);
-        fd[i] = RSFS_open(str[i][0], RSFS_RDWR);
-        RSFS_fseek(fd[i],3);
-        RSFS_write(fd[i],newText,59);
-        RSFS_fseek(fd[i],0);
-        RSFS_read(fd[i],buf,NUM_POINTERS*BLOCK_SIZE);
+        fd[i] = RSFS_open(fs, str[i][0], RSFS_RDWR);
+        RSFS_fseek(fs, fd[i],3);
+        RSFS_write(fs, fd[i],newText,59);
+        RSFS_fseek(fs, fd[i],0);
+        RSFS_read(fs, fd[i],buf,NUM_POINTERS*BLOCK_SIZE);
         printf("File '%c' new content: %s\n", str[i][0], buf);
-        RSFS_close(fd[i]);
+        RSFS_close(fs, fd[i]);
     }
     printf("\n[test_advanced_write] have read and then closed each file.\n");
-    RSFS_stat();
+    RSFS_stat(fs);
 
 
 
@@ -255,16 +260,16 @@ void test_isolated(){
     // for(int i=0; i<num_file_open; i++){
     //     char buf[NUM_POINTERS*BLOCK_SIZE];
     //     memset(buf,0,NUM_POINTERS*BLOCK_SIZE);
-    //     fd[i] = RSFS_open(str[i][0], RSFS_RDWR);
-    //     RSFS_fseek(fd[i],9);
-    //     RSFS_cut(fd[i],36);
-    //     RSFS_fseek(fd[i],0);
-    //     RSFS_read(fd[i],buf,NUM_POINTERS*BLOCK_SIZE);
+    //     fd[i] = RSFS_open(fs, str[i][0], RSFS_RDWR);
+    //     RSFS_fseek(fs, fd[i],9);
+    //     RSFS_cut(fs, fd[i],36);
+    //     RSFS_fseek(fs, fd[i],0);
+    //     RSFS_read(fs, fd[i],buf,NUM_POINTERS*BLOCK_SIZE);
     //     printf("File '%c' new content: %s\n", str[i][0], buf);
-    //     RSFS_close(fd[i]);
+    //     RSFS_close(fs, fd[i]);
     // }
     // printf("\n[test_advanced_cut] have read and then closed each file.\n");
-    // RSFS_stat();
+    // RSFS_stat(fs);
 
 
 
@@ -273,12 +278,12 @@ void test_isolated(){
     //delete all files 
     int num_file_deleted=0;
     for(int i=1; i<num_file_created; i++){
-        int ret = RSFS_delete(str[i][0]);
+        int ret = RSFS_delete(fs, str[i][0]);
         if(ret==0) num_file_deleted++;
 
     }
     printf("[test_basic] have deleted %d files.\n", num_file_deleted);
-    RSFS_stat();
+    RSFS_stat(fs);
 
 }
 
@@ -288,17 +293,18 @@ void test_isolated(){
 void main(){
 
     //initialize the file system
-    int ret = RSFS_init();
-    printf("[main] result of calling sys_init: %d\n", ret);
-    if(ret!=0){
+    rsfs_t *fs = RSFS_init();
+    printf("[main] result of calling sys_init: %d\n", fs ? 0 : -1);
+    if(fs==NULL){
         printf("[main] fail to initialize the system; run again later1\n");
         return; 
     }
 
     printf("\n\n-------------------Test for Isolated Cases-------------------------\n\n");
-    test_isolated();
+    test_isolated(fs);
 
     printf("\n\n--------Test for Concurrent Readers/Writers-----------\n\n");
-    test_concurrency();
+    test_concurrency(fs);
 
+    RSFS_destroy(fs);
 }
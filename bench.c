@@ -0,0 +1,839 @@
+/*
+    benchmarks of the file system (make bench; ./bench [--suite] [--csv path] [--json path])
+*/
+
+#include "def.h"
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_ITERATIONS 200000
+#define BENCH_FILE_SIZE (NUM_POINTERS*BLOCK_SIZE)
+#define BENCH_JOURNAL "/tmp/rsfs_bench_journal"
+
+
+static double now_seconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+//------ checksums -----------------------------------------------------------------------------------------------------
+
+//rewrite and read back a whole file; return the time per write+read pair in ns
+static double write_read_loop(rsfs_t *fs, int fd, char *buf, char *out){
+    double start = now_seconds();
+    for(int i=0; i<BENCH_ITERATIONS; i++){
+        buf[i % BENCH_FILE_SIZE]++;
+        RSFS_fseek(fs, fd, 0);
+        RSFS_write(fs, fd, buf, BENCH_FILE_SIZE);
+        RSFS_fseek(fs, fd, 0);
+        RSFS_read(fs, fd, out, BENCH_FILE_SIZE);
+    }
+    return (now_seconds() - start) * 1e9 / BENCH_ITERATIONS;
+}
+
+//cost of maintaining and verifying block checksums on the write/read paths
+static void bench_checksum(rsfs_t *fs){
+    char buf[BENCH_FILE_SIZE], out[BENCH_FILE_SIZE];
+    for(int i=0; i<BENCH_FILE_SIZE; i++) buf[i] = 'a' + i % 26;
+
+    //raw CRC32C throughput
+    char data[1 << 16];
+    memset(data, 7, sizeof(data));
+    unsigned int sink = 0;
+    double start = now_seconds();
+    for(int i=0; i<4096; i++) sink += crc32c(data, sizeof(data));
+    double elapsed = now_seconds() - start;
+    printf("crc32c: %.0f MB/s (per %d-byte block: %.1f ns) [%x]\n",
+        4096.0 * sizeof(data) / elapsed / 1e6, BLOCK_SIZE,
+        elapsed * 1e9 / (4096.0 * sizeof(data) / BLOCK_SIZE), sink);
+
+    RSFS_create(fs, 'b');
+    int fd = RSFS_open(fs, 'b', RSFS_RDWR);
+
+    char *names[] = {"off", "update", "verify"};
+    double base = 0;
+    for(int mode = CHECKSUM_OFF; mode <= CHECKSUM_VERIFY; mode++){
+        RSFS_checksum_enable(fs, mode);
+        double ns = write_read_loop(fs, fd, buf, out);
+        if(mode == CHECKSUM_OFF) base = ns;
+        printf("checksum %-7s %8.1f ns per %d-byte write+read  (%+.1f%%)\n",
+            names[mode], ns, BENCH_FILE_SIZE, (ns - base) / base * 100);
+    }
+
+    //the scrubber competing with the same loop (it skips the file while it
+    //is open for writing, so a second file gives it something to verify)
+    RSFS_create(fs, 'c');
+    int other = RSFS_open(fs, 'c', RSFS_RDWR);
+    RSFS_append(fs, other, buf, BENCH_FILE_SIZE);
+    RSFS_close(fs, other);
+    RSFS_scrubber_start(fs, 100000);
+    double ns = write_read_loop(fs, fd, buf, out);
+    RSFS_scrubber_stop(fs);
+    printf("verify + scrubber %8.1f ns per %d-byte write+read  (%+.1f%%)\n",
+        ns, BENCH_FILE_SIZE, (ns - base) / base * 100);
+    RSFS_checksum_stat(fs);
+
+    RSFS_checksum_enable(fs, CHECKSUM_OFF);
+    RSFS_close(fs, fd);
+    RSFS_delete(fs, 'b');
+    RSFS_delete(fs, 'c');
+}
+
+
+
+//------ instrumentation -----------------------------------------------------------------------------------------------
+
+//time per iteration of small calls with call histograms off and on
+static void bench_metrics(rsfs_t *fs){
+    char buf[BLOCK_SIZE], out[BLOCK_SIZE];
+    memset(buf, 'm', sizeof(buf));
+    RSFS_create(fs, 'm');
+    int fd = RSFS_open(fs, 'm', RSFS_RDWR);
+    RSFS_append(fs, fd, buf, sizeof(buf));
+    RSFS_close(fs, fd);
+
+    char *names[] = {"off", "on", "+events"};
+    double base_rw = 0, base_oc = 0;
+    for(int enabled=0; enabled<=2; enabled++){
+        RSFS_metrics_enable(fs, enabled > 0);
+        if(enabled == 2) RSFS_events_start(fs);
+
+        fd = RSFS_open(fs, 'm', RSFS_RDWR);
+        double start = now_seconds();
+        for(int i=0; i<BENCH_ITERATIONS; i++){
+            RSFS_fseek(fs, fd, 0);
+            RSFS_write(fs, fd, buf, sizeof(buf));
+            RSFS_fseek(fs, fd, 0);
+            RSFS_read(fs, fd, out, sizeof(out));
+        }
+        double rw = (now_seconds() - start) * 1e9 / BENCH_ITERATIONS;
+        RSFS_close(fs, fd);
+
+        start = now_seconds();
+        for(int i=0; i<BENCH_ITERATIONS; i++) RSFS_close(fs, RSFS_open(fs, 'm', RSFS_RDONLY));
+        double oc = (now_seconds() - start) * 1e9 / BENCH_ITERATIONS;
+
+        if(!enabled){
+            base_rw = rw;
+            base_oc = oc;
+        }
+        printf("metrics %-8s %8.1f ns per 4-call %d-byte write+read (%+.1f%%), %8.1f ns per open+close (%+.1f%%)\n",
+            names[enabled], rw, BLOCK_SIZE, (rw - base_rw) / base_rw * 100, oc, (oc - base_oc) / base_oc * 100);
+    }
+    RSFS_events_stop(fs);
+    RSFS_metrics_stat(fs);
+
+    RSFS_delete(fs, 'm');
+}
+
+//cost of a stats snapshot with a full directory, some files open
+static void bench_snapshot(rsfs_t *fs){
+    char names[MAX_INODES - 1];
+    int fds[NUM_OPEN_FILE / 2];
+    char buf[BLOCK_SIZE * 2];
+    memset(buf, 's', sizeof(buf));
+    int num_files = 0;
+    for(char name='A'; num_files < MAX_INODES - 1 && RSFS_create(fs, name) == 0; name++) names[num_files++] = name;
+    for(int i=0; i<num_files && i<NUM_OPEN_FILE/2; i++){
+        fds[i] = RSFS_open(fs, names[i], RSFS_RDWR);
+        RSFS_append(fs, fds[i], buf, sizeof(buf));
+    }
+
+    struct rsfs_stats *stats = malloc(sizeof(struct rsfs_stats));
+    double start = now_seconds();
+    for(int i=0; i<BENCH_ITERATIONS; i++) RSFS_stat_snapshot(fs, stats);
+    double ns = (now_seconds() - start) * 1e9 / BENCH_ITERATIONS;
+    printf("stat snapshot %8.1f ns with %d files (%d open)\n", ns, stats->num_files, stats->open_files);
+    free(stats);
+
+    //the same files listed 4 at a time, and looked up by name in one call
+    struct rsfs_file_stat files[MAX_INODES - 1];
+    int num_listed = 0;
+    start = now_seconds();
+    for(int i=0; i<BENCH_ITERATIONS; i++){
+        int cursor = 0, n;
+        for(num_listed = 0; (n = RSFS_readdir(fs, &cursor, files + num_listed, 4)) > 0; ) num_listed += n;
+    }
+    double readdir_ns = (now_seconds() - start) * 1e9 / BENCH_ITERATIONS;
+    start = now_seconds();
+    int num_found = 0;
+    for(int i=0; i<BENCH_ITERATIONS; i++) num_found = RSFS_stat_many(fs, names, num_files, files);
+    double stat_many_ns = (now_seconds() - start) * 1e9 / BENCH_ITERATIONS;
+    printf("readdir       %8.1f ns for %d files, 4 per call\n", readdir_ns, num_listed);
+    printf("stat_many     %8.1f ns for %d files\n\n", stat_many_ns, num_found);
+
+    for(int i=0; i<num_files && i<NUM_OPEN_FILE/2; i++) RSFS_close(fs, fds[i]);
+    for(int i=0; i<num_files; i++) RSFS_delete(fs, names[i]);
+}
+
+//ns per 5-byte append (the size of the names test_isolated appends) over
+//num_appends appends, each file filled to 240 bytes and emptied again with
+//RSFS_cut
+static double small_append_ns(rsfs_t *fs, int access_flag, int num_appends){
+    char buf[5] = "Alice";
+    int appends_per_file = NUM_POINTERS * BLOCK_SIZE / sizeof(buf) - 3;
+    RSFS_create(fs, 'w');
+    int fd = RSFS_open(fs, 'w', access_flag);
+
+    double start = now_seconds();
+    for(int i=0; i<num_appends; i+=appends_per_file){
+        for(int j=0; j<appends_per_file; j++) RSFS_append(fs, fd, buf, sizeof(buf));
+        RSFS_fseek(fs, fd, 0);
+        RSFS_cut(fs, fd, NUM_POINTERS * BLOCK_SIZE);
+    }
+    double ns = (now_seconds() - start) * 1e9 / num_appends;
+
+    RSFS_close(fs, fd);
+    RSFS_delete(fs, 'w');
+    return ns;
+}
+
+//small appends with and without a write-back buffer, in memory and with
+//every append committed to a journal
+static void bench_writeback(rsfs_t *fs){
+    double direct = small_append_ns(fs, RSFS_RDWR, BENCH_ITERATIONS);
+    double buffered = small_append_ns(fs, RSFS_RDWR | RSFS_WRBUF, BENCH_ITERATIONS);
+    printf("small appends   %10.1f ns each unbuffered, %10.1f ns with RSFS_WRBUF  (x%.1f)\n", direct, buffered, direct / buffered);
+
+    unlink(BENCH_JOURNAL);
+    rsfs_t *journaled = RSFS_init();
+    if(journaled == NULL || RSFS_journal_open(journaled, BENCH_JOURNAL, 0, 1) < 0){
+        if(journaled) RSFS_destroy(journaled);
+        printf("\n");
+        return;
+    }
+    direct = small_append_ns(journaled, RSFS_RDWR, BENCH_ITERATIONS / 100);
+    buffered = small_append_ns(journaled, RSFS_RDWR | RSFS_WRBUF, BENCH_ITERATIONS / 100);
+    printf("  journaled     %10.1f ns each unbuffered, %10.1f ns with RSFS_WRBUF  (x%.1f)\n\n", direct, buffered, direct / buffered);
+    RSFS_journal_close(journaled);
+    RSFS_destroy(journaled);
+    unlink(BENCH_JOURNAL);
+}
+
+
+
+//ns per update of num_files files, each rewritten with a 16-byte record
+//either through its own open/write/close or all in one transaction
+static double multi_file_update_ns(rsfs_t *fs, int use_txn, int num_updates){
+    char names[] = "pqrs";
+    int num_files = 4;
+    char record[16] = "balance:0000100";
+    for(int f=0; f<num_files; f++) RSFS_create(fs, names[f]);
+
+    double start = now_seconds();
+    for(int i=0; i<num_updates; i++){
+        if(use_txn){
+            rsfs_txn_t *txn = RSFS_txn_begin(fs);
+            for(int f=0; f<num_files; f++) RSFS_txn_write(txn, names[f], 0, record, sizeof(record));
+            RSFS_txn_commit(txn);
+            continue;
+        }
+        for(int f=0; f<num_files; f++){
+            int fd = RSFS_open(fs, names[f], RSFS_RDWR);
+            RSFS_write(fs, fd, record, sizeof(record));
+            RSFS_close(fs, fd);
+        }
+    }
+    double ns = (now_seconds() - start) * 1e9 / num_updates;
+
+    for(int f=0; f<num_files; f++) RSFS_delete(fs, names[f]);
+    return ns;
+}
+
+//updates of 4 files one call at a time and as one transaction, in memory and
+//with a journal (where a transaction waits for one commit instead of 4)
+static void bench_txn(rsfs_t *fs){
+    double separate = multi_file_update_ns(fs, 0, BENCH_ITERATIONS / 4);
+    double batched = multi_file_update_ns(fs, 1, BENCH_ITERATIONS / 4);
+    printf("4-file updates  %10.1f ns one call at a time, %10.1f ns as a transaction  (x%.1f)\n", separate, batched, separate / batched);
+
+    unlink(BENCH_JOURNAL);
+    rsfs_t *journaled = RSFS_init();
+    if(journaled == NULL || RSFS_journal_open(journaled, BENCH_JOURNAL, 0, 1) < 0){
+        if(journaled) RSFS_destroy(journaled);
+        printf("\n");
+        return;
+    }
+    separate = multi_file_update_ns(journaled, 0, BENCH_ITERATIONS / 400);
+    batched = multi_file_update_ns(journaled, 1, BENCH_ITERATIONS / 400);
+    printf("  journaled     %10.1f ns one call at a time, %10.1f ns as a transaction  (x%.1f)\n\n", separate, batched, separate / batched);
+    RSFS_journal_close(journaled);
+    RSFS_destroy(journaled);
+    unlink(BENCH_JOURNAL);
+}
+
+//------ compaction ----------------------------------------------------------------------------------------------------
+
+//read every file from start to end; return MB/s
+static double sequential_read_mbps(rsfs_t *fs, char *names, int num_files){
+    char out[BENCH_FILE_SIZE];
+    long bytes = 0;
+    double start = now_seconds();
+    for(int i=0; i<BENCH_ITERATIONS/10; i++){
+        int fd = RSFS_open(fs, names[i % num_files], RSFS_RDONLY);
+        bytes += RSFS_read(fs, fd, out, BENCH_FILE_SIZE);
+        RSFS_close(fs, fd);
+    }
+    return bytes / (now_seconds() - start) / 1e6;
+}
+
+//sequential reads through a small block cache, before and after compacting
+//files whose blocks were interleaved by concurrent appends and deletes
+static void bench_defrag(rsfs_t *fs){
+    char path[] = "/tmp/rsfs_bench_XXXXXX";
+    int tmp = mkstemp(path);
+    if(tmp < 0) return;
+    close(tmp);
+    unlink(path);
+    if(RSFS_cache_open(fs, path, 4) < 0) return;
+
+    //append to all files one block at a time so that their blocks interleave,
+    //then delete every other file to leave holes
+    char names[] = "defghij";
+    int num_files = 7;
+    char block[BLOCK_SIZE];
+    memset(block, 'x', BLOCK_SIZE);
+    int fd[7];
+    for(int f=0; f<num_files; f++){
+        RSFS_create(fs, names[f]);
+        fd[f] = RSFS_open(fs, names[f], RSFS_RDWR);
+    }
+    for(int b=0; b<NUM_POINTERS; b++){
+        for(int f=0; f<num_files; f++) RSFS_append(fs, fd[f], block, BLOCK_SIZE);
+    }
+    for(int f=0; f<num_files; f++) RSFS_close(fs, fd[f]);
+    for(int f=1; f<num_files; f+=2) RSFS_delete(fs, names[f]);
+    char kept[] = "dfhj";
+
+    RSFS_frag_stat(fs);
+    double before = sequential_read_mbps(fs, kept, 4);
+    double start = now_seconds();
+    int moved = RSFS_defrag(fs, 0);
+    double elapsed = now_seconds() - start;
+    RSFS_frag_stat(fs);
+    double after = sequential_read_mbps(fs, kept, 4);
+
+    printf("defrag: moved %d blocks in %.1f ms\n", moved, elapsed * 1e3);
+    printf("sequential read: %.1f MB/s before, %.1f MB/s after  (%+.1f%%)\n",
+        before, after, (after - before) / before * 100);
+
+    for(int f=0; f<num_files; f+=2) RSFS_delete(fs, names[f]);
+    RSFS_cache_close(fs);
+    unlink(path);
+}
+
+
+
+//------ block copy ----------------------------------------------------------------------------------------------------
+
+#define COPY_BYTES_PER_CELL (16 << 20) //bytes moved per measurement
+
+//move COPY_BYTES_PER_CELL bytes as transfers of transfer bytes, each copied
+//in pieces of block_size bytes by kernel; return GB/s
+static double kernel_gbps(struct copy_kernel *kernel, char *dst, char *src, int transfer, int block_size){
+    int transfers = COPY_BYTES_PER_CELL / transfer;
+    double start = now_seconds();
+    for(int t=0; t<transfers; t++){
+        for(int off=0; off<transfer; off+=block_size) kernel->copy(dst + off, src + off, block_size);
+    }
+    return (double)transfers * transfer / (now_seconds() - start) / 1e9;
+}
+
+//the copy kernels by themselves across transfer and block sizes, then the
+//read/write paths across transfer sizes with each kernel
+static void bench_copy(rsfs_t *fs){
+    int transfers[] = {256, 4096, 65536, 1 << 20};
+    int block_sizes[] = {16, 32, 64, 256, 4096};
+    int num_transfers = sizeof(transfers)/sizeof(transfers[0]);
+    int num_block_sizes = sizeof(block_sizes)/sizeof(block_sizes[0]);
+
+    int num_kernels;
+    struct copy_kernel *kernels = block_copy_kernels(&num_kernels);
+    const char *selected = block_copy_kernel();
+    char *src = malloc(1 << 20), *dst = malloc(1 << 20);
+    memset(src, 3, 1 << 20);
+
+    printf("copy kernels (GB/s; whole blocks use %s at BLOCK_SIZE %d)\n", selected, BLOCK_SIZE);
+    printf("%-8s%8s", "kernel", "block");
+    for(int t=0; t<num_transfers; t++) printf("%9dB", transfers[t]);
+    printf("\n");
+    for(int k=0; k<num_kernels; k++){
+        if(!kernels[k].supported) continue;
+        for(int b=0; b<num_block_sizes; b++){
+            printf("%-8s%7dB", kernels[k].name, block_sizes[b]);
+            for(int t=0; t<num_transfers; t++){
+                if(block_sizes[b] > transfers[t]) printf("%10s", "-");
+                else printf("%10.2f", kernel_gbps(&kernels[k], dst, src, transfers[t], block_sizes[b]));
+            }
+            printf("\n");
+        }
+    }
+
+    //RSFS_write + RSFS_read of one file
+    int sizes[] = {1, 16, BLOCK_SIZE, 2*BLOCK_SIZE, BENCH_FILE_SIZE/2, BENCH_FILE_SIZE};
+    int num_sizes = sizeof(sizes)/sizeof(sizes[0]);
+    RSFS_create(fs, 'k');
+    int fd = RSFS_open(fs, 'k', RSFS_RDWR);
+    printf("\nwrite+read (ns)\n%-8s", "kernel");
+    for(int i=0; i<num_sizes; i++) printf("%9dB", sizes[i]);
+    printf("\n");
+    for(int k=0; k<num_kernels; k++){
+        if(!kernels[k].supported) continue;
+        block_copy_use(kernels[k].name);
+        printf("%-8s", kernels[k].name);
+        for(int i=0; i<num_sizes; i++){
+            double start = now_seconds();
+            for(int j=0; j<BENCH_ITERATIONS/10; j++){
+                RSFS_fseek(fs, fd, 0);
+                RSFS_write(fs, fd, src, sizes[i]);
+                RSFS_fseek(fs, fd, 0);
+                RSFS_read(fs, fd, dst, sizes[i]);
+            }
+            printf("%10.1f", (now_seconds() - start) * 1e9 / (BENCH_ITERATIONS/10));
+        }
+        printf("\n");
+    }
+    printf("\n");
+    block_copy_use(selected);
+
+    RSFS_close(fs, fd);
+    RSFS_delete(fs, 'k');
+    free(src);
+    free(dst);
+}
+
+
+
+//------ sharded namespace ---------------------------------------------------------------------------------------------
+
+struct meta_arg{
+    rsfs_t *fs;
+    char name;
+    long ops;
+};
+
+//create, open, close and delete one file over and over
+static void *meta_thread(void *ptr){
+    struct meta_arg *arg = ptr;
+    for(int i=0; i<BENCH_ITERATIONS/10; i++){
+        RSFS_create(arg->fs, arg->name);
+        int fd = RSFS_open(arg->fs, arg->name, RSFS_RDWR);
+        RSFS_close(arg->fs, fd);
+        RSFS_delete(arg->fs, arg->name);
+        arg->ops += 4;
+    }
+    return NULL;
+}
+
+//metadata ops/sec of num_threads threads, each working on its own file;
+//with a sharded fs, thread t uses a name that hashes to shard t
+static double meta_ops_per_second(rsfs_t *fs, int num_threads){
+    pthread_t threads[RSFS_MAX_SHARDS];
+    struct meta_arg args[RSFS_MAX_SHARDS];
+    char next_name = 'A';
+
+    for(int t=0; t<num_threads; t++){
+        args[t].fs = fs;
+        args[t].ops = 0;
+        args[t].name = next_name++;
+        while(fs->num_shards && shard_index(fs, args[t].name) != t) args[t].name = next_name++;
+    }
+
+    double start = now_seconds();
+    for(int t=0; t<num_threads; t++) pthread_create(&threads[t], NULL, meta_thread, &args[t]);
+    long ops = 0;
+    for(int t=0; t<num_threads; t++){
+        pthread_join(threads[t], NULL);
+        ops += args[t].ops;
+    }
+    return ops / (now_seconds() - start);
+}
+
+//create/open/close/delete throughput: one instance shared by all threads
+//versus one shard per thread
+static void bench_shards(){
+    printf("\n%8s%16s%16s%10s\n", "threads", "1 fs (ops/s)", "sharded (ops/s)", "speedup");
+    for(int num_threads=1; num_threads<=4; num_threads*=2){
+        rsfs_t *single = RSFS_init();
+        rsfs_t *sharded = RSFS_init_sharded(num_threads);
+        double one = meta_ops_per_second(single, num_threads);
+        double many = meta_ops_per_second(sharded, num_threads);
+        printf("%8d%16.0f%16.0f%10.2f\n", num_threads, one, many, many / one);
+        RSFS_destroy(single);
+        RSFS_destroy(sharded);
+    }
+    printf("\n");
+}
+
+
+//------ local IPC -----------------------------------------------------------------------------------------------------
+
+//average time of RSFS_fseek (a call with no data) in ns
+static double call_latency_ns(rsfs_t *fs, int fd){
+    double start = now_seconds();
+    for(int i=0; i<BENCH_ITERATIONS/10; i++) RSFS_fseek(fs, fd, i % BENCH_FILE_SIZE);
+    return (now_seconds() - start) * 1e9 / (BENCH_ITERATIONS/10);
+}
+
+//throughput of whole-file write+read pairs in MB/s
+static double write_read_mbps(rsfs_t *fs, int fd){
+    char buf[BENCH_FILE_SIZE], out[BENCH_FILE_SIZE];
+    memset(buf, 'i', BENCH_FILE_SIZE);
+    double start = now_seconds();
+    for(int i=0; i<BENCH_ITERATIONS/10; i++){
+        RSFS_fseek(fs, fd, 0);
+        RSFS_write(fs, fd, buf, BENCH_FILE_SIZE);
+        RSFS_fseek(fs, fd, 0);
+        RSFS_read(fs, fd, out, BENCH_FILE_SIZE);
+    }
+    return 2.0 * BENCH_FILE_SIZE * (BENCH_ITERATIONS/10) / (now_seconds() - start) / 1e6;
+}
+
+//the same calls in-process and through a server (socket for the calls,
+//shared buffer for the data)
+static void bench_ipc(){
+    char path[] = "/tmp/rsfs_bench_ipc.sock";
+    rsfs_t *fs = RSFS_init();
+    if(RSFS_serve_start(fs, path) < 0){
+        RSFS_destroy(fs);
+        return;
+    }
+    rsfs_t *client = RSFS_connect(path);
+    if(client == NULL){
+        RSFS_destroy(fs);
+        return;
+    }
+
+    char buf[BENCH_FILE_SIZE];
+    memset(buf, 'i', BENCH_FILE_SIZE);
+    RSFS_create(fs, 'i');
+    int fd = RSFS_open(fs, 'i', RSFS_RDWR);
+    RSFS_append(fs, fd, buf, BENCH_FILE_SIZE);
+    double local_ns = call_latency_ns(fs, fd);
+    double local_mbps = write_read_mbps(fs, fd);
+    RSFS_close(fs, fd);
+
+    fd = RSFS_open(client, 'i', RSFS_RDWR);
+    double remote_ns = call_latency_ns(client, fd);
+    double remote_mbps = write_read_mbps(client, fd);
+    RSFS_close(client, fd);
+
+    printf("%12s%16s%16s\n", "", "in-process", "ipc");
+    printf("%12s%13.0f ns%13.0f ns  (x%.1f)\n", "call", local_ns, remote_ns, remote_ns / local_ns);
+    printf("%12s%11.1f MB/s%11.1f MB/s  (x%.2f)\n\n", "write+read", local_mbps, remote_mbps, remote_mbps / local_mbps);
+
+    RSFS_destroy(client);
+    RSFS_destroy(fs);
+}
+
+//------ operation suite -----------------------------------------------------------------------------------------------
+//every case runs with 1, 2, 4 and 8 threads on a fresh instance; each thread
+//times its own calls, and the latencies of all threads are merged into
+//percentiles (./bench --suite [--csv path] [--json path])
+
+#define SUITE_OPS 100000 //calls per measurement, split among the threads
+#define SUITE_MAX_THREADS 8
+
+struct suite_thread;
+
+//one kind of call; before (untimed) prepares the next op, e.g. resets a full file
+struct suite_case{
+    const char *name;
+    int shared_file; //1 if all threads use one file, 0 if each has its own
+    int (*op)(struct suite_thread *t); //one timed call (or pair); return 0 if succeed
+    void (*before)(struct suite_thread *t);
+};
+
+struct suite_thread{
+    rsfs_t *fs;
+    const struct suite_case *c;
+    int id;
+    int size; //bytes per call
+    int ops;
+    char name; //file of this thread
+    int fd;
+    int position;
+    int length;
+    unsigned int seed;
+    char buf[BENCH_FILE_SIZE];
+    long *latency_ns; //one per op
+    int errors;
+    pthread_barrier_t *barrier;
+};
+
+struct suite_result{
+    const char *name;
+    int size;
+    int num_threads;
+    int ops;
+    int errors;
+    double ops_per_second;
+    long p50_ns, p90_ns, p99_ns, p999_ns, max_ns;
+};
+
+static long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int op_create_delete(struct suite_thread *t){
+    if(RSFS_create(t->fs, t->name) < 0) return -1;
+    return RSFS_delete(t->fs, t->name);
+}
+
+static int op_open_close(struct suite_thread *t){
+    int fd = RSFS_open(t->fs, t->name, RSFS_RDONLY);
+    if(fd < 0) return -1;
+    return RSFS_close(t->fs, fd);
+}
+
+//next offset of a sequential stream over the file
+static int next_sequential(struct suite_thread *t){
+    if(t->position + t->size > BENCH_FILE_SIZE) t->position = 0;
+    int position = t->position;
+    t->position += t->size;
+    return position;
+}
+
+static int op_seq_read(struct suite_thread *t){
+    RSFS_fseek(t->fs, t->fd, next_sequential(t));
+    return RSFS_read(t->fs, t->fd, t->buf, t->size) == t->size ? 0 : -1;
+}
+
+static int op_rand_read(struct suite_thread *t){
+    RSFS_fseek(t->fs, t->fd, rand_r(&t->seed) % (BENCH_FILE_SIZE - t->size + 1));
+    return RSFS_read(t->fs, t->fd, t->buf, t->size) == t->size ? 0 : -1;
+}
+
+//RSFS_write truncates at its end, so the stream refills the file as it goes
+static int op_seq_write(struct suite_thread *t){
+    RSFS_fseek(t->fs, t->fd, next_sequential(t));
+    return RSFS_write(t->fs, t->fd, t->buf, t->size) == t->size ? 0 : -1;
+}
+
+static void before_append(struct suite_thread *t){
+    if(t->length + t->size <= BENCH_FILE_SIZE) return;
+    RSFS_fseek(t->fs, t->fd, 0);
+    RSFS_cut(t->fs, t->fd, t->length);
+    t->length = 0;
+}
+
+static int op_append(struct suite_thread *t){
+    if(RSFS_append(t->fs, t->fd, t->buf, t->size) != t->size) return -1;
+    t->length += t->size;
+    return 0;
+}
+
+//thread 0 writes the shared file, the others read it; each call opens and
+//closes it, so writers wait for readers and the other way around
+static int op_rw_contention(struct suite_thread *t){
+    int writer = t->id == 0;
+    int fd = RSFS_open(t->fs, t->name, writer ? RSFS_RDWR : RSFS_RDONLY);
+    if(fd < 0) return -1;
+    int ret = writer ? RSFS_write(t->fs, fd, t->buf, t->size) : RSFS_read(t->fs, fd, t->buf, t->size);
+    RSFS_close(t->fs, fd);
+    return ret == t->size ? 0 : -1;
+}
+
+static const struct suite_case suite_cases[] = {
+    {"create_delete", 0, op_create_delete, NULL},
+    {"open_close", 0, op_open_close, NULL},
+    {"seq_read", 0, op_seq_read, NULL},
+    {"rand_read", 0, op_rand_read, NULL},
+    {"seq_write", 0, op_seq_write, NULL},
+    {"append", 0, op_append, before_append},
+    {"rw_contention", 1, op_rw_contention, NULL},
+};
+
+static void *suite_thread_main(void *ptr){
+    struct suite_thread *t = (struct suite_thread *)ptr;
+    pthread_barrier_wait(t->barrier);
+    for(int i=0; i<t->ops; i++){
+        if(t->c->before) t->c->before(t);
+        long start = now_ns();
+        if(t->c->op(t) < 0) t->errors++;
+        t->latency_ns[i] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static int compare_long(const void *a, const void *b){
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+//run one case with num_threads threads on a fresh instance
+static struct suite_result suite_run(const struct suite_case *c, int size, int num_threads){
+    struct suite_result result = {0};
+    result.name = c->name;
+    result.size = size;
+    result.num_threads = num_threads;
+    rsfs_t *fs = RSFS_init();
+
+    //a full file per thread (or one shared), opened by its thread unless the
+    //case opens it itself
+    static struct suite_thread threads[SUITE_MAX_THREADS];
+    char fill[BENCH_FILE_SIZE];
+    memset(fill, 'x', sizeof(fill));
+    int ops_per_thread = SUITE_OPS / num_threads;
+    long *latency_ns = malloc(sizeof(long) * ops_per_thread * num_threads);
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, num_threads + 1);
+    int opens_file = c->op != op_create_delete && c->op != op_open_close && !c->shared_file;
+
+    for(int i=0; i<num_threads; i++){
+        struct suite_thread *t = &threads[i];
+        memset(t, 0, sizeof(*t));
+        t->fs = fs;
+        t->c = c;
+        t->id = i;
+        t->size = size;
+        t->ops = ops_per_thread;
+        t->name = c->shared_file ? 'S' : 'A' + i;
+        t->seed = i + 1;
+        t->latency_ns = latency_ns + (long)i * ops_per_thread;
+        t->barrier = &barrier;
+        memset(t->buf, 'a' + i, sizeof(t->buf));
+        if(c->op == op_create_delete || (c->shared_file && i > 0)) continue;
+
+        RSFS_create(fs, t->name);
+        int fd = RSFS_open(fs, t->name, RSFS_RDWR);
+        RSFS_append(fs, fd, fill, BENCH_FILE_SIZE);
+        t->length = BENCH_FILE_SIZE;
+        if(opens_file) t->fd = fd;
+        else RSFS_close(fs, fd);
+    }
+
+    pthread_t tids[SUITE_MAX_THREADS];
+    for(int i=0; i<num_threads; i++) pthread_create(&tids[i], NULL, suite_thread_main, &threads[i]);
+    long start = now_ns(); //no thread starts before main reaches the barrier
+    pthread_barrier_wait(&barrier);
+    for(int i=0; i<num_threads; i++){
+        pthread_join(tids[i], NULL);
+        result.errors += threads[i].errors;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    result.ops = ops_per_thread * num_threads;
+    result.ops_per_second = result.ops / elapsed;
+    qsort(latency_ns, result.ops, sizeof(long), compare_long);
+    result.p50_ns = latency_ns[(long)result.ops * 50 / 100];
+    result.p90_ns = latency_ns[(long)result.ops * 90 / 100];
+    result.p99_ns = latency_ns[(long)result.ops * 99 / 100];
+    result.p999_ns = latency_ns[(long)result.ops * 999 / 1000];
+    result.max_ns = latency_ns[result.ops - 1];
+
+    for(int i=0; i<num_threads; i++) if(opens_file) RSFS_close(fs, threads[i].fd);
+    pthread_barrier_destroy(&barrier);
+    free(latency_ns);
+    RSFS_destroy(fs);
+    return result;
+}
+
+//run every case at every size and thread count; print a table, and write the
+//results as CSV and/or JSON if paths are given; return the number of results
+static int bench_suite(const char *csv_path, const char *json_path){
+    int sizes[] = {1, BLOCK_SIZE, 4*BLOCK_SIZE, BENCH_FILE_SIZE};
+    int thread_counts[] = {1, 2, 4, SUITE_MAX_THREADS};
+    int num_cases = sizeof(suite_cases)/sizeof(suite_cases[0]);
+    int num_sizes = sizeof(sizes)/sizeof(sizes[0]);
+    int num_thread_counts = sizeof(thread_counts)/sizeof(thread_counts[0]);
+
+    int max_results = num_cases * num_sizes * num_thread_counts;
+    struct suite_result *results = malloc(sizeof(struct suite_result) * max_results);
+    int num_results = 0;
+
+    printf("%-14s%6s%8s%12s%10s%10s%10s%10s%10s%7s\n", "case", "size", "threads",
+        "ops/s", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns", "errors");
+    for(int c=0; c<num_cases; c++){
+        //the size does not apply to creating and opening files
+        int metadata = suite_cases[c].op == op_create_delete || suite_cases[c].op == op_open_close;
+        for(int s=0; s<num_sizes; s++){
+            if(metadata && s > 0) break;
+            int size = metadata ? 0 : sizes[s];
+            for(int n=0; n<num_thread_counts; n++){
+                struct suite_result *r = &results[num_results++];
+                *r = suite_run(&suite_cases[c], size, thread_counts[n]);
+                printf("%-14s%6d%8d%12.0f%10ld%10ld%10ld%10ld%10ld%7d\n", r->name, r->size, r->num_threads,
+                    r->ops_per_second, r->p50_ns, r->p90_ns, r->p99_ns, r->p999_ns, r->max_ns, r->errors);
+                fflush(stdout);
+            }
+        }
+    }
+    printf("\n");
+
+    FILE *csv = csv_path ? fopen(csv_path, "w") : NULL;
+    if(csv){
+        fprintf(csv, "case,size,threads,ops,ops_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,errors\n");
+        for(int i=0; i<num_results; i++){
+            struct suite_result *r = &results[i];
+            fprintf(csv, "%s,%d,%d,%d,%.0f,%ld,%ld,%ld,%ld,%ld,%d\n", r->name, r->size, r->num_threads, r->ops,
+                r->ops_per_second, r->p50_ns, r->p90_ns, r->p99_ns, r->p999_ns, r->max_ns, r->errors);
+        }
+        fclose(csv);
+    }
+    else if(csv_path) printf("[bench_suite] fail to open %s.\n", csv_path);
+
+    FILE *json = json_path ? fopen(json_path, "w") : NULL;
+    if(json){
+        fprintf(json, "{\"block_size\": %d, \"num_pointers\": %d, \"copy_kernel\": \"%s\", \"results\": [\n",
+            BLOCK_SIZE, NUM_POINTERS, block_copy_kernel());
+        for(int i=0; i<num_results; i++){
+            struct suite_result *r = &results[i];
+            fprintf(json, "  {\"case\": \"%s\", \"size\": %d, \"threads\": %d, \"ops\": %d, \"ops_per_sec\": %.0f, "
+                "\"p50_ns\": %ld, \"p90_ns\": %ld, \"p99_ns\": %ld, \"p999_ns\": %ld, \"max_ns\": %ld, \"errors\": %d}%s\n",
+                r->name, r->size, r->num_threads, r->ops, r->ops_per_second,
+                r->p50_ns, r->p90_ns, r->p99_ns, r->p999_ns, r->max_ns, r->errors, i < num_results-1 ? "," : "");
+        }
+        fprintf(json, "]}\n");
+        fclose(json);
+    }
+    else if(json_path) printf("[bench_suite] fail to open %s.\n", json_path);
+
+    free(results);
+    return num_results;
+}
+
+
+
+
+//./bench runs every section; --suite runs only the operation suite, and
+//--csv/--json save its results for comparing versions
+int main(int argc, char *argv[]){
+    int suite_only = 0;
+    const char *csv_path = NULL, *json_path = NULL;
+    for(int i=1; i<argc; i++){
+        if(strcmp(argv[i], "--suite") == 0) suite_only = 1;
+        else if(strcmp(argv[i], "--csv") == 0 && i+1 < argc) csv_path = argv[++i];
+        else if(strcmp(argv[i], "--json") == 0 && i+1 < argc) json_path = argv[++i];
+        else{
+            printf("usage: %s [--suite] [--csv path] [--json path]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if(!suite_only){
+        rsfs_t *fs = RSFS_init();
+        if(fs == NULL) return 1;
+
+        bench_checksum(fs);
+        bench_copy(fs);
+        bench_metrics(fs);
+        bench_snapshot(fs);
+        bench_writeback(fs);
+        bench_txn(fs);
+        bench_defrag(fs);
+
+        RSFS_destroy(fs);
+
+        bench_shards();
+        bench_ipc();
+    }
+
+    bench_suite(csv_path, json_path);
+
+    return 0;
+}
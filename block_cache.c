@@ -0,0 +1,463 @@
+/*
+    in-memory block cache in front of a block device;
+    frames are replaced with CLOCK, dirty frames are written back on eviction
+    or flush, and a frame is pinned while a caller copies to/from it
+*/
+
+#include "def.h"
+
+//pins the calling thread holds in the cache of fs (through get_block)
+static __thread struct{
+    rsfs_t *fs;
+    int count;
+} held;
+
+
+//frames nobody has pinned (called with the mutex held)
+static int unpinned_frames(rsfs_t *fs){
+    int num_unpinned = 0;
+    for(int f=0; f<fs->block_cache.num_frames; f++) num_unpinned += fs->block_cache.frames[f].pin_count == 0;
+    return num_unpinned;
+}
+
+//pick a frame to reuse with the CLOCK algorithm: sweep the hand and give
+//referenced frames a second chance; pinned or busy frames are skipped;
+//return -1 if every frame is pinned or busy (called with the mutex held)
+static int clock_evict(rsfs_t *fs){
+    for(int scanned=0; scanned<2*fs->block_cache.num_frames; scanned++){
+        struct cache_frame *frame = &fs->block_cache.frames[fs->block_cache.clock_hand];
+        int f = fs->block_cache.clock_hand;
+        fs->block_cache.clock_hand = (fs->block_cache.clock_hand + 1) % fs->block_cache.num_frames;
+
+        if(frame->pin_count > 0 || frame->io_busy) continue;
+        if(frame->referenced){
+            frame->referenced = 0;
+            continue;
+        }
+        return f;
+    }
+    return -1;
+}
+
+//map block_number to a frame, reading it from the device on a miss;
+//pin=1 for a demand access, pin=0 for a read-ahead that only loads the block;
+//a caller pinning its first block (holding=0) waits while fewer than two
+//frames are unpinned, so that the last one is left to a caller pinning its
+//second block (a copy-on-write or a dedup compare), which never waits for a
+//frame held by callers that wait for it in turn;
+//return the frame index with the mutex held, or -1 on I/O error
+static int cache_lookup(rsfs_t *fs, int block_number, int pin, int holding){
+    while(1){
+        int f = fs->block_cache.frame_of_block[block_number];
+        int takes_frame = f < 0 || fs->block_cache.frames[f].pin_count == 0;
+        if(pin && !holding && takes_frame && unpinned_frames(fs) < 2){
+            pthread_cond_wait(&fs->block_cache.changed, &fs->block_cache.mutex);
+            continue;
+        }
+        if(f >= 0){
+            struct cache_frame *frame = &fs->block_cache.frames[f];
+            if(frame->io_busy){//being filled or written back; look again when done
+                pthread_cond_wait(&fs->block_cache.changed, &fs->block_cache.mutex);
+                continue;
+            }
+            frame->referenced = 1;
+            frame->pin_count += pin;
+            if(pin){
+                fs->block_cache.hits++;
+                if(frame->prefetched) fs->block_cache.prefetch_hits++;
+                frame->prefetched = 0;
+            }
+            return f;
+        }
+
+        f = clock_evict(fs);
+        if(f < 0){//every frame is pinned
+            pthread_cond_wait(&fs->block_cache.changed, &fs->block_cache.mutex);
+            continue;
+        }
+        if(pin) fs->block_cache.misses++;
+        else fs->block_cache.prefetches++;
+
+        //claim the frame for block_number; the old mapping stays until the
+        //write-back is done so that nobody reads a stale copy from the device
+        struct cache_frame *frame = &fs->block_cache.frames[f];
+        int old_block = frame->block_number;
+        int write_back = old_block >= 0 && frame->dirty;
+        if(old_block >= 0) fs->block_cache.evictions++;
+        if(write_back) fs->block_cache.writebacks++;
+        frame->io_busy = 1;
+        frame->pin_count = pin;
+        fs->block_cache.frame_of_block[block_number] = f;
+
+        pthread_mutex_unlock(&fs->block_cache.mutex);
+
+        int ret = 0;
+        if(write_back) ret = fs->block_cache.dev->write_block(fs->block_cache.dev, old_block, frame->data);
+        int written = ret == 0;
+        if(ret == 0) ret = fs->block_cache.dev->read_block(fs->block_cache.dev, block_number, frame->data);
+
+        pthread_mutex_lock(&fs->block_cache.mutex);
+
+        if(!written){
+            //keep the dirty block in its frame (still mapped) rather than drop it
+            printf("[block_cache] fail to write back block %d.\n", old_block);
+            fs->block_cache.frame_of_block[block_number] = -1;
+            frame->io_busy = 0;
+            frame->pin_count = 0;
+            frame->referenced = 1;
+            pthread_cond_broadcast(&fs->block_cache.changed);
+            return -1;
+        }
+        if(old_block >= 0 && fs->block_cache.frame_of_block[old_block] == f){
+            fs->block_cache.frame_of_block[old_block] = -1;
+        }
+        frame->io_busy = 0;
+        frame->dirty = 0;
+        frame->referenced = 1;
+        frame->prefetched = !pin;
+        if(ret < 0){
+            printf("[block_cache] I/O error on block %d.\n", block_number);
+            fs->block_cache.frame_of_block[block_number] = -1;
+            frame->block_number = -1;
+            frame->pin_count = 0;
+            pthread_cond_broadcast(&fs->block_cache.changed);
+            return -1;
+        }
+        frame->block_number = block_number;
+        pthread_cond_broadcast(&fs->block_cache.changed);
+        return f;
+    }
+}
+
+
+//return the memory of data block block_number, pinned until put_block, or
+//NULL (nothing to put back) on an I/O error; without a cache this is simply
+//the block in memory
+char *get_block(rsfs_t *fs, int block_number){
+    if(!fs->block_cache.active) return block_memory(fs, block_number);
+
+    pthread_mutex_lock(&fs->block_cache.mutex);
+    int f = cache_lookup(fs, block_number, 1, held.fs == fs ? held.count : 0);
+    char *data = f >= 0 ? fs->block_cache.frames[f].data : NULL;
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+
+    if(data && held.count == 0) held.fs = fs;
+    if(data && held.fs == fs) held.count++;
+    return data;
+}
+
+//pin a block for as long as the instance needs it (the root directory
+//block), rather than for the calling thread; unpinned with unpin_block
+char *pin_block(rsfs_t *fs, int block_number){
+    if(!fs->block_cache.active) return block_memory(fs, block_number);
+
+    pthread_mutex_lock(&fs->block_cache.mutex);
+    int f = cache_lookup(fs, block_number, 1, 0);
+    char *data = f >= 0 ? fs->block_cache.frames[f].data : NULL;
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+
+    return data;
+}
+
+//return the memory of a block the caller already holds pinned (such as the
+//root directory block), without pinning it again
+char *pinned_block(rsfs_t *fs, int block_number){
+    if(!fs->block_cache.active) return block_memory(fs, block_number);
+
+    pthread_mutex_lock(&fs->block_cache.mutex);
+    int f = fs->block_cache.frame_of_block[block_number];
+    char *data = f >= 0 ? fs->block_cache.frames[f].data : NULL;
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+
+    return data;
+}
+
+//unpin a block of the cache of fs (called with the mutex held)
+static void unpin_locked(rsfs_t *fs, int block_number, int dirty){
+    int f = fs->block_cache.frame_of_block[block_number];
+    if(f >= 0 && fs->block_cache.frames[f].pin_count > 0){
+        struct cache_frame *frame = &fs->block_cache.frames[f];
+        if(dirty) frame->dirty = 1;
+        frame->pin_count--;
+        if(frame->pin_count == 0) pthread_cond_broadcast(&fs->block_cache.changed);
+    }
+}
+
+//unpin a block returned by get_block; dirty=1 if it was modified
+void put_block(rsfs_t *fs, int block_number, int dirty){
+    if(!fs->block_cache.active) return;
+
+    pthread_mutex_lock(&fs->block_cache.mutex);
+    unpin_locked(fs, block_number, dirty);
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+
+    if(held.fs == fs && held.count > 0) held.count--;
+}
+
+//unpin a block returned by pin_block; dirty=1 if it was modified
+void unpin_block(rsfs_t *fs, int block_number, int dirty){
+    if(!fs->block_cache.active) return;
+
+    pthread_mutex_lock(&fs->block_cache.mutex);
+    unpin_locked(fs, block_number, dirty);
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+}
+
+//load a block into the cache without pinning it (used by read-ahead)
+void prefetch_block(rsfs_t *fs, int block_number){
+    if(!fs->block_cache.active) return;
+
+    pthread_mutex_lock(&fs->block_cache.mutex);
+    cache_lookup(fs, block_number, 0, 0);
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+}
+
+//mark a block that stays pinned (e.g., the root directory) as modified
+void mark_block_dirty(rsfs_t *fs, int block_number){
+    if(!fs->block_cache.active) return;
+
+    pthread_mutex_lock(&fs->block_cache.mutex);
+    int f = fs->block_cache.frame_of_block[block_number];
+    if(f >= 0) fs->block_cache.frames[f].dirty = 1;
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//put a cache of num_frames frames in front of dev; no file may be open.
+//if dev is new, the current blocks are copied to it; if it already holds
+//data, its blocks are used as-is (replay the journal afterwards to get the
+//matching metadata). num_frames must hold the root directory block and the
+//two blocks a copy-on-write pins at once.
+//return 0 if succeed; otherwise return a negative value
+int RSFS_cache_attach(rsfs_t *fs, struct block_device *dev, int num_frames){
+    char *debug_title = "[RSFS_cache_attach]";
+
+    if(router_refuse(fs, debug_title) < 0 || shm_refuse(fs, debug_title) < 0) return -1;
+    if(fs->block_cache.active){
+        printf("%s a cache is already attached.\n", debug_title);
+        return -1;
+    }
+    if(dev == NULL || num_frames < 3){
+        printf("%s invalid device or number of frames (%d).\n", debug_title, num_frames);
+        return -1;
+    }
+
+    search_dir(fs, 0); //make sure the root directory block exists
+
+    pthread_rwlock_wrlock(&fs->mutator_lock);
+
+    for(int i=0; i<NUM_OPEN_FILE; i++){
+        if(fs->open_file_table[i].used){
+            pthread_rwlock_unlock(&fs->mutator_lock);
+            printf("%s files are still open.\n", debug_title);
+            return -2;
+        }
+    }
+
+    if(!dev->formatted){
+        for(int i=0; i<fs->num_dblocks; i++){
+            if(dev->write_block(dev, i, block_memory(fs, i)) < 0){
+                pthread_rwlock_unlock(&fs->mutator_lock);
+                printf("%s fail to format the device.\n", debug_title);
+                return -3;
+            }
+        }
+        dev->sync(dev);
+    }
+
+    fs->block_cache.frames = malloc(num_frames * sizeof(struct cache_frame));
+    fs->block_cache.frame_data = malloc((long)num_frames * BLOCK_SIZE);
+    if(fs->block_cache.frames == NULL || fs->block_cache.frame_data == NULL){
+        free(fs->block_cache.frames);
+        free(fs->block_cache.frame_data);
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        return -4;
+    }
+    for(int f=0; f<num_frames; f++){
+        struct cache_frame *frame = &fs->block_cache.frames[f];
+        frame->block_number = -1;
+        frame->pin_count = 0;
+        frame->referenced = 0;
+        frame->dirty = 0;
+        frame->io_busy = 0;
+        frame->prefetched = 0;
+        frame->data = fs->block_cache.frame_data + (long)f * BLOCK_SIZE;
+    }
+    for(int i=0; i<MAX_DBLOCKS; i++) fs->block_cache.frame_of_block[i] = -1;
+
+    shm_mutex_init(fs, &fs->block_cache.mutex);
+    shm_cond_init(fs, &fs->block_cache.changed);
+    fs->block_cache.dev = dev;
+    fs->block_cache.num_frames = num_frames;
+    fs->block_cache.clock_hand = 0;
+    fs->block_cache.num_syncing = 0;
+    fs->block_cache.hits = fs->block_cache.misses = 0;
+    fs->block_cache.evictions = fs->block_cache.writebacks = 0;
+    fs->block_cache.prefetches = fs->block_cache.prefetch_hits = 0;
+    fs->block_cache.active = 1;
+
+    reset_root_dir(fs); //the root directory now lives in a pinned frame
+
+    if(dev->formatted) checksum_rebuild(fs); //blocks came from the device
+
+    readahead_start(fs);
+
+    pthread_rwlock_unlock(&fs->mutator_lock);
+
+    return 0;
+}
+
+//open (or create) a local file as the backing store and attach a cache to it
+int RSFS_cache_open(rsfs_t *fs, const char *path, int num_frames){
+    if(router_refuse(fs, "[RSFS_cache_open]") < 0) return -1;
+
+    struct block_device *dev = open_file_device(path);
+    if(dev == NULL) return -1;
+
+    int ret = RSFS_cache_attach(fs, dev, num_frames);
+    if(ret < 0) dev->close(dev);
+
+    return ret;
+}
+
+//write every dirty frame back to the device and sync it; a frame under
+//write-back is waited for, so that the device holds it once this returns
+int RSFS_cache_flush(rsfs_t *fs){
+    if(!fs->block_cache.active) return 0;
+
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->block_cache.mutex);
+    for(int f=0; f<fs->block_cache.num_frames; f++){
+        struct cache_frame *frame = &fs->block_cache.frames[f];
+        while(frame->io_busy) pthread_cond_wait(&fs->block_cache.changed, &fs->block_cache.mutex);
+        if(frame->block_number < 0 || !frame->dirty) continue;
+        if(fs->block_cache.dev->write_block(fs->block_cache.dev, frame->block_number, frame->data) < 0) ret = -1;
+        else frame->dirty = 0;
+        fs->block_cache.writebacks++;
+    }
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+
+    if(fs->block_cache.dev->sync(fs->block_cache.dev) < 0) ret = -1;
+
+    return ret;
+}
+
+//write the dirty frames back and sync the device, so that the data blocks
+//reach it before the journal records that point to them (called by the
+//committer before each flush). a frame pinned by a caller may be in the
+//middle of a copy, so it is waited for; the directory block stays pinned and
+//is written as-is (its entries are journaled). each frame is marked io_busy
+//and written without the cache mutex, as an eviction does; return -1 if a
+//block could not be written
+int cache_sync(rsfs_t *fs){
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->block_cache.mutex);
+    if(!fs->block_cache.active){
+        pthread_mutex_unlock(&fs->block_cache.mutex);
+        return 0;
+    }
+    fs->block_cache.num_syncing++;
+
+    for(int f=0; f<fs->block_cache.num_frames; f++){
+        struct cache_frame *frame = &fs->block_cache.frames[f];
+        while(frame->io_busy || (frame->pin_count > 0 && frame->block_number != fs->root_data_block_pinned)){
+            pthread_cond_wait(&fs->block_cache.changed, &fs->block_cache.mutex);
+        }
+        if(frame->block_number < 0 || !frame->dirty) continue;
+
+        int block_number = frame->block_number;
+        frame->io_busy = 1;
+        frame->dirty = 0;
+        fs->block_cache.writebacks++;
+        pthread_mutex_unlock(&fs->block_cache.mutex);
+
+        int written = fs->block_cache.dev->write_block(fs->block_cache.dev, block_number, frame->data);
+
+        pthread_mutex_lock(&fs->block_cache.mutex);
+        if(written < 0){
+            frame->dirty = 1;
+            ret = -1;
+        }
+        frame->io_busy = 0;
+        pthread_cond_broadcast(&fs->block_cache.changed);
+    }
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+
+    if(fs->block_cache.dev->sync(fs->block_cache.dev) < 0) ret = -1;
+
+    pthread_mutex_lock(&fs->block_cache.mutex);
+    fs->block_cache.num_syncing--;
+    pthread_cond_broadcast(&fs->block_cache.changed);
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+
+    return ret;
+}
+
+//flush the cache, bring every block back into memory, and close the device
+int RSFS_cache_close(rsfs_t *fs){
+    if(!fs->block_cache.active) return -1;
+
+    pthread_rwlock_wrlock(&fs->mutator_lock);
+
+    readahead_stop(fs);
+
+    RSFS_cache_flush(fs);
+
+    for(int i=0; i<fs->num_dblocks; i++){
+        if(fs->block_cache.dev->read_block(fs->block_cache.dev, i, block_memory(fs, i)) < 0){
+            printf("[RSFS_cache_close] fail to load block %d.\n", i);
+        }
+    }
+
+    //the journal committer may be syncing
+    pthread_mutex_lock(&fs->block_cache.mutex);
+    while(fs->block_cache.num_syncing > 0){
+        pthread_cond_wait(&fs->block_cache.changed, &fs->block_cache.mutex);
+    }
+    fs->block_cache.active = 0;
+    fs->block_cache.dev->close(fs->block_cache.dev);
+    fs->block_cache.dev = NULL;
+    free(fs->block_cache.frames);
+    free(fs->block_cache.frame_data);
+    fs->block_cache.frames = NULL;
+    fs->block_cache.frame_data = NULL;
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+
+    reset_root_dir(fs);
+
+    pthread_rwlock_unlock(&fs->mutator_lock);
+
+    return 0;
+}
+
+//print cache counters
+void RSFS_cache_stat(rsfs_t *fs){
+    if(!fs->block_cache.active){
+        printf("\nBlock Cache: off\n\n");
+        return;
+    }
+
+    pthread_mutex_lock(&fs->block_cache.mutex);
+
+    int cached = 0, dirty = 0, pinned = 0;
+    for(int f=0; f<fs->block_cache.num_frames; f++){
+        if(fs->block_cache.frames[f].block_number >= 0) cached++;
+        if(fs->block_cache.frames[f].dirty) dirty++;
+        if(fs->block_cache.frames[f].pin_count > 0) pinned++;
+    }
+    long lookups = fs->block_cache.hits + fs->block_cache.misses;
+
+    printf("\nBlock Cache: %d frames,  Cached: %d,  Dirty: %d,  Pinned: %d\n",
+        fs->block_cache.num_frames, cached, dirty, pinned);
+    printf("Hits: %ld,  Misses: %ld,  Hit Ratio: %.2f,  Evictions: %ld,  Write-backs: %ld\n",
+        fs->block_cache.hits, fs->block_cache.misses, lookups ? (double)fs->block_cache.hits/lookups : 0,
+        fs->block_cache.evictions, fs->block_cache.writebacks);
+    printf("Read-ahead: %ld blocks prefetched,  %ld later hit\n\n", fs->block_cache.prefetches, fs->block_cache.prefetch_hits);
+
+    pthread_mutex_unlock(&fs->block_cache.mutex);
+}
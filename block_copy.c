@@ -0,0 +1,143 @@
+/*
+    copying between user buffers and data blocks;
+    block_iter walks a byte range of a file block by block (one division to
+    start, then only increments), and block_copy moves each piece; whole
+    blocks go through a vector kernel picked once for this CPU
+*/
+
+#include "def.h"
+#include <immintrin.h>
+
+static void copy_memcpy(char *dst, const char *src, int n);
+static void copy_sse2(char *dst, const char *src, int n);
+static void copy_avx2(char *dst, const char *src, int n);
+static void copy_avx512(char *dst, const char *src, int n);
+
+//every kernel, narrowest first; supported is filled in by block_copy_init
+static struct copy_kernel copy_kernels[] = {
+    {"memcpy", 1, 1, copy_memcpy},
+    {"sse2", 16, 0, copy_sse2},
+    {"avx2", 32, 0, copy_avx2},
+    {"avx512", 64, 0, copy_avx512},
+};
+#define NUM_COPY_KERNELS (int)(sizeof(copy_kernels)/sizeof(copy_kernels[0]))
+
+static struct copy_kernel *copy_impl; //kernel used for whole blocks
+static pthread_once_t copy_once = PTHREAD_ONCE_INIT;
+
+
+
+//------ kernels -------------------------------------------------------------------------------------------------------
+//each copies n bytes in vectors of its width and the rest with memcpy;
+//dst and src never overlap and need no particular alignment
+
+static void copy_memcpy(char *dst, const char *src, int n){
+    memcpy(dst, src, n);
+}
+
+__attribute__((target("sse2")))
+static void copy_sse2(char *dst, const char *src, int n){
+    int i = 0;
+    for(; i + 16 <= n; i += 16){
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+    }
+    if(i < n) memcpy(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(char *dst, const char *src, int n){
+    int i = 0;
+    for(; i + 32 <= n; i += 32){
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+    }
+    if(i < n) memcpy(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(char *dst, const char *src, int n){
+    int i = 0;
+    for(; i + 64 <= n; i += 64){
+        _mm512_storeu_si512((void *)(dst + i), _mm512_loadu_si512((const void *)(src + i)));
+    }
+    if(i < n) memcpy(dst + i, src + i, n - i);
+}
+
+//pick the widest kernel this CPU runs whose vectors tile a block exactly
+//(with 32-byte blocks that is AVX2 even where AVX-512 is available)
+static void copy_select(){
+    __builtin_cpu_init();
+    copy_kernels[1].supported = __builtin_cpu_supports("sse2");
+    copy_kernels[2].supported = __builtin_cpu_supports("avx2");
+    copy_kernels[3].supported = __builtin_cpu_supports("avx512f");
+
+    copy_impl = &copy_kernels[0];
+    for(int k=1; k<NUM_COPY_KERNELS; k++){
+        struct copy_kernel *kernel = &copy_kernels[k];
+        if(kernel->supported && kernel->width <= BLOCK_SIZE && BLOCK_SIZE % kernel->width == 0) copy_impl = kernel;
+    }
+}
+
+//called by every process using an instance, before its first copy
+void block_copy_init(){
+    pthread_once(&copy_once, copy_select);
+}
+
+
+
+//------ routines called by the I/O paths ------------------------------------------------------------------------------
+
+//copy n bytes between a user buffer and a data block (either direction)
+void block_copy(char *dst, const char *src, int n){
+    if(n == BLOCK_SIZE) copy_impl->copy(dst, src, BLOCK_SIZE);
+    else memcpy(dst, src, n);
+}
+
+//start walking size bytes of a file from byte position
+void block_iter_start(struct block_iter *it, int position, int size){
+    it->block_index = position / BLOCK_SIZE;
+    it->offset_in_block = position % BLOCK_SIZE;
+    it->done = 0;
+    it->size = size;
+    it->chunk = BLOCK_SIZE - it->offset_in_block;
+    if(it->chunk > size) it->chunk = size;
+}
+
+//move to the next piece, which starts a block
+void block_iter_next(struct block_iter *it){
+    it->done += it->chunk;
+    it->block_index++;
+    it->offset_in_block = 0;
+    it->chunk = it->size - it->done;
+    if(it->chunk > BLOCK_SIZE) it->chunk = BLOCK_SIZE;
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//the kernels, for benchmarks: set *num to their number and return them
+struct copy_kernel *block_copy_kernels(int *num){
+    block_copy_init();
+    *num = NUM_COPY_KERNELS;
+    return copy_kernels;
+}
+
+//use the kernel called name for whole blocks (process-wide);
+//return 0 if succeed, or -1 if there is no such kernel or the CPU lacks it
+int block_copy_use(const char *name){
+    block_copy_init();
+    for(int k=0; k<NUM_COPY_KERNELS; k++){
+        if(strcmp(copy_kernels[k].name, name) == 0 && copy_kernels[k].supported){
+            copy_impl = &copy_kernels[k];
+            return 0;
+        }
+    }
+    printf("[block_copy_use] kernel %s is not available.\n", name);
+    return -1;
+}
+
+//name of the kernel used for whole blocks
+const char *block_copy_kernel(){
+    block_copy_init();
+    return copy_impl->name;
+}
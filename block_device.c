@@ -0,0 +1,76 @@
+/*
+    block device backends that can sit behind the block cache;
+    a device stores up to MAX_DBLOCKS blocks of BLOCK_SIZE bytes each
+*/
+
+#include "def.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+
+//------ local file backend --------------------------------------------------------------------------------------------
+
+static int file_read_block(struct block_device *dev, int block_number, void *buf){
+    long offset = (long)block_number * BLOCK_SIZE;
+    int done = 0;
+    while(done < BLOCK_SIZE){
+        int ret = pread(dev->fd, (char *)buf+done, BLOCK_SIZE-done, offset+done);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret < 0) return -1;
+        if(ret == 0){//beyond the end of the file: the block was never written
+            memset((char *)buf+done, 0, BLOCK_SIZE-done);
+            break;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static int file_write_block(struct block_device *dev, int block_number, void *buf){
+    long offset = (long)block_number * BLOCK_SIZE;
+    int done = 0;
+    while(done < BLOCK_SIZE){
+        int ret = pwrite(dev->fd, (char *)buf+done, BLOCK_SIZE-done, offset+done);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) return -1;
+        done += ret;
+    }
+    return 0;
+}
+
+static int file_sync(struct block_device *dev){
+    return fdatasync(dev->fd);
+}
+
+static void file_close(struct block_device *dev){
+    close(dev->fd);
+    free(dev);
+}
+
+//open (or create) a local regular file as a block device;
+//return NULL if it cannot be opened
+struct block_device *open_file_device(const char *path){
+    int fd = open(path, O_RDWR|O_CREAT, 0644);
+    if(fd < 0){
+        printf("[open_file_device] fail to open %s.\n", path);
+        return NULL;
+    }
+
+    struct block_device *dev = malloc(sizeof(struct block_device));
+    if(dev == NULL){
+        close(fd);
+        return NULL;
+    }
+
+    struct stat st;
+    dev->fd = fd;
+    dev->formatted = (fstat(fd, &st) == 0 && st.st_size > 0);
+    dev->read_block = file_read_block;
+    dev->write_block = file_write_block;
+    dev->sync = file_sync;
+    dev->close = file_close;
+
+    return dev;
+}
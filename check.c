@@ -0,0 +1,292 @@
+/*
+    behavior checks of the file system (make check); each check prints
+    ok or FAIL, and the program exits non-zero if any of them failed
+*/
+
+#include "def.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+
+#define CHECK_DEVICE "/tmp/rsfs_check_device"
+#define CHECK_JOURNAL "/tmp/rsfs_check_journal"
+#define CHECK_CHECKPOINT "/tmp/rsfs_check_checkpoint"
+#define CHECK_FILE_SIZE (NUM_POINTERS*BLOCK_SIZE)
+#define CHECK_FRAMES 4 //cache frames, few enough that blocks get evicted
+#define CHECK_ITERATIONS 20000
+#define CHECK_READERS 2
+
+static int num_failed = 0;
+
+static void report(const char *name, int ok){
+    printf("%-40s %s\n", name, ok ? "ok" : "FAIL");
+    if(!ok) num_failed++;
+}
+
+//read the whole file into buf; return its length, or -1 if it cannot be opened
+static int read_file(rsfs_t *fs, char name, char *buf){
+    int fd = RSFS_open(fs, name, RSFS_RDONLY);
+    if(fd < 0) return -1;
+    int n = RSFS_read(fs, fd, buf, CHECK_FILE_SIZE);
+    RSFS_close(fs, fd);
+    return n;
+}
+
+//replace the content of the file with size bytes of buf
+static int write_file(rsfs_t *fs, char name, char *buf, int size){
+    int fd = RSFS_open(fs, name, RSFS_RDWR);
+    if(fd < 0) return -1;
+    RSFS_fseek(fs, fd, 0);
+    int n = RSFS_write(fs, fd, buf, size);
+    RSFS_close(fs, fd);
+    return n;
+}
+
+//1 if both instances hold the same files with the same contents
+static int same_files(rsfs_t *a, rsfs_t *b, const char *names){
+    char buf_a[CHECK_FILE_SIZE], buf_b[CHECK_FILE_SIZE];
+    for(const char *name=names; *name; name++){
+        int n_a = read_file(a, *name, buf_a);
+        int n_b = read_file(b, *name, buf_b);
+        if(n_a != n_b || (n_a > 0 && memcmp(buf_a, buf_b, n_a) != 0)) return 0;
+    }
+    return 1;
+}
+
+//copy the file at src to dst, as a crash would leave it on disk
+static int copy_file(const char *src, const char *dst){
+    int in = open(src, O_RDONLY);
+    int out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    char buf[4096];
+    int n = 0;
+    while(in >= 0 && out >= 0 && (n = read(in, buf, sizeof(buf))) > 0){
+        if(write(out, buf, n) != n){
+            n = -1;
+            break;
+        }
+    }
+    if(in >= 0) close(in);
+    if(out >= 0) close(out);
+    return in >= 0 && out >= 0 && n == 0 ? 0 : -1;
+}
+
+
+
+//------ journal -------------------------------------------------------------------------------------------------------
+
+//every call that returned before a crash is found again by a replay on the
+//device and journal the crash left behind; without the device, the replay
+//is refused
+static void check_journal_replay(){
+    char *crash_device = CHECK_DEVICE ".crash", *crash_journal = CHECK_JOURNAL ".crash";
+    unlink(CHECK_DEVICE);
+    unlink(CHECK_JOURNAL);
+
+    rsfs_t *fs = RSFS_init();
+    int ok = fs != NULL && RSFS_cache_open(fs, CHECK_DEVICE, CHECK_FRAMES) == 0 &&
+        RSFS_journal_open(fs, CHECK_JOURNAL, 0, 1) == 0;
+
+    char buf[CHECK_FILE_SIZE];
+    for(int i=0; ok && i<4; i++){
+        memset(buf, 'a'+i, sizeof(buf));
+        RSFS_create_ex(fs, 'A'+i, i % 2 ? RSFS_COMPRESSED : 0);
+        ok = write_file(fs, 'A'+i, buf, 40 + i*50) == 40 + i*50;
+    }
+    if(ok){
+        RSFS_delete(fs, 'B');
+        RSFS_clone(fs, 'C', 'E');
+        ok = copy_file(CHECK_DEVICE, crash_device) == 0 && copy_file(CHECK_JOURNAL, crash_journal) == 0;
+    }
+
+    rsfs_t *restarted = RSFS_init();
+    if(ok && restarted != NULL){
+        ok = RSFS_journal_open(restarted, crash_journal, 0, 1) < 0;
+        ok = ok && RSFS_cache_open(restarted, crash_device, CHECK_FRAMES) == 0 &&
+            RSFS_journal_open(restarted, crash_journal, 0, 1) == 0;
+        ok = ok && same_files(fs, restarted, "ABCDE") && read_file(restarted, 'B', buf) < 0;
+    }
+    report("journal replay after a crash", ok && restarted != NULL);
+
+    if(restarted != NULL) RSFS_destroy(restarted);
+    if(fs != NULL) RSFS_destroy(fs);
+    unlink(CHECK_DEVICE);
+    unlink(CHECK_JOURNAL);
+    unlink(crash_device);
+    unlink(crash_journal);
+}
+
+
+
+//------ checkpoint ----------------------------------------------------------------------------------------------------
+
+//a restore brings back exactly what the checkpoint saw, whatever changed since
+static void check_checkpoint_restore(){
+    rsfs_t *fs = RSFS_init();
+    rsfs_t *saved = RSFS_init();
+    int ok = fs != NULL && saved != NULL;
+
+    char buf[CHECK_FILE_SIZE];
+    for(int i=0; ok && i<3; i++){
+        memset(buf, 'k'+i, sizeof(buf));
+        for(rsfs_t *each=fs; each; each = each == fs ? saved : NULL){
+            RSFS_create_ex(each, 'K'+i, i == 1 ? RSFS_COMPRESSED : 0);
+            ok = ok && write_file(each, 'K'+i, buf, 100 + i*60) == 100 + i*60;
+        }
+    }
+    ok = ok && read_file(fs, 'L', buf) > 0; //fill the compressed chunk cache
+    ok = ok && RSFS_checkpoint(fs, CHECK_CHECKPOINT) == 0;
+
+    if(ok){
+        memset(buf, 'z', sizeof(buf));
+        write_file(fs, 'L', buf, 30);
+        RSFS_delete(fs, 'M');
+        RSFS_create(fs, 'N');
+        ok = RSFS_restore(fs, CHECK_CHECKPOINT) == 0 &&
+            same_files(fs, saved, "KLMN") && read_file(fs, 'N', buf) < 0;
+    }
+    report("checkpoint and restore round trip", ok);
+
+    if(saved != NULL) RSFS_destroy(saved);
+    if(fs != NULL) RSFS_destroy(fs);
+    unlink(CHECK_CHECKPOINT);
+}
+
+
+
+//------ transactions --------------------------------------------------------------------------------------------------
+
+//a transaction whose last operation cannot be applied changes nothing
+static void check_txn_all_or_none(){
+    rsfs_t *fs = RSFS_init();
+    int ok = fs != NULL;
+
+    char buf[CHECK_FILE_SIZE], out[CHECK_FILE_SIZE];
+    memset(buf, 't', sizeof(buf));
+    if(ok){
+        RSFS_create(fs, 'T');
+        ok = write_file(fs, 'T', buf, 64) == 64;
+    }
+
+    rsfs_txn_t *txn = ok ? RSFS_txn_begin(fs) : NULL;
+    if(txn != NULL){
+        memset(buf, 'u', sizeof(buf));
+        ok = RSFS_txn_create(txn, 'U', 0) == 0 &&
+            RSFS_txn_append(txn, 'U', buf, 10) == 0 &&
+            RSFS_txn_write(txn, 'T', 0, buf, 8) == 0 &&
+            RSFS_txn_append(txn, 'T', buf, CHECK_FILE_SIZE) == 0; //does not fit
+        if(ok){
+            memset(buf, 't', sizeof(buf));
+            ok = RSFS_txn_commit(txn) < 0 && read_file(fs, 'U', out) < 0 &&
+                read_file(fs, 'T', out) == 64 && memcmp(out, buf, 64) == 0;
+        }
+        else RSFS_txn_abort(txn);
+    }
+    report("transaction all or none", ok && txn != NULL);
+
+    if(fs != NULL) RSFS_destroy(fs);
+}
+
+
+
+//------ sequence lock -------------------------------------------------------------------------------------------------
+
+struct seqlock_check{
+    rsfs_t *fs;
+    int fd;
+    int inode_number;
+    volatile int num_started; //readers running
+    volatile int stopping;
+    long num_torn;
+    long num_reads;
+};
+
+//rewrite the file with one repeated byte, at a length that keeps changing
+static void *seqlock_writer(void *ptr){
+    struct seqlock_check *check = ptr;
+    char buf[CHECK_FILE_SIZE];
+    while(check->num_started < CHECK_READERS) sched_yield(); //race them from the first write
+    for(int i=0; i<CHECK_ITERATIONS; i++){
+        int size = 1 + (i*37) % CHECK_FILE_SIZE;
+        memset(buf, 'a' + i % 26, size);
+        RSFS_fseek(check->fs, check->fd, 0);
+        RSFS_write(check->fs, check->fd, buf, size);
+    }
+    check->stopping = 1;
+    return NULL;
+}
+
+//the length and block map read without a lock always go together
+static void *seqlock_meta_reader(void *ptr){
+    struct seqlock_check *check = ptr;
+    struct inode_meta meta;
+    __sync_fetch_and_add(&check->num_started, 1);
+    while(!check->stopping){
+        inode_meta_read(&check->fs->inodes[check->inode_number], &meta);
+        int num_blocks = (meta.length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for(int i=0; i<NUM_POINTERS; i++){
+            if((meta.block[i] >= 0) != (i < num_blocks)){
+                __sync_fetch_and_add(&check->num_torn, 1);
+                break;
+            }
+        }
+        __sync_fetch_and_add(&check->num_reads, 1);
+    }
+    return NULL;
+}
+
+//a read of a compressed file, as RSFS_read does it, never mixes two versions
+static void *seqlock_compressed_reader(void *ptr){
+    struct seqlock_check *check = ptr;
+    char buf[CHECK_FILE_SIZE];
+    __sync_fetch_and_add(&check->num_started, 1);
+    while(!check->stopping){
+        int n = compressed_read(check->fs, check->inode_number, 0, buf, CHECK_FILE_SIZE);
+        for(int i=1; i<n; i++){
+            if(buf[i] != buf[0]){
+                __sync_fetch_and_add(&check->num_torn, 1);
+                break;
+            }
+        }
+        __sync_fetch_and_add(&check->num_reads, 1);
+    }
+    return NULL;
+}
+
+//readers of the metadata of a plain file and of a whole compressed file,
+//racing their writer
+static void check_seqlock_reads(){
+    for(int compressed=0; compressed<=1; compressed++){
+        rsfs_t *fs = RSFS_init();
+        struct seqlock_check check = {fs, -1, 0, 0, 0, 0, 0};
+        int ok = fs != NULL && RSFS_create_ex(fs, 'S', compressed ? RSFS_COMPRESSED : 0) >= 0 &&
+            (check.fd = RSFS_open(fs, 'S', RSFS_RDWR)) >= 0;
+
+        if(ok){
+            check.inode_number = fs->open_file_table[check.fd].inode_number;
+            pthread_t writer, readers[CHECK_READERS];
+            pthread_create(&writer, NULL, seqlock_writer, &check);
+            for(int i=0; i<CHECK_READERS; i++){
+                pthread_create(&readers[i], NULL, compressed ? seqlock_compressed_reader : seqlock_meta_reader, &check);
+            }
+            pthread_join(writer, NULL);
+            for(int i=0; i<CHECK_READERS; i++) pthread_join(readers[i], NULL);
+            RSFS_close(fs, check.fd);
+            ok = check.num_torn == 0 && check.num_reads > 0;
+        }
+        report(compressed ? "consistent reads of a compressed file" : "consistent length and block map", ok);
+
+        if(fs != NULL) RSFS_destroy(fs);
+    }
+}
+
+
+
+int main(){
+    check_journal_replay();
+    check_checkpoint_restore();
+    check_txn_all_or_none();
+    check_seqlock_reads();
+
+    printf("%d checks failed\n", num_failed);
+    return num_failed ? 1 : 0;
+}
@@ -0,0 +1,291 @@
+/*
+    binary checkpoint and restore of the whole file system;
+    a checkpoint holds only live inodes and allocated data blocks (which
+    include the root directory block, hence all directory entries)
+*/
+
+#include "def.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define CHECKPOINT_MAGIC 0x52534643 //"RSFC"
+#define CHECKPOINT_VERSION 2
+
+//file layout: header, num_inodes inode records, num_blocks block records
+struct checkpoint_header{
+    unsigned int magic;
+    unsigned int version;
+    int num_inodes_total; //size of the inode table of the writer; restore grows the table to it
+    int num_dblocks_total; //size of the block pool of the writer
+    int num_pointers; //NUM_POINTERS of the writer
+    int block_size; //BLOCK_SIZE of the writer
+    int root_inode_number;
+    int num_inodes; //number of inode records
+    int num_blocks; //number of block records
+    unsigned int checksum; //checksum of everything after the header
+};
+
+struct checkpoint_inode{
+    int inode_number;
+    int length;
+    int flags;
+    char block[NUM_POINTERS];
+    short chunk_len[COMPRESS_MAX_CHUNKS];
+};
+
+struct checkpoint_block{
+    int block_number;
+    char data[BLOCK_SIZE];
+};
+
+
+//FNV-1a; cheap enough to run at memory bandwidth over small snapshots
+static unsigned int checkpoint_checksum(char *data, long size){
+    unsigned int h = 2166136261u;
+    for(long i=0; i<size; i++){
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+//write a snapshot of the file system to path;
+//mutators are paused only while the state is copied into one buffer, which
+//is then written as a single sequential stream;
+//return 0 if succeed; otherwise return a negative value
+int RSFS_checkpoint(rsfs_t *fs, const char *path){
+    char *debug_title = "[RSFS_checkpoint]";
+
+    if(router_refuse(fs, debug_title) < 0) return -1;
+
+    search_dir(fs, 0); //make sure the root directory block exists
+
+    //pause mutators and size the snapshot
+    pthread_rwlock_wrlock(&fs->mutator_lock);
+
+    int num_inodes = 0, num_blocks = 0;
+    for(int i=0; i<fs->num_inodes; i++) num_inodes += fs->inode_bitmap[i];
+    for(int i=0; i<fs->num_dblocks; i++) num_blocks += fs->data_bitmap[i];
+
+    long size = sizeof(struct checkpoint_header)
+        + num_inodes*sizeof(struct checkpoint_inode)
+        + num_blocks*sizeof(struct checkpoint_block);
+    char *buf = malloc(size);
+    if(buf == NULL){
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        printf("%s fail to allocate %ld bytes.\n", debug_title, size);
+        return -1;
+    }
+
+    struct checkpoint_header *header = (struct checkpoint_header *)buf;
+    struct checkpoint_inode *inode_record = (struct checkpoint_inode *)(header + 1);
+    for(int i=0; i<fs->num_inodes; i++){
+        if(!fs->inode_bitmap[i]) continue;
+        inode_record->inode_number = i;
+        inode_record->length = fs->inodes[i].length;
+        inode_record->flags = fs->inodes[i].flags;
+        memcpy(inode_record->block, fs->inodes[i].block, NUM_POINTERS);
+        memcpy(inode_record->chunk_len, fs->inodes[i].chunk_len, sizeof(inode_record->chunk_len));
+        inode_record++;
+    }
+    struct checkpoint_block *block_record = (struct checkpoint_block *)inode_record;
+    for(int i=0; i<fs->num_dblocks; i++){
+        if(!fs->data_bitmap[i]) continue;
+        block_record->block_number = i;
+        char *data = get_block(fs, i);
+        if(data == NULL){
+            pthread_rwlock_unlock(&fs->mutator_lock);
+            free(buf);
+            printf("%s fail to read block %d.\n", debug_title, i);
+            return -2;
+        }
+        memcpy(block_record->data, data, BLOCK_SIZE);
+        put_block(fs, i, 0);
+        block_record++;
+    }
+    header->root_inode_number = fs->root_inode_number;
+
+    pthread_rwlock_unlock(&fs->mutator_lock);
+
+    //fill the rest of the header outside the pause
+    header->magic = CHECKPOINT_MAGIC;
+    header->version = CHECKPOINT_VERSION;
+    header->num_inodes_total = fs->num_inodes;
+    header->num_dblocks_total = fs->num_dblocks;
+    header->num_pointers = NUM_POINTERS;
+    header->block_size = BLOCK_SIZE;
+    header->num_inodes = num_inodes;
+    header->num_blocks = num_blocks;
+    header->checksum = checkpoint_checksum(buf+sizeof(struct checkpoint_header), size-sizeof(struct checkpoint_header));
+
+    //stream it out to a temporary file and rename it over path
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(fd < 0){
+        free(buf);
+        printf("%s fail to open %s.\n", debug_title, tmp_path);
+        return -2;
+    }
+    long done = 0;
+    while(done < size){
+        long ret = write(fd, buf+done, size-done);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) break;
+        done += ret;
+    }
+    int ret = 0;
+    if(done != size || fsync(fd) < 0 || rename(tmp_path, path) < 0){
+        printf("%s fail to write %s.\n", debug_title, path);
+        ret = -2;
+    }
+    close(fd);
+    free(buf);
+
+    return ret;
+}
+
+
+//replace the file system state with the snapshot at path;
+//no file may be open, and the journal must be off;
+//return 0 if succeed; otherwise return a negative value (-6 if some block
+//could not be stored, the rest of the snapshot being restored)
+int RSFS_restore(rsfs_t *fs, const char *path){
+    char *debug_title = "[RSFS_restore]";
+
+    if(router_refuse(fs, debug_title) < 0) return -1;
+
+    if(fs->journal.active){
+        printf("%s close the journal before restoring.\n", debug_title);
+        return -1;
+    }
+
+    //load the whole file with one read
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        printf("%s fail to open %s.\n", debug_title, path);
+        return -2;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct checkpoint_header)){
+        close(fd);
+        printf("%s %s is not a checkpoint.\n", debug_title, path);
+        return -2;
+    }
+    long size = st.st_size;
+    char *buf = malloc(size);
+    long done = 0;
+    while(buf && done < size){
+        long ret = read(fd, buf+done, size-done);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) break;
+        done += ret;
+    }
+    close(fd);
+    if(buf == NULL || done != size){
+        free(buf);
+        printf("%s fail to read %s.\n", debug_title, path);
+        return -2;
+    }
+
+    //validate
+    struct checkpoint_header *header = (struct checkpoint_header *)buf;
+    long expected_size = sizeof(struct checkpoint_header)
+        + (long)header->num_inodes*sizeof(struct checkpoint_inode)
+        + (long)header->num_blocks*sizeof(struct checkpoint_block);
+    if(header->magic != CHECKPOINT_MAGIC || header->version != CHECKPOINT_VERSION ||
+        header->num_inodes_total < 1 || header->num_inodes_total > MAX_INODES ||
+        header->num_dblocks_total < 1 || header->num_dblocks_total > MAX_DBLOCKS ||
+        header->num_pointers != NUM_POINTERS || header->block_size != BLOCK_SIZE ||
+        header->num_inodes < 0 || header->num_inodes > header->num_inodes_total ||
+        header->num_blocks < 0 || header->num_blocks > header->num_dblocks_total ||
+        header->root_inode_number < 0 || header->root_inode_number >= header->num_inodes_total ||
+        expected_size != size ||
+        checkpoint_checksum(buf+sizeof(struct checkpoint_header), size-sizeof(struct checkpoint_header)) != header->checksum){
+        free(buf);
+        printf("%s %s is corrupted or was written with a different layout.\n", debug_title, path);
+        return -3;
+    }
+
+    pthread_rwlock_wrlock(&fs->mutator_lock);
+
+    int of_num = 0;
+    for(int i=0; i<NUM_OPEN_FILE; i++) of_num += fs->open_file_table[i].used;
+    if(of_num > 0){
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        free(buf);
+        printf("%s %d files are still open.\n", debug_title, of_num);
+        return -4;
+    }
+
+    //make room for every inode and block of the snapshot
+    if(grow_inodes(fs, header->num_inodes_total) < 0 || grow_dblocks(fs, header->num_dblocks_total) < 0){
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        printf("%s the file system cannot grow to %d inodes and %d blocks.\n", debug_title,
+            header->num_inodes_total, header->num_dblocks_total);
+        free(buf);
+        return -5;
+    }
+
+    metrics_lock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+    metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    for(int i=0; i<fs->num_inodes; i++){
+        fs->inode_bitmap[i] = 0;
+        fs->inodes[i].length = 0;
+        for(int j=0; j<NUM_POINTERS; j++) fs->inodes[i].block[j] = -1;
+    }
+    for(int i=0; i<fs->num_dblocks; i++) fs->data_bitmap[i] = 0;
+
+    struct checkpoint_inode *inode_record = (struct checkpoint_inode *)(header + 1);
+    for(int i=0; i<header->num_inodes; i++, inode_record++){
+        int inode_number = inode_record->inode_number;
+        if(inode_number < 0 || inode_number >= fs->num_inodes) continue;
+        fs->inode_bitmap[inode_number] = 1;
+        fs->inodes[inode_number].length = inode_record->length;
+        fs->inodes[inode_number].flags = inode_record->flags;
+        memcpy(fs->inodes[inode_number].block, inode_record->block, NUM_POINTERS);
+        memcpy(fs->inodes[inode_number].chunk_len, inode_record->chunk_len, sizeof(inode_record->chunk_len));
+        fs->inodes[inode_number].version = compress_new_version(fs);
+        shm_mutex_init(fs, &fs->inodes[inode_number].rw_mutex);
+        shm_cond_init(fs, &fs->inodes[inode_number].rw_cond);
+        fs->inodes[inode_number].reader_count = 0;
+        fs->inodes[inode_number].writer_active = 0;
+    }
+    int ret = 0;
+    struct checkpoint_block *block_record = (struct checkpoint_block *)inode_record;
+    for(int i=0; i<header->num_blocks; i++, block_record++){
+        int block_number = block_record->block_number;
+        if(block_number < 0 || block_number >= fs->num_dblocks) continue;
+        fs->data_bitmap[block_number] = 1;
+        char *data = get_block(fs, block_number);
+        if(data == NULL){
+            printf("%s fail to write block %d.\n", debug_title, block_number);
+            ret = -6;
+            continue;
+        }
+        memcpy(data, block_record->data, BLOCK_SIZE);
+        put_block(fs, block_number, 1);
+    }
+    fs->root_inode_number = header->root_inode_number;
+
+    metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    metrics_unlock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+
+    rebuild_block_refcounts(fs); //blocks shared by several files are stored once
+
+    checksum_rebuild(fs);
+
+    compress_cache_clear(fs); //cached chunks belong to the replaced blocks
+
+    reset_root_dir(fs);
+
+    pthread_rwlock_unlock(&fs->mutator_lock);
+
+    free(buf);
+
+    return ret;
+}
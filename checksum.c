@@ -0,0 +1,205 @@
+/*
+    per-block CRC32C checksums and a background scrubber;
+    checksums are computed with the SSE4.2 crc32 instruction when the CPU has
+    it, or with a table otherwise, and are kept up to date by every path that
+    modifies a block
+*/
+
+#define _GNU_SOURCE //SCHED_IDLE
+#include "def.h"
+#include <unistd.h>
+#include <sched.h>
+#include <nmmintrin.h>
+
+#define CRC32C_POLY 0x82F63B78 //Castagnoli polynomial, bit-reflected
+
+//shared by all instances; set up once per process
+static unsigned int crc32c_table[256];
+static unsigned int (*crc32c_impl)(unsigned int crc, const char *data, int size);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+
+//------ CRC32C ----------------------------------------------------------------------------------------------------------
+
+static unsigned int crc32c_portable(unsigned int crc, const char *data, int size){
+    for(int i=0; i<size; i++){
+        crc = crc32c_table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const char *data, int size){
+    unsigned long long crc64 = crc;
+    int i = 0;
+    for(; i + 8 <= size; i += 8){
+        unsigned long long v;
+        memcpy(&v, data + i, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = (unsigned int)crc64;
+    for(; i < size; i++) crc = _mm_crc32_u8(crc, data[i]);
+    return crc;
+}
+
+//CRC32C of size bytes of data
+unsigned int crc32c(const char *data, int size){
+    return ~crc32c_impl(~0u, data, size);
+}
+
+//build the table and pick the fastest implementation for this CPU
+static void crc32c_init(){
+    for(int i=0; i<256; i++){
+        unsigned int crc = i;
+        for(int j=0; j<8; j++) crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        crc32c_table[i] = crc;
+    }
+    __builtin_cpu_init();
+    crc32c_impl = __builtin_cpu_supports("sse4.2") ? crc32c_sse42 : crc32c_portable;
+}
+
+//checksums start off
+void checksum_init(rsfs_t *fs){
+    pthread_once(&crc32c_once, crc32c_init);
+    fs->checksum.mode = CHECKSUM_OFF;
+}
+
+
+
+//------ routines called by the I/O paths ------------------------------------------------------------------------------
+
+//record the checksum of a block after it was modified; data is the
+//(pinned) memory of the block
+void checksum_update(rsfs_t *fs, int block_number, const char *data){
+    if(fs->checksum.mode == CHECKSUM_OFF) return;
+    fs->checksum.crc[block_number] = crc32c(data, BLOCK_SIZE);
+}
+
+//check a block against its checksum before it is read;
+//return 0 if it matches (or checking is off), -1 if it is corrupted
+int checksum_verify(rsfs_t *fs, int block_number, const char *data){
+    if(fs->checksum.mode != CHECKSUM_VERIFY) return 0;
+    if(crc32c(data, BLOCK_SIZE) == fs->checksum.crc[block_number]) return 0;
+
+    __sync_fetch_and_add(&fs->checksum.num_mismatches, 1);
+    printf("[checksum] block %d does not match its checksum.\n", block_number);
+    return -1;
+}
+
+//recompute the checksum of every allocated block (when checksums are turned
+//on, or after the blocks were replaced by restore or a remount)
+void checksum_rebuild(rsfs_t *fs){
+    if(fs->checksum.mode == CHECKSUM_OFF) return;
+
+    for(int i=0; i<fs->num_dblocks; i++){
+        if(!fs->data_bitmap[i]) continue;
+        char *data = get_block(fs, i);
+        if(data == NULL) continue;
+        fs->checksum.crc[i] = crc32c(data, BLOCK_SIZE);
+        put_block(fs, i, 0);
+    }
+}
+
+
+
+//------ scrubber --------------------------------------------------------------------------------------------------------
+
+//verify one block of a file while holding read access to it, as RSFS_open
+//would; a file that is being written is skipped until the next pass
+static void scrub_block(rsfs_t *fs, struct inode *node, int block_index){
+    pthread_mutex_lock(&node->rw_mutex);
+    if(node->writer_active){
+        pthread_mutex_unlock(&node->rw_mutex);
+        return;
+    }
+    node->reader_count++;
+    pthread_mutex_unlock(&node->rw_mutex);
+
+    int block_number = node->block[block_index];
+    char *data = block_number >= 0 ? get_block(fs, block_number) : NULL; //unreadable blocks wait for the next pass
+    if(data != NULL){
+        if(crc32c(data, BLOCK_SIZE) != fs->checksum.crc[block_number]){
+            __sync_fetch_and_add(&fs->checksum.num_mismatches, 1);
+            printf("[scrubber] block %d does not match its checksum.\n", block_number);
+        }
+        put_block(fs, block_number, 0);
+        __sync_fetch_and_add(&fs->checksum.num_scrubbed, 1);
+    }
+
+    pthread_mutex_lock(&node->rw_mutex);
+    node->reader_count--;
+    if(node->reader_count == 0) pthread_cond_broadcast(&node->rw_cond);
+    pthread_mutex_unlock(&node->rw_mutex);
+}
+
+//walk the blocks of every file, at most scrub_rate blocks per second
+static void *scrubber_thread(void *ptr){
+    rsfs_t *fs = ptr;
+
+    //run only when the CPU would otherwise be idle
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    while(!fs->checksum.scrub_stopping){
+        for(int i=0; i<fs->num_inodes && !fs->checksum.scrub_stopping; i++){
+            if(i == fs->root_inode_number || !fs->inode_bitmap[i]) continue;
+            for(int j=0; j<NUM_POINTERS && !fs->checksum.scrub_stopping; j++){
+                if(fs->inodes[i].block[j] < 0) continue;
+                scrub_block(fs, &fs->inodes[i], j);
+                usleep(1000000 / fs->checksum.scrub_rate);
+            }
+        }
+        fs->checksum.num_passes++;
+        usleep(1000000 / fs->checksum.scrub_rate);
+    }
+
+    return NULL;
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//set the checksum mode: CHECKSUM_OFF, CHECKSUM_UPDATE (maintain checksums
+//for the scrubber), or CHECKSUM_VERIFY (also verify every block RSFS_read
+//copies); should be called while no file is open
+void RSFS_checksum_enable(rsfs_t *fs, int mode){
+    if(router_refuse(fs, "[RSFS_checksum_enable]") < 0) return;
+
+    int was_off = fs->checksum.mode == CHECKSUM_OFF;
+    fs->checksum.mode = mode;
+    if(was_off) checksum_rebuild(fs);
+}
+
+//start the scrubber thread, verifying at most blocks_per_second blocks
+//per second; return 0 if succeed
+int RSFS_scrubber_start(rsfs_t *fs, int blocks_per_second){
+    if(router_refuse(fs, "[RSFS_scrubber_start]") < 0 || shm_refuse(fs, "[RSFS_scrubber_start]") < 0) return -1;
+    if(fs->checksum.scrub_active || fs->checksum.mode == CHECKSUM_OFF || blocks_per_second <= 0){
+        printf("[RSFS_scrubber_start] scrubber already runs, checksums are off, or rate (%d) is invalid.\n", blocks_per_second);
+        return -1;
+    }
+
+    fs->checksum.scrub_rate = blocks_per_second;
+    fs->checksum.scrub_stopping = 0;
+    if(pthread_create(&fs->checksum.scrubber, NULL, scrubber_thread, fs) != 0) return -1;
+    fs->checksum.scrub_active = 1;
+
+    return 0;
+}
+
+//stop the scrubber thread
+void RSFS_scrubber_stop(rsfs_t *fs){
+    if(!fs->checksum.scrub_active) return;
+    fs->checksum.scrub_stopping = 1;
+    pthread_join(fs->checksum.scrubber, NULL);
+    fs->checksum.scrub_active = 0;
+}
+
+//print checksum statistics
+void RSFS_checksum_stat(rsfs_t *fs){
+    char *modes[] = {"off", "update", "verify"};
+    printf("\nChecksums: %s (%s),  Scrubbed Blocks: %ld,  Scrub Passes: %ld,  Mismatches: %ld\n\n",
+        modes[fs->checksum.mode], crc32c_impl == crc32c_sse42 ? "sse4.2" : "table",
+        fs->checksum.num_scrubbed, fs->checksum.num_passes, fs->checksum.num_mismatches);
+}
@@ -0,0 +1,501 @@
+/*
+    transparent compression for files created with RSFS_COMPRESSED;
+    the file is split into chunks of COMPRESS_CHUNK_SIZE bytes, each chunk is
+    compressed with an LZ4-style codec, and the compressed chunks are packed
+    back to back into the blocks of the inode. RSFS_read goes through a small
+    cache of decompressed chunks.
+*/
+
+#include "def.h"
+
+#define LZ_MIN_MATCH 4 //shortest match worth encoding
+#define LZ_LAST_LITERALS 5 //the last bytes of a chunk are always literals
+#define LZ_MATCH_LIMIT 12 //no match may start within this many bytes of the end
+#define LZ_HASH_BITS 8
+
+
+//------ LZ4-style codec -----------------------------------------------------------------------------------------------
+//a compressed chunk is a list of sequences: a token byte (literal count in
+//the high nibble, match length-4 in the low nibble; 15 means more length
+//bytes follow), the literals, then a 2-byte little-endian match offset;
+//the final sequence has literals only
+
+static unsigned int lz_read32(const unsigned char *p){
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static int lz_hash(unsigned int v){
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+//write a length that did not fit in the token nibble
+static unsigned char *lz_write_length(unsigned char *op, int len){
+    while(len >= 255){
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+//compress src_size bytes of src into dst (at most dst_capacity bytes);
+//return the compressed size, or -1 if it does not fit
+int lz_compress(const char *src, int src_size, char *dst, int dst_capacity){
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *anchor = ip; //start of pending literals
+    const unsigned char *end = ip + src_size;
+    const unsigned char *match_limit = end - LZ_MATCH_LIMIT;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *op_end = op + dst_capacity;
+    unsigned short table[1 << LZ_HASH_BITS];
+
+    memset(table, 0xff, sizeof(table));
+
+    if(src_size > LZ_MATCH_LIMIT){
+        while(ip < match_limit){
+            int h = lz_hash(lz_read32(ip));
+            int candidate = table[h];
+            table[h] = ip - (const unsigned char *)src;
+
+            const unsigned char *ref = (const unsigned char *)src + candidate;
+            if(candidate == 0xffff || ip - ref > 0xffff || lz_read32(ref) != lz_read32(ip)){
+                ip++;
+                continue;
+            }
+
+            //extend the match
+            int match_len = LZ_MIN_MATCH;
+            while(ip + match_len < end - LZ_LAST_LITERALS && ref[match_len] == ip[match_len]) match_len++;
+
+            //emit literals + match
+            int lit_len = ip - anchor;
+            if(op + 1 + lit_len/255 + 1 + lit_len + 2 + match_len/255 + 1 > op_end) return -1;
+            unsigned char *token = op++;
+            *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+            if(lit_len >= 15) op = lz_write_length(op, lit_len - 15);
+            memcpy(op, anchor, lit_len);
+            op += lit_len;
+            int offset = ip - ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            int ml = match_len - LZ_MIN_MATCH;
+            *token |= ml >= 15 ? 15 : ml;
+            if(ml >= 15) op = lz_write_length(op, ml - 15);
+
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    //last literals
+    int lit_len = end - anchor;
+    if(op + 1 + lit_len/255 + 1 + lit_len > op_end) return -1;
+    unsigned char *token = op++;
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if(lit_len >= 15) op = lz_write_length(op, lit_len - 15);
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    return op - (unsigned char *)dst;
+}
+
+//decompress src into exactly dst_size bytes of dst;
+//return dst_size, or -1 if src is malformed
+int lz_decompress(const char *src, int src_size, char *dst, int dst_size){
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *ip_end = ip + src_size;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *op_end = op + dst_size;
+
+    while(ip < ip_end){
+        int token = *ip++;
+
+        int lit_len = token >> 4;
+        if(lit_len == 15){
+            int b;
+            do{
+                if(ip >= ip_end) return -1;
+                b = *ip++;
+                lit_len += b;
+            }while(b == 255);
+        }
+        if(ip + lit_len > ip_end || op + lit_len > op_end) return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if(ip == ip_end) break; //final sequence
+
+        if(ip + 2 > ip_end) return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int match_len = token & 15;
+        if(match_len == 15){
+            int b;
+            do{
+                if(ip >= ip_end) return -1;
+                b = *ip++;
+                match_len += b;
+            }while(b == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+
+        unsigned char *ref = op - offset;
+        if(offset == 0 || ref < (unsigned char *)dst || op + match_len > op_end) return -1;
+        for(int i=0; i<match_len; i++) op[i] = ref[i]; //may overlap
+        op += match_len;
+    }
+
+    return op == op_end ? dst_size : -1;
+}
+
+
+
+//------ helpers -------------------------------------------------------------------------------------------------------
+
+//logical size of chunk c of a file of the given length
+static int chunk_size(int length, int c){
+    int size = length - c*COMPRESS_CHUNK_SIZE;
+    if(size > COMPRESS_CHUNK_SIZE) size = COMPRESS_CHUNK_SIZE;
+    return size < 0 ? 0 : size;
+}
+
+static int stored_size(short chunk_len){
+    return chunk_len < 0 ? -chunk_len : chunk_len;
+}
+
+//number of chunks of a file of the given length
+static int num_chunks(int length){
+    return (length + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE;
+}
+
+//total bytes of the packed compressed stream of node
+int compressed_stored_size(struct inode *node){
+    int size = 0;
+    for(int c=0; c<num_chunks(node->length); c++) size += stored_size(node->chunk_len[c]);
+    return size;
+}
+
+//copy the length, chunk sizes, block map and version of node into *meta
+static void copy_meta(struct inode *node, struct compressed_meta *meta){
+    meta->length = node->length;
+    memcpy(meta->block, node->block, NUM_POINTERS);
+    memcpy(meta->chunk_len, node->chunk_len, sizeof(meta->chunk_len));
+    meta->version = node->version;
+}
+
+//copy size bytes at offset of the packed stream held in the blocks of
+//block_map into buf; return -1 if a block cannot be read or fails its
+//checksum, 0 otherwise
+static int stream_read(rsfs_t *fs, const char *block_map, int offset, char *buf, int size){
+    while(size > 0){
+        int block_index = offset / BLOCK_SIZE;
+        int offset_in_block = offset % BLOCK_SIZE;
+        int chunk = BLOCK_SIZE - offset_in_block;
+        if(chunk > size) chunk = size;
+
+        int block_number = block_map[block_index];
+        char *block = block_number >= 0 ? get_block(fs, block_number) : NULL;
+        if(block == NULL) return -1;
+        int verified = checksum_verify(fs, block_number, block);
+        memcpy(buf, block + offset_in_block, chunk);
+        put_block(fs, block_number, 0);
+        if(verified < 0) return -1;
+
+        buf += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+//copy blocks first..last of a packed stream from image (the stream laid out
+//from its start) into fresh blocks, left in fresh[]; the blocks of the file
+//are not touched. return -1, with the fresh blocks freed again, if one cannot
+//be allocated or brought into memory
+static int stream_build(rsfs_t *fs, char *image, int first, int last, char *fresh){
+    for(int i=first; i<=last; i++){
+        int block_number = allocate_data_block(fs);
+        char *block = block_number >= 0 ? get_block(fs, block_number) : NULL;
+        if(block == NULL){
+            if(block_number < 0) printf("[compress] fail to allocate a new data block\n");
+            else free_data_block(fs, block_number);
+            for(int j=first; j<i; j++) free_data_block(fs, fresh[j]);
+            return -1;
+        }
+        memcpy(block, image + i*BLOCK_SIZE, BLOCK_SIZE);
+        checksum_update(fs, block_number, block);
+        put_block(fs, block_number, 1);
+        fresh[i] = block_number;
+    }
+    return 0;
+}
+
+//decompress chunk c of the file described by meta into out
+//(COMPRESS_CHUNK_SIZE bytes); return the logical size of the chunk, or -1 if
+//it is corrupted
+static int load_chunk(rsfs_t *fs, struct compressed_meta *meta, int c, char *out){
+    char stored[COMPRESS_CHUNK_SIZE + COMPRESS_CHUNK_SIZE/255 + 16];
+    int offset = 0;
+    for(int i=0; i<c; i++) offset += stored_size(meta->chunk_len[i]);
+    int size = stored_size(meta->chunk_len[c]);
+    int logical = chunk_size(meta->length, c);
+
+    if(meta->chunk_len[c] < 0){//stored raw
+        return stream_read(fs, meta->block, offset, out, logical) < 0 ? -1 : logical;
+    }
+    if(stream_read(fs, meta->block, offset, stored, size) < 0) return -1;
+    return lz_decompress(stored, size, out, logical);
+}
+
+//copy chunk c of inode_number, as described by meta, into out
+//(COMPRESS_CHUNK_SIZE bytes), from the chunk cache if it holds that version;
+//on a miss the chunk is decompressed without compress_state.mutex, so readers
+//of other chunks are not held up, and installed afterwards under meta's
+//version. return -1 if the chunk could not be decompressed
+static int cached_chunk(rsfs_t *fs, int inode_number, struct compressed_meta *meta, int c, char *out){
+    struct chunk_cache_entry *entry =
+        &fs->compress_state.cache[(inode_number * 31 + c) % COMPRESS_CACHE_ENTRIES];
+
+    pthread_mutex_lock(&fs->compress_state.mutex);
+    if(entry->inode_number == inode_number && entry->chunk == c && entry->version == meta->version){
+        fs->compress_state.cache_hits++;
+        memcpy(out, entry->data, COMPRESS_CHUNK_SIZE);
+        pthread_mutex_unlock(&fs->compress_state.mutex);
+        return 0;
+    }
+    fs->compress_state.cache_misses++;
+    pthread_mutex_unlock(&fs->compress_state.mutex);
+
+    if(load_chunk(fs, meta, c, out) < 0) return -1;
+
+    //a write publishes a newer version before any reader can copy its meta,
+    //so an install that raced the write is only ever matched by readers that
+    //retry anyway
+    pthread_mutex_lock(&fs->compress_state.mutex);
+    entry->inode_number = inode_number;
+    entry->chunk = c;
+    entry->version = meta->version;
+    memcpy(entry->data, out, COMPRESS_CHUNK_SIZE);
+    pthread_mutex_unlock(&fs->compress_state.mutex);
+    return 0;
+}
+
+
+
+//------ read/write paths used by api.c --------------------------------------------------------------------------------
+
+//read up to size bytes at position of a compressed file into buf;
+//return the number of bytes read, which stops short at a corrupted chunk.
+//the chunks are located through a copy of the chunk sizes and block map
+//taken between two writes; a write that starts meanwhile may free those
+//blocks, so the read is then done again
+int compressed_read(rsfs_t *fs, int inode_number, int position, char *buf, int size){
+    struct inode *node = &fs->inodes[inode_number];
+    struct compressed_meta meta;
+    int bytes_read;
+    int corrupted;
+
+    for(;;){
+        unsigned int seq = inode_meta_seq(node);
+        copy_meta(node, &meta);
+        if(inode_meta_changed(node, seq)) continue;
+
+        bytes_read = 0;
+        corrupted = -1;
+        while(bytes_read < size && position + bytes_read < meta.length){
+            int offset = position + bytes_read;
+            int c = offset / COMPRESS_CHUNK_SIZE;
+            int offset_in_chunk = offset % COMPRESS_CHUNK_SIZE;
+            int chunk = chunk_size(meta.length, c) - offset_in_chunk;
+            if(chunk > size - bytes_read) chunk = size - bytes_read;
+
+            //stop at a corrupted chunk, as RSFS_read stops at a corrupted block
+            char data[COMPRESS_CHUNK_SIZE];
+            if(cached_chunk(fs, inode_number, &meta, c, data) < 0){
+                corrupted = c;
+                break;
+            }
+            memcpy(buf + bytes_read, data + offset_in_chunk, chunk);
+
+            bytes_read += chunk;
+        }
+        if(!inode_meta_changed(node, seq)) break;
+    }
+
+    if(corrupted >= 0) printf("[compress] chunk %d of inode %d is corrupted.\n", corrupted, inode_number);
+    return bytes_read;
+}
+
+//write size bytes of buf at position of a compressed file; if truncate is
+//set, the file ends right after the written bytes (RSFS_write semantics).
+//the chunks from the first modified one onward are recompressed and the
+//packed stream is rebuilt from there in fresh blocks, which replace the old
+//ones only once all of them are written; return the number of bytes written,
+//or 0 with the file unchanged
+int compressed_write(rsfs_t *fs, int inode_number, int position, char *buf, int size, int truncate){
+    struct inode *node = &fs->inodes[inode_number];
+    int max_length = COMPRESS_MAX_CHUNKS * COMPRESS_CHUNK_SIZE;
+
+    if(position + size > max_length){
+        printf("[compress] file size exceeds maximum limit\n");
+        size = max_length - position;
+        if(size <= 0) return 0;
+    }
+
+    int old_length = node->length;
+    int new_length = truncate ? position + size : (position + size > old_length ? position + size : old_length);
+    int first = position / COMPRESS_CHUNK_SIZE;
+    int last_modified = (position + size - 1) / COMPRESS_CHUNK_SIZE;
+    int old_chunks = num_chunks(old_length);
+    int new_chunks = num_chunks(new_length);
+
+    struct compressed_meta meta;
+    copy_meta(node, &meta);
+
+    int stream_offset = 0;
+    for(int c=0; c<first; c++) stream_offset += stored_size(node->chunk_len[c]);
+
+    //build the new tail of the stream (chunks first..new_chunks-1) in image,
+    //after the part of its first block that it keeps
+    char image[NUM_POINTERS*BLOCK_SIZE];
+    int first_block = stream_offset / BLOCK_SIZE;
+    memset(image, 0, sizeof(image));
+    if(stream_read(fs, node->block, first_block*BLOCK_SIZE, image + first_block*BLOCK_SIZE, stream_offset % BLOCK_SIZE) < 0){
+        printf("[compress] a chunk of inode %d cannot be read.\n", inode_number);
+        return 0;
+    }
+    char *tail = image + stream_offset;
+    int tail_capacity = NUM_POINTERS*BLOCK_SIZE - stream_offset;
+    short new_len[COMPRESS_MAX_CHUNKS];
+    char data[COMPRESS_CHUNK_SIZE];
+    char packed[COMPRESS_CHUNK_SIZE];
+    int tail_size = 0;
+    int ret = size;
+
+    int old_offset = stream_offset;
+    for(int c=first; c<new_chunks; c++){
+        int old_stored = c < old_chunks ? stored_size(node->chunk_len[c]) : 0;
+        int logical = chunk_size(new_length, c);
+        int len;
+
+        if(c > last_modified && c < old_chunks && chunk_size(old_length, c) == logical){
+            //untouched chunk: move its stored bytes as they are
+            if(tail_size + old_stored > tail_capacity){ ret = 0; break; }
+            if(stream_read(fs, node->block, old_offset, tail + tail_size, old_stored) < 0){ ret = -1; break; }
+            len = node->chunk_len[c];
+        }else{
+            //modified chunk: old content, overlaid with the new bytes
+            memset(data, 0, COMPRESS_CHUNK_SIZE);
+            if(c < old_chunks && load_chunk(fs, &meta, c, data) < 0){ ret = -1; break; }
+            int from = position > c*COMPRESS_CHUNK_SIZE ? position : c*COMPRESS_CHUNK_SIZE;
+            int to = position + size < (c+1)*COMPRESS_CHUNK_SIZE ? position + size : (c+1)*COMPRESS_CHUNK_SIZE;
+            if(from < to) memcpy(data + from - c*COMPRESS_CHUNK_SIZE, buf + from - position, to - from);
+
+            len = lz_compress(data, logical, packed, logical - 1);
+            if(len < 0){//incompressible: store raw
+                if(tail_size + logical > tail_capacity){ ret = 0; break; }
+                memcpy(tail + tail_size, data, logical);
+                len = -logical;
+            }else{
+                if(tail_size + len > tail_capacity){ ret = 0; break; }
+                memcpy(tail + tail_size, packed, len);
+            }
+        }
+        new_len[c] = len;
+        tail_size += stored_size(len);
+        old_offset += old_stored;
+    }
+
+    if(ret < 0){
+        printf("[compress] a chunk of inode %d cannot be read.\n", inode_number);
+        return 0;
+    }
+    if(ret == 0){
+        printf("[compress] compressed data exceeds the block pointers of the file\n");
+        return 0;
+    }
+
+    //publish: swap the fresh blocks in for the ones they replace (a shared
+    //block only loses this file's reference)
+    char fresh[NUM_POINTERS];
+    int last_block = (stream_offset + tail_size - 1) / BLOCK_SIZE;
+    if(stream_build(fs, image, first_block, last_block, fresh) < 0) return 0;
+    for(int i=first_block; i<=last_block; i++){
+        if(node->block[i] != -1) free_data_block(fs, node->block[i]);
+        node->block[i] = fresh[i];
+    }
+
+    int used_blocks = (stream_offset + tail_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for(int i=used_blocks; i<NUM_POINTERS; i++){
+        if(node->block[i] != -1){
+            free_data_block(fs, node->block[i]);
+            node->block[i] = -1;
+        }
+    }
+    for(int c=first; c<new_chunks; c++) node->chunk_len[c] = new_len[c];
+    for(int c=new_chunks; c<COMPRESS_MAX_CHUNKS; c++) node->chunk_len[c] = 0;
+    node->length = new_length;
+
+    pthread_mutex_lock(&fs->compress_state.mutex);
+    node->version = ++fs->compress_state.next_version;
+    pthread_mutex_unlock(&fs->compress_state.mutex);
+
+    return ret;
+}
+
+//plan a write of size bytes of buf at position into a compressed file whose
+//content is data, its length *length and the stored sizes of its chunks
+//stored[], as compressed_write would do it (RSFS_txn_commit checks staged
+//writes with this): update the three, set *stream_end to the new size of the
+//packed stream, and return the offset from which the stream is rewritten, or
+//-1 if it would not fit the block pointers of the file
+int compressed_plan(char *data, int *length, short *stored, int position, const char *buf, int size, int truncate, int *stream_end){
+    char packed[COMPRESS_CHUNK_SIZE];
+    int new_length = truncate || position + size > *length ? position + size : *length;
+    int first = position / COMPRESS_CHUNK_SIZE;
+    int last_modified = (position + size - 1) / COMPRESS_CHUNK_SIZE;
+
+    memcpy(data + position, buf, size);
+    int stream_offset = 0, end = 0;
+    for(int c=0; c<COMPRESS_MAX_CHUNKS; c++){
+        if(c >= num_chunks(new_length)) stored[c] = 0;
+        else if(c >= first && c <= last_modified){
+            int logical = chunk_size(new_length, c);
+            int len = lz_compress(data + c*COMPRESS_CHUNK_SIZE, logical, packed, logical - 1);
+            stored[c] = len < 0 ? logical : len;
+        }
+        if(c < first) stream_offset += stored[c];
+        end += stored[c];
+    }
+
+    *length = new_length;
+    *stream_end = end;
+    return end > NUM_POINTERS*BLOCK_SIZE ? -1 : stream_offset;
+}
+
+//initialize the chunk cache
+void compress_init(rsfs_t *fs){
+    shm_mutex_init(fs, &fs->compress_state.mutex);
+    for(int i=0; i<COMPRESS_CACHE_ENTRIES; i++) fs->compress_state.cache[i].inode_number = -1;
+    fs->compress_state.next_version = 0;
+    fs->compress_state.cache_hits = 0;
+    fs->compress_state.cache_misses = 0;
+}
+
+//drop every cached chunk; the data blocks they came from were replaced
+void compress_cache_clear(rsfs_t *fs){
+    pthread_mutex_lock(&fs->compress_state.mutex);
+    for(int i=0; i<COMPRESS_CACHE_ENTRIES; i++) fs->compress_state.cache[i].inode_number = -1;
+    pthread_mutex_unlock(&fs->compress_state.mutex);
+}
+
+//fresh version for an inode that is (re)allocated, so stale cache entries never match
+unsigned int compress_new_version(rsfs_t *fs){
+    pthread_mutex_lock(&fs->compress_state.mutex);
+    unsigned int version = ++fs->compress_state.next_version;
+    pthread_mutex_unlock(&fs->compress_state.mutex);
+    return version;
+}
@@ -1,45 +1,219 @@
 /*
     Allocation of data block, data block bitmaps and mutex to guard M.E. access; 
-    routines for managing them
+    routines for managing them;
+    the pool starts with NUM_DBLOCKS blocks and grows by chunks of DBLOCK_CHUNK
+    blocks, each allocated separately so that existing blocks never move;
+    num_dblocks is a limit on the blocks in use: the pool never shrinks, and
+    the bitmaps are sized to MAX_DBLOCKS
 */
 
 #include "def.h"
 
+//blocks reserved by the calling thread for a transaction (reserve_data_blocks);
+//allocate_data_block hands them out before searching the bitmap
+static __thread struct{
+    rsfs_t *fs;
+    int *blocks;
+    int next; //blocks[next..count-1] are still unused
+    int count;
+} reserve;
 
-//allocation of data block and data block bitmaps
-void *data_blocks[NUM_DBLOCKS];
-int data_bitmap[NUM_DBLOCKS];
-pthread_mutex_t data_bitmap_mutex;
+//in-memory location of a data block: the initial blocks are part of
+//struct rsfs, later ones live in their chunk
+char *block_memory(rsfs_t *fs, int block_number){
+    if(block_number < NUM_DBLOCKS) return fs->data_blocks[block_number];
+    int index = block_number - NUM_DBLOCKS;
+    return fs->block_chunks[index / DBLOCK_CHUNK] + (index % DBLOCK_CHUNK) * BLOCK_SIZE;
+}
+
+//add a chunk at the end of the pool (data_bitmap_mutex held);
+//return -1 at MAX_DBLOCKS, for a shared instance (whose blocks must stay in
+//the shared region), or if out of memory
+static int grow_pool_locked(rsfs_t *fs){
+    if(fs->num_dblocks >= MAX_DBLOCKS || fs->shm.active) return -1;
+
+    char **chunk = &fs->block_chunks[(fs->num_dblocks - NUM_DBLOCKS) / DBLOCK_CHUNK];
+    *chunk = calloc(DBLOCK_CHUNK, BLOCK_SIZE);
+    if(*chunk == NULL) return -1;
 
+    //the chunk is in place before any caller can be handed one of its blocks
+    __sync_synchronize();
+    fs->num_dblocks += DBLOCK_CHUNK;
+    fs->num_grows++;
+    stats_pool_size(fs);
+
+    return 0;
+}
+
+//grow the pool until it has at least num_dblocks blocks (used when a journal
+//or checkpoint refers to blocks beyond the current pool); return 0 if succeed
+int grow_dblocks(rsfs_t *fs, int num_dblocks){
+    int ret = 0;
+    metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    while(fs->num_dblocks < num_dblocks && ret == 0) ret = grow_pool_locked(fs);
+    metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    return ret;
+}
 
 //to allocate an empty data block and return the block-number;
-//if no free data block is available, return -1
-int allocate_data_block(){
+//if no free data block is available and the pool cannot grow, return -1
+int allocate_data_block(rsfs_t *fs){
+
+    //a block reserved by this thread is already marked as allocated
+    if(reserve.fs == fs && reserve.next < reserve.count) return reserve.blocks[reserve.next++];
 
     int block_number=-1; //init
 
-    pthread_mutex_lock(&data_bitmap_mutex);
+    metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
 
-    for(int i=0; i<NUM_DBLOCKS; i++){
-        if(data_bitmap[i]==0){//find an available data block
+    for(int i=0; block_number<0; i++){
+        if(i == fs->num_dblocks && grow_pool_locked(fs) < 0) break; //full
+        if(fs->data_bitmap[i]==0){//find an available data block
             block_number=i;
-            data_bitmap[i]=1; //mark it as allocated
-            break;
+            fs->data_bitmap[i]=1; //mark it as allocated
+            fs->data_refcount[i]=1;
+            stats_refcount(fs, 0, 1);
         }
     }
 
-    pthread_mutex_unlock(&data_bitmap_mutex);
+    metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
 
+    if(block_number >= 0) event_record(fs, EVENT_BLOCK_ALLOC, 0, block_number);
     return block_number;
 }
 
-//to free a data block with the provided block_number
-void free_data_block(int block_number){
+//allocate count blocks into blocks[] with one acquisition of data_bitmap_mutex
+//and reserve them for the calling thread, whose next count calls to
+//allocate_data_block get them; return 0 if succeed, or -1 (nothing is
+//allocated) if there are not enough free blocks
+int reserve_data_blocks(rsfs_t *fs, int *blocks, int count){
+    int n = 0;
 
-    pthread_mutex_lock(&data_bitmap_mutex);
+    metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
 
-    data_bitmap[block_number]=0; //reset it to available
+    for(int i=0; n<count; i++){
+        if(i == fs->num_dblocks && grow_pool_locked(fs) < 0) break; //full
+        if(fs->data_bitmap[i]==0){
+            blocks[n++]=i;
+            fs->data_bitmap[i]=1;
+            fs->data_refcount[i]=1;
+        }
+    }
+    if(n < count){
+        for(int i=0; i<n; i++){
+            fs->data_bitmap[blocks[i]]=0;
+            fs->data_refcount[blocks[i]]=0;
+        }
+    }
+
+    metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    if(n < count) return -1;
+    for(int i=0; i<n; i++){
+        stats_refcount(fs, 0, 1);
+        event_record(fs, EVENT_BLOCK_ALLOC, 0, blocks[i]);
+    }
+    reserve.fs = fs;
+    reserve.blocks = blocks;
+    reserve.next = 0;
+    reserve.count = count;
+    return 0;
+}
 
-    pthread_mutex_unlock(&data_bitmap_mutex);
+//free the blocks of the calling thread's reservation it did not use, and end it
+void release_data_blocks(rsfs_t *fs){
+    if(reserve.fs != fs) return;
+    while(reserve.next < reserve.count) free_data_block(fs, reserve.blocks[reserve.next++]);
+    reserve.fs = NULL;
 }
 
+//to drop one reference to a data block with the provided block_number;
+//the block is freed when its last reference is dropped
+void free_data_block(rsfs_t *fs, int block_number){
+
+    pthread_mutex_lock(&fs->dedup.mutex);
+    metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    if(fs->data_refcount[block_number] > 0){
+        fs->data_refcount[block_number]--;
+        stats_refcount(fs, fs->data_refcount[block_number] + 1, fs->data_refcount[block_number]);
+    }
+    if(fs->data_refcount[block_number] == 0){
+        fs->data_bitmap[block_number]=0; //reset it to available
+        event_record(fs, EVENT_BLOCK_FREE, 0, block_number);
+        dedup_forget(fs, block_number);
+    }
+
+    metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    pthread_mutex_unlock(&fs->dedup.mutex);
+}
+
+//to make block[block_index] of node safe to modify in place and return its
+//block number: a shared block is first copied to a private one (copy-on-write),
+//and a private block is dropped from the dedup index since its content changes;
+//return -1 if the copy cannot be allocated or made
+int writable_block(rsfs_t *fs, struct inode *node, int block_index){
+
+    int block_number = node->block[block_index];
+
+    //fast path: with dedup off, a block with one reference cannot gain another
+    //while its file is open for writing
+    if(!fs->dedup.enabled && fs->data_refcount[block_number] == 1) return block_number;
+
+    pthread_mutex_lock(&fs->dedup.mutex);
+    metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    int shared = fs->data_refcount[block_number] > 1;
+    if(!shared) dedup_forget(fs, block_number);
+    metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    pthread_mutex_unlock(&fs->dedup.mutex);
+
+    if(!shared) return block_number;
+
+    int new_block = allocate_data_block(fs);
+    if(new_block < 0) return -1;
+
+    char *src = get_block(fs, block_number);
+    char *dst = get_block(fs, new_block);
+    if(src == NULL || dst == NULL){
+        //the file keeps its reference to the shared block
+        if(dst) put_block(fs, new_block, 0);
+        if(src) put_block(fs, block_number, 0);
+        free_data_block(fs, new_block);
+        return -1;
+    }
+    memcpy(dst, src, BLOCK_SIZE);
+    fs->checksum.crc[new_block] = fs->checksum.crc[block_number];
+    put_block(fs, new_block, 1);
+    put_block(fs, block_number, 0);
+
+    node->block[block_index] = new_block;
+    free_data_block(fs, block_number); //drop this file's reference to the shared block
+
+    return new_block;
+}
+
+//to rebuild data_bitmap and data_refcount from the block pointers of every
+//allocated inode (after the inodes were replaced by recovery or restore)
+void rebuild_block_refcounts(rsfs_t *fs){
+
+    pthread_mutex_lock(&fs->dedup.mutex);
+    metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    for(int i=0; i<fs->num_dblocks; i++){
+        fs->data_bitmap[i]=0;
+        fs->data_refcount[i]=0;
+        dedup_forget(fs, i);
+    }
+    for(int i=0; i<fs->num_inodes; i++){
+        if(!fs->inode_bitmap[i]) continue;
+        for(int j=0; j<NUM_POINTERS; j++){
+            int block_number = fs->inodes[i].block[j];
+            if(block_number < 0) continue;
+            fs->data_bitmap[block_number]=1;
+            fs->data_refcount[block_number]++;
+        }
+    }
+
+    metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    pthread_mutex_unlock(&fs->dedup.mutex);
+}
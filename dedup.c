@@ -0,0 +1,149 @@
+/*
+    content-addressed block deduplication;
+    full blocks written by RSFS_write/RSFS_append are fingerprinted and looked
+    up in an index, and a block with identical content is shared (through
+    data_refcount) instead of keeping a second copy
+*/
+
+#include "def.h"
+
+#define DEDUP_PRIME1 0x9E3779B185EBCA87ULL
+#define DEDUP_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+
+static unsigned long long rotl64(unsigned long long x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+//64-bit fingerprint of a block; four independent lanes over 32-byte
+//stripes so that the compiler can keep them in vector registers
+static unsigned long long fingerprint(const char *data){
+    unsigned long long lane[4] = {DEDUP_PRIME1 + DEDUP_PRIME2, DEDUP_PRIME2, 0, -DEDUP_PRIME1};
+    int i = 0;
+
+    for(; i + 32 <= BLOCK_SIZE; i += 32){
+        for(int l=0; l<4; l++){
+            unsigned long long v;
+            memcpy(&v, data + i + 8*l, 8);
+            lane[l] = rotl64(lane[l] + v*DEDUP_PRIME2, 31) * DEDUP_PRIME1;
+        }
+    }
+
+    unsigned long long h = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18);
+    for(; i < BLOCK_SIZE; i++){
+        h ^= (unsigned char)data[i] * DEDUP_PRIME1;
+        h = rotl64(h, 11) * DEDUP_PRIME2;
+    }
+
+    h ^= h >> 33;
+    h *= DEDUP_PRIME2;
+    h ^= h >> 29;
+    return h;
+}
+
+static int bucket_of(unsigned long long hash){
+    return hash % DEDUP_BUCKETS;
+}
+
+//remove a block from the index (called with dedup.mutex held)
+void dedup_forget(rsfs_t *fs, int block_number){
+    if(!fs->dedup.indexed[block_number]) return;
+
+    int *link = &fs->dedup.bucket[bucket_of(fs->dedup.hash[block_number])];
+    while(*link >= 0 && *link != block_number) link = &fs->dedup.next[*link];
+    if(*link == block_number) *link = fs->dedup.next[block_number];
+
+    fs->dedup.indexed[block_number] = 0;
+    fs->dedup.num_indexed--;
+}
+
+//share block[block_index] of node with an indexed block of identical
+//content, or index it if there is none
+static void dedup_block(rsfs_t *fs, struct inode *node, int block_index){
+    int block_number = node->block[block_index];
+    char *data = get_block(fs, block_number);
+    if(data == NULL) return;
+    unsigned long long hash = fingerprint(data);
+    int match = -1;
+
+    pthread_mutex_lock(&fs->dedup.mutex);
+
+    metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    int skip = fs->dedup.indexed[block_number] || fs->data_refcount[block_number] > 1;
+    metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+
+    if(!skip){
+        for(int c = fs->dedup.bucket[bucket_of(hash)]; c >= 0; c = fs->dedup.next[c]){
+            if(fs->dedup.hash[c] != hash || c == block_number) continue;
+            char *candidate = get_block(fs, c);
+            if(candidate == NULL) continue;
+            int same = memcmp(candidate, data, BLOCK_SIZE) == 0;
+            put_block(fs, c, 0);
+            if(same){
+                match = c;
+                break;
+            }
+        }
+
+        if(match >= 0){
+            metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+            fs->data_refcount[match]++;
+            stats_refcount(fs, fs->data_refcount[match] - 1, fs->data_refcount[match]);
+            metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+            node->block[block_index] = match;
+            fs->dedup.num_hits++;
+        }else{
+            int b = bucket_of(hash);
+            fs->dedup.hash[block_number] = hash;
+            fs->dedup.next[block_number] = fs->dedup.bucket[b];
+            fs->dedup.bucket[b] = block_number;
+            fs->dedup.indexed[block_number] = 1;
+            fs->dedup.num_indexed++;
+        }
+    }
+
+    pthread_mutex_unlock(&fs->dedup.mutex);
+
+    put_block(fs, block_number, 0);
+
+    if(match >= 0) free_data_block(fs, block_number); //the private copy is no longer referenced
+}
+
+//deduplicate the blocks first..last of node that are completely filled;
+//the partially filled last block of a file is left alone
+void dedup_blocks(rsfs_t *fs, struct inode *node, int first, int last){
+    if(!fs->dedup.enabled || (node->flags & RSFS_COMPRESSED)) return;
+
+    if(last >= NUM_POINTERS) last = NUM_POINTERS - 1;
+    for(int i = first; i <= last; i++){
+        if(node->block[i] < 0 || (i + 1) * BLOCK_SIZE > node->length) continue;
+        dedup_block(fs, node, i);
+    }
+}
+
+//initialize an empty index
+void dedup_init(rsfs_t *fs){
+    shm_mutex_init(fs, &fs->dedup.mutex);
+    for(int i=0; i<DEDUP_BUCKETS; i++) fs->dedup.bucket[i] = -1;
+    for(int i=0; i<MAX_DBLOCKS; i++){
+        fs->dedup.indexed[i] = 0;
+        fs->dedup.next[i] = -1;
+    }
+    fs->dedup.num_indexed = 0;
+    fs->dedup.num_hits = 0;
+    fs->dedup.enabled = 0;
+}
+
+
+//turn deduplication of newly written blocks on (1) or off (0);
+//turning it off empties the index (blocks already shared stay shared)
+void RSFS_dedup_enable(rsfs_t *fs, int enabled){
+    if(router_refuse(fs, "[RSFS_dedup_enable]") < 0) return;
+
+    pthread_mutex_lock(&fs->dedup.mutex);
+    fs->dedup.enabled = enabled;
+    if(!enabled){
+        for(int i=0; i<fs->num_dblocks; i++) dedup_forget(fs, i);
+    }
+    pthread_mutex_unlock(&fs->dedup.mutex);
+}
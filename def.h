@@ -10,34 +10,62 @@
 
 
 //global constants
-#define NUM_INODES 8 //total number of inodes
-#define NUM_DBLOCKS 64 //total number of data blocks
+#define NUM_INODES 8 //initial number of inodes; the inode table grows by INODE_CHUNK inodes when it runs out
+#define NUM_DBLOCKS 64 //initial number of data blocks; the block pool grows by DBLOCK_CHUNK blocks when it runs out
+#define INODE_CHUNK 4 //inodes added at a time
+#define DBLOCK_CHUNK 16 //data blocks added at a time
+#define MAX_INODES (1 + BLOCK_SIZE/2) //the root plus as many files as the root directory block holds (2-byte entries)
+#define MAX_DBLOCKS 128 //block numbers are stored in a char (block[] of an inode)
 #define NUM_POINTERS 8 //total number of (direct) pointers for each inode; i.e., each file can have at most this number of data blocks
 #define BLOCK_SIZE 32 //size of each data block (unit: byte)
 #define NUM_OPEN_FILE 8 //maximum number of files that can be open at a time in the whole system
 
 #define RSFS_RDONLY 0 //a value for access_flag in RSFS_open(): file is open for read only
 #define RSFS_RDWR 1 //a value for access_flag in RSFS_open(): file is open for read and write  
+#define RSFS_WRBUF 2 //a flag for access_flag in RSFS_open() (with RSFS_RDWR): buffer small appends and writes until RSFS_flush()
 
 #define RSFS_SEEK_SET 0 //a value for whence in RSFS_fseek()
 #define RSFS_SEEK_CUR 1 //a value for whence in RSFS_fseek()
 #define RSFS_SEEK_END 2 //a value for whence in RSFS_fseek()
 
+#define RSFS_COMPRESSED 1 //a flag for RSFS_create_ex(): file data is stored compressed
+
+#define COMPRESS_CHUNK_SIZE (4*BLOCK_SIZE) //compressed files are compressed in chunks of this many bytes
+#define COMPRESS_MAX_CHUNKS (2*NUM_POINTERS) //max number of chunks of a compressed file
+#define COMPRESS_CACHE_ENTRIES 8 //number of decompressed chunks kept in memory
+
+#define WRITEBACK_SIZE (4*BLOCK_SIZE) //capacity of the write-back buffer of a descriptor opened with RSFS_WRBUF
+
+#define CHECKSUM_OFF 0 //a value for RSFS_checksum_enable(): no checksums
+#define CHECKSUM_UPDATE 1 //a value for RSFS_checksum_enable(): maintain checksums (checked by the scrubber)
+#define CHECKSUM_VERIFY 2 //a value for RSFS_checksum_enable(): also verify every block RSFS_read copies
+
 #define DEBUG 0 //1-enable debug, 0-disable debug prints
 
+#define RSFS_MAX_SHARDS 16 //maximum number of partitions of a sharded file system
+
+typedef struct rsfs rsfs_t; //one file system instance (see struct rsfs below)
+
 //directory entry
 struct dir_entry{
     char name; //file name must be at most three characters
     char inode_number; //inode_number identifying the inode of the file
 };
-extern int root_inode_number; //initial value
-extern pthread_mutex_t root_dir_mutex;
 
 
 //inode data structure: inodes implemented in inode.c
 struct inode {
     char block[NUM_POINTERS]; //(direct) pointers to data blocks; note: value<0 means the block is not used
     int length; //length of the file of the inode
+    int flags; //RSFS_COMPRESSED or 0
+
+    //compressed files: the chunks are packed back to back in the data blocks
+    short chunk_len[COMPRESS_MAX_CHUNKS]; //stored size of each chunk; <0 means the chunk is stored raw
+    unsigned int version; //changes whenever the data changes; validates the chunk cache
+
+    //seqlock over length and block[]: odd while the file's writer changes
+    //them, so that RSFS_read and RSFS_fseek copy them without a lock
+    unsigned int meta_seq;
 
     // 2.3.3 primitives for read/write access to the inode
     pthread_mutex_t rw_mutex;
@@ -45,20 +73,6 @@ struct inode {
     int reader_count;
     int writer_active;
 };
-extern struct inode inodes[NUM_INODES]; //global array of inodes
-extern pthread_mutex_t inodes_mutex; //mutex to guard mutually-exclusive access of inodes
-
-//inode bitmap: implemented in inode.c
-extern int inode_bitmap[NUM_INODES]; //global inode bitmap
-extern pthread_mutex_t inode_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
-
-//data bitmap: implemented in data_block.c
-extern int data_bitmap[NUM_DBLOCKS]; //global data-block bitmap
-extern pthread_mutex_t data_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
-
-//data blocks: implemented in data_block.c
-extern void *data_blocks[NUM_DBLOCKS]; //global array of pointers to the data blocks
-extern void *root_data_block;
 
 //open file entry: open_file_table implemented in open_file_table.c 
 struct open_file_entry{
@@ -67,51 +81,831 @@ struct open_file_entry{
     int inode_number;
     int position; //current position of the file
     char access_flag; //RSFS_RDONLY or RSFS_RDWR - how the file can be accessed by the process/thread openning this file
+
+    //access pattern for read-ahead
+    int last_position; //position right after the previous read; -1 if none
+    int stride; //size of the previous read
+    int seq_count; //number of back-to-back sequential reads
+    int ra_window; //current read-ahead window (in blocks)
+    int ra_next_block; //first block index not yet requested for prefetch
+
+    //write-back buffer (RSFS_WRBUF): small appends or writes not yet in the file
+    char wb_enabled; //1 if the descriptor was opened with RSFS_WRBUF
+    char wb_truncate; //1 if the buffered bytes come from RSFS_write (the file ends after them)
+    int wb_position; //file position of the first buffered byte
+    int wb_size; //number of buffered bytes; guarded by entry_mutex
+    char wb_data[WRITEBACK_SIZE];
 };
-extern struct open_file_entry open_file_table[NUM_OPEN_FILE]; //global table (array) of open_file_entries 
-extern pthread_mutex_t open_file_table_mutex; //mutex to guard M.E. access to the table
 
 
 //routines for directory management: implemented in dir.c
-struct dir_entry *search_dir(char file_name); //get the dir_entry for file_name
-struct dir_entry *insert_dir(char file_name, char inode_number); //create a dir_entry for file_name and its inode_number; the dir_entry is returned
-int delete_dir(char file_name); //delete the dir_entry for the given file name from the global directory
+struct dir_entry *search_dir(rsfs_t *fs, char file_name); //get the dir_entry for file_name
+struct dir_entry *insert_dir(rsfs_t *fs, char file_name, char inode_number); //create a dir_entry for file_name and its inode_number; the dir_entry is returned
+int delete_dir(rsfs_t *fs, char file_name); //delete the dir_entry for the given file name from the root directory
+int dir_entry_slot(rsfs_t *fs, struct dir_entry *dir_entry); //index of dir_entry within the directory block
+void set_dir_entry(rsfs_t *fs, int slot, char name, char inode_number); //overwrite a directory slot (used by recovery)
+void reset_root_dir(rsfs_t *fs); //re-pin the root directory block after the inodes were replaced
+struct dir_entry *root_dir_entries(rsfs_t *fs); //entries of the (pinned) root directory block; NULL if it does not exist yet
 
 
 //routines for inode management: implemented in inode.c
-int allocate_inode(); //allocate an unused inode, and the inode_number is returned
-void free_inode(int inode_number); //free (release) an inode
+int allocate_inode(rsfs_t *fs); //allocate an unused inode, and the inode_number is returned
+void free_inode(rsfs_t *fs, int inode_number); //free (release) an inode
+int grow_inodes(rsfs_t *fs, int num_inodes); //grow the inode table to at least num_inodes inodes; return 0 if succeed
+struct inode_meta{ //consistent copy of the length and block map of an inode
+    int length;
+    char block[NUM_POINTERS];
+};
+void inode_meta_begin(struct inode *node); //start changing the length or block map of node, waiting for another change to end
+void inode_meta_end(struct inode *node); //publish the change
+void inode_meta_read(struct inode *node, struct inode_meta *meta); //copy the length and block map of node, without a lock
+unsigned int inode_meta_seq(struct inode *node); //wait for no change under way, return the count for inode_meta_changed
+int inode_meta_changed(struct inode *node, unsigned int seq); //whether a change started since inode_meta_seq returned seq
 
 
 //routines for data block management: implemented in data_block.c
-int allocate_data_block(); //allocate an unused data block, and the block_number is returned
-void free_data_block(int block_number); //free (release) a data block
+int allocate_data_block(rsfs_t *fs); //allocate an unused data block, and the block_number is returned
+void free_data_block(rsfs_t *fs, int block_number); //drop a reference to a data block; free (release) it when none is left
+int writable_block(rsfs_t *fs, struct inode *node, int block_index); //copy-on-write a shared block before it is modified; return its block number
+void rebuild_block_refcounts(rsfs_t *fs); //recompute data_bitmap and data_refcount from the inodes
+int grow_dblocks(rsfs_t *fs, int num_dblocks); //grow the block pool to at least num_dblocks blocks; return 0 if succeed
+int reserve_data_blocks(rsfs_t *fs, int *blocks, int count); //allocate count blocks at once for the calling thread's next allocations; return 0 if succeed
+void release_data_blocks(rsfs_t *fs); //free the reserved blocks the calling thread did not use
+char *block_memory(rsfs_t *fs, int block_number); //in-memory location of a data block (without a block cache)
+
+
+//copying between user buffers and data blocks: implemented in block_copy.c
+//a byte range of a file, walked one block at a time:
+//for(block_iter_start(&it, position, size); it.done < it.size; block_iter_next(&it))
+struct block_iter{
+    int block_index; //block of the file holding the current piece
+    int offset_in_block; //where the current piece starts in that block
+    int chunk; //bytes in the current piece
+    int done; //bytes before the current piece
+    int size; //bytes in the whole range
+};
+
+//a copy routine, selected at run time for the CPU
+struct copy_kernel{
+    const char *name;
+    int width; //bytes moved per instruction
+    int supported; //1 if this CPU runs it
+    void (*copy)(char *dst, const char *src, int n);
+};
+
+void block_copy_init(); //select the kernel for whole blocks (once per process)
+void block_copy(char *dst, const char *src, int n); //copy a piece of a block from or to a user buffer
+void block_iter_start(struct block_iter *it, int position, int size); //start walking size bytes from position
+void block_iter_next(struct block_iter *it); //move to the next piece
+struct copy_kernel *block_copy_kernels(int *num); //all kernels (for benchmarks)
 
 
 //routines for open file entry management: implemented in open_file_table.c
-int allocate_open_file_entry(int access_flag, int inode_number); 
+int allocate_open_file_entry(rsfs_t *fs, int access_flag, int inode_number); 
         //allocate_open_file_entry: allocate an open file entry and initialize it with provided parameters
-void free_open_file_entry(int fd); //free (release) an open file entry
+void free_open_file_entry(rsfs_t *fs, int fd); //free (release) an open file entry
 
 
 
-//api - basic: already implemented in api.c
-int RSFS_init(); //initialize thesystem (provided)
-void RSFS_stat(); //print the file's stat (provided)
+//metadata journal: implemented in journal.c
+#define JOURNAL_MAX_TXN_RECORDS (2*NUM_POINTERS+4) //max number of records logged by one API call
+#define JOURNAL_BUF_SIZE 65536 //size (in bytes) of each in-memory group-commit buffer
 
-//api - basic: required to be implemented in api.c
-int RSFS_create(char file_name); //create an empty file and return the file handler (i.e., index of the entry in open_file_table)
-int RSFS_open(char file_name, int access_flag); //open an existing file and return the file handler
-int RSFS_append(int fd, void *buf, int size); //append to the end of the file, and return the actual number of bytes appended
-int RSFS_fseek(int fd, int offset); //change the current location of the file
-int RSFS_read(int fd, void *buf, int size); //read from file, and return the actual number of bytes read
-int RSFS_close(int fd); //close the file
+#define JR_INODE 1 //inode is allocated; value=length, block[]=pointers
+#define JR_INODE_FREE 2 //inode is released
+#define JR_DBLOCK 3 //data-bitmap entry of block index is set to value
+#define JR_DIRENT 4 //directory slot index now holds (name, value=inode_number)
 
-//api - advanced: to be implemented in api.c
-int RSFS_write(int fd, void *buf, int size);
-int RSFS_cut(int fd, int size); 
-int RSFS_delete(char file_name); //delete the file with the provided file_name
+//one redo record describing the new state of a piece of metadata
+struct journal_record{
+    int type; //one of JR_*
+    int index; //inode number, block number, or directory slot
+    int value; //meaning depends on type
+    char name; //file name for JR_DIRENT
+    char block[NUM_POINTERS]; //block pointers for JR_INODE
+    int flags; //inode flags for JR_INODE
+    short chunk_len[COMPRESS_MAX_CHUNKS]; //chunk sizes of a compressed file for JR_INODE
+};
+
+//records of a single API call; committed atomically
+struct journal_txn{
+    int num_records;
+    struct journal_record records[JOURNAL_MAX_TXN_RECORDS];
+};
+
+//state of the journal: a committer thread flushes the records of many
+//concurrent transactions with one write+fdatasync (group commit)
+struct journal{
+    int active; //1 if a journal file is open
+    int fd; //backing file
+    char path[256]; //where it lives, to be rewritten by a compaction
+    long file_size; //bytes in the file, compacted past JOURNAL_COMPACT_SIZE
+    pthread_mutex_t mutex; //guards every field below
+    pthread_cond_t committed; //signaled when durable_seq advances
+    pthread_cond_t pending; //signaled when a transaction is queued
+    pthread_t committer;
+    int stopping;
+
+    char *buf; //transactions waiting for the next flush
+    char *flush_buf; //buffer being written by the committer
+    int buf_used;
+    int buf_txns;
+
+    unsigned int next_seq; //sequence number of the next queued transaction
+    unsigned int durable_seq; //all transactions up to this one are on disk
+    int failed; //1 once a flush failed: durable_seq stops and every later commit fails
+
+    int commit_latency_us; //max time a transaction waits for others to join its batch
+    int max_batch; //flush as soon as this many transactions are queued
+
+    //statistics
+    long num_txns;
+    long num_flushes;
+    long max_batch_seen;
+    long total_wait_us; //sum of per-transaction commit latency
+    long max_wait_us;
+    long num_compactions;
+};
+
+void journal_txn_begin(struct journal_txn *txn); //reset txn
+void journal_log_inode(rsfs_t *fs, struct journal_txn *txn, int inode_number); //log the current state of an inode
+void journal_log_inode_free(rsfs_t *fs, struct journal_txn *txn, int inode_number); //log the release of an inode
+void journal_log_dblock(rsfs_t *fs, struct journal_txn *txn, int block_number, int allocated); //log a data-bitmap change
+void journal_log_blocks_diff(rsfs_t *fs, struct journal_txn *txn, char *old_block, char *new_block); //log data-bitmap changes between two block maps
+void journal_log_dirent(rsfs_t *fs, struct journal_txn *txn, struct dir_entry *dir_entry); //log the content of a directory slot
+void journal_log_dirent_free(rsfs_t *fs, struct journal_txn *txn, struct dir_entry *dir_entry); //log that a directory slot becomes empty
+unsigned int journal_txn_queue(rsfs_t *fs, struct journal_txn *txn); //queue txn for the next flush and return its sequence number
+unsigned int journal_txns_queue(rsfs_t *fs, struct journal_txn *txns, int n); //queue n txns as one transaction and return its sequence number
+int journal_wait(rsfs_t *fs, unsigned int seq); //wait until the transaction with sequence number seq is durable; -1 if it never will be
+int journal_txn_commit(rsfs_t *fs, struct journal_txn *txn); //queue txn and wait until it is durable; -1 if it never will be
+
+
+//block device backends: implemented in block_device.c
+struct block_device{
+    int fd; //backing file
+    int formatted; //1 if the device already held blocks when opened
+    int (*read_block)(struct block_device *dev, int block_number, void *buf); //read BLOCK_SIZE bytes; 0 if succeed
+    int (*write_block)(struct block_device *dev, int block_number, void *buf); //write BLOCK_SIZE bytes; 0 if succeed
+    int (*sync)(struct block_device *dev); //make written blocks durable
+    void (*close)(struct block_device *dev); //close and free the device
+};
+struct block_device *open_file_device(const char *path); //open (or create) a local file as a block device
+
+
+//block cache: implemented in block_cache.c
+struct cache_frame{
+    int block_number; //block held by the frame; -1 if empty
+    int pin_count; //number of callers copying to/from the frame; never evicted while >0
+    char referenced; //CLOCK reference bit
+    char dirty; //1 if the frame must be written back before reuse
+    char io_busy; //1 while the frame is being written back or filled
+    char prefetched; //1 if loaded by read-ahead and not accessed since
+    char *data;
+};
+
+struct block_cache{
+    int active; //1 if data blocks live on dev instead of data_blocks[]
+    struct block_device *dev;
+    int num_frames;
+    struct cache_frame *frames;
+    char *frame_data; //memory of all frames
+    int frame_of_block[MAX_DBLOCKS]; //frame holding each block; -1 if not cached
+    int clock_hand;
+    int num_syncing; //cache_sync calls using dev; RSFS_cache_close waits for them
+    pthread_mutex_t mutex; //guards every field above
+    pthread_cond_t changed; //signaled when a frame is unpinned or finishes I/O
+
+    //statistics
+    long hits;
+    long misses;
+    long evictions;
+    long writebacks;
+    long prefetches; //blocks loaded by read-ahead
+    long prefetch_hits; //demand accesses served by a prefetched block
+};
+
+char *get_block(rsfs_t *fs, int block_number); //pin a data block and return its memory
+char *pinned_block(rsfs_t *fs, int block_number); //memory of a block that is already pinned
+void put_block(rsfs_t *fs, int block_number, int dirty); //unpin a data block; dirty=1 if it was modified
+char *pin_block(rsfs_t *fs, int block_number); //pin a block for the instance rather than the calling thread (the root directory)
+void unpin_block(rsfs_t *fs, int block_number, int dirty); //unpin a block pinned by pin_block
+void mark_block_dirty(rsfs_t *fs, int block_number); //mark a block that stays pinned as modified
+void prefetch_block(rsfs_t *fs, int block_number); //load a block into the cache without pinning it
+int cache_sync(rsfs_t *fs); //write the dirty frames back and sync the device (journal ordering)
+
+
+//read-ahead: implemented in readahead.c
+#define READAHEAD_MIN_WINDOW 1 //blocks prefetched when a sequential stream is first detected
+#define READAHEAD_MAX_WINDOW NUM_POINTERS //upper bound of the adaptive window
+#define READAHEAD_QUEUE_SIZE 64 //pending prefetch requests; more are dropped
+
+//prefetch requests from RSFS_read, served by a background thread
+struct readahead{
+    int active;
+    int stopping;
+    pthread_t thread;
+    pthread_mutex_t mutex; //guards the queue
+    pthread_cond_t pending; //signaled when a request is queued
+    int queue[READAHEAD_QUEUE_SIZE]; //block numbers to prefetch
+    int head;
+    int count;
+    long num_dropped; //requests dropped because the queue was full
+};
+
+void readahead_start(rsfs_t *fs); //start the prefetch thread (called when a block cache is attached)
+void readahead_stop(rsfs_t *fs); //stop the prefetch thread
+void readahead_after_read(rsfs_t *fs, struct open_file_entry *entry, struct inode_meta *meta, int position, int size); //update the access pattern of entry and queue prefetches
+
+
+//write-back buffers: implemented in writeback.c
+int writeback_append(rsfs_t *fs, int fd, void *buf, int size); //RSFS_append on a descriptor opened with RSFS_WRBUF
+int writeback_write(rsfs_t *fs, int fd, void *buf, int size); //RSFS_write on a descriptor opened with RSFS_WRBUF
+int writeback_flush(rsfs_t *fs, int fd); //write out the buffered bytes of fd; return 0, or -1 if some could not be written
+int file_append(rsfs_t *fs, int fd, void *buf, int size); //unbuffered RSFS_append of a checked descriptor (api.c)
+int file_write(rsfs_t *fs, int fd, void *buf, int size); //unbuffered RSFS_write of a checked descriptor (api.c)
+int inode_write(rsfs_t *fs, int inode_number, int position, void *buf, int size, int truncate, struct journal_txn *txn); //write into a file held for writing, logging to txn (api.c)
+
+
+//compression: implemented in compress.c
+struct chunk_cache_entry{
+    int inode_number; //-1 if empty
+    int chunk;
+    unsigned int version; //inode version the data was decompressed from
+    char data[COMPRESS_CHUNK_SIZE];
+};
+
+struct compressed_meta{ //what a reader of a compressed file needs, copied between two changes
+    int length;
+    char block[NUM_POINTERS];
+    short chunk_len[COMPRESS_MAX_CHUNKS];
+    unsigned int version;
+};
+
+struct compress_state{
+    pthread_mutex_t mutex; //guards the chunk cache and next_version
+    struct chunk_cache_entry cache[COMPRESS_CACHE_ENTRIES];
+    unsigned int next_version;
+    long cache_hits;
+    long cache_misses;
+};
+
+void compress_init(rsfs_t *fs); //initialize the chunk cache
+void compress_cache_clear(rsfs_t *fs); //drop every cached chunk (RSFS_restore)
+unsigned int compress_new_version(rsfs_t *fs); //a version number never used before
+int lz_compress(const char *src, int src_size, char *dst, int dst_capacity); //return compressed size, or -1 if larger than dst_capacity
+int lz_decompress(const char *src, int src_size, char *dst, int dst_size); //return dst_size, or -1 if src is malformed
+int compressed_read(rsfs_t *fs, int inode_number, int position, char *buf, int size); //RSFS_read for compressed files
+int compressed_write(rsfs_t *fs, int inode_number, int position, char *buf, int size, int truncate); //RSFS_append/RSFS_write for compressed files
+int compressed_stored_size(struct inode *node); //bytes of compressed data held by node
+int compressed_plan(char *data, int *length, short *stored, int position, const char *buf, int size, int truncate, int *stream_end); //simulate compressed_write on a copy of a file; return where the stream is rewritten, or -1 if it does not fit
+
+
+//block deduplication: implemented in dedup.c
+#define DEDUP_BUCKETS NUM_DBLOCKS //number of hash buckets of the fingerprint index
+
+//fingerprint index of full blocks; lock order: dedup.mutex, then data_bitmap_mutex
+struct dedup{
+    int enabled; //1 if newly written full blocks are deduplicated
+    pthread_mutex_t mutex; //guards the index
+    int bucket[DEDUP_BUCKETS]; //first block in each bucket; -1 if empty
+    int next[MAX_DBLOCKS]; //next block in the same bucket
+    unsigned long long hash[MAX_DBLOCKS]; //fingerprint of each indexed block
+    char indexed[MAX_DBLOCKS]; //1 if the block is in the index
+    int num_indexed;
+    long num_hits; //blocks that were shared instead of stored
+};
+
+void dedup_init(rsfs_t *fs); //initialize an empty index
+void dedup_forget(rsfs_t *fs, int block_number); //remove a block from the index (dedup.mutex held)
+void dedup_blocks(rsfs_t *fs, struct inode *node, int first, int last); //share or index the full blocks first..last of node
+
+
+//block checksums: implemented in checksum.c
+struct checksum{
+    int mode; //CHECKSUM_OFF, CHECKSUM_UPDATE or CHECKSUM_VERIFY
+    unsigned int crc[MAX_DBLOCKS]; //CRC32C of each allocated block
+    pthread_t scrubber;
+    int scrub_active;
+    volatile int scrub_stopping;
+    int scrub_rate; //blocks verified per second by the scrubber
+    long num_scrubbed;
+    long num_passes;
+    long num_mismatches; //blocks found corrupted by reads or the scrubber
+};
+
+void checksum_init(rsfs_t *fs); //select the CRC32C implementation for this CPU
+unsigned int crc32c(const char *data, int size); //CRC32C (hardware-accelerated when available)
+void checksum_update(rsfs_t *fs, int block_number, const char *data); //record the checksum of a modified block
+int checksum_verify(rsfs_t *fs, int block_number, const char *data); //return -1 if a block read in CHECKSUM_VERIFY mode is corrupted
+void checksum_rebuild(rsfs_t *fs); //recompute the checksums of all allocated blocks
+
+
+//online compaction: implemented in defrag.c
+struct defrag{
+    volatile int stopping; //set by RSFS_defrag_stop()
+    int rate; //blocks moved per second by the running pass (0: no limit)
+    long num_passes;
+    long num_moved; //blocks relocated so far
+};
+
+
+//shared-memory mode: implemented in shm.c
+#define SHM_NAME_SIZE 64 //max length of a shm_open() name
+
+//an instance created by RSFS_init_shared() lives entirely in one shared
+//memory region: it holds no pointers (blocks, inodes and directory entries
+//are referenced by number) and its mutexes and condition variables are
+//process-shared, so every process mapping the region can use it
+struct shm{
+    int active; //1 if the instance lives in a shared memory region
+    char name[SHM_NAME_SIZE]; //shm_open() name; empty for an anonymous region inherited by fork()
+    volatile int ready; //set by the creating process once the region is initialized
+    int num_attached; //processes that have the region mapped (named regions)
+};
+
+void shm_mutex_init(rsfs_t *fs, pthread_mutex_t *mutex); //pthread_mutex_init, process-shared for a shared instance
+void shm_cond_init(rsfs_t *fs, pthread_cond_t *cond); //pthread_cond_init, process-shared for a shared instance
+void shm_detach(rsfs_t *fs); //unmap a shared instance (RSFS_destroy); the last process to detach removes a named region
+int shm_refuse(rsfs_t *fs, const char *caller); //return -1 (and print why) if fs is shared; for features that keep per-process threads or files
+
+
+//local IPC: implemented in ipc.c
+#define IPC_BUF_SIZE 65536 //size of the shared data buffer of each client connection
+#define IPC_MAX_CLIENTS 16 //max number of clients connected to a server at a time
+
+#define IPC_CREATE 1 //ops of struct ipc_request: one per forwarded API call
+#define IPC_DELETE 2
+#define IPC_OPEN 3
+#define IPC_APPEND 4
+#define IPC_FSEEK 5
+#define IPC_READ 6
+#define IPC_CLOSE 7
+#define IPC_WRITE 8
+#define IPC_CUT 9
+#define IPC_CLONE 10
+#define IPC_FLUSH 11
+
+//a call sent over the socket; bulk data (RSFS_append/RSFS_write input,
+//RSFS_read output) is passed in the shared buffer of the connection instead
+struct ipc_request{
+    int op; //IPC_*
+    int fd; //file descriptor of the server
+    int arg; //flags, access_flag, offset or size, depending on op
+    char name; //file name
+    char name2; //dst_name for IPC_CLONE
+};
+
+struct ipc_response{
+    int ret; //return value of the call
+};
+
+//client side: an instance returned by RSFS_connect() forwards every file call
+struct ipc_client{
+    int active; //1 if this instance is a connection to a server
+    int sock;
+    char *buf; //shared data buffer (IPC_BUF_SIZE bytes) mapped from the server
+    pthread_mutex_t mutex; //one call at a time per connection
+};
 
+//server side: started by RSFS_serve_start()
+struct ipc_server{
+    int active;
+    int listen_fd;
+    char path[108]; //socket path
+    pthread_t thread; //accepts connections and starts a thread for each
+    volatile int stopping;
+    pthread_mutex_t mutex; //guards client_socks and num_clients
+    pthread_cond_t client_exited;
+    int client_socks[IPC_MAX_CLIENTS]; //-1 if the slot is free
+    int num_clients;
+    long num_requests;
+};
+
+int remote_create(rsfs_t *fs, char file_name, int flags); //RSFS_create_ex on the server
+int remote_delete(rsfs_t *fs, char file_name); //RSFS_delete on the server
+int remote_open(rsfs_t *fs, char file_name, int access_flag); //RSFS_open on the server
+int remote_io(rsfs_t *fs, int op, int fd, void *buf, int size); //RSFS_append/RSFS_write/RSFS_read through the shared buffer
+int remote_fd_call(rsfs_t *fs, int op, int fd, int arg); //RSFS_fseek/RSFS_close/RSFS_cut on the server
+int remote_clone(rsfs_t *fs, char src_name, char dst_name); //RSFS_clone on the server
+void remote_disconnect(rsfs_t *fs); //close the connection (RSFS_destroy)
+
+
+//workload tracing: implemented in trace.c
+#define TRACE_MAGIC 0x52535454 //"RSTT"
+#define TRACE_VERSION 1
+#define TRACE_BUF_RECORDS 4096 //records buffered before they are written out
+
+#define TRACE_CREATE 1 //ops of struct trace_record: one per recorded API call
+#define TRACE_DELETE 2
+#define TRACE_OPEN 3
+#define TRACE_APPEND 4
+#define TRACE_FSEEK 5
+#define TRACE_READ 6
+#define TRACE_CLOSE 7
+#define TRACE_WRITE 8
+#define TRACE_CUT 9
+#define TRACE_CLONE 10
+#define TRACE_FILE 11 //a file that existed when the trace started (name, flags in arg, length in size)
+
+//trace file layout: a header, then one record per call in the order the
+//calls returned (a replay orders them by start_ns)
+struct trace_header{
+    unsigned int magic;
+    unsigned int version;
+    int block_size; //BLOCK_SIZE of the writer
+    int num_pointers; //NUM_POINTERS of the writer
+};
+
+struct trace_record{
+    long start_ns; //when the call started, since the trace started
+    int duration_ns;
+    int thread; //OS thread id of the caller
+    int fd; //file descriptor argument (-1 if none)
+    int size; //bytes for append/read/write/cut, offset for fseek, length for TRACE_FILE
+    int ret; //return value of the call
+    char op; //TRACE_*
+    char name; //file name, or src_name for TRACE_CLONE
+    char arg; //flags, access_flag, or dst_name for TRACE_CLONE
+};
+
+struct trace{
+    int active; //1 while recording
+    int fd;
+    long start_ns;
+    pthread_mutex_t mutex; //guards the buffer and the file
+    struct trace_record *buf; //TRACE_BUF_RECORDS records waiting to be written
+    int num_buffered;
+    long num_records;
+    long num_dropped; //records lost to write errors
+};
 
+void trace_init(rsfs_t *fs); //prepare the trace state of a new instance
+void trace_call(rsfs_t *fs, long start_ns, long end_ns, int op, int fd, char name, int arg, int size, int ret); //record a call (from call_exit)
 
 
+//instrumentation: implemented in metrics.c
+#define METRICS_MAX_THREADS 32 //threads with a histogram of their own; later threads share the last one
+#define METRICS_BUCKETS 40 //bucket b counts calls taking [2^(b-1), 2^b) time-stamp counter ticks; the last one also counts longer calls
+#define METRICS_NUM_OPS (TRACE_CLONE+1) //histograms are indexed by TRACE_* op
+
+#define LOCK_ROOT_DIR 0 //instrumented locks: index into struct metrics.locks
+#define LOCK_DATA_BITMAP 1
+#define LOCK_OPEN_FILE_TABLE 2
+#define LOCK_INODE_BITMAP 3
+#define LOCK_FILE_RW 4 //RSFS_open waiting on rw_cond for the readers or the writer of a file
+#define NUM_LOCK_STATS 5
+
+//call latencies of one thread; only that thread updates them
+struct metrics_thread{
+    long count[METRICS_NUM_OPS];
+    long sum_ticks[METRICS_NUM_OPS];
+    long bucket[METRICS_NUM_OPS][METRICS_BUCKETS];
+};
+
+//counters of one lock; updated while holding it
+struct lock_stat{
+    long acquisitions;
+    long contended; //acquisitions that had to wait
+    long wait_ns;
+};
+
+struct metrics{
+    int enabled; //1 if calls are timed (the default)
+    long instance_id; //tells the instance apart from an earlier one at the same address
+    int num_threads; //slots handed out so far
+    struct metrics_thread threads[METRICS_MAX_THREADS];
+    struct lock_stat locks[NUM_LOCK_STATS];
+    pthread_mutex_t mutex; //serializes aggregation
+};
+
+extern const char *metrics_op_names[METRICS_NUM_OPS]; //indexed by TRACE_* op
+extern const char *metrics_lock_names[NUM_LOCK_STATS]; //indexed by LOCK_* lock
+
+void metrics_process_init(); //calibrate the time-stamp counter (once per process)
+void metrics_init(rsfs_t *fs); //metrics start on
+long metrics_now(); //monotonic time in ns
+long ticks_to_ns(long tick); //metrics_now() time of a time-stamp counter reading
+int metrics_thread_index(rsfs_t *fs); //slot of the calling thread in fs (0 .. METRICS_MAX_THREADS-1)
+int call_enter(rsfs_t *fs, int op, long *start_tick); //1 if the calling API function should time (or trace) this call of op
+void call_exit(rsfs_t *fs, long start_tick, int op, int fd, char name, int arg, int size, int ret); //time (and trace) a call that returned ret
+void metrics_lock(rsfs_t *fs, pthread_mutex_t *mutex, int lock); //pthread_mutex_lock, counting contention and wait time
+void metrics_unlock(rsfs_t *fs, pthread_mutex_t *mutex, int lock); //pthread_mutex_unlock of a lock taken with metrics_lock
+void metrics_rw_wait(rsfs_t *fs, long wait_ns); //count a wait of RSFS_open for a file
+void metrics_rw_acquired(rsfs_t *fs); //count an RSFS_open that got its file
+
+
+//event tracing: implemented in events.c
+#define EVENT_RING_SIZE 4096 //events kept per thread slot (a power of 2); older ones are overwritten
+
+#define EVENT_OP_BEGIN 1 //types of struct event: id is the TRACE_* op
+#define EVENT_OP_END 2 //arg is the return value
+#define EVENT_LOCK_ACQUIRE 3 //id is the LOCK_* lock, arg the ns spent waiting for it
+#define EVENT_LOCK_RELEASE 4
+#define EVENT_BLOCK_ALLOC 5 //arg is the block number
+#define EVENT_BLOCK_FREE 6
+#define EVENT_WAIT_BEGIN 7 //waiting on the rw_cond of inode arg
+#define EVENT_WAIT_END 8
+
+struct event{
+    long seq; //1 + position in the ring once complete, 0 while being written
+    long tick; //time-stamp counter
+    int thread; //OS thread id
+    int arg;
+    short type; //EVENT_*
+    short id;
+};
+
+//events of one thread slot; each event is claimed with an atomic increment
+//of head (uncontended but for the shared last slot), so recording takes no lock
+struct event_ring{
+    long head; //events recorded so far
+    struct event events[EVENT_RING_SIZE];
+};
+
+struct events{
+    int active; //1 while recording
+    long start_tick; //when recording started; dumped times count from it
+    struct event_ring *rings; //METRICS_MAX_THREADS rings, allocated by the first RSFS_events_start
+};
+
+void event_record(rsfs_t *fs, int type, int id, int arg); //record an event of the calling thread while recording
+void event_record_at(rsfs_t *fs, long tick, int type, int id, int arg); //the same, at a time-stamp counter reading already taken
+void events_free(rsfs_t *fs); //release the rings (RSFS_destroy)
+
+
+//stats snapshots: implemented in stats.c
+#define RSFS_MAX_FILES (RSFS_MAX_SHARDS * (MAX_INODES - 1)) //files a snapshot can list (every partition full)
+
+//one file of a snapshot (also filled by RSFS_readdir and RSFS_stat_many)
+struct rsfs_file_stat{
+    char name;
+    int inode_number;
+    int length;
+    int num_blocks; //data blocks in its block map (blocks shared with other files included)
+    int stored_bytes; //compressed data held for an RSFS_COMPRESSED file, its length otherwise
+    int flags;
+    int num_open; //file descriptors open on it
+};
+
+//what RSFS_stat_snapshot reports; a sharded file system sums its partitions
+struct rsfs_stats{
+    int total_blocks, used_blocks;
+    int shared_blocks; //blocks referenced by more than one file
+    int saved_blocks; //blocks sharing saves
+    int total_inodes, used_inodes; //the root directory's inode included
+    int open_files;
+    long generation; //updates so far: equal in two snapshots if nothing changed in between
+    int num_files;
+    struct rsfs_file_stat files[RSFS_MAX_FILES]; //in directory order
+};
+
+//a copy of the reported state, updated next to the state it mirrors (under
+//the lock guarding that state) and read without a lock: begun and ended form
+//a sequence lock that any number of writers can be inside at once
+struct stats{
+    long begun; //updates started
+    long ended; //updates finished
+    int used_blocks, shared_blocks, saved_blocks;
+    int used_inodes;
+    int open_files;
+    int total_blocks, total_inodes;
+    char dir_name[MAX_INODES - 1]; //directory slot -> file name (0 if empty)
+    char dir_inode[MAX_INODES - 1];
+    struct rsfs_file_stat inodes[MAX_INODES]; //by inode number (name unused)
+};
+
+void stats_rebuild(rsfs_t *fs); //recompute everything (after setup, restore or recovery)
+void stats_refcount(rsfs_t *fs, int old_refcount, int new_refcount); //a block's reference count changed (data_bitmap_mutex held)
+void stats_pool_size(rsfs_t *fs); //the block pool changed size (data_bitmap_mutex held)
+void stats_table_size(rsfs_t *fs); //the inode table changed size (inode_bitmap_mutex held)
+void stats_inodes(rsfs_t *fs, int delta); //inodes were allocated or freed (inode_bitmap_mutex held)
+void stats_open(rsfs_t *fs, int inode_number, int delta); //a file was opened or closed (open_file_table_mutex held)
+void stats_dir(rsfs_t *fs, int slot, char name, char inode_number); //a directory slot changed (root_dir_mutex held)
+void stats_file(rsfs_t *fs, int inode_number); //the length or block map of a file changed (by its writer)
+void stats_hold(rsfs_t *fs); //snapshots wait from here until stats_release (RSFS_txn_commit)
+void stats_release(rsfs_t *fs); //let snapshots see the updates made since stats_hold
+
+
+//change notification: implemented in watch.c
+#define RSFS_MAX_WATCHES 16 //watches an instance can hold at a time
+
+#define RSFS_WATCH_APPEND 1 //events of RSFS_watch(): bytes were appended
+#define RSFS_WATCH_WRITE 2 //the file was written (RSFS_write)
+#define RSFS_WATCH_TRUNCATE 4 //the file got shorter (RSFS_cut, or RSFS_write before the end)
+#define RSFS_WATCH_DELETE 8 //the file was deleted; the watch gets no more events
+#define RSFS_WATCH_CLOSE_WRITE 16 //a descriptor open for writing was closed
+
+struct watch{
+    char used;
+    char name;
+    int inode_number; //file watched; -1 once it is deleted
+    int mask; //RSFS_WATCH_* events wanted
+    int pending; //events since the last RSFS_watch_wait, coalesced
+    int efd; //eventfd signalled when pending becomes non-zero
+};
+
+struct watches{
+    pthread_mutex_t mutex; //guards list
+    pthread_cond_t changed; //broadcast when an event is added or a watch removed
+    int num_active; //watches in use; the mutators skip the list when 0
+    struct watch list[RSFS_MAX_WATCHES];
+};
+
+void watch_init(rsfs_t *fs); //prepare the watch list of a new instance
+void watch_notify(rsfs_t *fs, int inode_number, int events); //report events on a file to its watches
+void watch_defer(rsfs_t *fs); //hold back the calling thread's events until watch_flush (RSFS_txn_commit)
+void watch_flush(rsfs_t *fs); //deliver the events held back
+void watches_free(rsfs_t *fs); //close the eventfds (RSFS_destroy)
+
+
+//multi-file transactions: implemented in txn.c
+#define RSFS_TXN_MAX_OPS 8 //operations one transaction may stage (their journal records must fit one replayed transaction)
+
+#define TXN_CREATE 1 //kinds of staged operation
+#define TXN_DELETE 2
+#define TXN_WRITE 3
+#define TXN_APPEND 4
+
+//one staged operation; its data is copied when staged
+struct txn_op{
+    int type; //one of TXN_*
+    char name;
+    int flags; //RSFS_COMPRESSED for TXN_CREATE
+    int position; //offset of TXN_WRITE
+    int size;
+    char *data;
+};
+
+//a transaction being staged, from RSFS_txn_begin until RSFS_txn_commit or
+//RSFS_txn_abort
+typedef struct rsfs_txn{
+    rsfs_t *fs;
+    int num_ops;
+    struct txn_op ops[RSFS_TXN_MAX_OPS];
+} rsfs_txn_t;
+
+
+//one file system instance: all of its state, created by RSFS_init() and
+//passed to every call; instances share nothing, so independent file systems
+//can run side by side (e.g., one per core or per tenant)
+struct rsfs{
+    //inodes: implemented in inode.c
+    struct inode inodes[MAX_INODES]; //array of inodes; [0, num_inodes) are in the table
+    int num_inodes; //current size of the inode table; growing it never moves an inode
+    pthread_mutex_t inodes_mutex; //mutex to guard mutually-exclusive access of inodes
+    int inode_bitmap[MAX_INODES]; //inode bitmap
+    pthread_mutex_t inode_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
+
+    //data blocks: implemented in data_block.c
+    char data_blocks[NUM_DBLOCKS][BLOCK_SIZE]; //the initial data blocks (while no block cache is attached); referenced by block number
+    char *block_chunks[(MAX_DBLOCKS-NUM_DBLOCKS)/DBLOCK_CHUNK]; //memory of the blocks beyond NUM_DBLOCKS, one allocation per chunk
+    int num_dblocks; //current size of the block pool; growing it never moves a block
+    long num_grows; //chunks added to the inode table or block pool
+    int data_bitmap[MAX_DBLOCKS]; //data-block bitmap
+    int data_refcount[MAX_DBLOCKS]; //number of references to each data block; >1 if shared (guarded by data_bitmap_mutex)
+    pthread_mutex_t data_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
+
+    //open files: implemented in open_file_table.c
+    struct open_file_entry open_file_table[NUM_OPEN_FILE]; //table (array) of open_file_entries
+    pthread_mutex_t open_file_table_mutex; //mutex to guard M.E. access to the table
+
+    //root directory: implemented in dir.c
+    int root_inode_number;
+    pthread_mutex_t root_dir_mutex;
+    int root_data_block_pinned; //block number of the directory block, which stays pinned in the block cache (if any) while in use; -1 if none
+
+    pthread_mutex_t mutex_for_fs_stat; //mutex used by RSFS_frag_stat()
+    pthread_rwlock_t mutator_lock; //held shared by every mutating API call; held exclusively while a checkpoint copies the state
+
+    struct journal journal;
+    struct block_cache block_cache;
+    struct readahead readahead;
+    struct compress_state compress_state;
+    struct dedup dedup;
+    struct checksum checksum;
+    struct defrag defrag;
+    struct shm shm;
+
+    //sharded namespace: implemented in shard.c
+    int num_shards; //>0 if this instance only routes calls to its partitions
+    rsfs_t *shards[RSFS_MAX_SHARDS];
+
+    //local IPC: implemented in ipc.c
+    struct ipc_client remote; //active if this instance only forwards calls to a server
+    struct ipc_server server;
+
+    struct trace trace;
+    struct metrics metrics;
+    struct events events;
+    struct stats stats;
+    struct watches watches;
+};
+
+int shard_index(rsfs_t *fs, char file_name); //partition holding file_name
+rsfs_t *shard_of_fd(rsfs_t *fs, int *fd); //partition of a router fd; *fd becomes the fd within it
+int shard_fd(int index, int fd); //router fd for fd of partition index
+int router_refuse(rsfs_t *fs, const char *caller); //return -1 (and print why) if fs is a router or a connected instance, which hold no blocks of their own
+int shard_copy_file(rsfs_t *src_fs, char src_name, rsfs_t *dst_fs, char dst_name); //RSFS_clone across partitions
+
+
+//api - basic: already implemented in api.c
+rsfs_t *RSFS_init(); //create and initialize a file system instance; return NULL on failure
+int rsfs_setup(rsfs_t *fs); //initialize a zero-filled instance in place; return 0 if succeed
+void RSFS_destroy(rsfs_t *fs); //stop the background threads of fs and free everything it holds
+void RSFS_stat(rsfs_t *fs); //print the file's stat (provided)
+int RSFS_stat_snapshot(rsfs_t *fs, struct rsfs_stats *stats); //fill stats with a consistent snapshot, without locking
+int RSFS_readdir(rsfs_t *fs, int *cursor, struct rsfs_file_stat *out, int max); //list up to max files from *cursor on (start at 0); return how many, 0 at the end
+int RSFS_stat_many(rsfs_t *fs, const char *names, int count, struct rsfs_file_stat *out); //stat count files by name without opening them; return how many exist
+
+//api - basic: required to be implemented in api.c
+int RSFS_create(rsfs_t *fs, char file_name); //create an empty file and return the file handler (i.e., index of the entry in open_file_table)
+int RSFS_create_ex(rsfs_t *fs, char file_name, int flags); //RSFS_create with flags (RSFS_COMPRESSED)
+int RSFS_open(rsfs_t *fs, char file_name, int access_flag); //open an existing file and return the file handler
+int RSFS_append(rsfs_t *fs, int fd, void *buf, int size); //append to the end of the file, and return the actual number of bytes appended
+int RSFS_fseek(rsfs_t *fs, int fd, int offset); //change the current location of the file
+int RSFS_read(rsfs_t *fs, int fd, void *buf, int size); //read from file, and return the actual number of bytes read
+int RSFS_close(rsfs_t *fs, int fd); //close the file
+
+//api - advanced: to be implemented in api.c
+int RSFS_write(rsfs_t *fs, int fd, void *buf, int size);
+int RSFS_cut(rsfs_t *fs, int fd, int size); //remove size bytes at the current position, and return the number of bytes removed
+int RSFS_delete(rsfs_t *fs, char file_name); //delete the file with the provided file_name
+int RSFS_clone(rsfs_t *fs, char src_name, char dst_name); //create dst_name sharing the data blocks of src_name (copy-on-write)
+
+//api - write-back buffers: implemented in writeback.c
+int RSFS_flush(rsfs_t *fs, int fd); //write out the bytes buffered for fd (opened with RSFS_WRBUF); return 0 if succeed
+
+//api - journal: implemented in journal.c
+int RSFS_journal_open(rsfs_t *fs, const char *path, int commit_latency_us, int max_batch); //replay the journal at path and log all later metadata updates to it
+int RSFS_journal_close(rsfs_t *fs); //flush pending transactions and stop journaling
+void RSFS_journal_stat(rsfs_t *fs); //print group-commit statistics
+
+//api - checkpoint: implemented in checkpoint.c
+int RSFS_checkpoint(rsfs_t *fs, const char *path); //write a binary snapshot of the whole file system to path
+int RSFS_restore(rsfs_t *fs, const char *path); //replace the whole file system with the snapshot at path
+
+//api - block cache: implemented in block_cache.c
+int RSFS_cache_attach(rsfs_t *fs, struct block_device *dev, int num_frames); //move the data blocks to dev behind a cache of num_frames blocks
+int RSFS_cache_open(rsfs_t *fs, const char *path, int num_frames); //RSFS_cache_attach with a local file as the device
+int RSFS_cache_flush(rsfs_t *fs); //write all dirty blocks back to the device
+int RSFS_cache_close(rsfs_t *fs); //flush, move the data blocks back into memory, and close the device
+void RSFS_cache_stat(rsfs_t *fs); //print hit/miss/eviction counters
+
+//api - deduplication: implemented in dedup.c
+void RSFS_dedup_enable(rsfs_t *fs, int enabled); //turn deduplication of full blocks on (1) or off (0)
+
+//api - checksums: implemented in checksum.c
+void RSFS_checksum_enable(rsfs_t *fs, int mode); //CHECKSUM_OFF, CHECKSUM_UPDATE or CHECKSUM_VERIFY
+int RSFS_scrubber_start(rsfs_t *fs, int blocks_per_second); //verify all file blocks in the background at the given rate
+void RSFS_scrubber_stop(rsfs_t *fs); //stop the scrubber
+void RSFS_checksum_stat(rsfs_t *fs); //print scrub and mismatch counters
+
+//api - compaction: implemented in defrag.c
+void RSFS_frag_stat(rsfs_t *fs); //print extents per file and free-space fragmentation
+int RSFS_defrag(rsfs_t *fs, int blocks_per_second); //move each file's blocks into a contiguous run; return the number of blocks moved
+void RSFS_defrag_stop(rsfs_t *fs); //make a running RSFS_defrag return early
+
+//api - workload tracing: implemented in trace.c
+int RSFS_trace_start(rsfs_t *fs, const char *path); //record every file call on fs (thread, arguments, result, timing) into a trace at path
+long RSFS_trace_stop(rsfs_t *fs); //stop recording; return the number of records written
+
+//api - instrumentation: implemented in metrics.c
+void RSFS_metrics_enable(rsfs_t *fs, int enabled); //turn call latency histograms on (1, the default) or off (0)
+void RSFS_metrics_stat(rsfs_t *fs); //print call counts and latencies, and lock contention
+int RSFS_metrics_export(rsfs_t *fs, const char *path); //write the histograms and lock counters to path in the Prometheus text format
+
+//api - event tracing: implemented in events.c
+int RSFS_events_start(rsfs_t *fs); //record op, lock, block and wait events of every thread in per-thread rings
+void RSFS_events_stop(rsfs_t *fs); //stop recording; the recorded events are kept
+long RSFS_events_dump(rsfs_t *fs, const char *path); //write the recorded events to path as Chrome trace_event JSON; return how many
+
+//api - change notification: implemented in watch.c
+int RSFS_watch(rsfs_t *fs, char file_name, int mask); //watch RSFS_WATCH_* events on a file; return a handle
+int RSFS_watch_fd(rsfs_t *fs, int handle); //eventfd readable while the watch has events pending (for poll/epoll)
+int RSFS_watch_wait(rsfs_t *fs, int handle, int timeout_ms); //wait for events (timeout_ms<0: forever, 0: don't); return and clear them
+int RSFS_unwatch(rsfs_t *fs, int handle); //remove a watch
+
+//api - multi-file transactions: implemented in txn.c
+rsfs_txn_t *RSFS_txn_begin(rsfs_t *fs); //start staging a transaction; return NULL on failure
+int RSFS_txn_create(rsfs_txn_t *txn, char file_name, int flags); //stage RSFS_create_ex; return 0 if staged
+int RSFS_txn_delete(rsfs_txn_t *txn, char file_name); //stage RSFS_delete; return 0 if staged
+int RSFS_txn_write(rsfs_txn_t *txn, char file_name, int offset, void *buf, int size); //stage a write at offset that ends the file after it; return 0 if staged
+int RSFS_txn_append(rsfs_txn_t *txn, char file_name, void *buf, int size); //stage an append; return 0 if staged
+int RSFS_txn_commit(rsfs_txn_t *txn); //apply all staged operations atomically, or none; frees txn; return 0 if succeed
+void RSFS_txn_abort(rsfs_txn_t *txn); //drop the staged operations and free txn
+
+//api - block copy: implemented in block_copy.c
+int block_copy_use(const char *name); //use the kernel called name ("memcpy", "sse2", "avx2", "avx512") for whole blocks
+const char *block_copy_kernel(); //name of the kernel used for whole blocks
+
+//api - sharded namespace: implemented in shard.c
+rsfs_t *RSFS_init_sharded(int num_shards); //create num_shards partitions; file calls are routed by a hash of the file name
+rsfs_t *RSFS_shard(rsfs_t *fs, int index); //a partition of a sharded file system (to configure its journal, cache, ...)
+
+//api - shared memory: implemented in shm.c
+rsfs_t *RSFS_init_shared(const char *name); //create, or attach to, an instance in the shared memory object name (NULL: anonymous, shared with children forked afterwards)
+
+//api - local IPC: implemented in ipc.c
+int RSFS_serve_start(rsfs_t *fs, const char *socket_path); //serve fs to other processes over a Unix domain socket
+void RSFS_serve_stop(rsfs_t *fs); //disconnect all clients and stop serving
+rsfs_t *RSFS_connect(const char *socket_path); //connect to a server; the returned instance forwards RSFS_create/RSFS_open/RSFS_read/... to it
@@ -0,0 +1,278 @@
+/*
+    fragmentation report and online compaction;
+    the compactor slides the blocks of every file, in order, to the low end of
+    the pool so that each file becomes one contiguous run of block numbers and
+    the free blocks end up in one run at the high end
+*/
+
+#include "def.h"
+#include <unistd.h>
+
+
+//number of blocks of a file and number of extents (runs of consecutive
+//block numbers) they form, in block[] order
+static void file_extents(struct inode *node, int *num_blocks, int *num_extents){
+    *num_blocks = 0;
+    *num_extents = 0;
+    int prev = -2;
+    for(int i=0; i<NUM_POINTERS; i++){
+        int block_number = node->block[i];
+        if(block_number < 0) continue;
+        (*num_blocks)++;
+        if(block_number != prev + 1) (*num_extents)++;
+        prev = block_number;
+    }
+}
+
+//lowest block number of a file; MAX_DBLOCKS if it has no blocks
+static int first_block_of(struct inode *node){
+    int first = MAX_DBLOCKS;
+    for(int i=0; i<NUM_POINTERS; i++){
+        if(node->block[i] >= 0 && node->block[i] < first) first = node->block[i];
+    }
+    return first;
+}
+
+//find the file and pointer index referring to block_number;
+//return the inode number, or -1 if no file refers to it
+static int owner_of(rsfs_t *fs, int block_number, int *block_index){
+    for(int i=0; i<fs->num_inodes; i++){
+        if(!fs->inode_bitmap[i]) continue;
+        for(int j=0; j<NUM_POINTERS; j++){
+            if(fs->inodes[i].block[j] == block_number){
+                *block_index = j;
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+//claim a specific free block; return 0 if it was free
+static int claim_data_block(rsfs_t *fs, int block_number){
+    int ret = -1;
+    metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    if(block_number < fs->num_dblocks && fs->data_bitmap[block_number] == 0){
+        fs->data_bitmap[block_number] = 1;
+        fs->data_refcount[block_number] = 1;
+        stats_refcount(fs, 0, 1);
+        ret = 0;
+    }
+    metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+    return ret;
+}
+
+
+//get exclusive access to a file that nobody has open, as RSFS_open with
+//RSFS_RDWR would; return -1 (without waiting) if the file is in use
+static int try_lock_file(struct inode *node){
+    pthread_mutex_lock(&node->rw_mutex);
+    int busy = node->reader_count > 0 || node->writer_active;
+    if(!busy) node->writer_active = 1;
+    pthread_mutex_unlock(&node->rw_mutex);
+    return busy ? -1 : 0;
+}
+
+static void unlock_file(struct inode *node){
+    pthread_mutex_lock(&node->rw_mutex);
+    node->writer_active = 0;
+    pthread_cond_broadcast(&node->rw_cond);
+    pthread_mutex_unlock(&node->rw_mutex);
+}
+
+//move block[block_index] of a file from old_block to target;
+//return 0 if succeed, or -1 if the file is open, the pointer changed,
+//the block is shared, target was taken in the meantime, one of the two
+//blocks could not be brought into memory (the file then keeps old_block),
+//or the file was deleted during the copy
+static int move_block(rsfs_t *fs, int inode_number, int block_index, int old_block, int target){
+    struct inode *node = &fs->inodes[inode_number];
+
+    //the file is locked for one block at a time, so readers that open it
+    //during compaction wait for a single block copy at most
+    if(inode_number == fs->root_inode_number || try_lock_file(node) < 0) return -1;
+    pthread_rwlock_rdlock(&fs->mutator_lock);
+
+    //a block that is not shared and not in the dedup index cannot become
+    //shared while it is moved
+    int movable = 0;
+    if(fs->inode_bitmap[inode_number] && node->block[block_index] == old_block){
+        pthread_mutex_lock(&fs->dedup.mutex);
+        metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+        movable = fs->data_refcount[old_block] == 1;
+        if(movable) dedup_forget(fs, old_block);
+        metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+        pthread_mutex_unlock(&fs->dedup.mutex);
+    }
+    if(!movable || claim_data_block(fs, target) < 0){
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        unlock_file(node);
+        return -1;
+    }
+
+    char *src = get_block(fs, old_block);
+    char *dst = get_block(fs, target);
+    if(src == NULL || dst == NULL){
+        if(dst) put_block(fs, target, 0);
+        if(src) put_block(fs, old_block, 0);
+        free_data_block(fs, target);
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        unlock_file(node);
+        return -1;
+    }
+    memcpy(dst, src, BLOCK_SIZE);
+    fs->checksum.crc[target] = fs->checksum.crc[old_block];
+    put_block(fs, target, 1);
+    put_block(fs, old_block, 0);
+
+    //RSFS_delete only holds mutator_lock shared and does not wait for the
+    //file, so it may have freed the inode and its blocks since the check
+    inode_meta_begin(node);
+    if(!fs->inode_bitmap[inode_number] || node->block[block_index] != old_block){
+        inode_meta_end(node);
+        free_data_block(fs, target);
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        unlock_file(node);
+        return -1;
+    }
+    char old_map[NUM_POINTERS];
+    memcpy(old_map, node->block, NUM_POINTERS);
+    node->block[block_index] = target;
+    free_data_block(fs, old_block);
+    inode_meta_end(node);
+
+    struct journal_txn txn;
+    journal_txn_begin(&txn);
+    journal_log_blocks_diff(fs, &txn, old_map, node->block);
+    journal_log_inode(fs, &txn, inode_number);
+    unsigned int seq = journal_txn_queue(fs, &txn);
+
+    pthread_rwlock_unlock(&fs->mutator_lock);
+    unlock_file(node);
+
+    if(journal_wait(fs, seq) < 0) return -1;
+
+    fs->defrag.num_moved++;
+    if(fs->defrag.rate > 0) usleep(1000000 / fs->defrag.rate);
+
+    return 0;
+}
+
+//move block[block_index] of a file to block number next; a block of another
+//file in the way is first moved to a free block above next;
+//return 0 if the block is at next afterwards
+static int slide_block(rsfs_t *fs, int inode_number, int block_index, int next){
+    int block_number = fs->inodes[inode_number].block[block_index];
+    if(block_number == next) return 0;
+
+    if(fs->data_bitmap[next]){
+        int occupant_index;
+        int occupant = owner_of(fs, next, &occupant_index);
+        if(occupant < 0) return -1;
+
+        int spare = -1;
+        for(int i=next+1; i<fs->num_dblocks && spare<0; i++){
+            if(!fs->data_bitmap[i]) spare = i;
+        }
+        if(spare < 0 || move_block(fs, occupant, occupant_index, next, spare) < 0) return -1;
+    }
+
+    return move_block(fs, inode_number, block_index, block_number, next);
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//print the number of extents of each file and the fragmentation of free space
+void RSFS_frag_stat(rsfs_t *fs){
+    if(router_refuse(fs, "[RSFS_frag_stat]") < 0) return;
+
+    pthread_mutex_lock(&fs->mutex_for_fs_stat);
+
+    printf("\nFragmentation:\n\n %16s%10s%10s%10s\n", "iNode #", "Blocks", "Extents", "Avg Ext");
+
+    int total_blocks = 0, total_extents = 0;
+    for(int i=0; i<fs->num_inodes; i++){
+        if(!fs->inode_bitmap[i] || i == fs->root_inode_number) continue;
+        int num_blocks, num_extents;
+        file_extents(&fs->inodes[i], &num_blocks, &num_extents);
+        total_blocks += num_blocks;
+        total_extents += num_extents;
+        printf("%16d%10d%10d%10.2f\n", i, num_blocks, num_extents,
+            num_extents ? (double)num_blocks/num_extents : 0);
+    }
+
+    int free_blocks = 0, free_runs = 0, largest_run = 0, run = 0;
+    for(int i=0; i<fs->num_dblocks; i++){
+        if(fs->data_bitmap[i]){
+            run = 0;
+            continue;
+        }
+        free_blocks++;
+        if(run == 0) free_runs++;
+        run++;
+        if(run > largest_run) largest_run = run;
+    }
+
+    printf("\nAverage Extent Length: %.2f blocks\n", total_extents ? (double)total_blocks/total_extents : 0);
+    printf("Free Blocks: %d,  Free Runs: %d,  Largest Run: %d,  Free Space Fragmentation: %.2f\n",
+        free_blocks, free_runs, largest_run, free_blocks ? 1 - (double)largest_run/free_blocks : 0);
+    printf("Compactor: %ld passes,  %ld blocks moved\n\n", fs->defrag.num_passes, fs->defrag.num_moved);
+
+    pthread_mutex_unlock(&fs->mutex_for_fs_stat);
+}
+
+//run one compaction pass over all files, moving at most blocks_per_second
+//blocks per second (0: no limit); files stay usable during the pass: a block
+//of a file that is open, or shared by several files, stays where it is;
+//return the number of blocks moved, or -1 on a router or connected instance
+int RSFS_defrag(rsfs_t *fs, int blocks_per_second){
+    if(router_refuse(fs, "[RSFS_defrag]") < 0) return -1;
+
+    long moved_before = fs->defrag.num_moved;
+    fs->defrag.rate = blocks_per_second;
+    fs->defrag.stopping = 0;
+
+    //visit files in order of their first block, so that files that are
+    //already low in the pool do not move
+    int order[MAX_INODES], count = 0;
+    for(int i=0; i<fs->num_inodes; i++){
+        if(!fs->inode_bitmap[i] || i == fs->root_inode_number) continue;
+        int k = count++;
+        while(k > 0 && first_block_of(&fs->inodes[order[k-1]]) > first_block_of(&fs->inodes[i])){
+            order[k] = order[k-1];
+            k--;
+        }
+        order[k] = i;
+    }
+
+    //next: the lowest block number that does not hold its final block yet
+    int next = 0;
+    for(int k=0; k<count && !fs->defrag.stopping; k++){
+        struct inode *node = &fs->inodes[order[k]];
+        for(int i=0; i<NUM_POINTERS && !fs->defrag.stopping; i++){
+            if(node->block[i] < 0) continue;
+
+            //step over blocks that cannot be moved out of the way (the root
+            //directory, shared blocks)
+            int owner_index;
+            while(next < fs->num_dblocks && fs->data_bitmap[next] && node->block[i] != next
+                && (fs->data_refcount[next] != 1 || owner_of(fs, next, &owner_index) == fs->root_inode_number)){
+                next++;
+            }
+            if(next >= fs->num_dblocks) break;
+
+            if(slide_block(fs, order[k], i, next) == 0) next++;
+        }
+    }
+
+    fs->defrag.num_passes++;
+
+    return fs->defrag.num_moved - moved_before;
+}
+
+//make a running RSFS_defrag return after the block it is moving
+void RSFS_defrag_stop(rsfs_t *fs){
+    fs->defrag.stopping = 1;
+}
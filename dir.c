@@ -1,44 +1,41 @@
 /*
-    allocation of global variable root_dir (root directory); 
+    management of the root directory (kept in struct rsfs); 
     routines for directory management
 */
 
 
 #include "def.h"
 
-//global variable
-pthread_mutex_t root_dir_mutex;
-struct inode *root_inode = NULL;
-void *root_data_block = NULL;
-
-
-
 //helper function: search for dir entry matching provided file_name
-struct dir_entry *search_dir_internal(char file_name){
+struct dir_entry *search_dir_internal(rsfs_t *fs, char file_name){
 
-    //get the inode for root directory if not assigned yet
-    if(root_inode == NULL){
-        root_inode = &inodes[root_inode_number];
+    struct inode *root_inode = &fs->inodes[fs->root_inode_number];
 
-        int root_data_block_number = allocate_data_block();
+    //allocate the data block for root directory if not allocated yet
+    if(root_inode->block[0] < 0){
+        int root_data_block_number = allocate_data_block(fs);
         if(root_data_block_number<0){
             printf("[search_dir_internal] fail to get root_data_block_number.\n");
             return NULL;
         }
-        root_data_block = data_blocks[root_data_block_number];
+        char *root_data_block = pin_block(fs, root_data_block_number);
+        fs->root_data_block_pinned = root_data_block_number;
         root_inode->block[0]=root_data_block_number;
+        memset(root_data_block, 0, BLOCK_SIZE); //no entries yet
+        mark_block_dirty(fs, root_data_block_number);
         printf("[search_dir_internal] got root_data_block_number = %d\n", root_data_block_number);
     } 
 
-    //get the data block for root directory if not assigned to variable root_data_block yet
-    if(root_data_block == NULL){
-        int root_data_block_number = root_inode->block[0];
-        root_data_block = data_blocks[root_data_block_number];
+    //pin the data block for root directory if not pinned yet
+    if(fs->root_data_block_pinned < 0){
+        fs->root_data_block_pinned = root_inode->block[0];
+        pin_block(fs, fs->root_data_block_pinned);
     }
 
     //search file_name in the entries 
+    struct dir_entry *entries = root_dir_entries(fs);
     for(int i=0; i<BLOCK_SIZE/sizeof(struct dir_entry); i++){
-        struct dir_entry *dir_entry = (struct dir_entry *)root_data_block + i;
+        struct dir_entry *dir_entry = &entries[i];
         if(dir_entry->name == file_name) return dir_entry;     
     }
     
@@ -48,13 +45,13 @@ struct dir_entry *search_dir_internal(char file_name){
 
 
 //search for the dir_entry for provided file_name
-struct dir_entry *search_dir(char file_name){    
+struct dir_entry *search_dir(rsfs_t *fs, char file_name){    
 
-    pthread_mutex_lock(&root_dir_mutex);
+    metrics_lock(fs, &fs->root_dir_mutex, LOCK_ROOT_DIR);
 
-    struct dir_entry *dir_entry = search_dir_internal(file_name);
+    struct dir_entry *dir_entry = search_dir_internal(fs, file_name);
     
-    pthread_mutex_unlock(&root_dir_mutex);
+    metrics_unlock(fs, &fs->root_dir_mutex, LOCK_ROOT_DIR);
 
     return dir_entry;
 }
@@ -62,47 +59,51 @@ struct dir_entry *search_dir(char file_name){
 
 //insert an entry with provided (file_name, inode_number) and return it;
 //if such entry exists already, return it directly
-struct dir_entry *insert_dir(char file_name, char inode_number){
+struct dir_entry *insert_dir(rsfs_t *fs, char file_name, char inode_number){
     
-    pthread_mutex_lock(&root_dir_mutex);
+    metrics_lock(fs, &fs->root_dir_mutex, LOCK_ROOT_DIR);
 
 
     //search for the entry
-    struct dir_entry *dir_entry = search_dir_internal(file_name);
+    struct dir_entry *dir_entry = search_dir_internal(fs, file_name);
+    struct inode *root_inode = &fs->inodes[fs->root_inode_number];
     
     if(!dir_entry && root_inode->length<BLOCK_SIZE/sizeof(struct dir_entry)){//if not found and there is space to add an entry
         
         //find an empty entry
-        dir_entry = search_dir_internal(0); //find an entry where name = 0 or '\0'
+        dir_entry = search_dir_internal(fs, 0); //find an entry where name = 0 or '\0'
 
         //construct a new dir_entry
         if(dir_entry==NULL){
             printf("[insert_dir] fail to allocate a space for dir_entry.\n");
-            pthread_mutex_unlock(&root_dir_mutex);
+            metrics_unlock(fs, &fs->root_dir_mutex, LOCK_ROOT_DIR);
             return NULL;
         }
         dir_entry->name = file_name;
         dir_entry->inode_number = inode_number;
+        mark_block_dirty(fs, root_inode->block[0]);
+        stats_dir(fs, dir_entry_slot(fs, dir_entry), file_name, inode_number);
         
         //update the inode
         root_inode->length += 1;
     } 
 
-    pthread_mutex_unlock(&root_dir_mutex);
+    metrics_unlock(fs, &fs->root_dir_mutex, LOCK_ROOT_DIR);
 
     return dir_entry;
 }
 
 //delete the entry matching provided file_name if it exists;
 //return 0 if succeed (found and deleted) or -1 if errs
-int delete_dir(char file_name){
+int delete_dir(rsfs_t *fs, char file_name){
 
-    pthread_mutex_lock(&root_dir_mutex);
+    metrics_lock(fs, &fs->root_dir_mutex, LOCK_ROOT_DIR);
 
     int ret = -1;
 
     //search for the matching dir_entry
-    struct dir_entry *dir_entry = search_dir_internal(file_name); 
+    struct dir_entry *dir_entry = search_dir_internal(fs, file_name); 
+    struct inode *root_inode = &fs->inodes[fs->root_inode_number];
 
     //if found, delete it
     if(dir_entry){
@@ -110,6 +111,8 @@ int delete_dir(char file_name){
         //mark this entry as not used (empty)
         dir_entry->name = 0;
         dir_entry->inode_number = 0;
+        mark_block_dirty(fs, root_inode->block[0]);
+        stats_dir(fs, dir_entry_slot(fs, dir_entry), 0, 0);
 
         //update the inode
         root_inode->length -= 1;
@@ -117,8 +120,63 @@ int delete_dir(char file_name){
         ret = 0;
     }
 
-    pthread_mutex_unlock(&root_dir_mutex);
+    metrics_unlock(fs, &fs->root_dir_mutex, LOCK_ROOT_DIR);
 
     return ret;
 }
 
+
+
+//return the index of dir_entry within the root directory block
+int dir_entry_slot(rsfs_t *fs, struct dir_entry *dir_entry){
+    return dir_entry - root_dir_entries(fs);
+}
+
+//overwrite the directory slot with (name, inode_number) and keep the
+//entry count of the root inode in sync; used when replaying the journal
+void set_dir_entry(rsfs_t *fs, int slot, char name, char inode_number){
+
+    metrics_lock(fs, &fs->root_dir_mutex, LOCK_ROOT_DIR);
+
+    search_dir_internal(fs, 0); //make sure the root directory block exists
+    struct inode *root_inode = &fs->inodes[fs->root_inode_number];
+
+    struct dir_entry *dir_entry = &root_dir_entries(fs)[slot];
+    if(dir_entry->name != 0) root_inode->length -= 1;
+    dir_entry->name = name;
+    dir_entry->inode_number = inode_number;
+    if(name != 0) root_inode->length += 1;
+    mark_block_dirty(fs, root_inode->block[0]);
+    stats_dir(fs, slot, name, inode_number);
+
+    metrics_unlock(fs, &fs->root_dir_mutex, LOCK_ROOT_DIR);
+}
+
+//unpin the root directory block and pin it again as looked up from
+//root_inode_number (used after RSFS_restore replaced the inodes, and when a
+//block cache is attached or detached)
+void reset_root_dir(rsfs_t *fs){
+
+    metrics_lock(fs, &fs->root_dir_mutex, LOCK_ROOT_DIR);
+
+    if(fs->root_data_block_pinned >= 0) unpin_block(fs, fs->root_data_block_pinned, 1);
+
+    struct inode *root_inode = &fs->inodes[fs->root_inode_number];
+    fs->root_data_block_pinned = -1;
+    if(root_inode->block[0] >= 0){
+        fs->root_data_block_pinned = root_inode->block[0];
+        pin_block(fs, fs->root_data_block_pinned);
+    }
+
+    metrics_unlock(fs, &fs->root_dir_mutex, LOCK_ROOT_DIR);
+
+    stats_rebuild(fs); //the state may have been replaced as a whole
+}
+
+//entries of the root directory block, which stays pinned while in use; the
+//address is derived from the block number on every call, so that it is
+//right in every process mapping a shared instance
+struct dir_entry *root_dir_entries(rsfs_t *fs){
+    if(fs->root_data_block_pinned < 0) return NULL;
+    return (struct dir_entry *)pinned_block(fs, fs->root_data_block_pinned);
+}
@@ -0,0 +1,191 @@
+/*
+    event tracing;
+    while RSFS_events_start is on, every thread records timestamped events
+    (call begin and end, lock acquire and release, block alloc and free,
+    rw_cond wait begin and end) into a ring of its own without taking a lock
+    or calling stdio; RSFS_events_dump exports the rings as Chrome
+    trace_event JSON, to be opened in chrome://tracing or Perfetto
+*/
+
+#include "def.h"
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+static __thread int event_tid; //OS thread id of this thread, once looked up
+
+
+//copy event seq of ring into *copy; return 0 if it has been overwritten
+//since, or is still being written
+static int read_event(struct event_ring *ring, long seq, struct event *copy){
+    struct event *event = &ring->events[seq & (EVENT_RING_SIZE - 1)];
+    if(__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != seq + 1) return 0;
+    *copy = *event;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&event->seq, __ATOMIC_RELAXED) == seq + 1;
+}
+
+//write one event as a trace_event object; pid tells the instances apart
+//(0: fs itself, i+1: partition i of a sharded fs)
+static void dump_event(FILE *file, struct event *event, int pid, long start_tick){
+    double ts = (ticks_to_ns(event->tick) - ticks_to_ns(start_tick)) / 1e3;
+    fprintf(file, ",\n{\"pid\":%d,\"tid\":%d,\"ts\":%.3f,", pid, event->thread, ts);
+    switch(event->type){
+        case EVENT_OP_BEGIN:
+            fprintf(file, "\"ph\":\"B\",\"cat\":\"call\",\"name\":\"%s\"}", metrics_op_names[event->id]);
+            break;
+        case EVENT_OP_END:
+            fprintf(file, "\"ph\":\"E\",\"cat\":\"call\",\"name\":\"%s\",\"args\":{\"ret\":%d}}", metrics_op_names[event->id], event->arg);
+            break;
+        //locks are not released in the order they were taken, so each one
+        //gets an async track of its own instead of nesting under the call
+        case EVENT_LOCK_ACQUIRE:
+            fprintf(file, "\"ph\":\"b\",\"cat\":\"lock\",\"name\":\"%s\",\"id\":\"%d.%d.%d\",\"args\":{\"wait_ns\":%d}}",
+                metrics_lock_names[event->id], pid, event->thread, event->id, event->arg);
+            break;
+        case EVENT_LOCK_RELEASE:
+            fprintf(file, "\"ph\":\"e\",\"cat\":\"lock\",\"name\":\"%s\",\"id\":\"%d.%d.%d\"}",
+                metrics_lock_names[event->id], pid, event->thread, event->id);
+            break;
+        case EVENT_BLOCK_ALLOC:
+        case EVENT_BLOCK_FREE:
+            fprintf(file, "\"ph\":\"i\",\"s\":\"t\",\"cat\":\"block\",\"name\":\"%s\",\"args\":{\"block\":%d}}",
+                event->type == EVENT_BLOCK_ALLOC ? "alloc" : "free", event->arg);
+            break;
+        case EVENT_WAIT_BEGIN:
+        case EVENT_WAIT_END:
+            fprintf(file, "\"ph\":\"%s\",\"cat\":\"wait\",\"name\":\"rw_cond\",\"args\":{\"inode\":%d}}",
+                event->type == EVENT_WAIT_BEGIN ? "B" : "E", event->arg);
+            break;
+    }
+}
+
+//write the events of target (and of its partitions) still in the rings,
+//after a name for its track (the first object of the file for fs itself);
+//return how many
+static long dump_instance(FILE *file, rsfs_t *target, int pid, long start_tick){
+    if(pid == 0) fprintf(file, "\n{\"pid\":0,\"ph\":\"M\",\"name\":\"process_name\",\"args\":{\"name\":\"rsfs\"}}");
+    else fprintf(file, ",\n{\"pid\":%d,\"ph\":\"M\",\"name\":\"process_name\",\"args\":{\"name\":\"shard %d\"}}", pid, pid - 1);
+
+    long num_dumped = 0;
+    for(int t=0; target->events.rings && t<METRICS_MAX_THREADS; t++){
+        struct event_ring *ring = &target->events.rings[t];
+        long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for(long seq = head > EVENT_RING_SIZE ? head - EVENT_RING_SIZE : 0; seq < head; seq++){
+            struct event event;
+            if(!read_event(ring, seq, &event)) continue;
+            dump_event(file, &event, pid, start_tick);
+            num_dumped++;
+        }
+    }
+    for(int i=0; i<target->num_shards; i++) num_dumped += dump_instance(file, target->shards[i], i + 1, start_tick);
+    return num_dumped;
+}
+
+
+
+//------ routines called by the instrumented paths ---------------------------------------------------------------------
+
+//record an event at time-stamp counter reading tick, in the ring of the
+//calling thread, if recording
+void event_record_at(rsfs_t *fs, long tick, int type, int id, int arg){
+    if(!__atomic_load_n(&fs->events.active, __ATOMIC_ACQUIRE)) return;
+    if(event_tid == 0) event_tid = syscall(SYS_gettid);
+
+    int index = metrics_thread_index(fs);
+    struct event_ring *ring = &fs->events.rings[index];
+    long seq;
+    if(index == METRICS_MAX_THREADS - 1) seq = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED); //shared by the late threads
+    else{
+        seq = ring->head;
+        __atomic_store_n(&ring->head, seq + 1, __ATOMIC_RELAXED);
+    }
+
+    //mark the slot incomplete while it is filled in, so that a dump racing
+    //with this thread skips it instead of reading a torn event
+    struct event *event = &ring->events[seq & (EVENT_RING_SIZE - 1)];
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->tick = tick;
+    event->thread = event_tid;
+    event->arg = arg;
+    event->type = type;
+    event->id = id;
+    __atomic_store_n(&event->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+//record an event now
+void event_record(rsfs_t *fs, int type, int id, int arg){
+    if(!fs->events.active) return; //checked first so that the clock is not read for nothing
+    event_record_at(fs, __rdtsc(), type, id, arg);
+}
+
+//release the rings of fs (its partitions release their own)
+void events_free(rsfs_t *fs){
+    fs->events.active = 0;
+    free(fs->events.rings);
+    fs->events.rings = NULL;
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//start recording events of every thread using fs (and its partitions) into
+//fresh rings; each thread keeps its last EVENT_RING_SIZE events;
+//return 0 if succeed; otherwise return a negative value
+int RSFS_events_start(rsfs_t *fs){
+    char *debug_title = "[RSFS_events_start]";
+
+    if(shm_refuse(fs, debug_title) < 0) return -1;
+    if(fs->events.active){
+        printf("%s events are already being recorded.\n", debug_title);
+        return -1;
+    }
+    if(fs->events.rings == NULL) fs->events.rings = malloc(METRICS_MAX_THREADS * sizeof(struct event_ring));
+    if(fs->events.rings == NULL){
+        printf("%s fail to allocate the rings.\n", debug_title);
+        return -2;
+    }
+    memset(fs->events.rings, 0, METRICS_MAX_THREADS * sizeof(struct event_ring));
+    fs->events.start_tick = __rdtsc();
+    for(int i=0; i<fs->num_shards; i++){
+        if(RSFS_events_start(fs->shards[i]) < 0){
+            while(i--) RSFS_events_stop(fs->shards[i]);
+            return -2;
+        }
+    }
+    __atomic_store_n(&fs->events.active, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//stop recording; the events stay in the rings until the next
+//RSFS_events_start or RSFS_destroy
+void RSFS_events_stop(rsfs_t *fs){
+    for(int i=0; i<fs->num_shards; i++) RSFS_events_stop(fs->shards[i]);
+    __atomic_store_n(&fs->events.active, 0, __ATOMIC_RELEASE);
+}
+
+//write the events in the rings of fs (and of its partitions) to path as
+//Chrome trace_event JSON, times in us since RSFS_events_start; recording may
+//go on meanwhile; return the number of events written, or -1 if path cannot
+//be written
+long RSFS_events_dump(rsfs_t *fs, const char *path){
+    char *debug_title = "[RSFS_events_dump]";
+
+    FILE *file = fopen(path, "w");
+    if(file == NULL){
+        printf("%s fail to open %s.\n", debug_title, path);
+        return -1;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    long num_dumped = dump_instance(file, fs, 0, fs->events.start_tick);
+    fprintf(file, "\n]}\n");
+
+    int failed = ferror(file);
+    if(fclose(file) != 0 || failed){
+        printf("%s fail to write %s.\n", debug_title, path);
+        return -1;
+    }
+    return num_dumped;
+}
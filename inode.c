@@ -1,60 +1,129 @@
 /*
     allocation of inodes, inode bitmap, and mutexes to guard them;
-    routines for inode management
+    routines for inode management;
+    the table starts with NUM_INODES inodes and grows by INODE_CHUNK inodes;
+    num_inodes is a limit on the inodes in use (inodes[] is sized to
+    MAX_INODES), and it never shrinks
 */
 
 #include "def.h"
+#include <sched.h>
 
 
-//allocation of inodes, inode bitmap and their mutexes
-struct inode inodes[NUM_INODES];
-pthread_mutex_t inodes_mutex;
-int inode_bitmap[NUM_INODES];
-pthread_mutex_t inode_bitmap_mutex;
+//extend the table by a chunk (inode_bitmap_mutex held); the inodes are part
+//of struct rsfs, so this only widens the range in use and no inode moves;
+//return -1 at MAX_INODES
+static int grow_inodes_locked(rsfs_t *fs){
+    if(fs->num_inodes >= MAX_INODES) return -1;
+    fs->num_inodes += INODE_CHUNK;
+    if(fs->num_inodes > MAX_INODES) fs->num_inodes = MAX_INODES;
+    fs->num_grows++;
+    stats_table_size(fs);
+    return 0;
+}
 
-//root inode number, which should be known globally
-int root_inode_number=-1;
+//grow the table until it has at least num_inodes inodes (used when a journal
+//or checkpoint refers to inodes beyond the current table); return 0 if succeed
+int grow_inodes(rsfs_t *fs, int num_inodes){
+    int ret = 0;
+    metrics_lock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+    while(fs->num_inodes < num_inodes && ret == 0) ret = grow_inodes_locked(fs);
+    metrics_unlock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+    return ret;
+}
 
 //to allocate an empty inode and return the inode-number; 
-//if no free inode is available, return -1
-int allocate_inode(){
+//if no free inode is available and the table cannot grow, return -1
+int allocate_inode(rsfs_t *fs){
 
     int inode_number=-1; //init 
 
-    pthread_mutex_lock(&inode_bitmap_mutex);
+    metrics_lock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
 
-    for(int i=0; i<NUM_INODES; i++){
-        if(inode_bitmap[i]==0){//find an empty inode
+    for(int i=0; inode_number<0; i++){
+        if(i == fs->num_inodes && grow_inodes_locked(fs) < 0) break; //full
+        if(fs->inode_bitmap[i]==0){//find an empty inode
             
             inode_number=i;
-            inode_bitmap[i]=1; //mark it as allocated
+            fs->inode_bitmap[i]=1; //mark it as allocated
+            stats_inodes(fs, 1);
             
             //initialize the inode
-            inodes[i].length=0;
-            for(int j=0; j<NUM_POINTERS; j++) inodes[i].block[j]=-1;
+            fs->inodes[i].length=0;
+            for(int j=0; j<NUM_POINTERS; j++) fs->inodes[i].block[j]=-1;
+            fs->inodes[i].flags=0;
+            for(int j=0; j<COMPRESS_MAX_CHUNKS; j++) fs->inodes[i].chunk_len[j]=0;
+            fs->inodes[i].version=compress_new_version(fs);
 
             // initialize the mutex and condition variable for this inode
-            pthread_mutex_init(&inodes[i].rw_mutex, NULL);
-            pthread_cond_init(&inodes[i].rw_cond, NULL);
-            inodes[i].reader_count = 0;
-            inodes[i].writer_active = 0;
-            
-            break;
+            shm_mutex_init(fs, &fs->inodes[i].rw_mutex);
+            shm_cond_init(fs, &fs->inodes[i].rw_cond);
+            fs->inodes[i].reader_count = 0;
+            fs->inodes[i].writer_active = 0;
         }
     }
 
-    pthread_mutex_unlock(&inode_bitmap_mutex);
+    metrics_unlock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
 
     return inode_number;
 }
 
 //to free an inode with provided inode_number - require students to implement this???
-void free_inode(int inode_number){
+void free_inode(rsfs_t *fs, int inode_number){
 
-    pthread_mutex_lock(&inode_bitmap_mutex);
+    metrics_lock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
     
-    inode_bitmap[inode_number]=0; //mark it as available
+    fs->inode_bitmap[inode_number]=0; //mark it as available
+    stats_inodes(fs, -1);
     
-    pthread_mutex_unlock(&inode_bitmap_mutex);
+    metrics_unlock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+}
+
+
+//the length and block map of an inode are changed by the writer of its file
+//and by RSFS_delete (which does not wait for the writer to close), and read
+//by RSFS_read and RSFS_fseek through inode_meta_read; a change is bracketed
+//by inode_meta_begin and inode_meta_end, which make meta_seq odd while it is
+//under way. begin takes the count from even to odd with a compare-and-swap,
+//so two changes of one inode never overlap
+void inode_meta_begin(struct inode *node){
+    for(;;){
+        unsigned int seq = __atomic_load_n(&node->meta_seq, __ATOMIC_RELAXED);
+        if(!(seq & 1) && __atomic_compare_exchange_n(&node->meta_seq, &seq, seq + 1, 0,
+                                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        sched_yield(); //another change is under way
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE); //the odd count is visible before any change
 }
 
+void inode_meta_end(struct inode *node){
+    __atomic_store_n(&node->meta_seq, node->meta_seq + 1, __ATOMIC_RELEASE);
+}
+
+//wait until no change of the length and block map of node is under way, and
+//return the sequence count to hand to inode_meta_changed
+unsigned int inode_meta_seq(struct inode *node){
+    for(;;){
+        unsigned int seq = __atomic_load_n(&node->meta_seq, __ATOMIC_ACQUIRE);
+        if(!(seq & 1)) return seq;
+        sched_yield(); //let the writer finish
+    }
+}
+
+//whether a change was started since inode_meta_seq returned seq, so what was
+//loaded in between may be torn
+int inode_meta_changed(struct inode *node, unsigned int seq){
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&node->meta_seq, __ATOMIC_RELAXED) != seq;
+}
+
+//copy the length and block map of node into *meta as they were between two
+//changes; readers only load, so they do not bounce the inode between cores
+void inode_meta_read(struct inode *node, struct inode_meta *meta){
+    unsigned int seq;
+    do{
+        seq = inode_meta_seq(node);
+        meta->length = node->length;
+        memcpy(meta->block, node->block, NUM_POINTERS);
+    }while(inode_meta_changed(node, seq));
+}
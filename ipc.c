@@ -0,0 +1,404 @@
+/*
+    local IPC;
+    a server thread accepts clients on a Unix domain socket; each client gets
+    a shared memory buffer (a memfd passed over the socket), so calls travel
+    through the socket as small fixed-size messages while the data of
+    RSFS_append/RSFS_write/RSFS_read is read and written in place by the server
+*/
+
+#define _GNU_SOURCE //memfd_create
+#include "def.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+//send or receive exactly size bytes; return 0 if succeed
+static int send_all(int sock, const void *data, int size){
+    for(int done=0; done<size; ){
+        int n = send(sock, (const char *)data + done, size - done, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int recv_all(int sock, void *data, int size){
+    for(int done=0; done<size; ){
+        int n = recv(sock, (char *)data + done, size - done, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+//fill addr with socket_path; return -1 if the path is too long
+static int socket_address(struct sockaddr_un *addr, const char *socket_path){
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(addr->sun_path)) return -1;
+    strcpy(addr->sun_path, socket_path);
+    return 0;
+}
+
+
+
+//------ server --------------------------------------------------------------------------------------------------------
+
+//one connected client
+struct ipc_connection{
+    rsfs_t *fs;
+    int slot; //index in server.client_socks
+    int sock;
+    char *buf; //shared data buffer
+    char owned[NUM_OPEN_FILE]; //1 for the fds this client opened
+};
+
+//run one call on behalf of a client; a client may only use the fds it opened
+static int serve_request(struct ipc_connection *conn, struct ipc_request *req){
+    rsfs_t *fs = conn->fs;
+    int fd_valid = req->fd >= 0 && req->fd < NUM_OPEN_FILE && conn->owned[req->fd];
+    int size = req->arg < 0 || req->arg > IPC_BUF_SIZE ? -1 : req->arg;
+    int ret;
+
+    switch(req->op){
+        case IPC_CREATE: return RSFS_create_ex(fs, req->name, req->arg);
+        case IPC_DELETE: return RSFS_delete(fs, req->name);
+        case IPC_CLONE: return RSFS_clone(fs, req->name, req->name2);
+        case IPC_OPEN:
+            ret = RSFS_open(fs, req->name, req->arg);
+            if(ret >= 0 && ret < NUM_OPEN_FILE) conn->owned[ret] = 1;
+            return ret;
+    }
+
+    if(!fd_valid) return -1;
+    switch(req->op){
+        case IPC_APPEND: return size < 0 ? -1 : RSFS_append(fs, req->fd, conn->buf, size);
+        case IPC_WRITE: return size < 0 ? -1 : RSFS_write(fs, req->fd, conn->buf, size);
+        case IPC_READ: return size < 0 ? -1 : RSFS_read(fs, req->fd, conn->buf, size);
+        case IPC_FSEEK: return RSFS_fseek(fs, req->fd, req->arg);
+        case IPC_CUT: return RSFS_cut(fs, req->fd, req->arg);
+        case IPC_FLUSH: return RSFS_flush(fs, req->fd);
+        case IPC_CLOSE:
+            ret = RSFS_close(fs, req->fd);
+            if(ret == 0) conn->owned[req->fd] = 0;
+            return ret;
+    }
+    return -1;
+}
+
+//serve the calls of one client until it disconnects; files it left open
+//are closed
+static void *connection_thread(void *ptr){
+    struct ipc_connection *conn = ptr;
+    rsfs_t *fs = conn->fs;
+
+    struct ipc_request req;
+    while(recv_all(conn->sock, &req, sizeof(req)) == 0){
+        struct ipc_response resp;
+        resp.ret = serve_request(conn, &req);
+        __sync_fetch_and_add(&fs->server.num_requests, 1);
+        if(send_all(conn->sock, &resp, sizeof(resp)) < 0) break;
+    }
+
+    for(int i=0; i<NUM_OPEN_FILE; i++){
+        if(conn->owned[i]) RSFS_close(fs, i);
+    }
+    munmap(conn->buf, IPC_BUF_SIZE);
+    close(conn->sock);
+
+    pthread_mutex_lock(&fs->server.mutex);
+    fs->server.client_socks[conn->slot] = -1;
+    fs->server.num_clients--;
+    pthread_cond_broadcast(&fs->server.client_exited);
+    pthread_mutex_unlock(&fs->server.mutex);
+
+    free(conn);
+    return NULL;
+}
+
+//create the shared buffer of a new client and pass it over the socket;
+//return the mapped buffer, or NULL on failure
+static char *share_buffer(int sock){
+    int memfd = memfd_create("rsfs_ipc", MFD_CLOEXEC);
+    if(memfd < 0) return NULL;
+    char *buf = NULL;
+    if(ftruncate(memfd, IPC_BUF_SIZE) == 0){
+        buf = mmap(NULL, IPC_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if(buf == MAP_FAILED) buf = NULL;
+    }
+
+    //the descriptor travels as SCM_RIGHTS ancillary data of a 1-byte message
+    char byte = buf ? 1 : 0;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(buf){
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    }
+    if(sendmsg(sock, &msg, MSG_NOSIGNAL) != 1 && buf){
+        munmap(buf, IPC_BUF_SIZE);
+        buf = NULL;
+    }
+
+    close(memfd);
+    return buf;
+}
+
+//accept clients and start a connection thread for each
+static void *accept_thread(void *ptr){
+    rsfs_t *fs = ptr;
+
+    while(!fs->server.stopping){
+        int sock = accept(fs->server.listen_fd, NULL, NULL);
+        if(sock < 0){
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            break; //the listening socket was shut down
+        }
+
+        pthread_mutex_lock(&fs->server.mutex);
+        int slot = -1;
+        for(int i=0; i<IPC_MAX_CLIENTS && slot<0; i++){
+            if(fs->server.client_socks[i] < 0) slot = i;
+        }
+        if(slot >= 0){
+            fs->server.client_socks[slot] = sock;
+            fs->server.num_clients++;
+        }
+        pthread_mutex_unlock(&fs->server.mutex);
+
+        struct ipc_connection *conn = slot >= 0 ? calloc(1, sizeof(struct ipc_connection)) : NULL;
+        char *buf = conn ? share_buffer(sock) : NULL;
+        pthread_t thread;
+        if(buf){
+            conn->fs = fs;
+            conn->slot = slot;
+            conn->sock = sock;
+            conn->buf = buf;
+            if(pthread_create(&thread, NULL, connection_thread, conn) == 0){
+                pthread_detach(thread);
+                continue;
+            }
+            munmap(buf, IPC_BUF_SIZE);
+        }
+
+        //too many clients, or out of resources
+        printf("[rsfs server] fail to accept a client.\n");
+        free(conn);
+        close(sock);
+        if(slot >= 0){
+            pthread_mutex_lock(&fs->server.mutex);
+            fs->server.client_socks[slot] = -1;
+            fs->server.num_clients--;
+            pthread_mutex_unlock(&fs->server.mutex);
+        }
+    }
+
+    return NULL;
+}
+
+
+
+//------ client --------------------------------------------------------------------------------------------------------
+
+//send a call and wait for its result; in_buf (size bytes) is placed in the
+//shared buffer before the call, and out_buf receives ret bytes of it after;
+//return the result of the call, or -1 if the connection is lost
+static int remote_call(rsfs_t *fs, struct ipc_request *req, const void *in_buf, void *out_buf, int size){
+    struct ipc_response resp;
+
+    pthread_mutex_lock(&fs->remote.mutex);
+    if(in_buf) memcpy(fs->remote.buf, in_buf, size);
+    int failed = send_all(fs->remote.sock, req, sizeof(*req)) < 0 || recv_all(fs->remote.sock, &resp, sizeof(resp)) < 0;
+    if(!failed && out_buf && resp.ret > 0) memcpy(out_buf, fs->remote.buf, resp.ret);
+    pthread_mutex_unlock(&fs->remote.mutex);
+
+    if(failed){
+        printf("[remote] connection to the server is lost.\n");
+        return -1;
+    }
+    return resp.ret;
+}
+
+int remote_create(rsfs_t *fs, char file_name, int flags){
+    struct ipc_request req = {IPC_CREATE, -1, flags, file_name, 0};
+    return remote_call(fs, &req, NULL, NULL, 0);
+}
+
+int remote_delete(rsfs_t *fs, char file_name){
+    struct ipc_request req = {IPC_DELETE, -1, 0, file_name, 0};
+    return remote_call(fs, &req, NULL, NULL, 0);
+}
+
+int remote_open(rsfs_t *fs, char file_name, int access_flag){
+    struct ipc_request req = {IPC_OPEN, -1, access_flag, file_name, 0};
+    return remote_call(fs, &req, NULL, NULL, 0);
+}
+
+int remote_clone(rsfs_t *fs, char src_name, char dst_name){
+    struct ipc_request req = {IPC_CLONE, -1, 0, src_name, dst_name};
+    return remote_call(fs, &req, NULL, NULL, 0);
+}
+
+int remote_fd_call(rsfs_t *fs, int op, int fd, int arg){
+    struct ipc_request req = {op, fd, arg, 0, 0};
+    return remote_call(fs, &req, NULL, NULL, 0);
+}
+
+//RSFS_append/RSFS_write/RSFS_read in pieces of at most IPC_BUF_SIZE bytes;
+//return the total number of bytes transferred (or the error of the first piece)
+int remote_io(rsfs_t *fs, int op, int fd, void *buf, int size){
+    if(size < 0) return remote_fd_call(fs, op, fd, size); //let the server reject it
+
+    int done = 0;
+    do{
+        int piece = size - done < IPC_BUF_SIZE ? size - done : IPC_BUF_SIZE;
+        struct ipc_request req = {op, fd, piece, 0, 0};
+        char *data = (char *)buf + done;
+        int ret = remote_call(fs, &req, op == IPC_READ ? NULL : data, op == IPC_READ ? data : NULL, piece);
+        if(ret < 0) return done ? done : ret;
+        done += ret;
+        if(ret < piece) break;
+    } while(done < size);
+
+    return done;
+}
+
+//close the connection; the server closes the files left open
+void remote_disconnect(rsfs_t *fs){
+    munmap(fs->remote.buf, IPC_BUF_SIZE);
+    close(fs->remote.sock);
+    pthread_mutex_destroy(&fs->remote.mutex);
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//serve fs on a Unix domain socket at socket_path (an old socket file there
+//is replaced); return 0 if succeed
+int RSFS_serve_start(rsfs_t *fs, const char *socket_path){
+    char *debug_title = "[RSFS_serve_start]";
+
+    struct sockaddr_un addr;
+    if(fs->server.active || socket_address(&addr, socket_path) < 0){
+        printf("%s already serving, or invalid socket path.\n", debug_title);
+        return -1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listen_fd < 0) return -1;
+    unlink(socket_path);
+    if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, IPC_MAX_CLIENTS) < 0){
+        printf("%s fail to listen on %s.\n", debug_title, socket_path);
+        close(listen_fd);
+        return -1;
+    }
+
+    fs->server.listen_fd = listen_fd;
+    strcpy(fs->server.path, socket_path);
+    fs->server.stopping = 0;
+    fs->server.num_clients = 0;
+    fs->server.num_requests = 0;
+    for(int i=0; i<IPC_MAX_CLIENTS; i++) fs->server.client_socks[i] = -1;
+    shm_mutex_init(fs, &fs->server.mutex);
+    shm_cond_init(fs, &fs->server.client_exited);
+
+    if(pthread_create(&fs->server.thread, NULL, accept_thread, fs) != 0){
+        close(listen_fd);
+        unlink(socket_path);
+        return -1;
+    }
+    fs->server.active = 1;
+
+    return 0;
+}
+
+//stop accepting clients, disconnect the connected ones (closing the files
+//they left open), and remove the socket file
+void RSFS_serve_stop(rsfs_t *fs){
+    if(!fs->server.active) return;
+
+    fs->server.stopping = 1;
+    shutdown(fs->server.listen_fd, SHUT_RDWR); //wakes up accept()
+    pthread_join(fs->server.thread, NULL);
+
+    pthread_mutex_lock(&fs->server.mutex);
+    for(int i=0; i<IPC_MAX_CLIENTS; i++){
+        if(fs->server.client_socks[i] >= 0) shutdown(fs->server.client_socks[i], SHUT_RDWR);
+    }
+    while(fs->server.num_clients > 0) pthread_cond_wait(&fs->server.client_exited, &fs->server.mutex);
+    pthread_mutex_unlock(&fs->server.mutex);
+
+    close(fs->server.listen_fd);
+    unlink(fs->server.path);
+    fs->server.active = 0;
+}
+
+//connect to the server at socket_path; the returned instance is used with
+//the usual calls (RSFS_create, RSFS_open, RSFS_read, ... and RSFS_destroy to
+//disconnect), which run on the server's file system; return NULL on failure
+rsfs_t *RSFS_connect(const char *socket_path){
+    char *debug_title = "[RSFS_connect]";
+
+    struct sockaddr_un addr;
+    if(socket_address(&addr, socket_path) < 0) return NULL;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock < 0) return NULL;
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        printf("%s fail to connect to %s.\n", debug_title, socket_path);
+        close(sock);
+        return NULL;
+    }
+
+    //receive the shared buffer
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    char *buf = NULL;
+    if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == 1 && byte == 1){
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+            int memfd;
+            memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+            buf = mmap(NULL, IPC_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+            if(buf == MAP_FAILED) buf = NULL;
+            close(memfd);
+        }
+    }
+
+    rsfs_t *fs = buf ? calloc(1, sizeof(rsfs_t)) : NULL;
+    if(fs == NULL){
+        printf("%s the server refused the connection.\n", debug_title);
+        if(buf) munmap(buf, IPC_BUF_SIZE);
+        close(sock);
+        return NULL;
+    }
+
+    fs->remote.active = 1;
+    fs->remote.sock = sock;
+    fs->remote.buf = buf;
+    pthread_mutex_init(&fs->remote.mutex, NULL);
+    trace_init(fs);
+    metrics_init(fs);
+
+    return fs;
+}
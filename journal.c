@@ -0,0 +1,621 @@
+/*
+    redo journal for metadata (inode bitmap, data bitmap, inodes, directory);
+    transactions of concurrent API calls are batched and flushed together
+    by a committer thread (group commit), and replayed on RSFS_journal_open;
+    data blocks are not logged: they live on the block device, which is
+    synced before every batch (ordered mode), and the journal is rewritten
+    as a snapshot once it grows past JOURNAL_COMPACT_SIZE
+*/
+
+#include "def.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#define JOURNAL_MAGIC 0x5253464a //"RSFJ"
+#define JOURNAL_COMPACT_SIZE (16*JOURNAL_BUF_SIZE) //journal size that triggers a compaction
+#define JOURNAL_COMPACT_WAIT_US 1000 //how long the committer waits for the mutators to pause
+
+//on-disk header in front of the records of every transaction
+struct journal_txn_header{
+    unsigned int magic;
+    unsigned int seq;
+    unsigned int num_records;
+    unsigned int checksum; //checksum of the records following the header
+};
+
+
+//current time in microseconds
+static long now_us(){
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000000L + tv.tv_usec;
+}
+
+//FNV-1a over the records of a transaction
+static unsigned int journal_checksum(void *data, int size){
+    unsigned int h = 2166136261u;
+    unsigned char *p = (unsigned char *)data;
+    for(int i=0; i<size; i++){
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+//write the whole buffer, retrying on short writes
+static int write_all(int fd, char *buf, int size){
+    int done = 0;
+    while(done < size){
+        int ret = write(fd, buf+done, size-done);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+
+
+//------ logging routines called by the API ----------------------------------------------------------------------------
+
+void journal_txn_begin(struct journal_txn *txn){
+    txn->num_records = 0;
+}
+
+static struct journal_record *journal_new_record(struct journal_txn *txn, int type, int index){
+    if(txn->num_records >= JOURNAL_MAX_TXN_RECORDS){
+        printf("[journal] too many records in one transaction.\n");
+        return NULL;
+    }
+    struct journal_record *record = &txn->records[txn->num_records++];
+    memset(record, 0, sizeof(struct journal_record));
+    record->type = type;
+    record->index = index;
+    return record;
+}
+
+//log the current length and block pointers of an allocated inode
+void journal_log_inode(rsfs_t *fs, struct journal_txn *txn, int inode_number){
+    if(!fs->journal.active) return;
+    struct journal_record *record = journal_new_record(txn, JR_INODE, inode_number);
+    if(record == NULL) return;
+    record->value = fs->inodes[inode_number].length;
+    memcpy(record->block, fs->inodes[inode_number].block, NUM_POINTERS);
+    record->flags = fs->inodes[inode_number].flags;
+    memcpy(record->chunk_len, fs->inodes[inode_number].chunk_len, sizeof(record->chunk_len));
+}
+
+void journal_log_inode_free(rsfs_t *fs, struct journal_txn *txn, int inode_number){
+    if(!fs->journal.active) return;
+    journal_new_record(txn, JR_INODE_FREE, inode_number);
+}
+
+void journal_log_dblock(rsfs_t *fs, struct journal_txn *txn, int block_number, int allocated){
+    if(!fs->journal.active) return;
+    struct journal_record *record = journal_new_record(txn, JR_DBLOCK, block_number);
+    if(record == NULL) return;
+    record->value = allocated;
+}
+
+//log the data blocks that are in new_block but not in old_block as
+//allocated, and the ones that disappeared as freed
+void journal_log_blocks_diff(rsfs_t *fs, struct journal_txn *txn, char *old_block, char *new_block){
+    if(!fs->journal.active) return;
+    for(int i=0; i<NUM_POINTERS; i++){
+        if(old_block[i] == new_block[i]) continue;
+        if(old_block[i] >= 0) journal_log_dblock(fs, txn, old_block[i], 0);
+        if(new_block[i] >= 0) journal_log_dblock(fs, txn, new_block[i], 1);
+    }
+}
+
+void journal_log_dirent(rsfs_t *fs, struct journal_txn *txn, struct dir_entry *dir_entry){
+    if(!fs->journal.active || dir_entry == NULL) return;
+    struct journal_record *record = journal_new_record(txn, JR_DIRENT, dir_entry_slot(fs, dir_entry));
+    if(record == NULL) return;
+    record->name = dir_entry->name;
+    record->value = dir_entry->inode_number;
+}
+
+//log that the directory slot of dir_entry becomes empty
+void journal_log_dirent_free(rsfs_t *fs, struct journal_txn *txn, struct dir_entry *dir_entry){
+    if(!fs->journal.active || dir_entry == NULL) return;
+    journal_new_record(txn, JR_DIRENT, dir_entry_slot(fs, dir_entry));
+}
+
+//copy txn into the group-commit buffer and return its sequence number;
+//return 0 if there is nothing to log
+unsigned int journal_txn_queue(rsfs_t *fs, struct journal_txn *txn){
+    return journal_txns_queue(fs, txn, 1);
+}
+
+//copy the records of txns[0..n-1], in order, into the group-commit buffer as
+//one transaction (replayed all or nothing) and return its sequence number;
+//return 0 if there is nothing to log
+unsigned int journal_txns_queue(rsfs_t *fs, struct journal_txn *txns, int n){
+    int num_records = 0;
+    for(int i=0; i<n; i++) num_records += txns[i].num_records;
+    if(!fs->journal.active || num_records == 0) return 0;
+
+    int records_size = num_records * sizeof(struct journal_record);
+    int size = sizeof(struct journal_txn_header) + records_size;
+
+    pthread_mutex_lock(&fs->journal.mutex);
+
+    //wait for the committer to drain the buffer if it is full
+    while(fs->journal.buf_used + size > JOURNAL_BUF_SIZE){
+        pthread_cond_signal(&fs->journal.pending);
+        pthread_cond_wait(&fs->journal.committed, &fs->journal.mutex);
+    }
+
+    char *records = fs->journal.buf + fs->journal.buf_used + sizeof(struct journal_txn_header);
+    for(int i=0, offset=0; i<n; i++){
+        memcpy(records + offset, txns[i].records, txns[i].num_records * sizeof(struct journal_record));
+        offset += txns[i].num_records * sizeof(struct journal_record);
+    }
+
+    struct journal_txn_header header;
+    header.magic = JOURNAL_MAGIC;
+    header.seq = fs->journal.next_seq++;
+    header.num_records = num_records;
+    header.checksum = journal_checksum(records, records_size);
+
+    memcpy(fs->journal.buf + fs->journal.buf_used, &header, sizeof(header));
+    fs->journal.buf_used += size;
+    fs->journal.buf_txns++;
+
+    if(fs->journal.buf_txns == 1 || fs->journal.buf_txns >= fs->journal.max_batch){
+        pthread_cond_signal(&fs->journal.pending);
+    }
+
+    pthread_mutex_unlock(&fs->journal.mutex);
+
+    return header.seq;
+}
+
+//block until the transaction with sequence number seq has been flushed;
+//return 0 if it is durable, or -1 if a flush failed before it got there
+int journal_wait(rsfs_t *fs, unsigned int seq){
+    if(seq == 0) return 0;
+
+    long start = now_us();
+
+    pthread_mutex_lock(&fs->journal.mutex);
+    while(fs->journal.durable_seq < seq && fs->journal.active && !fs->journal.failed){
+        pthread_cond_wait(&fs->journal.committed, &fs->journal.mutex);
+    }
+    int ret = fs->journal.durable_seq < seq ? -1 : 0;
+
+    long waited = now_us() - start;
+    fs->journal.num_txns++;
+    fs->journal.total_wait_us += waited;
+    if(waited > fs->journal.max_wait_us) fs->journal.max_wait_us = waited;
+
+    pthread_mutex_unlock(&fs->journal.mutex);
+
+    return ret;
+}
+
+int journal_txn_commit(rsfs_t *fs, struct journal_txn *txn){
+    return journal_wait(fs, journal_txn_queue(fs, txn));
+}
+
+
+
+static int journal_write_snapshot(rsfs_t *fs, const char *path);
+
+//replace the journal with a snapshot of the current metadata, which holds
+//every transaction queued so far; called by the committer without the
+//journal mutex. a mutating call may be waiting in journal_txns_queue for the
+//committer while it holds mutator_lock shared, so the committer only waits
+//JOURNAL_COMPACT_WAIT_US for the lock and otherwise tries after its next flush
+static void journal_compact(rsfs_t *fs){
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += JOURNAL_COMPACT_WAIT_US * 1000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    if(pthread_rwlock_timedwrlock(&fs->mutator_lock, &deadline) != 0) return;
+
+    //the data of the queued transactions goes first, as for a flush
+    if(cache_sync(fs) < 0 || journal_write_snapshot(fs, fs->journal.path) < 0){
+        printf("[journal] fail to compact %s.\n", fs->journal.path);
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        return;
+    }
+    int fd = open(fs->journal.path, O_WRONLY|O_APPEND);
+    if(fd < 0){
+        printf("[journal] fail to reopen %s after compaction.\n", fs->journal.path);
+        pthread_rwlock_unlock(&fs->mutator_lock);
+        return;
+    }
+    close(fs->journal.fd);
+    fs->journal.fd = fd;
+
+    pthread_mutex_lock(&fs->journal.mutex);
+    fs->journal.file_size = lseek(fd, 0, SEEK_END);
+    fs->journal.durable_seq = fs->journal.next_seq - 1;
+    fs->journal.buf_used = 0;
+    fs->journal.buf_txns = 0;
+    fs->journal.num_compactions++;
+    pthread_cond_broadcast(&fs->journal.committed);
+    pthread_mutex_unlock(&fs->journal.mutex);
+
+    pthread_rwlock_unlock(&fs->mutator_lock);
+}
+
+
+
+//------ committer thread ------------------------------------------------------------------------------------------------
+
+static void *journal_committer(void *ptr){
+    rsfs_t *fs = ptr;
+
+    pthread_mutex_lock(&fs->journal.mutex);
+
+    while(1){
+        while(fs->journal.buf_txns == 0 && !fs->journal.stopping){
+            pthread_cond_wait(&fs->journal.pending, &fs->journal.mutex);
+        }
+        if(fs->journal.buf_txns == 0 && fs->journal.stopping) break;
+
+        //give concurrent operations up to commit_latency_us to join this batch
+        if(fs->journal.buf_txns < fs->journal.max_batch && !fs->journal.stopping && fs->journal.commit_latency_us > 0){
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)fs->journal.commit_latency_us * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while(fs->journal.buf_txns < fs->journal.max_batch && !fs->journal.stopping &&
+                fs->journal.buf_used < JOURNAL_BUF_SIZE/2){
+                if(pthread_cond_timedwait(&fs->journal.pending, &fs->journal.mutex, &deadline) == ETIMEDOUT) break;
+            }
+        }
+
+        //swap buffers so that new transactions can be queued during the flush
+        char *batch = fs->journal.buf;
+        int batch_size = fs->journal.buf_used;
+        int batch_txns = fs->journal.buf_txns;
+        unsigned int batch_last_seq = fs->journal.next_seq - 1;
+        int failed = fs->journal.failed;
+        long file_size = fs->journal.file_size;
+        fs->journal.buf = fs->journal.flush_buf;
+        fs->journal.flush_buf = batch;
+        fs->journal.buf_used = 0;
+        fs->journal.buf_txns = 0;
+
+        pthread_mutex_unlock(&fs->journal.mutex);
+
+        //once a flush failed, later batches are dropped: a transaction that
+        //follows a lost one must not be replayed without it
+        if(!failed && cache_sync(fs) < 0){
+            //the blocks the batch points to must be on the device before it is
+            printf("[journal] fail to write back the data of %d transactions.\n", batch_txns);
+            failed = 1;
+        }
+        if(!failed && (write_all(fs->journal.fd, batch, batch_size) < 0 || fdatasync(fs->journal.fd) < 0)){
+            printf("[journal] fail to flush %d transactions.\n", batch_txns);
+            failed = 1;
+            //cut a partly written batch off so that the file still replays
+            if(ftruncate(fs->journal.fd, file_size) < 0) printf("[journal] fail to cut the torn batch off.\n");
+        }
+        if(failed && !fs->journal.failed) printf("[journal] journal stopped: later changes are not durable.\n");
+
+        pthread_mutex_lock(&fs->journal.mutex);
+        if(failed) fs->journal.failed = 1;
+        else{
+            fs->journal.durable_seq = batch_last_seq;
+            fs->journal.file_size += batch_size;
+            fs->journal.num_flushes++;
+            if(batch_txns > fs->journal.max_batch_seen) fs->journal.max_batch_seen = batch_txns;
+        }
+        pthread_cond_broadcast(&fs->journal.committed);
+
+        if(fs->journal.file_size > JOURNAL_COMPACT_SIZE && !fs->journal.stopping && !fs->journal.failed){
+            pthread_mutex_unlock(&fs->journal.mutex);
+            journal_compact(fs);
+            pthread_mutex_lock(&fs->journal.mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&fs->journal.mutex);
+
+    return NULL;
+}
+
+
+
+//------ recovery ------------------------------------------------------------------------------------------------------
+
+//apply one redo record to the in-memory metadata
+static void journal_apply(rsfs_t *fs, struct journal_record *record){
+    switch(record->type){
+        case JR_INODE:
+            if(record->index <= 0 || grow_inodes(fs, record->index + 1) < 0) return;
+            metrics_lock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+            if(fs->inode_bitmap[record->index] == 0){
+                fs->inode_bitmap[record->index] = 1;
+                shm_mutex_init(fs, &fs->inodes[record->index].rw_mutex);
+                shm_cond_init(fs, &fs->inodes[record->index].rw_cond);
+                fs->inodes[record->index].reader_count = 0;
+                fs->inodes[record->index].writer_active = 0;
+            }
+            metrics_unlock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+            fs->inodes[record->index].length = record->value;
+            memcpy(fs->inodes[record->index].block, record->block, NUM_POINTERS);
+            fs->inodes[record->index].flags = record->flags;
+            memcpy(fs->inodes[record->index].chunk_len, record->chunk_len, sizeof(record->chunk_len));
+            fs->inodes[record->index].version = compress_new_version(fs);
+            break;
+        case JR_INODE_FREE:
+            if(record->index <= 0 || record->index >= fs->num_inodes) return;
+            free_inode(fs, record->index);
+            break;
+        case JR_DBLOCK:
+            if(record->index < 0 || grow_dblocks(fs, record->index + 1) < 0) return;
+            metrics_lock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+            fs->data_bitmap[record->index] = record->value;
+            metrics_unlock(fs, &fs->data_bitmap_mutex, LOCK_DATA_BITMAP);
+            break;
+        case JR_DIRENT:
+            if(record->index < 0 || record->index >= (int)(BLOCK_SIZE/sizeof(struct dir_entry))) return;
+            set_dir_entry(fs, record->index, record->name, record->value);
+            break;
+    }
+}
+
+//transactions of concurrent calls may reach the journal in a different order
+//than their bitmap updates; rebuild both bitmaps from what the directory reaches
+static void journal_repair(rsfs_t *fs){
+    int reachable[MAX_INODES] = {0};
+    reachable[fs->root_inode_number] = 1;
+    for(int slot=0; slot<(int)(BLOCK_SIZE/sizeof(struct dir_entry)); slot++){
+        struct dir_entry *dir_entry = &root_dir_entries(fs)[slot];
+        if(dir_entry->name == 0) continue;
+        int inode_number = dir_entry->inode_number;
+        if(inode_number > 0 && inode_number < fs->num_inodes && fs->inode_bitmap[inode_number]) reachable[inode_number] = 1;
+        else set_dir_entry(fs, slot, 0, 0); //entry of an inode that never made it to the journal
+    }
+
+    metrics_lock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+    for(int i=0; i<fs->num_inodes; i++) fs->inode_bitmap[i] = reachable[i];
+    metrics_unlock(fs, &fs->inode_bitmap_mutex, LOCK_INODE_BITMAP);
+
+    rebuild_block_refcounts(fs);
+    stats_rebuild(fs);
+}
+
+//replay every complete transaction in the file; stop at the first torn one;
+//return the number of transactions replayed
+static int journal_replay(rsfs_t *fs, int fd){
+    int num_replayed = 0;
+    struct journal_txn_header header;
+    //a snapshot transaction holds every inode, block, and directory slot
+    int max_records = MAX_INODES + MAX_DBLOCKS + BLOCK_SIZE/sizeof(struct dir_entry) + JOURNAL_MAX_TXN_RECORDS;
+    struct journal_record *records = malloc(max_records*sizeof(struct journal_record));
+    if(records == NULL) return -1;
+
+    while(read(fd, &header, sizeof(header)) == sizeof(header)){
+        if(header.magic != JOURNAL_MAGIC || header.num_records > (unsigned int)max_records) break;
+        int records_size = header.num_records * sizeof(struct journal_record);
+        if(read(fd, records, records_size) != records_size) break;
+        if(journal_checksum(records, records_size) != header.checksum) break;
+
+        for(unsigned int i=0; i<header.num_records; i++) journal_apply(fs, &records[i]);
+        num_replayed++;
+    }
+
+    free(records);
+
+    journal_repair(fs);
+
+    return num_replayed;
+}
+
+//write the current metadata as a single transaction to a fresh file at path;
+//used to keep the journal bounded across mounts
+static int journal_write_snapshot(rsfs_t *fs, const char *path){
+    char tmp_path[sizeof(fs->journal.path)];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int max_records = MAX_INODES + MAX_DBLOCKS + BLOCK_SIZE/sizeof(struct dir_entry);
+    struct journal_record *records = calloc(max_records, sizeof(struct journal_record));
+    if(records == NULL) return -1;
+    int n = 0;
+
+    for(int i=0; i<fs->num_inodes; i++){
+        if(i == fs->root_inode_number || !fs->inode_bitmap[i]) continue;
+        records[n].type = JR_INODE;
+        records[n].index = i;
+        records[n].value = fs->inodes[i].length;
+        memcpy(records[n].block, fs->inodes[i].block, NUM_POINTERS);
+        records[n].flags = fs->inodes[i].flags;
+        memcpy(records[n].chunk_len, fs->inodes[i].chunk_len, sizeof(records[n].chunk_len));
+        n++;
+    }
+    for(int i=0; i<fs->num_dblocks; i++){
+        if(!fs->data_bitmap[i]) continue;
+        records[n].type = JR_DBLOCK;
+        records[n].index = i;
+        records[n].value = 1;
+        n++;
+    }
+    for(int slot=0; slot<(int)(BLOCK_SIZE/sizeof(struct dir_entry)); slot++){
+        struct dir_entry *dir_entry = &root_dir_entries(fs)[slot];
+        if(dir_entry->name == 0) continue;
+        records[n].type = JR_DIRENT;
+        records[n].index = slot;
+        records[n].name = dir_entry->name;
+        records[n].value = dir_entry->inode_number;
+        n++;
+    }
+
+    struct journal_txn_header header;
+    header.magic = JOURNAL_MAGIC;
+    header.seq = 0;
+    header.num_records = n;
+    header.checksum = journal_checksum(records, n*sizeof(struct journal_record));
+
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    int ret = -1;
+    if(fd >= 0 &&
+        write_all(fd, (char *)&header, sizeof(header)) == 0 &&
+        write_all(fd, (char *)records, n*sizeof(struct journal_record)) == 0 &&
+        fdatasync(fd) == 0 &&
+        rename(tmp_path, path) == 0){
+        ret = 0;
+    }
+    if(fd >= 0) close(fd);
+    free(records);
+
+    return ret;
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//open (or create) the journal at path: replay what it holds into the file
+//system, compact it, then log every later metadata update to it.
+//commit_latency_us bounds how long a transaction waits for others to share
+//its flush; max_batch flushes early once that many transactions are queued.
+//should be called right after RSFS_init and before any file is created.
+//the journal holds metadata only: replaying a non-empty one needs the block
+//device holding the data blocks attached first (RSFS_cache_open), and is
+//refused otherwise.
+//if a flush fails, the journal stops: the call whose change it held and
+//every later call that changes metadata return an error (-2 for RSFS_create
+//and RSFS_clone, -3 for RSFS_txn_commit, -1 otherwise) although the change is
+//made in memory, until the journal is closed.
+//return 0 if succeed; otherwise return a negative value
+int RSFS_journal_open(rsfs_t *fs, const char *path, int commit_latency_us, int max_batch){
+    char *debug_title = "[RSFS_journal_open]";
+
+    if(router_refuse(fs, debug_title) < 0 || shm_refuse(fs, debug_title) < 0) return -1;
+    if(fs->journal.active){
+        printf("%s journal is already open.\n", debug_title);
+        return -1;
+    }
+    if(commit_latency_us < 0 || max_batch <= 0){
+        printf("%s invalid commit latency (%d) or batch size (%d).\n", debug_title, commit_latency_us, max_batch);
+        return -1;
+    }
+
+    search_dir(fs, 0); //make sure the root directory block exists before replay
+
+    if(strlen(path) + sizeof(".tmp") > sizeof(fs->journal.path)){
+        printf("%s journal path is too long (%s).\n", debug_title, path);
+        return -1;
+    }
+
+    //replay
+    int fd = open(path, O_RDONLY);
+    if(fd >= 0 && lseek(fd, 0, SEEK_END) > (off_t)sizeof(struct journal_txn_header) && !fs->block_cache.active){
+        printf("%s %s refers to data blocks on a block device: attach it first (RSFS_cache_open).\n", debug_title, path);
+        close(fd);
+        return -4;
+    }
+    if(fd >= 0){
+        lseek(fd, 0, SEEK_SET);
+        int num_replayed = journal_replay(fs, fd);
+        close(fd);
+        if(DEBUG) printf("%s replayed %d transactions.\n", debug_title, num_replayed);
+    }
+
+    //compact
+    if(journal_write_snapshot(fs, path) < 0){
+        printf("%s fail to write journal (%s).\n", debug_title, path);
+        return -2;
+    }
+    fd = open(path, O_WRONLY|O_APPEND);
+    if(fd < 0){
+        printf("%s fail to open journal (%s).\n", debug_title, path);
+        return -2;
+    }
+
+    fs->journal.buf = malloc(JOURNAL_BUF_SIZE);
+    fs->journal.flush_buf = malloc(JOURNAL_BUF_SIZE);
+    if(fs->journal.buf == NULL || fs->journal.flush_buf == NULL){
+        free(fs->journal.buf);
+        free(fs->journal.flush_buf);
+        close(fd);
+        return -2;
+    }
+
+    strcpy(fs->journal.path, path);
+    fs->journal.file_size = lseek(fd, 0, SEEK_END);
+
+    shm_mutex_init(fs, &fs->journal.mutex);
+    shm_cond_init(fs, &fs->journal.committed);
+    shm_cond_init(fs, &fs->journal.pending);
+    fs->journal.fd = fd;
+    fs->journal.stopping = 0;
+    fs->journal.buf_used = 0;
+    fs->journal.buf_txns = 0;
+    fs->journal.next_seq = 1;
+    fs->journal.durable_seq = 0;
+    fs->journal.failed = 0;
+    fs->journal.commit_latency_us = commit_latency_us;
+    fs->journal.max_batch = max_batch;
+    fs->journal.num_txns = 0;
+    fs->journal.num_flushes = 0;
+    fs->journal.max_batch_seen = 0;
+    fs->journal.total_wait_us = 0;
+    fs->journal.max_wait_us = 0;
+    fs->journal.num_compactions = 0;
+
+    fs->journal.active = 1;
+    if(pthread_create(&fs->journal.committer, NULL, journal_committer, fs) != 0){
+        fs->journal.active = 0;
+        close(fd);
+        return -3;
+    }
+
+    return 0;
+}
+
+//flush everything that is queued, then stop the committer thread;
+//return 0 if every transaction is durable, -2 if a flush failed
+int RSFS_journal_close(rsfs_t *fs){
+    if(!fs->journal.active) return -1;
+
+    pthread_mutex_lock(&fs->journal.mutex);
+    fs->journal.stopping = 1;
+    pthread_cond_signal(&fs->journal.pending);
+    pthread_mutex_unlock(&fs->journal.mutex);
+
+    pthread_join(fs->journal.committer, NULL);
+
+    fs->journal.active = 0;
+    close(fs->journal.fd);
+    free(fs->journal.buf);
+    free(fs->journal.flush_buf);
+    fs->journal.buf = fs->journal.flush_buf = NULL;
+
+    return fs->journal.failed ? -2 : 0;
+}
+
+//print group-commit configuration and statistics
+void RSFS_journal_stat(rsfs_t *fs){
+    if(!fs->journal.active){
+        printf("\nJournal: off\n\n");
+        return;
+    }
+
+    pthread_mutex_lock(&fs->journal.mutex);
+
+    double avg_batch = fs->journal.num_flushes ? (double)fs->journal.num_txns/fs->journal.num_flushes : 0;
+    double avg_wait = fs->journal.num_txns ? (double)fs->journal.total_wait_us/fs->journal.num_txns : 0;
+
+    printf("\nJournal: commit latency %d us, max batch %d\n", fs->journal.commit_latency_us, fs->journal.max_batch);
+    printf("Transactions: %ld,  Flushes: %ld,  Avg Batch: %.2f,  Max Batch: %ld\n",
+        fs->journal.num_txns, fs->journal.num_flushes, avg_batch, fs->journal.max_batch_seen);
+    printf("Commit Latency: avg %.1f us,  max %ld us\n", avg_wait, fs->journal.max_wait_us);
+    printf("Journal Size: %ld bytes,  Compactions: %ld%s\n\n", fs->journal.file_size, fs->journal.num_compactions,
+        fs->journal.failed ? ",  FAILED: later changes are not durable" : "");
+
+    pthread_mutex_unlock(&fs->journal.mutex);
+}
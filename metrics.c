@@ -0,0 +1,291 @@
+/*
+    always-on instrumentation;
+    every API call is timed into a log2-bucketed latency histogram of the
+    calling thread, and the main mutexes count acquisitions, contended
+    acquisitions and the time spent waiting; RSFS_metrics_export aggregates
+    them into a Prometheus text file;
+    calls are timed with the time-stamp counter (constant rate on current
+    x86 CPUs), which is cheaper to read than clock_gettime, and ticks are
+    converted to seconds only when the metrics are read
+*/
+
+#include "def.h"
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#define METRICS_CACHED_INSTANCES 4 //instances whose slot a thread remembers
+#define METRICS_CALIBRATE_US 2000 //how long to compare the time-stamp counter with the clock
+
+static __thread int call_depth; //1 while this thread is inside an observed call (calls it makes are not observed)
+
+//slot of this thread in recently used instances; instance ids tell a new
+//instance apart from a destroyed one at the same address
+static __thread struct{
+    rsfs_t *fs;
+    long instance_id;
+    int index;
+} slot_cache[METRICS_CACHED_INSTANCES];
+static __thread int slot_cache_next;
+static long next_instance_id;
+
+//the time-stamp counter against the clock, measured once per process
+static pthread_once_t tick_once = PTHREAD_ONCE_INIT;
+static long tick0, ns0;
+static double ns_per_tick;
+
+const char *metrics_op_names[METRICS_NUM_OPS] = {"", "create", "delete", "open", "append", "fseek", "read", "close", "write", "cut", "clone"};
+const char *metrics_lock_names[NUM_LOCK_STATS] = {"root_dir", "data_bitmap", "open_file_table", "inode_bitmap", "file_rw"};
+
+
+static void tick_calibrate(){
+    ns0 = metrics_now();
+    tick0 = __rdtsc();
+    usleep(METRICS_CALIBRATE_US);
+    ns_per_tick = (metrics_now() - ns0) / (double)(__rdtsc() - tick0);
+}
+
+//histogram bucket of a duration: [2^(b-1), 2^b) ticks, the last one unbounded
+static int bucket_of(long ticks){
+    int b = ticks > 0 ? 64 - __builtin_clzl(ticks) : 0;
+    return b < METRICS_BUCKETS ? b : METRICS_BUCKETS - 1;
+}
+
+//add a call of op taking ticks to the histogram of this thread
+static void record_latency(rsfs_t *fs, int op, long ticks){
+    struct metrics_thread *slot = &fs->metrics.threads[metrics_thread_index(fs)];
+    int b = bucket_of(ticks);
+    if(slot == &fs->metrics.threads[METRICS_MAX_THREADS - 1]){
+        //shared by the late threads
+        __sync_fetch_and_add(&slot->count[op], 1);
+        __sync_fetch_and_add(&slot->sum_ticks[op], ticks);
+        __sync_fetch_and_add(&slot->bucket[op][b], 1);
+    }
+    else{
+        slot->count[op]++;
+        slot->sum_ticks[op] += ticks;
+        slot->bucket[op][b]++;
+    }
+}
+
+//add the lock counters of target (or of its partitions) to locks
+static void sum_locks(rsfs_t *target, struct lock_stat *locks){
+    if(target->num_shards){
+        for(int i=0; i<target->num_shards; i++) sum_locks(target->shards[i], locks);
+        return;
+    }
+    for(int l=0; l<NUM_LOCK_STATS; l++){
+        locks[l].acquisitions += target->metrics.locks[l].acquisitions;
+        locks[l].contended += target->metrics.locks[l].contended;
+        locks[l].wait_ns += target->metrics.locks[l].wait_ns;
+    }
+}
+
+//sum the histograms of all threads of fs
+static void sum_threads(rsfs_t *fs, struct metrics_thread *total){
+    memset(total, 0, sizeof(*total));
+    int num_slots = fs->metrics.num_threads < METRICS_MAX_THREADS ? fs->metrics.num_threads : METRICS_MAX_THREADS;
+    for(int t=0; t<num_slots; t++){
+        struct metrics_thread *slot = &fs->metrics.threads[t];
+        for(int op=1; op<METRICS_NUM_OPS; op++){
+            total->count[op] += slot->count[op];
+            total->sum_ticks[op] += slot->sum_ticks[op];
+            for(int b=0; b<METRICS_BUCKETS; b++) total->bucket[op][b] += slot->bucket[op][b];
+        }
+    }
+}
+
+
+
+//------ routines called by the API ------------------------------------------------------------------------------------
+
+//calibrate the time-stamp counter (once per process using an instance)
+void metrics_process_init(){
+    pthread_once(&tick_once, tick_calibrate);
+}
+
+//metrics start on
+void metrics_init(rsfs_t *fs){
+    metrics_process_init();
+    fs->metrics.enabled = 1;
+    shm_mutex_init(fs, &fs->metrics.mutex);
+    fs->metrics.instance_id = __sync_add_and_fetch(&next_instance_id, 1);
+}
+
+//the slot of the calling thread in fs (its histograms and event ring);
+//threads beyond METRICS_MAX_THREADS share the last slot
+int metrics_thread_index(rsfs_t *fs){
+    for(int i=0; i<METRICS_CACHED_INSTANCES; i++){
+        if(slot_cache[i].fs == fs && slot_cache[i].instance_id == fs->metrics.instance_id) return slot_cache[i].index;
+    }
+    int index = __sync_fetch_and_add(&fs->metrics.num_threads, 1);
+    if(index >= METRICS_MAX_THREADS - 1) index = METRICS_MAX_THREADS - 1;
+
+    int i = slot_cache_next;
+    slot_cache_next = (i + 1) % METRICS_CACHED_INSTANCES;
+    slot_cache[i].fs = fs;
+    slot_cache[i].instance_id = fs->metrics.instance_id;
+    slot_cache[i].index = index;
+    return index;
+}
+
+//return 1 (and the start tick) if the calling API function should be
+//observed in this call of op: it then calls itself again and passes the
+//result to call_exit
+int call_enter(rsfs_t *fs, int op, long *start_tick){
+    if(call_depth || !(fs->metrics.enabled || fs->trace.active || fs->events.active)) return 0;
+    call_depth = 1;
+    *start_tick = __rdtsc();
+    if(fs->events.active) event_record_at(fs, *start_tick, EVENT_OP_BEGIN, op, 0);
+    return 1;
+}
+
+//time (and trace, while recording) a call of op that returned ret
+void call_exit(rsfs_t *fs, long start_tick, int op, int fd, char name, int arg, int size, int ret){
+    long end_tick = __rdtsc();
+    call_depth = 0;
+    if(fs->metrics.enabled) record_latency(fs, op, end_tick - start_tick);
+    if(fs->trace.active) trace_call(fs, ticks_to_ns(start_tick), ticks_to_ns(end_tick), op, fd, name, arg, size, ret);
+    if(fs->events.active) event_record_at(fs, end_tick, EVENT_OP_END, op, ret);
+}
+
+//monotonic time in ns of a time-stamp counter reading
+long ticks_to_ns(long tick){
+    return ns0 + (long)((tick - tick0) * ns_per_tick);
+}
+
+//lock mutex (one of the instrumented locks of fs); the clock is only read
+//when the lock is contended
+void metrics_lock(rsfs_t *fs, pthread_mutex_t *mutex, int lock){
+    struct lock_stat *stat = &fs->metrics.locks[lock];
+    if(pthread_mutex_trylock(mutex) == 0){
+        stat->acquisitions++; //counted under the lock itself
+        event_record(fs, EVENT_LOCK_ACQUIRE, lock, 0);
+        return;
+    }
+    long start_ns = metrics_now();
+    pthread_mutex_lock(mutex);
+    long wait_ns = metrics_now() - start_ns;
+    stat->acquisitions++;
+    stat->contended++;
+    stat->wait_ns += wait_ns;
+    event_record(fs, EVENT_LOCK_ACQUIRE, lock, wait_ns < INT_MAX ? wait_ns : INT_MAX);
+}
+
+//unlock mutex, taken with metrics_lock
+void metrics_unlock(rsfs_t *fs, pthread_mutex_t *mutex, int lock){
+    event_record(fs, EVENT_LOCK_RELEASE, lock, 0);
+    pthread_mutex_unlock(mutex);
+}
+
+//count a wait of RSFS_open for the readers or the writer of a file
+void metrics_rw_wait(rsfs_t *fs, long wait_ns){
+    struct lock_stat *stat = &fs->metrics.locks[LOCK_FILE_RW];
+    __sync_fetch_and_add(&stat->contended, 1);
+    __sync_fetch_and_add(&stat->wait_ns, wait_ns);
+}
+
+//count an RSFS_open that got its file (rw_mutex held, but of one file only)
+void metrics_rw_acquired(rsfs_t *fs){
+    __sync_fetch_and_add(&fs->metrics.locks[LOCK_FILE_RW].acquisitions, 1);
+}
+
+//monotonic time in ns
+long metrics_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//turn the call histograms on (1) or off (0); lock counters are always kept
+void RSFS_metrics_enable(rsfs_t *fs, int enabled){
+    fs->metrics.enabled = enabled;
+}
+
+//print calls, mean latency and median bucket per op, and lock contention
+void RSFS_metrics_stat(rsfs_t *fs){
+    struct metrics_thread *total = malloc(sizeof(struct metrics_thread)); //too large for a thread stack
+    struct lock_stat locks[NUM_LOCK_STATS] = {{0}};
+    if(total == NULL) return;
+
+    pthread_mutex_lock(&fs->metrics.mutex);
+    sum_threads(fs, total);
+    sum_locks(fs, locks);
+
+    printf("\n%-8s%12s%12s%12s\n", "Call", "Count", "Mean ns", "p50 < ns");
+    for(int op=1; op<METRICS_NUM_OPS; op++){
+        if(total->count[op] == 0) continue;
+        long seen = 0;
+        int b = 0;
+        while(b < METRICS_BUCKETS-1 && (seen += total->bucket[op][b]) * 2 < total->count[op]) b++;
+        printf("%-8s%12ld%12.0f%12.0f\n", metrics_op_names[op], total->count[op],
+            total->sum_ticks[op] * ns_per_tick / total->count[op], (1L << b) * ns_per_tick);
+    }
+    printf("%-16s%14s%12s%14s\n", "Lock", "Acquisitions", "Contended", "Wait us");
+    for(int l=0; l<NUM_LOCK_STATS; l++){
+        printf("%-16s%14ld%12ld%14.1f\n", metrics_lock_names[l], locks[l].acquisitions, locks[l].contended, locks[l].wait_ns / 1e3);
+    }
+    printf("\n");
+    pthread_mutex_unlock(&fs->metrics.mutex);
+    free(total);
+}
+
+//write the call histograms and lock counters to path in the Prometheus text
+//exposition format; return 0 if succeed, or -1 if path cannot be written
+int RSFS_metrics_export(rsfs_t *fs, const char *path){
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *file = fopen(tmp_path, "w");
+    if(file == NULL){
+        printf("[RSFS_metrics_export] fail to open %s.\n", tmp_path);
+        return -1;
+    }
+
+    struct metrics_thread *total = malloc(sizeof(struct metrics_thread));
+    struct lock_stat locks[NUM_LOCK_STATS] = {{0}};
+    if(total == NULL){
+        fclose(file);
+        return -1;
+    }
+    pthread_mutex_lock(&fs->metrics.mutex);
+    sum_threads(fs, total);
+    sum_locks(fs, locks);
+
+    fprintf(file, "# HELP rsfs_call_duration_seconds Latency of RSFS_* calls.\n");
+    fprintf(file, "# TYPE rsfs_call_duration_seconds histogram\n");
+    for(int op=1; op<METRICS_NUM_OPS; op++){
+        long cumulative = 0;
+        for(int b=0; b<METRICS_BUCKETS-1; b++){
+            cumulative += total->bucket[op][b];
+            fprintf(file, "rsfs_call_duration_seconds_bucket{op=\"%s\",le=\"%.3g\"} %ld\n", metrics_op_names[op], (1L << b) * ns_per_tick / 1e9, cumulative);
+        }
+        fprintf(file, "rsfs_call_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %ld\n", metrics_op_names[op], total->count[op]);
+        fprintf(file, "rsfs_call_duration_seconds_sum{op=\"%s\"} %.9f\n", metrics_op_names[op], total->sum_ticks[op] * ns_per_tick / 1e9);
+        fprintf(file, "rsfs_call_duration_seconds_count{op=\"%s\"} %ld\n", metrics_op_names[op], total->count[op]);
+    }
+
+    fprintf(file, "# HELP rsfs_lock_acquisitions_total Acquisitions of a lock (file_rw: RSFS_open getting its file).\n");
+    fprintf(file, "# TYPE rsfs_lock_acquisitions_total counter\n");
+    for(int l=0; l<NUM_LOCK_STATS; l++) fprintf(file, "rsfs_lock_acquisitions_total{lock=\"%s\"} %ld\n", metrics_lock_names[l], locks[l].acquisitions);
+    fprintf(file, "# HELP rsfs_lock_contended_total Acquisitions that had to wait.\n");
+    fprintf(file, "# TYPE rsfs_lock_contended_total counter\n");
+    for(int l=0; l<NUM_LOCK_STATS; l++) fprintf(file, "rsfs_lock_contended_total{lock=\"%s\"} %ld\n", metrics_lock_names[l], locks[l].contended);
+    fprintf(file, "# HELP rsfs_lock_wait_seconds_total Time spent waiting for a lock.\n");
+    fprintf(file, "# TYPE rsfs_lock_wait_seconds_total counter\n");
+    for(int l=0; l<NUM_LOCK_STATS; l++) fprintf(file, "rsfs_lock_wait_seconds_total{lock=\"%s\"} %.9f\n", metrics_lock_names[l], locks[l].wait_ns / 1e9);
+    pthread_mutex_unlock(&fs->metrics.mutex);
+    free(total);
+
+    //replace the file at once, so that a scraper never reads half of it
+    int failed = ferror(file);
+    if(fclose(file) != 0 || failed || rename(tmp_path, path) < 0){
+        printf("[RSFS_metrics_export] fail to write %s.\n", path);
+        return -1;
+    }
+    return 0;
+}
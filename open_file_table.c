@@ -1,46 +1,56 @@
 /*
-    allocation of global open_file_table and its guarding mutex; 
+    management of the open_file_table (kept in struct rsfs); 
     routines for open file entry
 */
 
 #include "def.h"
 
-struct open_file_entry open_file_table[NUM_OPEN_FILE];
-pthread_mutex_t open_file_table_mutex;
 
 // allocate an available entry in open file table and return fd (file descriptor);
 // return -1 if no entry is found
 // (Cleaned this one up a bit)
-int allocate_open_file_entry(int access_flag, int inode_number){
+int allocate_open_file_entry(rsfs_t *fs, int access_flag, int inode_number){
     int fd = -1;
 
-    pthread_mutex_lock(&open_file_table_mutex);
+    metrics_lock(fs, &fs->open_file_table_mutex, LOCK_OPEN_FILE_TABLE);
     for(int i = 0; i < NUM_OPEN_FILE; i++){
-        struct open_file_entry *entry = &open_file_table[i];
+        struct open_file_entry *entry = &fs->open_file_table[i];
         if(entry->used == 0){ // find an empty entry
             fd = i;
             entry->used = 1;
             entry->access_flag = access_flag;
             entry->inode_number = inode_number;
             entry->position = 0;
+            entry->last_position = -1;
+            entry->stride = 0;
+            entry->seq_count = 0;
+            entry->ra_window = READAHEAD_MIN_WINDOW;
+            entry->ra_next_block = 0;
+            entry->wb_enabled = 0;
+            entry->wb_size = 0;
+            stats_open(fs, inode_number, 1);
 
             break;
         }
     }
-    pthread_mutex_unlock(&open_file_table_mutex);
+    metrics_unlock(fs, &fs->open_file_table_mutex, LOCK_OPEN_FILE_TABLE);
 
     return fd;
 }
 
 // Changed the function so it resets everything
-void free_open_file_entry(int fd) {
+void free_open_file_entry(rsfs_t *fs, int fd) {
     if(fd < 0 || fd >= NUM_OPEN_FILE) return;
-    pthread_mutex_lock(&open_file_table_mutex);
+    metrics_lock(fs, &fs->open_file_table_mutex, LOCK_OPEN_FILE_TABLE);
 
-    open_file_table[fd].used = 0;
-    open_file_table[fd].access_flag = -1;
-    open_file_table[fd].inode_number = -1;
-    open_file_table[fd].position = 0;
+    if(fs->open_file_table[fd].used) stats_open(fs, fs->open_file_table[fd].inode_number, -1);
 
-    pthread_mutex_unlock(&open_file_table_mutex);
+    fs->open_file_table[fd].used = 0;
+    fs->open_file_table[fd].access_flag = -1;
+    fs->open_file_table[fd].inode_number = -1;
+    fs->open_file_table[fd].position = 0;
+    fs->open_file_table[fd].wb_enabled = 0;
+    fs->open_file_table[fd].wb_size = 0;
+
+    metrics_unlock(fs, &fs->open_file_table_mutex, LOCK_OPEN_FILE_TABLE);
 }
\ No newline at end of file
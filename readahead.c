@@ -0,0 +1,115 @@
+/*
+    sequential access detection and asynchronous read-ahead;
+    RSFS_read records the access pattern in the open file entry and, once a
+    sequential stream is seen, queues the next blocks of the file for a
+    background thread that loads them into the block cache
+*/
+
+#include "def.h"
+
+
+//background thread: prefetch queued blocks until stopped
+static void *readahead_thread(void *ptr){
+    rsfs_t *fs = ptr;
+
+    pthread_mutex_lock(&fs->readahead.mutex);
+
+    while(1){
+        while(fs->readahead.count == 0 && !fs->readahead.stopping){
+            pthread_cond_wait(&fs->readahead.pending, &fs->readahead.mutex);
+        }
+        if(fs->readahead.stopping) break;
+
+        int block_number = fs->readahead.queue[fs->readahead.head];
+        fs->readahead.head = (fs->readahead.head + 1) % READAHEAD_QUEUE_SIZE;
+        fs->readahead.count--;
+
+        pthread_mutex_unlock(&fs->readahead.mutex);
+        prefetch_block(fs, block_number);
+        pthread_mutex_lock(&fs->readahead.mutex);
+    }
+
+    pthread_mutex_unlock(&fs->readahead.mutex);
+
+    return NULL;
+}
+
+//start the prefetch thread
+void readahead_start(rsfs_t *fs){
+    if(fs->readahead.active) return;
+
+    shm_mutex_init(fs, &fs->readahead.mutex);
+    shm_cond_init(fs, &fs->readahead.pending);
+    fs->readahead.head = 0;
+    fs->readahead.count = 0;
+    fs->readahead.num_dropped = 0;
+    fs->readahead.stopping = 0;
+
+    if(pthread_create(&fs->readahead.thread, NULL, readahead_thread, fs) != 0){
+        printf("[readahead_start] fail to start the read-ahead thread.\n");
+        return;
+    }
+    fs->readahead.active = 1;
+}
+
+//stop the prefetch thread; pending requests are discarded
+void readahead_stop(rsfs_t *fs){
+    if(!fs->readahead.active) return;
+
+    pthread_mutex_lock(&fs->readahead.mutex);
+    fs->readahead.stopping = 1;
+    pthread_cond_signal(&fs->readahead.pending);
+    pthread_mutex_unlock(&fs->readahead.mutex);
+
+    pthread_join(fs->readahead.thread, NULL);
+    fs->readahead.active = 0;
+}
+
+//queue a block for prefetch; dropped if the queue is full
+static void readahead_queue(rsfs_t *fs, int block_number){
+    pthread_mutex_lock(&fs->readahead.mutex);
+    if(fs->readahead.count < READAHEAD_QUEUE_SIZE){
+        fs->readahead.queue[(fs->readahead.head + fs->readahead.count) % READAHEAD_QUEUE_SIZE] = block_number;
+        fs->readahead.count++;
+        pthread_cond_signal(&fs->readahead.pending);
+    }else{
+        fs->readahead.num_dropped++;
+    }
+    pthread_mutex_unlock(&fs->readahead.mutex);
+}
+
+
+//called by RSFS_read after reading size bytes from position:
+//a read that starts where the previous one ended continues a sequential
+//stream; on the second such read, the next ra_window blocks past the read
+//are queued, and the window doubles each time the stream keeps up with it
+void readahead_after_read(rsfs_t *fs, struct open_file_entry *entry, struct inode_meta *meta, int position, int size){
+    if(size <= 0) return;
+
+    if(position == entry->last_position){
+        entry->seq_count++;
+    }else{//random access: start over
+        entry->seq_count = 0;
+        entry->ra_window = READAHEAD_MIN_WINDOW;
+        entry->ra_next_block = 0;
+    }
+    entry->last_position = position + size;
+    entry->stride = size;
+
+    if(!fs->readahead.active || entry->seq_count < 1) return;
+
+    //blocks already requested but not reached yet keep the window as is
+    int next_block = (position + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if(entry->ra_next_block > next_block) return;
+
+    int last_block = next_block + entry->ra_window;
+    if(last_block > NUM_POINTERS) last_block = NUM_POINTERS;
+    for(int i = next_block; i < last_block; i++){
+        if(i * BLOCK_SIZE >= meta->length || meta->block[i] < 0) break;
+        readahead_queue(fs, meta->block[i]);
+    }
+    entry->ra_next_block = last_block;
+
+    if(entry->ra_window < READAHEAD_MAX_WINDOW) entry->ra_window *= 2;
+    if(entry->ra_window > READAHEAD_MAX_WINDOW) entry->ra_window = READAHEAD_MAX_WINDOW;
+}
@@ -0,0 +1,306 @@
+/*
+    replay: re-issues a trace recorded by RSFS_trace_start against a fresh
+    file system (make replay; ./replay trace_path [--timed] [--shards n]);
+    each recorded thread gets a thread of its own, and calls start in the
+    recorded order (as fast as possible, or at their recorded times with
+    --timed), so the same trace always produces the same interleaving of
+    call starts
+*/
+
+#include "def.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define REPLAY_MAX_THREADS 256
+#define FD_OPENING -2 //fd of an RSFS_open that has not returned yet
+
+struct replay{
+    rsfs_t *fs;
+    int timed;
+    struct trace_record *records; //in start order
+    long num_records;
+    long start_ns; //when the replay started
+
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    long turn; //index of the next record allowed to start
+    long *source; //for a call taking an fd: the record of the RSFS_open that returned it (-1 if none)
+    int *opened_fd; //for an RSFS_open: the fd it returned in this replay
+
+    long num_differ; //calls whose result differs from the recorded one
+    long max_size; //largest append/read/write
+};
+
+struct replay_thread{
+    struct replay *replay;
+    pthread_t tid;
+    int thread; //recorded OS thread id
+    long *indexes; //its records, in start order
+    long num_indexes;
+};
+
+
+static long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int compare_start(const void *a, const void *b){
+    const struct trace_record *x = a, *y = b;
+    return x->start_ns < y->start_ns ? -1 : x->start_ns > y->start_ns;
+}
+
+//the recorded fd of a call, or -1 if it takes none
+static int recorded_fd(struct trace_record *record){
+    switch(record->op){
+        case TRACE_APPEND: case TRACE_FSEEK: case TRACE_READ: case TRACE_CLOSE: case TRACE_WRITE: case TRACE_CUT:
+            return record->fd >= 0 ? record->fd : -1;
+    }
+    return -1;
+}
+
+//an RSFS_open returning an fd, or a call using one, at time_ns
+struct fd_event{
+    long time_ns;
+    int use; //0: the open returned (at its end), 1: a call used the fd (at its start)
+    long index;
+};
+
+static int compare_event(const void *a, const void *b){
+    const struct fd_event *x = a, *y = b;
+    if(x->time_ns != y->time_ns) return x->time_ns < y->time_ns ? -1 : 1;
+    return x->use - y->use;
+}
+
+//link every call taking an fd to the open that returned that fd last before
+//the call started; recorded fd numbers are reused, and an open can start
+//before the close that frees its number, so start order alone is not enough
+static void link_fds(struct replay *replay){
+    long n = replay->num_records;
+    struct fd_event *events = malloc(sizeof(struct fd_event) * (n + 1));
+    long num_events = 0;
+    int max_fd = 0;
+    for(long i=0; i<n; i++){
+        struct trace_record *record = &replay->records[i];
+        replay->source[i] = -1;
+        replay->opened_fd[i] = FD_OPENING;
+        if(record->op == TRACE_OPEN && record->ret >= 0){
+            events[num_events++] = (struct fd_event){record->start_ns + record->duration_ns, 0, i};
+            if(record->ret > max_fd) max_fd = record->ret;
+        }
+        else if(recorded_fd(record) >= 0){
+            events[num_events++] = (struct fd_event){record->start_ns, 1, i};
+        }
+    }
+    qsort(events, num_events, sizeof(struct fd_event), compare_event);
+
+    long *owner = malloc(sizeof(long) * (max_fd + 1)); //recorded fd -> record of its open
+    for(int fd=0; fd<=max_fd; fd++) owner[fd] = -1;
+    for(long e=0; e<num_events; e++){
+        struct trace_record *record = &replay->records[events[e].index];
+        if(!events[e].use) owner[record->ret] = events[e].index;
+        else if(record->fd <= max_fd) replay->source[events[e].index] = owner[record->fd];
+    }
+    free(owner);
+    free(events);
+}
+
+//load the trace at path; return the number of records, or -1
+static long load_trace(const char *path, struct trace_record **records){
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    struct trace_header header;
+    if(fd < 0 || fstat(fd, &st) < 0 || read(fd, &header, sizeof(header)) != sizeof(header)){
+        if(fd >= 0) close(fd);
+        printf("[replay] fail to read %s.\n", path);
+        return -1;
+    }
+    if(header.magic != TRACE_MAGIC || header.version != TRACE_VERSION ||
+        header.block_size != BLOCK_SIZE || header.num_pointers != NUM_POINTERS){
+        close(fd);
+        printf("[replay] %s is not a trace of this build.\n", path);
+        return -1;
+    }
+
+    long num_records = (st.st_size - sizeof(header)) / sizeof(struct trace_record);
+    *records = malloc((num_records + 1) * sizeof(struct trace_record));
+    long size = num_records * sizeof(struct trace_record), done = 0;
+    while(*records && done < size){
+        long ret = read(fd, (char *)*records + done, size - done);
+        if(ret <= 0) break;
+        done += ret;
+    }
+    close(fd);
+    if(*records == NULL || done != size){
+        printf("[replay] fail to read %s.\n", path);
+        return -1;
+    }
+    return num_records;
+}
+
+//create the files that existed when the trace started
+static void create_files(rsfs_t *fs, struct trace_record *records, long num_records){
+    for(long i=0; i<num_records; i++){
+        struct trace_record *record = &records[i];
+        if(record->op != TRACE_FILE) continue;
+        RSFS_create_ex(fs, record->name, record->arg);
+        int fd = RSFS_open(fs, record->name, RSFS_RDWR);
+        char data[BLOCK_SIZE];
+        memset(data, record->name, sizeof(data));
+        for(int done=0; fd >= 0 && done < record->size; done += BLOCK_SIZE){
+            int chunk = record->size - done < BLOCK_SIZE ? record->size - done : BLOCK_SIZE;
+            if(RSFS_append(fs, fd, data, chunk) < chunk) break;
+        }
+        if(fd >= 0) RSFS_close(fs, fd);
+    }
+}
+
+//issue one recorded call with fd as the fd of this replay; return its result
+static int issue(rsfs_t *fs, struct trace_record *record, int fd, char *buf){
+    switch(record->op){
+        case TRACE_CREATE: return RSFS_create_ex(fs, record->name, record->arg);
+        case TRACE_DELETE: return RSFS_delete(fs, record->name);
+        case TRACE_OPEN: return RSFS_open(fs, record->name, record->arg);
+        case TRACE_APPEND: return RSFS_append(fs, fd, buf, record->size);
+        case TRACE_FSEEK: return RSFS_fseek(fs, fd, record->size);
+        case TRACE_READ: return RSFS_read(fs, fd, buf, record->size);
+        case TRACE_CLOSE: return RSFS_close(fs, fd);
+        case TRACE_WRITE: return RSFS_write(fs, fd, buf, record->size);
+        case TRACE_CUT: return RSFS_cut(fs, fd, record->size);
+        case TRACE_CLONE: return RSFS_clone(fs, record->name, record->arg);
+    }
+    return -1;
+}
+
+static void *replay_thread_main(void *ptr){
+    struct replay_thread *t = (struct replay_thread *)ptr;
+    struct replay *replay = t->replay;
+    char *buf = malloc(replay->max_size + 1);
+    memset(buf, 'r', replay->max_size + 1);
+
+    for(long k=0; k<t->num_indexes; k++){
+        long i = t->indexes[k];
+        struct trace_record *record = &replay->records[i];
+        long source = replay->source[i];
+
+        //wait for the turn of this call (and for the open that returned its fd)
+        pthread_mutex_lock(&replay->mutex);
+        while(replay->turn != i || (source >= 0 && replay->opened_fd[source] == FD_OPENING)){
+            pthread_cond_wait(&replay->changed, &replay->mutex);
+        }
+        int replay_fd = source >= 0 ? replay->opened_fd[source] : -1;
+        if(replay->timed){
+            long delay = replay->start_ns + record->start_ns - now_ns();
+            if(delay > 0){
+                struct timespec ts = {delay / 1000000000L, delay % 1000000000L};
+                nanosleep(&ts, NULL);
+            }
+        }
+        //the next call may start while this one runs
+        replay->turn++;
+        pthread_cond_broadcast(&replay->changed);
+        pthread_mutex_unlock(&replay->mutex);
+
+        int ret = issue(replay->fs, record, replay_fd, buf);
+
+        pthread_mutex_lock(&replay->mutex);
+        if(record->op == TRACE_OPEN){
+            replay->opened_fd[i] = ret >= 0 ? ret : -1;
+            pthread_cond_broadcast(&replay->changed);
+        }
+        if(record->op == TRACE_OPEN ? (ret >= 0) != (record->ret >= 0) : ret != record->ret) replay->num_differ++;
+        pthread_mutex_unlock(&replay->mutex);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+
+int main(int argc, char *argv[]){
+    const char *path = NULL;
+    int timed = 0, num_shards = 0, usage = 0;
+    for(int i=1; i<argc; i++){
+        if(strcmp(argv[i], "--timed") == 0) timed = 1;
+        else if(strcmp(argv[i], "--shards") == 0 && i+1 < argc) num_shards = atoi(argv[++i]);
+        else if(path == NULL && argv[i][0] != '-') path = argv[i];
+        else usage = 1;
+    }
+    if(path == NULL || usage){
+        printf("usage: %s trace_path [--timed] [--shards n]\n", argv[0]);
+        return 1;
+    }
+
+    struct replay replay = {0};
+    replay.timed = timed;
+    replay.num_records = load_trace(path, &replay.records);
+    if(replay.num_records < 0) return 1;
+
+    replay.fs = num_shards ? RSFS_init_sharded(num_shards) : RSFS_init();
+    if(replay.fs == NULL) return 1;
+    create_files(replay.fs, replay.records, replay.num_records);
+
+    //drop the file records and order the calls by start time
+    long n = 0;
+    for(long i=0; i<replay.num_records; i++){
+        if(replay.records[i].op != TRACE_FILE) replay.records[n++] = replay.records[i];
+    }
+    replay.num_records = n;
+    qsort(replay.records, n, sizeof(struct trace_record), compare_start);
+
+    //one replay thread per recorded thread
+    static struct replay_thread threads[REPLAY_MAX_THREADS];
+    int num_threads = 0;
+    for(long i=0; i<n; i++){
+        struct trace_record *record = &replay.records[i];
+        int t = 0;
+        while(t < num_threads && threads[t].thread != record->thread) t++;
+        if(t == num_threads){
+            if(num_threads == REPLAY_MAX_THREADS){
+                printf("[replay] the trace has more than %d threads.\n", REPLAY_MAX_THREADS);
+                return 1;
+            }
+            threads[t].replay = &replay;
+            threads[t].thread = record->thread;
+            threads[t].indexes = malloc(sizeof(long) * n);
+            num_threads++;
+        }
+        threads[t].indexes[threads[t].num_indexes++] = i;
+
+        if(record->op == TRACE_APPEND || record->op == TRACE_READ || record->op == TRACE_WRITE){
+            if(record->size > replay.max_size) replay.max_size = record->size;
+        }
+    }
+    replay.source = malloc(sizeof(long) * (n + 1));
+    replay.opened_fd = malloc(sizeof(int) * (n + 1));
+    link_fds(&replay);
+    pthread_mutex_init(&replay.mutex, NULL);
+    pthread_cond_init(&replay.changed, NULL);
+
+    long recorded_ns = 0;
+    for(long i=0; i<n; i++){
+        long end = replay.records[i].start_ns + replay.records[i].duration_ns;
+        if(end > recorded_ns) recorded_ns = end;
+    }
+
+    replay.start_ns = now_ns();
+    for(int t=0; t<num_threads; t++) pthread_create(&threads[t].tid, NULL, replay_thread_main, &threads[t]);
+    for(int t=0; t<num_threads; t++){
+        pthread_join(threads[t].tid, NULL);
+        free(threads[t].indexes);
+    }
+    double elapsed = (now_ns() - replay.start_ns) / 1e9;
+
+    printf("[replay] %ld calls from %d threads in %.3f s (%.0f calls/s); recorded in %.3f s\n",
+        n, num_threads, elapsed, n / elapsed, recorded_ns / 1e9);
+    printf("[replay] %ld calls returned a different result than recorded\n", replay.num_differ);
+
+    RSFS_destroy(replay.fs);
+    free(replay.source);
+    free(replay.opened_fd);
+    free(replay.records);
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+    rsfsd: hosts a file system and serves it to other processes over a Unix
+    domain socket (make rsfsd; ./rsfsd [socket_path [journal_path [device_path]]]);
+    the journal holds metadata only, so restarting on it needs the device
+    that holds the data blocks; clients use RSFS_connect(socket_path) and
+    the usual RSFS_* calls
+*/
+
+#include "def.h"
+#include <signal.h>
+
+#define RSFSD_SOCKET "/tmp/rsfsd.sock" //default socket path
+#define RSFSD_COMMIT_LATENCY_US 1000 //group-commit window of the journal
+#define RSFSD_MAX_BATCH 64
+#define RSFSD_CACHE_FRAMES 32 //frames of the block cache when a device is given
+
+
+int main(int argc, char *argv[]){
+    const char *socket_path = argc > 1 ? argv[1] : RSFSD_SOCKET;
+
+    //SIGINT/SIGTERM are blocked in every thread and taken by sigwait below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    rsfs_t *fs = RSFS_init();
+    if(fs == NULL) return 1;
+    if(argc > 3 && RSFS_cache_open(fs, argv[3], RSFSD_CACHE_FRAMES) < 0){
+        RSFS_destroy(fs);
+        return 1;
+    }
+    if(argc > 2 && RSFS_journal_open(fs, argv[2], RSFSD_COMMIT_LATENCY_US, RSFSD_MAX_BATCH) < 0){
+        RSFS_destroy(fs);
+        return 1;
+    }
+    if(RSFS_serve_start(fs, socket_path) < 0){
+        RSFS_destroy(fs);
+        return 1;
+    }
+    printf("[rsfsd] serving on %s\n", socket_path);
+    fflush(stdout);
+
+    int sig;
+    sigwait(&signals, &sig);
+
+    RSFS_serve_stop(fs);
+    printf("[rsfsd] %ld requests served\n", fs->server.num_requests);
+    RSFS_stat(fs);
+    RSFS_destroy(fs);
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+    sharded namespace;
+    a sharded file system is a router over num_shards independent instances
+    (each with its own allocators, inode table, directory and open-file slots);
+    files are placed by a hash of their name, and a file descriptor returned
+    by the router encodes its shard as fd / NUM_OPEN_FILE
+*/
+
+#include "def.h"
+
+
+//partition holding file_name
+int shard_index(rsfs_t *fs, char file_name){
+    unsigned int h = (unsigned char)file_name * 0x9E3779B1u;
+    return (h >> 16) % fs->num_shards;
+}
+
+//partition of a router fd; *fd is replaced by the fd within that partition
+//(-1 if the router fd is invalid, so that the partition reports the error)
+rsfs_t *shard_of_fd(rsfs_t *fs, int *fd){
+    if(*fd < 0 || *fd >= fs->num_shards * NUM_OPEN_FILE){
+        *fd = -1;
+        return fs->shards[0];
+    }
+    rsfs_t *shard = fs->shards[*fd / NUM_OPEN_FILE];
+    *fd = *fd % NUM_OPEN_FILE;
+    return shard;
+}
+
+//router fd for fd of partition index; errors are passed through
+int shard_fd(int index, int fd){
+    return fd < 0 ? fd : index * NUM_OPEN_FILE + fd;
+}
+
+//the router of a sharded file system and an instance of RSFS_connect hold no
+//inodes or blocks of their own: calls that work on them (journal, block
+//cache, checkpoint, dedup, checksums, defragmentation) are made on each
+//partition (RSFS_shard) or on the server instead; return -1 (and print why)
+//if fs is such an instance, 0 otherwise
+int router_refuse(rsfs_t *fs, const char *caller){
+    if(fs->num_shards){
+        printf("%s not available on a sharded file system: call it on each partition (RSFS_shard).\n", caller);
+        return -1;
+    }
+    if(fs->remote.active){
+        printf("%s not available on a connected instance: call it on the server.\n", caller);
+        return -1;
+    }
+    return 0;
+}
+
+//RSFS_clone between two partitions: the blocks cannot be shared, so the
+//content is copied; return values are the same as RSFS_clone()
+int shard_copy_file(rsfs_t *src_fs, char src_name, rsfs_t *dst_fs, char dst_name){
+    struct dir_entry *dir_entry = search_dir(src_fs, src_name);
+    if(dir_entry == NULL){
+        printf("[RSFS_clone] file (%c) does not exist.\n", src_name);
+        return -1;
+    }
+    int flags = src_fs->inodes[(int)dir_entry->inode_number].flags;
+
+    int src_fd = RSFS_open(src_fs, src_name, RSFS_RDONLY);
+    if(src_fd < 0) return -2;
+    int ret = RSFS_create_ex(dst_fs, dst_name, flags);
+    int dst_fd = ret == 0 ? RSFS_open(dst_fs, dst_name, RSFS_RDWR) : -1;
+
+    if(dst_fd >= 0){
+        char buf[COMPRESS_MAX_CHUNKS*COMPRESS_CHUNK_SIZE];
+        int size = RSFS_read(src_fs, src_fd, buf, sizeof(buf));
+        if(size > 0 && RSFS_append(dst_fs, dst_fd, buf, size) < size) ret = -2;
+        RSFS_close(dst_fs, dst_fd);
+    }
+    RSFS_close(src_fs, src_fd);
+
+    return ret;
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//create a sharded file system of num_shards partitions; RSFS_create, RSFS_open,
+//RSFS_read and the other file calls are routed to the partition of the file;
+//return NULL on failure
+rsfs_t *RSFS_init_sharded(int num_shards){
+    if(num_shards < 1 || num_shards > RSFS_MAX_SHARDS){
+        printf("[RSFS_init_sharded] invalid number of shards (%d).\n", num_shards);
+        return NULL;
+    }
+
+    rsfs_t *fs = calloc(1, sizeof(rsfs_t));
+    if(fs == NULL) return NULL;
+    trace_init(fs);
+    metrics_init(fs);
+
+    for(int i=0; i<num_shards; i++){
+        fs->shards[i] = RSFS_init();
+        if(fs->shards[i] == NULL){
+            RSFS_destroy(fs);
+            return NULL;
+        }
+        fs->num_shards = i + 1;
+    }
+
+    return fs;
+}
+
+//partition index of a sharded file system (to attach a journal, cache, etc.
+//to it); a non-sharded instance is its own single partition
+rsfs_t *RSFS_shard(rsfs_t *fs, int index){
+    if(fs->num_shards == 0) return index == 0 ? fs : NULL;
+    if(index < 0 || index >= fs->num_shards) return NULL;
+    return fs->shards[index];
+}
@@ -0,0 +1,153 @@
+/*
+    shared-memory mode;
+    RSFS_init_shared places a whole instance in one shared memory region (a
+    POSIX shared memory object, or an anonymous mapping inherited by fork),
+    so that cooperating processes use the same files at memory speed
+*/
+
+#include "def.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_ATTACH_TIMEOUT_MS 5000 //how long to wait for the creator to initialize a region
+
+
+//------ synchronization -----------------------------------------------------------------------------------------------
+
+//initialize a mutex of fs; it works across processes if fs is shared
+void shm_mutex_init(rsfs_t *fs, pthread_mutex_t *mutex){
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if(fs->shm.active) pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+//initialize a condition variable of fs; it works across processes if fs is shared
+void shm_cond_init(rsfs_t *fs, pthread_cond_t *cond){
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    if(fs->shm.active) pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+//features that keep a thread, a file descriptor or heap memory of the calling
+//process (journal, block cache, scrubber) cannot be shared with other
+//processes; return -1 if fs is shared, 0 otherwise
+int shm_refuse(rsfs_t *fs, const char *caller){
+    if(!fs->shm.active) return 0;
+    printf("%s not available on a shared file system.\n", caller);
+    return -1;
+}
+
+
+
+//------ regions -------------------------------------------------------------------------------------------------------
+
+//map the region of shared memory object fd, or an anonymous region if fd<0
+static rsfs_t *map_region(int fd){
+    int flags = MAP_SHARED | (fd < 0 ? MAP_ANONYMOUS : 0);
+    rsfs_t *fs = mmap(NULL, sizeof(rsfs_t), PROT_READ | PROT_WRITE, flags, fd, 0);
+    return fs == MAP_FAILED ? NULL : fs;
+}
+
+//initialize a new (zero-filled) region as a file system instance
+static rsfs_t *create_region(const char *name, int fd){
+    rsfs_t *fs = map_region(fd);
+    if(fs == NULL) return NULL;
+
+    fs->shm.active = 1; //before rsfs_setup, so that its locks are process-shared
+    if(name) strcpy(fs->shm.name, name);
+    fs->shm.num_attached = 1;
+    if(rsfs_setup(fs) < 0){
+        munmap(fs, sizeof(rsfs_t));
+        return NULL;
+    }
+
+    __sync_synchronize(); //publish the initialized instance before ready
+    fs->shm.ready = 1;
+
+    return fs;
+}
+
+//map an existing region and wait until its creator has initialized it
+static rsfs_t *attach_region(int fd){
+    struct stat st;
+    for(int ms=0; ; ms++){
+        if(fstat(fd, &st) < 0) return NULL;
+        if(st.st_size > 0 || ms >= SHM_ATTACH_TIMEOUT_MS) break;
+        usleep(1000);
+    }
+    if(st.st_size != sizeof(rsfs_t)){
+        printf("[RSFS_init_shared] the shared memory object does not hold a file system of this build.\n");
+        return NULL;
+    }
+
+    rsfs_t *fs = map_region(fd);
+    if(fs == NULL) return NULL;
+
+    for(int ms=0; !fs->shm.ready; ms++){
+        if(ms >= SHM_ATTACH_TIMEOUT_MS){
+            munmap(fs, sizeof(rsfs_t));
+            return NULL;
+        }
+        usleep(1000);
+    }
+    __sync_synchronize();
+    __sync_fetch_and_add(&fs->shm.num_attached, 1);
+    block_copy_init(); //per-process state that rsfs_setup set up only in the creator
+    metrics_process_init();
+
+    return fs;
+}
+
+//unmap a shared instance from this process; the last process to detach
+//from a named region also removes the shared memory object
+void shm_detach(rsfs_t *fs){
+    int last = __sync_sub_and_fetch(&fs->shm.num_attached, 1) == 0;
+    if(last && fs->shm.name[0]) shm_unlink(fs->shm.name);
+    munmap(fs, sizeof(rsfs_t));
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//create a file system in the shared memory object name (e.g. "/rsfs"), or
+//attach to the one another process already created there; with name NULL
+//the region is anonymous and shared with the children forked afterwards;
+//every process calls RSFS_destroy when done with it; return NULL on failure
+//(the journal, block cache and scrubber are not available in this mode, and
+//a process must not exit while it holds files open or is inside an API call)
+rsfs_t *RSFS_init_shared(const char *name){
+    char *debug_title = "[RSFS_init_shared]";
+
+    if(name == NULL){
+        rsfs_t *fs = create_region(NULL, -1);
+        if(fs == NULL) printf("%s fail to map an anonymous region.\n", debug_title);
+        return fs;
+    }
+    if(strlen(name) >= SHM_NAME_SIZE){
+        printf("%s name (%s) is too long.\n", debug_title, name);
+        return NULL;
+    }
+
+    rsfs_t *fs = NULL;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd >= 0){
+        if(ftruncate(fd, sizeof(rsfs_t)) == 0) fs = create_region(name, fd);
+        if(fs == NULL) shm_unlink(name);
+    }
+    else if(errno == EEXIST){
+        fd = shm_open(name, O_RDWR, 0);
+        if(fd >= 0) fs = attach_region(fd);
+    }
+    if(fd >= 0) close(fd);
+
+    if(fs == NULL) printf("%s fail to create or attach to shared memory object %s.\n", debug_title, name);
+    return fs;
+}
@@ -0,0 +1,277 @@
+/*
+    stats snapshots;
+    the counters and per-file figures RSFS_stat reports are kept up to date
+    by the code changing the state they mirror, so a snapshot is one copy of
+    struct stats rather than a rescan of the bitmaps and inodes; the copy is
+    taken without a lock, retrying while an update is in progress
+*/
+
+#include "def.h"
+#include <sched.h>
+#include <stddef.h>
+
+
+//enter and leave an update of fs->stats; the increment of begun is a full
+//barrier, so a snapshot that sees it unchanged saw none of the update
+static void stats_begin(rsfs_t *fs){
+    __atomic_fetch_add(&fs->stats.begun, 1, __ATOMIC_SEQ_CST);
+}
+
+static void stats_end(rsfs_t *fs){
+    __atomic_fetch_add(&fs->stats.ended, 1, __ATOMIC_RELEASE);
+}
+
+//count a block going from old_refcount to new_refcount references (inside an update)
+static void add_refcount(rsfs_t *fs, int old_refcount, int new_refcount){
+    fs->stats.used_blocks += (new_refcount > 0) - (old_refcount > 0);
+    fs->stats.shared_blocks += (new_refcount > 1) - (old_refcount > 1);
+    fs->stats.saved_blocks += (new_refcount > 1 ? new_refcount - 1 : 0) - (old_refcount > 1 ? old_refcount - 1 : 0);
+}
+
+//recompute the row of inode_number (inside an update)
+static void file_row(rsfs_t *fs, int inode_number){
+    struct rsfs_file_stat *row = &fs->stats.inodes[inode_number];
+    struct inode *node = &fs->inodes[inode_number];
+    int num_open = row->num_open;
+    memset(row, 0, sizeof(*row));
+    row->num_open = num_open;
+    row->inode_number = inode_number;
+    if(inode_number >= fs->num_inodes || !fs->inode_bitmap[inode_number]) return;
+
+    row->length = node->length;
+    row->flags = node->flags;
+    for(int i=0; i<NUM_POINTERS; i++) row->num_blocks += node->block[i] >= 0;
+    row->stored_bytes = (node->flags & RSFS_COMPRESSED) ? compressed_stored_size(node) : node->length;
+}
+
+//copy the stats of one instance into *copy, retrying until no update ran
+//during the copy
+static void copy_stats(rsfs_t *fs, struct stats *copy){
+    for(;;){
+        long ended = __atomic_load_n(&fs->stats.ended, __ATOMIC_SEQ_CST);
+        long begun = __atomic_load_n(&fs->stats.begun, __ATOMIC_SEQ_CST);
+        if(begun == ended){
+            memcpy(copy, &fs->stats, sizeof(*copy));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&fs->stats.begun, __ATOMIC_SEQ_CST) == begun) return;
+        }
+        sched_yield(); //let the writer finish
+    }
+}
+
+//fill *file with the file in directory slot of copy; return 0 if the slot is empty
+static int file_of_slot(struct stats *copy, int slot, struct rsfs_file_stat *file){
+    if(copy->dir_name[slot] == 0) return 0;
+    *file = copy->inodes[(int)copy->dir_inode[slot]];
+    file->name = copy->dir_name[slot];
+    return 1;
+}
+
+//instance holding partition index of fs (fs itself if it is not sharded)
+static rsfs_t *partition(rsfs_t *fs, int index){
+    return fs->num_shards ? fs->shards[index] : fs;
+}
+
+//add the snapshot of fs (or of its partitions) to *stats
+static void add_snapshot(rsfs_t *fs, struct rsfs_stats *stats){
+    if(fs->num_shards){
+        for(int i=0; i<fs->num_shards; i++) add_snapshot(fs->shards[i], stats);
+        return;
+    }
+
+    struct stats snapshot;
+    struct stats *copy = &snapshot;
+    copy_stats(fs, copy);
+
+    stats->total_blocks += copy->total_blocks;
+    stats->used_blocks += copy->used_blocks;
+    stats->shared_blocks += copy->shared_blocks;
+    stats->saved_blocks += copy->saved_blocks;
+    stats->total_inodes += copy->total_inodes;
+    stats->used_inodes += copy->used_inodes;
+    stats->open_files += copy->open_files;
+    stats->generation += copy->ended;
+    for(int slot=0; slot<MAX_INODES-1 && stats->num_files<RSFS_MAX_FILES; slot++){
+        stats->num_files += file_of_slot(copy, slot, &stats->files[stats->num_files]);
+    }
+}
+
+
+
+//------ routines called by the mutators -------------------------------------------------------------------------------
+
+//hold snapshots back until stats_release, so that they see the updates made
+//in between (a transaction) all at once, or none of them
+void stats_hold(rsfs_t *fs){
+    stats_begin(fs);
+}
+
+void stats_release(rsfs_t *fs){
+    stats_end(fs);
+}
+
+//recompute everything from the bitmaps, inodes, directory and open file
+//table (after setup, restore, recovery, or a block cache replaced the root
+//directory block), with no other update running
+void stats_rebuild(rsfs_t *fs){
+    stats_begin(fs);
+
+    fs->stats.used_blocks = fs->stats.shared_blocks = fs->stats.saved_blocks = 0;
+    for(int i=0; i<fs->num_dblocks; i++) add_refcount(fs, 0, fs->data_refcount[i]);
+    fs->stats.used_inodes = 0;
+    for(int i=0; i<fs->num_inodes; i++) fs->stats.used_inodes += fs->inode_bitmap[i];
+    fs->stats.total_blocks = fs->num_dblocks;
+    fs->stats.total_inodes = fs->num_inodes;
+
+    fs->stats.open_files = 0;
+    for(int i=0; i<MAX_INODES; i++) fs->stats.inodes[i].num_open = 0;
+    for(int i=0; i<NUM_OPEN_FILE; i++){
+        if(!fs->open_file_table[i].used) continue;
+        fs->stats.open_files++;
+        fs->stats.inodes[fs->open_file_table[i].inode_number].num_open++;
+    }
+    for(int i=0; i<MAX_INODES; i++) file_row(fs, i);
+
+    struct dir_entry *entries = root_dir_entries(fs);
+    for(int slot=0; slot<MAX_INODES-1; slot++){
+        fs->stats.dir_name[slot] = entries ? entries[slot].name : 0;
+        fs->stats.dir_inode[slot] = entries ? entries[slot].inode_number : 0;
+    }
+
+    stats_end(fs);
+}
+
+//a block went from old_refcount to new_refcount references (0: free)
+void stats_refcount(rsfs_t *fs, int old_refcount, int new_refcount){
+    stats_begin(fs);
+    add_refcount(fs, old_refcount, new_refcount);
+    stats_end(fs);
+}
+
+//the block pool grew or shrank
+void stats_pool_size(rsfs_t *fs){
+    stats_begin(fs);
+    fs->stats.total_blocks = fs->num_dblocks;
+    stats_end(fs);
+}
+
+//the inode table grew or shrank
+void stats_table_size(rsfs_t *fs){
+    stats_begin(fs);
+    fs->stats.total_inodes = fs->num_inodes;
+    stats_end(fs);
+}
+
+//delta inodes were allocated (or freed, if negative)
+void stats_inodes(rsfs_t *fs, int delta){
+    stats_begin(fs);
+    fs->stats.used_inodes += delta;
+    stats_end(fs);
+}
+
+//a file descriptor was opened on inode_number (delta 1) or closed (-1)
+void stats_open(rsfs_t *fs, int inode_number, int delta){
+    stats_begin(fs);
+    fs->stats.open_files += delta;
+    fs->stats.inodes[inode_number].num_open += delta;
+    stats_end(fs);
+}
+
+//directory slot now names inode_number as name (0: empty)
+void stats_dir(rsfs_t *fs, int slot, char name, char inode_number){
+    stats_begin(fs);
+    fs->stats.dir_name[slot] = name;
+    fs->stats.dir_inode[slot] = inode_number;
+    stats_end(fs);
+}
+
+//the length, block map or flags of inode_number changed, or it was
+//allocated or freed
+void stats_file(rsfs_t *fs, int inode_number){
+    stats_begin(fs);
+    file_row(fs, inode_number);
+    stats_end(fs);
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//fill *stats with a snapshot of fs: block, inode and open file counts, and
+//the length, block count and open descriptors of every file; taken without
+//a lock, so it may be polled often without slowing the file calls down (the
+//snapshot of a sharded file system is consistent per partition);
+//return 0 if succeed, or -1 if fs is hosted by a server
+int RSFS_stat_snapshot(rsfs_t *fs, struct rsfs_stats *stats){
+    memset(stats, 0, offsetof(struct rsfs_stats, files)); //files are filled up to num_files
+    if(fs->remote.active){
+        printf("[RSFS_stat_snapshot] the file system is hosted by the server.\n");
+        return -1;
+    }
+    add_snapshot(fs, stats);
+    return 0;
+}
+
+//list the files of fs in directory order, max at a time: fill out with the
+//files from *cursor (0 for the first call) on and move *cursor past them;
+//each call reads one snapshot per partition it visits, so files created or
+//deleted between calls may or may not be listed, but none is listed twice;
+//return the number of files filled (0 once all were listed), or -1 if fs is
+//hosted by a server
+int RSFS_readdir(rsfs_t *fs, int *cursor, struct rsfs_file_stat *out, int max){
+    if(fs->remote.active){
+        printf("[RSFS_readdir] the file system is hosted by the server.\n");
+        return -1;
+    }
+
+    int num_partitions = fs->num_shards ? fs->num_shards : 1;
+    int num_filled = 0;
+    struct stats copy;
+    while(num_filled < max && *cursor >= 0 && *cursor < num_partitions * (MAX_INODES - 1)){
+        copy_stats(partition(fs, *cursor / (MAX_INODES - 1)), &copy);
+        for(int slot = *cursor % (MAX_INODES - 1); slot < MAX_INODES - 1 && num_filled < max; slot++){
+            num_filled += file_of_slot(&copy, slot, &out[num_filled]);
+            (*cursor)++;
+        }
+    }
+    return num_filled;
+}
+
+//fill out[i] with the length, block count, inode number etc. of file
+//names[i], for count names (inode_number is -1 for a file that does not
+//exist); no file is opened and no lock is taken, so writers are not held up;
+//return the number of files found, or -1 if fs is hosted by a server
+int RSFS_stat_many(rsfs_t *fs, const char *names, int count, struct rsfs_file_stat *out){
+    if(fs->remote.active){
+        printf("[RSFS_stat_many] the file system is hosted by the server.\n");
+        return -1;
+    }
+
+    for(int i=0; i<count; i++){
+        memset(&out[i], 0, sizeof(out[i]));
+        out[i].name = names[i];
+        out[i].inode_number = -1;
+    }
+
+    //one snapshot per partition holding any of the names
+    int num_partitions = fs->num_shards ? fs->num_shards : 1;
+    int num_found = 0;
+    struct stats copy;
+    for(int index=0; index<num_partitions; index++){
+        int copied = 0;
+        for(int i=0; i<count; i++){
+            if(fs->num_shards && shard_index(fs, names[i]) != index) continue;
+            if(!copied){
+                copy_stats(partition(fs, index), &copy);
+                copied = 1;
+            }
+            for(int slot=0; slot<MAX_INODES-1; slot++){
+                if(copy.dir_name[slot] == names[i] && file_of_slot(&copy, slot, &out[i])){
+                    num_found++;
+                    break;
+                }
+            }
+        }
+    }
+    return num_found;
+}
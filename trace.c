@@ -0,0 +1,157 @@
+/*
+    workload tracing;
+    RSFS_trace_start records every file call made on an instance (caller
+    thread, arguments, result, start time and duration) in a compact binary
+    trace, which the replay program re-issues against a fresh instance
+*/
+
+#include "def.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+static __thread int trace_tid; //OS thread id of this thread, once looked up
+
+
+//write out the buffered records (trace.mutex held); records that cannot be
+//written are counted as dropped
+static void trace_flush_locked(rsfs_t *fs){
+    long size = fs->trace.num_buffered * sizeof(struct trace_record);
+    long done = 0;
+    while(done < size){
+        long ret = write(fs->trace.fd, (char *)fs->trace.buf + done, size - done);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) break;
+        done += ret;
+    }
+    if(done < size){
+        fs->trace.num_dropped += fs->trace.num_buffered;
+        fs->trace.num_records -= fs->trace.num_buffered;
+    }
+    fs->trace.num_buffered = 0;
+}
+
+//buffer a record (trace.mutex held)
+static void trace_append_locked(rsfs_t *fs, struct trace_record *record){
+    if(fs->trace.num_buffered == TRACE_BUF_RECORDS) trace_flush_locked(fs);
+    fs->trace.buf[fs->trace.num_buffered++] = *record;
+    fs->trace.num_records++;
+}
+
+//record the files of fs (or of its partitions) as they are when the trace
+//starts, so that a replay begins with the same files
+static void trace_files(rsfs_t *fs, rsfs_t *target){
+    if(target->num_shards){
+        for(int i=0; i<target->num_shards; i++) trace_files(fs, target->shards[i]);
+        return;
+    }
+
+    pthread_mutex_lock(&target->root_dir_mutex);
+    struct dir_entry *entries = root_dir_entries(target);
+    for(int i=0; entries && i<(int)(BLOCK_SIZE/sizeof(struct dir_entry)); i++){
+        if(entries[i].name == 0) continue;
+        struct inode *node = &target->inodes[(int)entries[i].inode_number];
+        struct trace_record record = {0};
+        record.op = TRACE_FILE;
+        record.name = entries[i].name;
+        record.arg = node->flags;
+        record.size = node->length;
+        record.fd = -1;
+        trace_append_locked(fs, &record);
+    }
+    pthread_mutex_unlock(&target->root_dir_mutex);
+}
+
+
+
+//------ routines called by the API ------------------------------------------------------------------------------------
+
+//prepare the trace state of a new instance
+void trace_init(rsfs_t *fs){
+    shm_mutex_init(fs, &fs->trace.mutex);
+}
+
+//record a call of op that ran from start_ns to end_ns and returned ret
+void trace_call(rsfs_t *fs, long start_ns, long end_ns, int op, int fd, char name, int arg, int size, int ret){
+    if(trace_tid == 0) trace_tid = syscall(SYS_gettid);
+
+    struct trace_record record;
+    record.thread = trace_tid;
+    record.op = op;
+    record.name = name;
+    record.arg = arg;
+    record.fd = fd;
+    record.size = size;
+    record.ret = ret;
+    record.duration_ns = end_ns - start_ns;
+
+    pthread_mutex_lock(&fs->trace.mutex);
+    if(fs->trace.active){
+        record.start_ns = start_ns - fs->trace.start_ns;
+        trace_append_locked(fs, &record);
+    }
+    pthread_mutex_unlock(&fs->trace.mutex);
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//record every file call on fs into a new trace at path, starting with the
+//files that exist now (those of a remote instance are not visible to it);
+//return 0 if succeed; otherwise return a negative value
+int RSFS_trace_start(rsfs_t *fs, const char *path){
+    char *debug_title = "[RSFS_trace_start]";
+
+    if(shm_refuse(fs, debug_title) < 0) return -1;
+    if(fs->trace.active){
+        printf("%s a trace is already being recorded.\n", debug_title);
+        return -1;
+    }
+
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    struct trace_header header = {TRACE_MAGIC, TRACE_VERSION, BLOCK_SIZE, NUM_POINTERS};
+    if(fd < 0 || write(fd, &header, sizeof(header)) != sizeof(header)){
+        if(fd >= 0) close(fd);
+        printf("%s fail to create %s.\n", debug_title, path);
+        return -2;
+    }
+    struct trace_record *buf = malloc(TRACE_BUF_RECORDS * sizeof(struct trace_record));
+    if(buf == NULL){
+        close(fd);
+        return -3;
+    }
+
+    pthread_mutex_lock(&fs->trace.mutex);
+    fs->trace.fd = fd;
+    fs->trace.buf = buf;
+    fs->trace.num_buffered = 0;
+    fs->trace.num_records = 0;
+    fs->trace.num_dropped = 0;
+    fs->trace.start_ns = metrics_now();
+    if(!fs->remote.active) trace_files(fs, fs);
+    fs->trace.active = 1;
+    pthread_mutex_unlock(&fs->trace.mutex);
+
+    return 0;
+}
+
+//stop recording and close the trace; return the number of records written
+//(calls still running when it stops are not recorded)
+long RSFS_trace_stop(rsfs_t *fs){
+    pthread_mutex_lock(&fs->trace.mutex);
+    long num_records = 0;
+    if(fs->trace.active){
+        fs->trace.active = 0;
+        trace_flush_locked(fs);
+        fsync(fs->trace.fd);
+        close(fs->trace.fd);
+        free(fs->trace.buf);
+        fs->trace.buf = NULL;
+        num_records = fs->trace.num_records;
+        if(fs->trace.num_dropped) printf("[RSFS_trace_stop] %ld records could not be written.\n", fs->trace.num_dropped);
+    }
+    pthread_mutex_unlock(&fs->trace.mutex);
+    return num_records;
+}
@@ -0,0 +1,428 @@
+/*
+    multi-file transactions;
+    RSFS_txn_begin starts staging creates, deletes, writes and appends on
+    several files, and RSFS_txn_commit applies all of them or none: the files
+    are held for writing in inode order (so two commits cannot deadlock), the
+    staged operations are checked against the files before anything changes,
+    the blocks they may need are allocated in one batch, their journal
+    records are queued as one transaction, and snapshots see the result at once
+*/
+
+#include "def.h"
+
+
+//one file named by a transaction while it commits
+struct txn_file{
+    char name;
+    int inode_number; //-1 while the file does not exist
+    int held; //1 while the file is held for writing
+    int deleted; //1 once a staged delete removed it (released after the journal)
+    int exists, length, flags; //state of the file as the staged operations run, when checking them
+    char block[NUM_POINTERS]; //and of its blocks: -1 none, 0 its own, 1 shared (copied when written)
+    short stored[COMPRESS_MAX_CHUNKS]; //and, for a compressed file, of its stored chunk sizes
+    char data[COMPRESS_MAX_CHUNKS * COMPRESS_CHUNK_SIZE]; //and content
+};
+
+//get exclusive access to a file, waiting for its descriptors to close as
+//RSFS_open with RSFS_RDWR does
+static void hold_file(rsfs_t *fs, int inode_number){
+    struct inode *node = &fs->inodes[inode_number];
+    pthread_mutex_lock(&node->rw_mutex);
+    while(node->reader_count > 0 || node->writer_active){
+        event_record(fs, EVENT_WAIT_BEGIN, 0, inode_number);
+        pthread_cond_wait(&node->rw_cond, &node->rw_mutex);
+        event_record(fs, EVENT_WAIT_END, 0, inode_number);
+    }
+    node->writer_active = 1;
+    pthread_mutex_unlock(&node->rw_mutex);
+}
+
+static void drop_file(rsfs_t *fs, int inode_number){
+    struct inode *node = &fs->inodes[inode_number];
+    pthread_mutex_lock(&node->rw_mutex);
+    node->writer_active = 0;
+    pthread_cond_broadcast(&node->rw_cond);
+    pthread_mutex_unlock(&node->rw_mutex);
+}
+
+static void drop_files(rsfs_t *fs, struct txn_file *files, int num_files){
+    for(int i=0; i<num_files; i++){
+        if(files[i].held) drop_file(fs, files[i].inode_number);
+        files[i].held = 0;
+    }
+}
+
+//inode number of file_name, or -1 if it does not exist
+static int inode_of(rsfs_t *fs, char file_name){
+    struct dir_entry *dir_entry = search_dir(fs, file_name);
+    return dir_entry ? dir_entry->inode_number : -1;
+}
+
+//hold every existing file of files for writing, in increasing inode order;
+//a name that moved to another inode (or was created or deleted) while
+//waiting makes it start over
+static void hold_files(rsfs_t *fs, struct txn_file *files, int num_files){
+    for(;;){
+        for(int i=0; i<num_files; i++) files[i].inode_number = inode_of(fs, files[i].name);
+
+        int order[RSFS_TXN_MAX_OPS];
+        for(int i=0; i<num_files; i++){
+            int j = i;
+            for(; j>0 && files[order[j-1]].inode_number > files[i].inode_number; j--) order[j] = order[j-1];
+            order[j] = i;
+        }
+        for(int k=0; k<num_files; k++){
+            struct txn_file *file = &files[order[k]];
+            if(file->inode_number < 0) continue;
+            hold_file(fs, file->inode_number);
+            file->held = 1;
+        }
+
+        int moved = 0;
+        for(int i=0; i<num_files; i++) moved |= inode_of(fs, files[i].name) != files[i].inode_number;
+        if(!moved) return;
+        drop_files(fs, files, num_files);
+    }
+}
+
+//count the blocks of file first..last that a write needs: the missing ones
+//and copies of the shared ones, or all of them for a compressed file (its
+//stream is rebuilt in fresh blocks); they become the file's own, or shared
+//again if dedup may share them once written
+static int write_blocks(rsfs_t *fs, struct txn_file *file, int first, int last){
+    int count = 0;
+    for(int i=first; i<=last; i++){
+        if(file->block[i] != 0 || (file->flags & RSFS_COMPRESSED)) count++;
+        file->block[i] = fs->dedup.enabled && !(file->flags & RSFS_COMPRESSED);
+    }
+    return count;
+}
+
+//run the staged operations on the state of files without changing anything:
+//fill *num_inodes and *num_blocks with the inodes and data blocks they need;
+//return 0 if they can all succeed, or -1
+static int check_ops(rsfs_t *fs, rsfs_txn_t *txn, struct txn_file *files, int num_files, int *num_inodes, int *num_blocks){
+    char *debug_title = "[RSFS_txn_commit]";
+
+    //with dedup on, a block of a file held for writing may still gain a
+    //reference from another file, so each one counts as shared
+    for(int i=0; i<num_files; i++){
+        struct txn_file *file = &files[i];
+        file->exists = file->inode_number >= 0;
+        file->deleted = 0;
+        if(!file->exists) continue;
+
+        struct inode *node = &fs->inodes[file->inode_number];
+        file->length = node->length;
+        file->flags = node->flags;
+        for(int j=0; j<NUM_POINTERS; j++){
+            int block_number = node->block[j];
+            file->block[j] = block_number < 0 ? -1 : fs->dedup.enabled || fs->data_refcount[block_number] > 1;
+        }
+        if(file->flags & RSFS_COMPRESSED){
+            for(int c=0; c<COMPRESS_MAX_CHUNKS; c++) file->stored[c] = node->chunk_len[c] < 0 ? -node->chunk_len[c] : node->chunk_len[c];
+            if(compressed_read(fs, file->inode_number, 0, file->data, file->length) < file->length){
+                printf("%s file (%c) cannot be read.\n", debug_title, file->name);
+                return -1;
+            }
+        }
+    }
+
+    *num_inodes = *num_blocks = 0;
+    for(int i=0; i<txn->num_ops; i++){
+        struct txn_op *op = &txn->ops[i];
+        struct txn_file *file = files;
+        while(file->name != op->name) file++;
+
+        if(op->type == TXN_CREATE){
+            //a name deleted earlier keeps its directory slot until the commit ends
+            if(file->exists || file->deleted){
+                printf("%s operation %d: file (%c) already exists.\n", debug_title, i, op->name);
+                return -1;
+            }
+            file->exists = 1;
+            file->length = 0;
+            file->flags = op->flags;
+            memset(file->block, -1, NUM_POINTERS);
+            memset(file->stored, 0, sizeof(file->stored));
+            (*num_inodes)++;
+            continue;
+        }
+        if(!file->exists){
+            printf("%s operation %d: file (%c) does not exist.\n", debug_title, i, op->name);
+            return -1;
+        }
+        if(op->type == TXN_DELETE){
+            file->exists = 0;
+            file->deleted = 1;
+            continue;
+        }
+
+        int position = op->type == TXN_WRITE ? op->position : file->length;
+        int compressed = file->flags & RSFS_COMPRESSED;
+        int max_length = compressed ? COMPRESS_MAX_CHUNKS * COMPRESS_CHUNK_SIZE : NUM_POINTERS * BLOCK_SIZE;
+        if(position > file->length || position + op->size > max_length){
+            printf("%s operation %d: %d bytes at %d do not fit file (%c) of length %d.\n",
+                debug_title, i, op->size, position, op->name, file->length);
+            return -1;
+        }
+
+        //the blocks rewritten: those of the bytes written, or from the first
+        //recompressed chunk to the end of the packed stream; a truncation
+        //frees those past the new end
+        int first, end;
+        if(compressed){
+            first = compressed_plan(file->data, &file->length, file->stored, position, op->data, op->size, op->type == TXN_WRITE, &end);
+            if(first < 0){
+                printf("%s operation %d: the data of file (%c) does not fit its blocks once compressed.\n", debug_title, i, op->name);
+                return -1;
+            }
+        }else{
+            first = position;
+            end = position + op->size;
+            if(op->type == TXN_WRITE || end > file->length) file->length = end;
+        }
+        *num_blocks += write_blocks(fs, file, first / BLOCK_SIZE, (end - 1) / BLOCK_SIZE);
+        if(compressed || op->type == TXN_WRITE){
+            for(int j=(end + BLOCK_SIZE - 1) / BLOCK_SIZE; j<NUM_POINTERS; j++) file->block[j] = -1;
+        }
+    }
+    return 0;
+}
+
+//release what a deleted file held, as RSFS_delete does once its deletion is
+//queued to the journal
+static void release_file(rsfs_t *fs, struct txn_file *file){
+    struct inode *inode = &fs->inodes[file->inode_number];
+
+    inode_meta_begin(inode);
+    for(int i = 0; i < NUM_POINTERS; i++){
+        if(inode->block[i] >= 0) free_data_block(fs, inode->block[i]);
+        inode->block[i] = -1;
+    }
+    inode_meta_end(inode);
+
+    free_inode(fs, file->inode_number);
+    stats_file(fs, file->inode_number);
+    delete_dir(fs, file->name);
+    watch_notify(fs, file->inode_number, RSFS_WATCH_DELETE);
+}
+
+//apply the checked operations of txn with the inodes in new_inodes for its
+//creates, logging each to its own txns[i]; the check and the reserved blocks
+//make every write complete
+static void apply_ops(rsfs_t *fs, rsfs_txn_t *txn, struct txn_file *files, int *new_inodes, struct journal_txn *txns){
+    for(int i=0; i<txn->num_ops; i++){
+        struct txn_op *op = &txn->ops[i];
+        struct txn_file *file = files;
+        while(file->name != op->name) file++;
+        journal_txn_begin(&txns[i]);
+
+        if(op->type == TXN_CREATE){
+            //held before it gets a name, so that nobody opens it before the commit ends
+            file->inode_number = *new_inodes++;
+            hold_file(fs, file->inode_number);
+            file->held = 1;
+            fs->inodes[file->inode_number].flags = op->flags;
+            stats_file(fs, file->inode_number);
+
+            struct dir_entry *dir_entry = insert_dir(fs, file->name, file->inode_number);
+            journal_log_inode(fs, &txns[i], file->inode_number);
+            journal_log_dirent(fs, &txns[i], dir_entry);
+        }
+        else if(op->type == TXN_DELETE){
+            struct inode *inode = &fs->inodes[file->inode_number];
+            journal_log_inode_free(fs, &txns[i], file->inode_number);
+            for(int j = 0; j < NUM_POINTERS; j++){
+                if(inode->block[j] >= 0) journal_log_dblock(fs, &txns[i], inode->block[j], 0);
+            }
+            journal_log_dirent_free(fs, &txns[i], search_dir(fs, file->name));
+            file->deleted = 1;
+        }
+        else{
+            int position = op->type == TXN_WRITE ? op->position : fs->inodes[file->inode_number].length;
+            inode_write(fs, file->inode_number, position, op->data, op->size, op->type == TXN_WRITE, &txns[i]);
+        }
+    }
+}
+
+//stage an operation of type on file_name with a copy of size bytes of buf;
+//return it, or NULL if the transaction is full or out of memory
+static struct txn_op *stage(rsfs_txn_t *txn, int type, char file_name, void *buf, int size, const char *caller){
+    if(txn->num_ops == RSFS_TXN_MAX_OPS){
+        printf("%s the transaction already holds %d operations.\n", caller, RSFS_TXN_MAX_OPS);
+        return NULL;
+    }
+    struct txn_op *op = &txn->ops[txn->num_ops];
+    memset(op, 0, sizeof(*op));
+    if(size > 0){
+        op->data = malloc(size);
+        if(op->data == NULL){
+            printf("%s fail to copy %d bytes.\n", caller, size);
+            return NULL;
+        }
+        memcpy(op->data, buf, size);
+    }
+    op->type = type;
+    op->name = file_name;
+    op->size = size;
+    txn->num_ops++;
+    return op;
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//start staging a transaction on fs; nothing changes until RSFS_txn_commit;
+//return it, or NULL if fs is hosted by a server or out of memory
+rsfs_txn_t *RSFS_txn_begin(rsfs_t *fs){
+    if(fs->remote.active){
+        printf("[RSFS_txn_begin] the file system is hosted by the server.\n");
+        return NULL;
+    }
+    rsfs_txn_t *txn = calloc(1, sizeof(rsfs_txn_t));
+    if(txn == NULL){
+        printf("[RSFS_txn_begin] fail to allocate the transaction.\n");
+        return NULL;
+    }
+    txn->fs = fs;
+    return txn;
+}
+
+//stage the creation of an empty file with flags (as RSFS_create_ex);
+//return 0 if staged, or -1
+int RSFS_txn_create(rsfs_txn_t *txn, char file_name, int flags){
+    if(file_name == 0 || (flags & ~RSFS_COMPRESSED)){
+        printf("[RSFS_txn_create] invalid file name or flags (%d).\n", flags);
+        return -1;
+    }
+    struct txn_op *op = stage(txn, TXN_CREATE, file_name, NULL, 0, "[RSFS_txn_create]");
+    if(op == NULL) return -1;
+    op->flags = flags;
+    return 0;
+}
+
+//stage the deletion of a file; return 0 if staged, or -1
+int RSFS_txn_delete(rsfs_txn_t *txn, char file_name){
+    return stage(txn, TXN_DELETE, file_name, NULL, 0, "[RSFS_txn_delete]") ? 0 : -1;
+}
+
+//stage writing size bytes of buf at offset (at most the length of the file
+//by then), the file ending after them as with RSFS_write; return 0 if
+//staged, or -1
+int RSFS_txn_write(rsfs_txn_t *txn, char file_name, int offset, void *buf, int size){
+    if(offset < 0 || size <= 0){
+        printf("[RSFS_txn_write] invalid offset (%d) or size (%d).\n", offset, size);
+        return -1;
+    }
+    struct txn_op *op = stage(txn, TXN_WRITE, file_name, buf, size, "[RSFS_txn_write]");
+    if(op == NULL) return -1;
+    op->position = offset;
+    return 0;
+}
+
+//stage appending size bytes of buf to a file; return 0 if staged, or -1
+int RSFS_txn_append(rsfs_txn_t *txn, char file_name, void *buf, int size){
+    if(size <= 0){
+        printf("[RSFS_txn_append] invalid size (%d).\n", size);
+        return -1;
+    }
+    return stage(txn, TXN_APPEND, file_name, buf, size, "[RSFS_txn_append]") ? 0 : -1;
+}
+
+//drop the staged operations and free txn
+void RSFS_txn_abort(rsfs_txn_t *txn){
+    for(int i=0; i<txn->num_ops; i++) free(txn->ops[i].data);
+    free(txn);
+}
+
+//apply the staged operations in order, all of them or none, and free txn;
+//they are checked first (a create of an existing file, an operation on a
+//missing one, data past the maximum file size, or compressed data that does
+//not fit the blocks of its file fails the transaction); the files are held
+//as if open for writing meanwhile, so the call waits for their descriptors to
+//close (a thread holding one of them must not commit), and their watches are
+//woken once the result is published; return 0 if succeed, -1 if the
+//operations cannot all succeed (or the files live in several partitions of
+//a sharded fs), or -2 if there are not enough free inodes or blocks (the
+//blocks needed are exact with dedup off; with it on, every block a file
+//holds counts as one that may need a copy), or -3 if it was applied but the
+//journal failed to make it durable
+int RSFS_txn_commit(rsfs_txn_t *txn){
+    char *debug_title = "[RSFS_txn_commit]";
+    rsfs_t *fs = txn->fs;
+
+    //sharded: the partition holding every file commits them
+    if(fs->num_shards){
+        int index = txn->num_ops ? shard_index(fs, txn->ops[0].name) : 0;
+        for(int i=1; i<txn->num_ops; i++){
+            if(shard_index(fs, txn->ops[i].name) == index) continue;
+            printf("%s the files of a transaction must live in one partition.\n", debug_title);
+            RSFS_txn_abort(txn);
+            return -1;
+        }
+        txn->fs = fs->shards[index];
+        return RSFS_txn_commit(txn);
+    }
+
+    struct txn_file files[RSFS_TXN_MAX_OPS];
+    int num_files = 0;
+    for(int i=0; i<txn->num_ops; i++){
+        int j = 0;
+        while(j < num_files && files[j].name != txn->ops[i].name) j++;
+        if(j < num_files) continue;
+        memset(&files[num_files], 0, sizeof(files[0]));
+        files[num_files++].name = txn->ops[i].name;
+    }
+
+    hold_files(fs, files, num_files);
+    pthread_rwlock_rdlock(&fs->mutator_lock);
+
+    int ret = 0, num_inodes, num_blocks;
+    int new_inodes[RSFS_TXN_MAX_OPS], num_allocated = 0;
+    int blocks[RSFS_TXN_MAX_OPS * NUM_POINTERS];
+    struct journal_txn txns[RSFS_TXN_MAX_OPS];
+    unsigned int seq = 0;
+
+    if(check_ops(fs, txn, files, num_files, &num_inodes, &num_blocks) < 0) ret = -1;
+
+    //everything below is seen by snapshots at once
+    if(ret == 0) stats_hold(fs);
+
+    //allocate what the operations need up front, so that they cannot fail half way
+    for(; ret == 0 && num_allocated < num_inodes; num_allocated++){
+        new_inodes[num_allocated] = allocate_inode(fs);
+        if(new_inodes[num_allocated] < 0) ret = -2;
+    }
+    if(ret == 0 && reserve_data_blocks(fs, blocks, num_blocks) < 0) ret = -2;
+    if(ret == -2){
+        printf("%s fail to allocate %d inodes and %d data blocks.\n", debug_title, num_inodes, num_blocks);
+        for(int i=0; i<num_allocated; i++){
+            if(new_inodes[i] >= 0) free_inode(fs, new_inodes[i]);
+        }
+    }
+
+    if(ret == 0){
+        watch_defer(fs);
+        apply_ops(fs, txn, files, new_inodes, txns);
+        release_data_blocks(fs);
+
+        //the records of every operation form one journal transaction; deleted
+        //files are released after it is queued, as RSFS_delete does
+        seq = journal_txns_queue(fs, txns, txn->num_ops);
+        for(int i=0; i<num_files; i++){
+            if(files[i].deleted) release_file(fs, &files[i]);
+        }
+    }
+
+    if(ret != -1) stats_release(fs);
+    pthread_rwlock_unlock(&fs->mutator_lock);
+    drop_files(fs, files, num_files);
+    if(ret == 0) watch_flush(fs);
+
+    if(journal_wait(fs, seq) < 0) ret = -3;
+
+    RSFS_txn_abort(txn);
+    return ret;
+}
@@ -0,0 +1,280 @@
+/*
+    change notification;
+    RSFS_watch subscribes to appends, writes, truncations, deletion and
+    closes after writing on one file; the events are coalesced into a mask
+    per watch, which RSFS_watch_wait returns (blocking until one arrives),
+    and an eventfd per watch becomes readable when the mask goes from empty
+    to non-empty, so consumers can also poll() or epoll() for it
+*/
+
+#include "def.h"
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+//events held back for the calling thread (watch_defer), per watch handle;
+//watch_flush delivers them
+static __thread struct{
+    rsfs_t *fs;
+    int events[RSFS_MAX_WATCHES];
+} deferred;
+
+//the watch of handle, or NULL if handle is not in use
+static struct watch *watch_of(rsfs_t *fs, int handle){
+    if(handle < 0 || handle >= RSFS_MAX_WATCHES || !fs->watches.list[handle].used) return NULL;
+    return &fs->watches.list[handle];
+}
+
+//instance holding the watch of a router handle; *handle becomes the handle within it
+static rsfs_t *shard_of_watch(rsfs_t *fs, int *handle){
+    if(*handle < 0 || *handle >= fs->num_shards * RSFS_MAX_WATCHES){
+        *handle = -1;
+        return fs->shards[0];
+    }
+    rsfs_t *shard = fs->shards[*handle / RSFS_MAX_WATCHES];
+    *handle = *handle % RSFS_MAX_WATCHES;
+    return shard;
+}
+
+//refuse the calls a remote instance cannot serve (eventfds are not forwarded)
+static int remote_refuse(rsfs_t *fs, const char *caller){
+    if(!fs->remote.active) return 0;
+    printf("%s the file system is hosted by the server.\n", caller);
+    return -1;
+}
+
+
+
+//------ routines called by the mutators -------------------------------------------------------------------------------
+
+//prepare the watch list of a new instance
+void watch_init(rsfs_t *fs){
+    shm_mutex_init(fs, &fs->watches.mutex);
+    shm_cond_init(fs, &fs->watches.changed);
+    for(int i=0; i<RSFS_MAX_WATCHES; i++) fs->watches.list[i].efd = -1;
+}
+
+//add events to a watch and wake its waiters (inside fs->watches.mutex)
+static void deliver(struct watch *watch, int events){
+    if(watch->pending == 0){
+        uint64_t one = 1;
+        write(watch->efd, &one, sizeof(one)); //cannot fail: the counter is drained with the events
+    }
+    watch->pending |= events;
+}
+
+//report events (RSFS_WATCH_*) on inode_number to the watches wanting them;
+//costs one load while nothing is watched
+void watch_notify(rsfs_t *fs, int inode_number, int events){
+    if(__atomic_load_n(&fs->watches.num_active, __ATOMIC_RELAXED) == 0) return;
+
+    pthread_mutex_lock(&fs->watches.mutex);
+    int woken = 0;
+    for(int i=0; i<RSFS_MAX_WATCHES; i++){
+        struct watch *watch = &fs->watches.list[i];
+        if(!watch->used || watch->inode_number != inode_number) continue;
+        int wanted = events & watch->mask;
+        if(wanted && deferred.fs == fs) deferred.events[i] |= wanted;
+        else if(wanted){
+            deliver(watch, wanted);
+            woken = 1;
+        }
+        if(events & RSFS_WATCH_DELETE) watch->inode_number = -1; //the inode may be reused by another file
+    }
+    if(woken) pthread_cond_broadcast(&fs->watches.changed);
+    pthread_mutex_unlock(&fs->watches.mutex);
+}
+
+//hold back the events the calling thread reports on fs until watch_flush,
+//so that a transaction wakes nobody before it is published; the watches of
+//a deleted file still let go of its inode at once
+void watch_defer(rsfs_t *fs){
+    memset(deferred.events, 0, sizeof(deferred.events));
+    deferred.fs = fs;
+}
+
+//deliver the events held back since watch_defer
+void watch_flush(rsfs_t *fs){
+    if(deferred.fs != fs) return;
+    deferred.fs = NULL;
+
+    pthread_mutex_lock(&fs->watches.mutex);
+    int woken = 0;
+    for(int i=0; i<RSFS_MAX_WATCHES; i++){
+        struct watch *watch = &fs->watches.list[i];
+        if(!deferred.events[i] || !watch->used) continue;
+        deliver(watch, deferred.events[i]);
+        woken = 1;
+    }
+    if(woken) pthread_cond_broadcast(&fs->watches.changed);
+    pthread_mutex_unlock(&fs->watches.mutex);
+}
+
+//close the eventfds of the watches left (their partitions close their own)
+void watches_free(rsfs_t *fs){
+    for(int i=0; i<RSFS_MAX_WATCHES; i++){
+        struct watch *watch = &fs->watches.list[i];
+        if(watch->used) close(watch->efd);
+        watch->used = 0;
+    }
+    fs->watches.num_active = 0;
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//watch the events in mask (RSFS_WATCH_*) on file file_name, without opening
+//it; return a handle if succeed, -1 if the file does not exist or mask is
+//empty, or -2 if no watch (or eventfd) is available
+int RSFS_watch(rsfs_t *fs, char file_name, int mask){
+    char *debug_title = "[RSFS_watch]";
+
+    //sharded: the watch lives in the partition of the file
+    if(fs->num_shards){
+        int index = shard_index(fs, file_name);
+        int handle = RSFS_watch(fs->shards[index], file_name, mask);
+        return handle < 0 ? handle : index * RSFS_MAX_WATCHES + handle;
+    }
+    if(remote_refuse(fs, debug_title) < 0 || shm_refuse(fs, debug_title) < 0) return -2;
+
+    mask &= RSFS_WATCH_APPEND | RSFS_WATCH_WRITE | RSFS_WATCH_TRUNCATE | RSFS_WATCH_DELETE | RSFS_WATCH_CLOSE_WRITE;
+    if(mask == 0){
+        printf("%s no event is asked for.\n", debug_title);
+        return -1;
+    }
+
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(efd < 0){
+        printf("%s fail to create an eventfd.\n", debug_title);
+        return -2;
+    }
+
+    //take a slot (watching no inode yet) before looking the file up, so that
+    //a delete removing the name after the lookup finds the watch to drop
+    pthread_mutex_lock(&fs->watches.mutex);
+    int handle = -1;
+    for(int i=0; i<RSFS_MAX_WATCHES && handle<0; i++){
+        if(!fs->watches.list[i].used) handle = i;
+    }
+    if(handle >= 0){
+        struct watch *watch = &fs->watches.list[handle];
+        watch->used = 1;
+        watch->name = file_name;
+        watch->inode_number = -1;
+        watch->mask = mask;
+        watch->pending = 0;
+        watch->efd = efd;
+        __atomic_store_n(&fs->watches.num_active, fs->watches.num_active + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&fs->watches.mutex);
+
+    if(handle < 0){
+        close(efd);
+        printf("%s all %d watches are in use.\n", debug_title, RSFS_MAX_WATCHES);
+        return -2;
+    }
+
+    //attach to the inode of the file, under the mutator lock so that a
+    //restore cannot replace the inodes meanwhile; the deletions notify after
+    //removing the name, so if the name still leads to the inode afterwards,
+    //a later deletion drops the watch
+    pthread_rwlock_rdlock(&fs->mutator_lock);
+    struct dir_entry *dir_entry = search_dir(fs, file_name);
+    int inode_number = dir_entry ? dir_entry->inode_number : -1;
+    if(inode_number >= 0){
+        pthread_mutex_lock(&fs->watches.mutex);
+        fs->watches.list[handle].inode_number = inode_number;
+        pthread_mutex_unlock(&fs->watches.mutex);
+        dir_entry = search_dir(fs, file_name);
+        if(dir_entry == NULL || dir_entry->inode_number != inode_number) inode_number = -1;
+    }
+    pthread_rwlock_unlock(&fs->mutator_lock);
+
+    if(inode_number < 0){
+        RSFS_unwatch(fs, handle);
+        printf("%s file (%c) does not exist.\n", debug_title, file_name);
+        return -1;
+    }
+    return handle;
+}
+
+//eventfd of a watch: it becomes readable when events are pending, and is
+//drained by RSFS_watch_wait; return -1 if handle is invalid
+int RSFS_watch_fd(rsfs_t *fs, int handle){
+    if(fs->num_shards){
+        rsfs_t *shard = shard_of_watch(fs, &handle);
+        return RSFS_watch_fd(shard, handle);
+    }
+    if(remote_refuse(fs, "[RSFS_watch_fd]") < 0) return -1;
+
+    pthread_mutex_lock(&fs->watches.mutex);
+    struct watch *watch = watch_of(fs, handle);
+    int efd = watch ? watch->efd : -1;
+    pthread_mutex_unlock(&fs->watches.mutex);
+    return efd;
+}
+
+//wait until events are pending on a watch, for at most timeout_ms ms (for
+//ever if <0, not at all if 0); return the pending events, cleared, 0 if none
+//came in time, or -1 if handle is invalid (or was removed meanwhile)
+int RSFS_watch_wait(rsfs_t *fs, int handle, int timeout_ms){
+    if(fs->num_shards){
+        rsfs_t *shard = shard_of_watch(fs, &handle);
+        return RSFS_watch_wait(shard, handle, timeout_ms);
+    }
+    if(remote_refuse(fs, "[RSFS_watch_wait]") < 0) return -1;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if(timeout_ms > 0){
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&fs->watches.mutex);
+    struct watch *watch = watch_of(fs, handle);
+    while(watch && watch->pending == 0 && timeout_ms != 0){
+        if(timeout_ms < 0) pthread_cond_wait(&fs->watches.changed, &fs->watches.mutex);
+        else if(pthread_cond_timedwait(&fs->watches.changed, &fs->watches.mutex, &deadline) == ETIMEDOUT) break;
+        watch = watch_of(fs, handle);
+    }
+
+    int events = -1;
+    if(watch){
+        events = watch->pending;
+        watch->pending = 0;
+        uint64_t count;
+        if(events) read(watch->efd, &count, sizeof(count)); //drain it (the caller may have read it already)
+    }
+    pthread_mutex_unlock(&fs->watches.mutex);
+    return events;
+}
+
+//remove a watch; threads waiting on it return -1; return 0 if succeed, or
+//-1 if handle is invalid
+int RSFS_unwatch(rsfs_t *fs, int handle){
+    if(fs->num_shards){
+        rsfs_t *shard = shard_of_watch(fs, &handle);
+        return RSFS_unwatch(shard, handle);
+    }
+    if(remote_refuse(fs, "[RSFS_unwatch]") < 0) return -1;
+
+    pthread_mutex_lock(&fs->watches.mutex);
+    struct watch *watch = watch_of(fs, handle);
+    if(watch){
+        close(watch->efd);
+        watch->efd = -1;
+        watch->used = 0;
+        __atomic_store_n(&fs->watches.num_active, fs->watches.num_active - 1, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&fs->watches.changed);
+    }
+    pthread_mutex_unlock(&fs->watches.mutex);
+    return watch ? 0 : -1;
+}
@@ -0,0 +1,151 @@
+/*
+    write-back buffers;
+    a descriptor opened with RSFS_RDWR|RSFS_WRBUF collects small appends (or
+    small back-to-back writes) in its open file entry, and writes them to the
+    file as one run ending on a block boundary when the buffer fills up, on
+    RSFS_flush or RSFS_close, or before the descriptor reads, seeks or cuts;
+    until then the file itself (RSFS_stat, checkpoints) does not show them
+*/
+
+#include "def.h"
+
+
+//bytes a run starting at position may hold: up to the block boundary at
+//most WRITEBACK_SIZE bytes ahead, and no further than the maximum file size
+static int run_capacity(int position){
+    int capacity = WRITEBACK_SIZE - position % BLOCK_SIZE;
+    int max_length = NUM_POINTERS * BLOCK_SIZE;
+    return capacity < max_length - position ? capacity : max_length - position;
+}
+
+//write out the run buffered for fd (entry_mutex held)
+static int flush_locked(rsfs_t *fs, int fd){
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+    int size = entry->wb_size;
+    if(size == 0) return 0;
+    entry->wb_size = 0;
+
+    int written;
+    if(entry->wb_truncate){
+        entry->position = entry->wb_position;
+        written = file_write(fs, fd, entry->wb_data, size);
+    }
+    else written = file_append(fs, fd, entry->wb_data, size);
+
+    if(written < size){
+        printf("[writeback] %d buffered bytes of descriptor (%d) could not be written.\n", size - written, fd);
+        return -1;
+    }
+    return 0;
+}
+
+//add size bytes of buf to the run of fd, starting one (at the end of the
+//file, or at the current position if truncate) if none is pending, and
+//flushing it whenever it is full; return the number of bytes taken, which is
+//short only when the file reaches its maximum size (entry_mutex held)
+static int buffer_locked(rsfs_t *fs, int fd, char *buf, int size, int truncate){
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+    int done = 0;
+
+    while(done < size){
+        if(entry->wb_size == 0){
+            entry->wb_truncate = truncate;
+            entry->wb_position = truncate ? entry->position : fs->inodes[entry->inode_number].length;
+        }
+        int room = run_capacity(entry->wb_position) - entry->wb_size;
+        if(room <= 0){
+            if(entry->wb_size == 0) break; //the file is full
+            if(flush_locked(fs, fd) < 0) break;
+            continue;
+        }
+
+        int chunk = size - done < room ? size - done : room;
+        memcpy(entry->wb_data + entry->wb_size, buf + done, chunk);
+        entry->wb_size += chunk;
+        done += chunk;
+        entry->position = entry->wb_position + entry->wb_size;
+    }
+    return done;
+}
+
+
+
+//------ routines called by the API ------------------------------------------------------------------------------------
+
+//append size bytes of buf to the file of fd (checked by RSFS_append);
+//return the number of bytes appended
+int writeback_append(rsfs_t *fs, int fd, void *buf, int size){
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+
+    pthread_mutex_lock(&entry->entry_mutex);
+    if(entry->wb_size && entry->wb_truncate) flush_locked(fs, fd); //pending writes go first
+
+    int done = 0;
+    if(size < WRITEBACK_SIZE) done = buffer_locked(fs, fd, buf, size, 0);
+    else flush_locked(fs, fd);
+
+    //large appends, and those past the maximum file size (which fail as
+    //they would unbuffered), go to the file directly
+    if(done < size) done += file_append(fs, fd, (char *)buf + done, size - done);
+    pthread_mutex_unlock(&entry->entry_mutex);
+
+    return done;
+}
+
+//write size bytes of buf at the current position of fd (checked by
+//RSFS_write); return the number of bytes written
+int writeback_write(rsfs_t *fs, int fd, void *buf, int size){
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+
+    pthread_mutex_lock(&entry->entry_mutex);
+    //only a write continuing the pending writes joins their run
+    if(entry->wb_size && (!entry->wb_truncate || entry->position != entry->wb_position + entry->wb_size)){
+        flush_locked(fs, fd);
+    }
+
+    int done = 0;
+    if(size < WRITEBACK_SIZE) done = buffer_locked(fs, fd, buf, size, 1);
+    else flush_locked(fs, fd);
+
+    if(done < size) done += file_write(fs, fd, (char *)buf + done, size - done);
+    pthread_mutex_unlock(&entry->entry_mutex);
+
+    return done;
+}
+
+//write out the bytes buffered for fd; return 0 if succeed, or -1 if some of
+//them could not be written (they are dropped)
+int writeback_flush(rsfs_t *fs, int fd){
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+
+    pthread_mutex_lock(&entry->entry_mutex);
+    int ret = flush_locked(fs, fd);
+    pthread_mutex_unlock(&entry->entry_mutex);
+
+    return ret;
+}
+
+
+
+//------ api -----------------------------------------------------------------------------------------------------------
+
+//write out the bytes buffered for fd (nothing to do for a descriptor opened
+//without RSFS_WRBUF); return 0 if succeed, -1 if fd is invalid, or -2 if
+//some buffered bytes could not be written
+int RSFS_flush(rsfs_t *fs, int fd){
+    //sharded: forward to the partition encoded in fd
+    if(fs->num_shards){
+        rsfs_t *shard = shard_of_fd(fs, &fd);
+        return RSFS_flush(shard, fd);
+    }
+    //remote: forward to the server
+    if(fs->remote.active) return remote_fd_call(fs, IPC_FLUSH, fd, 0);
+
+    if(fd < 0 || fd >= NUM_OPEN_FILE || fs->open_file_table[fd].used == 0){
+        printf("[RSFS_flush] file descriptor (%d) is not in use.\n", fd);
+        return -1;
+    }
+    if(fs->open_file_table[fd].wb_size == 0) return 0;
+
+    return writeback_flush(fs, fd) < 0 ? -2 : 0;
+}